@@ -52,5 +52,6 @@ APIFUNC void *rtc3d_get_local_data(rtc3d_connection_t *rtc3d_conn);
 
 // Send data frame (deprecated function, use rtc3d_dataframe instead)
 APIFUNC void rtc3d_send_data(rtc3d_connection_t *rtc3d_conn, uint32_t frame, uint64_t time, float point);
+APIFUNC void rtc3d_send_marker(rtc3d_connection_t *rtc3d_conn, uint32_t frame, uint64_t time, float point, float delta);
 
 #endif
@@ -72,6 +72,16 @@ inline void rtc3d_set_marker(char *buffer, float x, float y, float z, float delt
  * Sends a single position.
  */
 void rtc3d_send_data(rtc3d_connection_t *rtc3d_conn, uint32_t frame, uint64_t time, float point)
+{
+  rtc3d_send_marker(rtc3d_conn, frame, time, point, 0);
+}
+
+
+/**
+ * Sends a single position, delta is stored in the fourth
+ * field of the marker (e.g. to flag missing samples).
+ */
+void rtc3d_send_marker(rtc3d_connection_t *rtc3d_conn, uint32_t frame, uint64_t time, float point, float delta)
 {
   char buffer[52];
   rtc3d_set_packet_header(buffer, 52, PTYPE_DATAFRAME);
@@ -86,7 +96,7 @@ void rtc3d_send_data(rtc3d_connection_t *rtc3d_conn, uint32_t frame, uint64_t ti
   uint32_t *mcount = (uint32_t *) &(buffer[32]);
   *mcount = htonl(1);
 
-  rtc3d_set_marker(&(buffer[36]), point, 0, 0, 0);
+  rtc3d_set_marker(&(buffer[36]), point, 0, 0, delta);
 
   net_send(rtc3d_conn->net_conn, buffer, 8 + 4 + 20 + 4 + 16);
 }
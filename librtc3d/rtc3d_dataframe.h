@@ -50,5 +50,6 @@ struct rtc3d_dataframe_t;
 struct rtc3d_component_t;
 
 void rtc3d_send_data(rtc3d_connection_t *rtc3d_conn, uint32_t frame, uint64_t time, float point);
+void rtc3d_send_marker(rtc3d_connection_t *rtc3d_conn, uint32_t frame, uint64_t time, float point, float delta);
 
 #endif
@@ -10,130 +10,228 @@
 #include <stdio.h>
 #include <errno.h>
 #include <string.h>
-#include <fcntl.h>
 #include <time.h>
+#include <pthread.h>
 
-#include <sys/stat.h>
+
+// Interfaces in use, see intf_create
+static intf_t *intf_list = NULL;
+static pthread_mutex_t intf_list_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void intf_on_read(evutil_socket_t fd, short events, void *intf_v);
+static void intf_on_poll(evutil_socket_t fd, short events, void *intf_v);
+static void intf_on_write(evutil_socket_t fd, short events, void *intf_v);
 
 
 /**
- * Writes PEAK CAN interface status to system log.
- *
- * @param function  Function where the status message was received.
- * @param status  Status message received.
- */
-static void intf_log_status(const char *function, int status)
-{
-  assert(function);
-
-	if(status & 0x01)
-		syslog(LOG_ALERT, "%s() chip-send-buffer full.", function);
-
-	if(status & 0x02)
-		syslog(LOG_ALERT, "%s() chip-receive-buffer overrun.", function);
-
-	if(status & 0x04)
-		syslog(LOG_WARNING, "%s() bus warning.", function);
-
-	if(status & 0x08)
-		syslog(LOG_WARNING, "%s() bus passive.", function);
-
-	if(status & 0x10)
-		syslog(LOG_ERR, "%s() bus off.", function);
-
-	if(status & 0x20)
-		syslog(LOG_INFO, "%s() receive buffer is empty.", function);
-
-	if(status & 0x40)
-		syslog(LOG_ALERT, "%s() receive buffer overrun.", function);
-
-	if(status & 0x80)
-		syslog(LOG_ALERT, "%s() send-buffer is full.", function);
-}
-
-
-static void intf_log_emergency(int emergency)
-{
-	switch(emergency) {
-		case 0x0000: syslog(LOG_ERR, "Error reset or no error (mandatory)"); break;
-		case 0x1000: syslog(LOG_ERR, "Generic error (mandatory)"); break;
-		case 0x1080: syslog(LOG_ERR, "No BTB/RTO (status not ready for operation)"); break;
-		case 0x2330: syslog(LOG_ERR, "Error in ground connection (F22)"); break;
-		case 0x2380: syslog(LOG_ERR, "Error in motor connection (phase fault) (F12)"); break;
-		case 0x3100: syslog(LOG_ERR, "No mains/line-BTB (F16)"); break;
-		case 0x3110: syslog(LOG_ERR, "Overvoltage in DC-bus/DC-link (F02)"); break;
-		case 0x3120: syslog(LOG_ERR, "Undervoltage in DC-bus/DC-link (F05)"); break;
-		case 0x3130: syslog(LOG_ERR, "Supply line phase missing (with PMODE = 2) (F19)"); break;
-		case 0x4110: syslog(LOG_ERR, "Ambient temperature too high (F13)"); break;
-		case 0x4210: syslog(LOG_ERR, "Heat sink temperature too high (F01)"); break;
-		case 0x4310: syslog(LOG_ERR, "Motor temperature too high (F06)"); break;
-		case 0x5111: syslog(LOG_ERR, "Fault in ±15V auxiliary voltage (F07)"); break;
-		case 0x5380: syslog(LOG_ERR, "Fault in A/D converter (F17)"); break;
-		case 0x5400: syslog(LOG_ERR, "Fault in output stage (F14)"); break;
-		case 0x5420: syslog(LOG_ERR, "Ballast (chopper) (F18)"); break;
-		case 0x5441: syslog(LOG_ERR, "Operating error for AS-option (F27)"); break;
-		case 0x5530: syslog(LOG_ERR, "Serial EEPROM (F09)"); break;
-		case 0x6320: syslog(LOG_ERR, "Parameter error"); break;
-		case 0x7111: syslog(LOG_ERR, "Braking error/fault (F11)"); break;
-		case 0x7122: syslog(LOG_ERR, "Commutation error (F25)"); break;
-		case 0x7181: syslog(LOG_ERR, "Could not enable S300/S700"); break;
-		case 0x7303: syslog(LOG_ERR, "Feedback device error (F04)"); break;
-		case 0x7305: syslog(LOG_ERR, "Signal failure digital encoder input (F10)"); break;
-		case 0x8182: syslog(LOG_ERR, "CAN bus off (F23)"); break;
-		case 0x8331: syslog(LOG_ERR, "I2t (torque fault, F15)"); break;
-		case 0x8480: syslog(LOG_ERR, "Overspeed (F08)"); break;
-		case 0x8611: syslog(LOG_ERR, "Lag/following error (n03/F03)"); break;
-		case 0x8681: syslog(LOG_ERR, "Invalid motion task number"); break;
-		case 0xFF01: syslog(LOG_ERR, "Serious exception error (F32)"); break;
-		case 0xFF02: syslog(LOG_ERR, "Error in PDO elements"); break;
-		case 0xFF04: syslog(LOG_ERR, "Slot error (F20)"); break;
-		case 0xFF05: syslog(LOG_ERR, "Handling error (F21)"); break;
-		case 0xFF06: syslog(LOG_ERR, "Warning display as error (F24)"); break;
-		case 0xFF07: syslog(LOG_ERR, "Homing error (drove onto HW limit switch) (F26)"); break;
-		case 0xFF08: syslog(LOG_ERR, "Sercos error (F29)"); break;
-		case 0xFF11: syslog(LOG_ERR, "Emergency timeout failure(F30)"); break;
-		default: syslog(LOG_ERR, "Unknown emergency (%04x)", emergency);
+ * Describe emergency error code (S300/S700 manual).
+ */
+const char *intf_emcy_to_message(uint16_t code)
+{
+	switch(code) {
+		case 0x0000: return "Error reset or no error (mandatory)";
+		case 0x1000: return "Generic error (mandatory)";
+		case 0x1080: return "No BTB/RTO (status not ready for operation)";
+		case 0x2330: return "Error in ground connection (F22)";
+		case 0x2380: return "Error in motor connection (phase fault) (F12)";
+		case 0x3100: return "No mains/line-BTB (F16)";
+		case 0x3110: return "Overvoltage in DC-bus/DC-link (F02)";
+		case 0x3120: return "Undervoltage in DC-bus/DC-link (F05)";
+		case 0x3130: return "Supply line phase missing (with PMODE = 2) (F19)";
+		case 0x4110: return "Ambient temperature too high (F13)";
+		case 0x4210: return "Heat sink temperature too high (F01)";
+		case 0x4310: return "Motor temperature too high (F06)";
+		case 0x5111: return "Fault in ±15V auxiliary voltage (F07)";
+		case 0x5380: return "Fault in A/D converter (F17)";
+		case 0x5400: return "Fault in output stage (F14)";
+		case 0x5420: return "Ballast (chopper) (F18)";
+		case 0x5441: return "Operating error for AS-option (F27)";
+		case 0x5530: return "Serial EEPROM (F09)";
+		case 0x6320: return "Parameter error";
+		case 0x7111: return "Braking error/fault (F11)";
+		case 0x7122: return "Commutation error (F25)";
+		case 0x7181: return "Could not enable S300/S700";
+		case 0x7303: return "Feedback device error (F04)";
+		case 0x7305: return "Signal failure digital encoder input (F10)";
+		case 0x8182: return "CAN bus off (F23)";
+		case 0x8331: return "I2t (torque fault, F15)";
+		case 0x8480: return "Overspeed (F08)";
+		case 0x8611: return "Lag/following error (n03/F03)";
+		case 0x8681: return "Invalid motion task number";
+		case 0xFF01: return "Serious exception error (F32)";
+		case 0xFF02: return "Error in PDO elements";
+		case 0xFF04: return "Slot error (F20)";
+		case 0xFF05: return "Handling error (F21)";
+		case 0xFF06: return "Warning display as error (F24)";
+		case 0xFF07: return "Homing error (drove onto HW limit switch) (F26)";
+		case 0xFF08: return "Sercos error (F29)";
+		case 0xFF11: return "Emergency timeout failure(F30)";
 	}
+
+	return "Unknown emergency";
+}
+
+
+/**
+ * Returns current (monotonic) time in seconds.
+ */
+double intf_get_time()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return double(ts.tv_sec) + double(ts.tv_nsec) / 1000.0 / 1000.0 / 1000.0;
+}
+
+
+/**
+ * Converts the age of a received message into a CLOCK_MONOTONIC
+ * timestamp. Backends compute the age from the driver timestamp,
+ * which is usually taken on another clock. Implausible ages result
+ * in the current time, they are counted in the bus statistics.
+ *
+ * @param age  Time since reception in seconds.
+ * @return Time of reception in seconds.
+ */
+double intf_receive_time(intf_t *intf, double age)
+{
+	double now = intf_get_time();
+
+	if(age >= 0.0 && age <= INTF_MAX_RECEIVE_AGE)
+		return now - age;
+
+	if(__atomic_fetch_add(&intf->untrusted_stamps, 1, __ATOMIC_RELAXED) == 0)
+		syslog(LOG_WARNING, "%s() driver timestamp %.3f s old, using time of reading",
+			__FUNCTION__, age);
+
+	return now;
 }
 
 
-static void intf_clear_sdo_callbacks(intf_t *intf)
+static void intf_clear_sdo_callbacks(intf_node_t *node)
 {
-  assert(intf);
+  assert(node);
+
+	node->sdo_pending = false;
+	node->sdo_callback_data = NULL;
+	node->read_callback = NULL;
+	node->write_callback = NULL;
+	node->abort_callback = NULL;
+	node->frame_callback = NULL;
+}
 
-	intf->sdo_callback_data = NULL;
-	intf->read_callback = NULL;
-	intf->write_callback = NULL;
-	intf->abort_callback = NULL;
+
+/**
+ * Returns registered node, NULL if there is none.
+ */
+static intf_node_t *intf_get_node(intf_t *intf, uint8_t node)
+{
+	if(node > INTF_MAX_NODE)
+		return NULL;
+
+	return intf->nodes[node];
 }
 
 
 /**
  * Setup CAN Interface
  *
+ * Device names starting with /dev/ are opened using the PEAK driver,
+ * "emulator" selects the built-in drive emulator, "replay:<file>" and
+ * "replay-fast:<file>" play back a capture and all other names
+ * are treated as SocketCAN network interfaces.
+ *
+ * Several nodes can share a bus: creating an interface for a device
+ * that is already in use on the same event base returns the existing
+ * instance. Each call must be matched by intf_destroy.
+ *
  * @param ev_base  LibEvent event_base.
+ * @param device  Device node or network interface, NULL for default.
  * @return CAN Interface instance.
  */
-intf_t *intf_create(event_base *ev_base)
+intf_t *intf_create(event_base *ev_base, const char *device)
 {
 	assert(ev_base);
 
+	if(!device)
+		device = INTF_DEFAULT_DEVICE;
+
+	pthread_mutex_lock(&intf_list_lock);
+
+	for(intf_t *intf = intf_list; intf; intf = intf->next)
+		if(intf->ev_base == ev_base && strcmp(intf->device, device) == 0) {
+			intf->references++;
+			pthread_mutex_unlock(&intf_list_lock);
+			return intf;
+		}
+
 	intf_t *intf = new intf_t();
 
 	intf->ev_base = ev_base;
+	intf->references = 1;
+
+	if(strncmp(device, "/dev/", 5) == 0)
+		intf->backend = &intf_backend_pcan;
+	else if(strcmp(device, "emulator") == 0 || strncmp(device, "emulator:", 9) == 0)
+		intf->backend = &intf_backend_emulator;
+	else if(strncmp(device, "replay:", 7) == 0 || strncmp(device, "replay-fast:", 12) == 0)
+		intf->backend = &intf_backend_replay;
+	else
+		intf->backend = &intf_backend_socketcan;
+
+	intf->device = strdup(device);
+
 	intf->handle = 0;
-	intf->fd = 0;
+	intf->fd = -1;
+
+	intf->stamp_synced = false;
+	intf->stamp_offset = 0.0;
+	intf->stamp_last_ms = 0;
+	intf->stamp_wraps = 0;
 
 	intf->read_event = NULL;
+	intf->write_event = NULL;
+	intf->retry_event = NULL;
+	intf->tx_retry = false;
+
+	for(int i = 0; i < INTF_TX_PRIORITIES; i++)
+		intf->tx_head[i] = intf->tx_count[i] = 0;
+	memset(&intf->tx_stats, 0, sizeof(intf_tx_stats_t));
+
+	intf->read_limit = INTF_READ_BATCH;
+	memset(&intf->read_stats, 0, sizeof(intf_read_stats_t));
+	intf->report_max_frames = 0;
+
+	memset(&intf->filter_stats, 0, sizeof(intf_filter_stats_t));
+
+	memset(&intf->overrun_stats, 0, sizeof(intf_overrun_stats_t));
+	intf->overrun_pending = false;
+	intf->overrun_lost = 0;
+
+	memset(&intf->emcy_stats, 0, sizeof(intf_emcy_stats_t));
+
+	intf_stats_init(intf);
+
+	intf->trace = intf_trace_create(INTF_TRACE_SIZE);
+	intf->trace_enabled = true;
 
-	intf->payload = NULL;
+	intf->capture = NULL;
+	intf->capture_seq = 0;
 
-	// Initialize callback functions
-	intf->nmt_state_handler = NULL;
-	intf->tpdo_handler = NULL;
-	intf->close_handler = NULL;
+	intf->fault = NULL;
+	intf->poll = NULL;
 
-	intf_clear_sdo_callbacks(intf);
+	// Nodes are added using intf_register_node
+	for(int i = 0; i <= INTF_MAX_NODE; i++)
+		intf->nodes[i] = NULL;
+
+	memset(intf->cob_table, 0, sizeof(intf->cob_table));
+
+	// Only publish the interface once it is set up, the list
+	// is searched by sleds created on other threads
+	intf->next = intf_list;
+	intf_list = intf;
+
+	pthread_mutex_unlock(&intf_list_lock);
 
   return intf;
 }
@@ -142,16 +240,83 @@ intf_t *intf_create(event_base *ev_base)
 /**
  * Destroy CAN Interface
  *
+ * The interface is closed and freed once
+ * the last user has released it.
+ *
  * @param intf  Interface to destroy.
  */
 void intf_destroy(intf_t **intf)
 {
+	pthread_mutex_lock(&intf_list_lock);
+
+	bool last = --(*intf)->references == 0;
+
+	if(last)
+		for(intf_t **p = &intf_list; *p; p = &(*p)->next)
+			if(*p == *intf) {
+				*p = (*intf)->next;
+				break;
+			}
+
+	pthread_mutex_unlock(&intf_list_lock);
+
+	if(!last) {
+		*intf = NULL;
+		return;
+	}
+
 	intf_close(*intf);
-	free(*intf);
+	intf_stop_capture(*intf);
+	intf_set_fault_profile(*intf, NULL);
+	intf_set_busy_poll(*intf, -1);
+	intf_trace_destroy(&(*intf)->trace);
+	intf_stats_destroy(*intf);
+
+	for(int i = 0; i <= INTF_MAX_NODE; i++)
+		delete (*intf)->nodes[i];
+
+	free((*intf)->device);
+	delete *intf;
 	*intf = NULL;
 }
 
 
+/**
+ * Program the acceptance filter of the device with all COB-IDs
+ * that have a handler, such that other traffic on the bus does
+ * not wake us up. Devices without a filter receive everything.
+ *
+ * @return 0 on success, -1 if the filter could not be set.
+ */
+static int intf_update_filter(intf_t *intf)
+{
+	uint16_t ids[INTF_NUM_COB_IDS];
+	int count = 0;
+
+	for(int i = 0; i < INTF_NUM_COB_IDS; i++)
+		if(intf->cob_table[i].handler)
+			ids[count++] = i;
+
+	intf->filter_stats.cob_ids = count;
+
+	if(intf->fd < 0 || !intf->backend->set_filter)
+		return 0;
+
+	if(intf->backend->set_filter(intf, ids, count) == -1) {
+		syslog(LOG_WARNING, "%s() could not set acceptance filter, "
+			"all frames will be received", __FUNCTION__);
+		intf->filter_stats.active = false;
+		return -1;
+	}
+
+	intf->filter_stats.active = true;
+
+	syslog(LOG_INFO, "%s() accepting %d COB-IDs", __FUNCTION__, count);
+
+	return 0;
+}
+
+
 /**
  * Open connection to device
  *
@@ -162,90 +327,179 @@ int intf_open(intf_t *intf)
 {
 	assert(intf);
 
-	#ifdef WIN32
-	return -1;
-	#else
-	const char *device = "/dev/pcanpci0";
-
 	// Device is already open
-	if(intf->handle) {
+	if(intf->fd >= 0) {
 		return 0;
 	}
 
-	// Check whether the device exists
-	struct stat buf;
-	if(stat(device, &buf) == -1)
-	{
-		fprintf(stderr, "Error locating device node (%s)\n", device);
+	if(intf->backend->open(intf, intf->device) != 0) {
+		intf->fd = -1;
 		return -1;
 	}
 
-	// Device should be a character device
-	if(!S_ISCHR(buf.st_mode))
-	{
-		fprintf(stderr, "Device node is not a character device (%s)\n", device);
-		return -1;
-	}
+	syslog(LOG_INFO, "%s() opened %s using %s driver",
+		__FUNCTION__, intf->device, intf->backend->name);
 
-	// Try to open interface
-	intf->handle = LINUX_CAN_Open(device, O_RDWR);
+	intf_update_filter(intf);
 
-	if(!intf->handle) {
-		fprintf(stderr, "Opening of CAN device failed\n");
-		return -1;
-	}
+	intf_start_reading(intf);
 
-	// Initialize interface
-	DWORD result = CAN_Init(intf->handle, CAN_BAUD_1M, CAN_INIT_TYPE_ST);
+	// Added when frames are waiting to be sent
+	intf->write_event = event_new(intf->ev_base, intf->fd,
+		EV_WRITE, intf_on_write, (void *) intf);
+	event_priority_set(intf->write_event, 0);
 
-	if(result != CAN_ERR_OK && result != CAN_ERR_QRCVEMPTY)
-	{
-		fprintf(stderr, "Initializing of CAN device failed\n");
-		intf_close(intf);
-		return -1;
+	intf->retry_event = evtimer_new(intf->ev_base, intf_on_write, (void *) intf);
+	event_priority_set(intf->retry_event, 0);
+	intf->tx_retry = false;
+
+	return 0;
+}
+
+
+/**
+ * Wait for frames from the device, or from the
+ * busy-poll thread when busy polling is enabled.
+ */
+void intf_start_reading(intf_t *intf)
+{
+	int fd = intf->fd;
+	event_callback_fn handler = intf_on_read;
+
+	if(intf->poll) {
+		if(intf_poll_start(intf) == 0) {
+			fd = intf_poll_fd(intf);
+			handler = intf_on_poll;
+		} else {
+			syslog(LOG_ERR, "%s() busy polling failed, "
+				"reading from the event loop", __FUNCTION__);
+		}
 	}
 
 	// Register handle with libevent and set priority to important
-	intf->fd = LINUX_CAN_FileHandle(intf->handle);
-	intf->read_event = event_new(intf->ev_base, intf->fd, 
-		EV_READ | EV_PERSIST, intf_on_read, (void *) intf);
+	intf->read_event = event_new(intf->ev_base, fd,
+		EV_READ | EV_PERSIST, handler, (void *) intf);
 	event_priority_set(intf->read_event, 0);
 	event_add(intf->read_event, NULL);
-
-	return 0;
-#endif
 }
 
 
 /**
- * Close the device connection.
+ * Stop reading, the poll thread has ended on return.
  */
-int intf_close(intf_t *intf)
+void intf_stop_reading(intf_t *intf)
 {
-	// Remove event
 	if(intf->read_event) {
 		event_del(intf->read_event);
 		event_free(intf->read_event);
 		intf->read_event = NULL;
 	}
 
-	#ifdef WIN32
-	#else
+	intf_poll_stop(intf);
+}
+
+
+/**
+ * Close the device connection.
+ */
+int intf_close(intf_t *intf)
+{
+	// Remove event
+	intf_stop_reading(intf);
+
+	if(intf->write_event) {
+		event_del(intf->write_event);
+		event_free(intf->write_event);
+		intf->write_event = NULL;
+	}
+
+	if(intf->retry_event) {
+		event_del(intf->retry_event);
+		event_free(intf->retry_event);
+		intf->retry_event = NULL;
+	}
+
+	// Frames queued for the closed device are lost
+	for(int i = 0; i < INTF_TX_PRIORITIES; i++)
+		intf->tx_head[i] = intf->tx_count[i] = 0;
+	intf->tx_stats.depth = 0;
+
+	intf_fault_flush(intf);
+
+	intf->filter_stats.active = false;
+
 	// Close connection
-	if(intf->handle) {
-		DWORD result = CAN_Close(intf->handle);
-		if(result != CAN_ERR_OK) {
-			fprintf(stderr, "Closing of CAN device failed\n");
+	if(intf->fd >= 0) {
+		int result = intf->backend->close(intf);
+		intf->fd = -1;
+
+		if(result != 0)
 			return -1;
-		}
+	}
+
+	// Inform all nodes, handlers may close the interface again
+	for(int i = 0; i <= INTF_MAX_NODE; i++) {
+		intf_node_t *node = intf->nodes[i];
 
-		intf->handle = 0;
-		intf->fd = 0;
+		if(node && node->close_handler)
+			node->close_handler(intf, node->payload);
 	}
-	#endif
 
-	if(intf->close_handler) {
-		intf->close_handler(intf, intf->payload);
+	return 0;
+}
+
+
+/**
+ * Flush the queue once the device can take frames again.
+ */
+static void intf_wait_writable(intf_t *intf)
+{
+	if(!intf->tx_retry) {
+		event_add(intf->write_event, NULL);
+		return;
+	}
+
+	// Waiting for the device to become writable would spin
+	timeval interval;
+	interval.tv_sec = 0;
+	interval.tv_usec = long(INTF_TX_RETRY_INTERVAL * 1000.0 * 1000.0);
+
+	intf->tx_retry = false;
+	evtimer_add(intf->retry_event, &interval);
+}
+
+
+/**
+ * Hand queued frames to the device, highest priority first.
+ *
+ * @return 0 when the queue is empty or the device is busy, -1 on failure.
+ */
+static int intf_flush_tx_queue(intf_t *intf)
+{
+	for(int p = 0; p < INTF_TX_PRIORITIES; p++) {
+		while(intf->tx_count[p] > 0) {
+			// Send contiguous part of the ring in one go
+			int head = intf->tx_head[p];
+			int count = intf->tx_count[p];
+			if(head + count > INTF_TX_QUEUE_SIZE)
+				count = INTF_TX_QUEUE_SIZE - head;
+
+			int sent = intf->backend->write(intf, &(intf->tx_queue[p][head]), count);
+
+			if(sent == -1)
+				return -1;
+
+			intf->tx_head[p] = (head + sent) % INTF_TX_QUEUE_SIZE;
+			intf->tx_count[p] -= sent;
+			intf->tx_stats.depth -= sent;
+			intf->tx_stats.frames += sent;
+
+			// Device is full, wait until it becomes writable
+			if(sent < count) {
+				intf_wait_writable(intf);
+				return 0;
+			}
+		}
 	}
 
 	return 0;
@@ -253,71 +507,145 @@ int intf_close(intf_t *intf)
 
 
 /**
- * Writes a single message
+ * Called when the device can accept frames again.
  */
-int intf_write(intf_t *intf, can_message_t msg)
+static void intf_on_write(evutil_socket_t fd, short events, void *intf_v)
 {
-	assert(intf);
+	intf_t *intf = (intf_t *) intf_v;
 
-	TPCANMsg cmsg;
-	cmsg.ID = msg.id;
-	cmsg.MSGTYPE = msg.type;
-	cmsg.LEN = msg.len;
+	if(!intf || intf->fd < 0)
+		return;
 
-	for(int i = 0; i < 8; i++)
-		cmsg.DATA[i] = msg.data[i];
+	if(intf_flush_tx_queue(intf) == -1) {
+		syslog(LOG_ALERT, "%s() writing to the CAN bus failed interface will be closed.", __FUNCTION__);
+		intf_close(intf);
+	}
+}
 
-	syslog(LOG_DEBUG, "%s() %04x %02x %02x (%02x %02x %02x %02x %02x %02x %02x %02x)\n",
-		__FUNCTION__, cmsg.ID, cmsg.MSGTYPE, cmsg.LEN,
-		cmsg.DATA[0], cmsg.DATA[1], cmsg.DATA[2], cmsg.DATA[3],
-		cmsg.DATA[4], cmsg.DATA[5], cmsg.DATA[6], cmsg.DATA[7]);
 
-	#ifdef WIN32
-	DWORD result = -1;
-	#else
-	DWORD result = CAN_Write(intf->handle, &cmsg);
-	#endif
+/**
+ * Queues a single message for transmission.
+ *
+ * The message is sent immediately when nothing is waiting and
+ * the device accepts it, otherwise it is sent once the device
+ * becomes writable. This function never blocks.
+ *
+ * @param intf  Interface.
+ * @param msg  Message to send.
+ * @param priority  INTF_TX_PRIO_HIGH or INTF_TX_PRIO_NORMAL.
+ * @return 0 on success, -1 if the message was dropped.
+ */
+int intf_write(intf_t *intf, can_message_t msg, int priority)
+{
+	assert(intf && priority >= 0 && priority < INTF_TX_PRIORITIES);
+
+	msg.time = intf_get_time();
 
-	if(result == -1) {
-		syslog(LOG_ALERT, "%s() could not send message: %s", __FUNCTION__, strerror(errno));
+	if(intf->trace_enabled)
+		intf_trace_record(intf->trace, &msg, INTF_TRACE_TX);
+
+	if(intf->capture)
+		intf_capture_record(intf, &msg, INTF_TRACE_TX);
+
+	if(intf->fd < 0) {
+		syslog(LOG_ALERT, "%s() could not send message: interface is closed", __FUNCTION__);
 		return -1;
 	}
 
+	// Dropped or delayed by fault injection
+	if(intf->fault && intf_fault_transmit(intf, &msg, priority) == 0)
+		return 0;
+
+	return intf_write_device(intf, msg, priority);
+}
+
+
+/**
+ * Hand message to the device, or queue it when the device is busy.
+ *
+ * @return 0 on success, -1 if the message was dropped.
+ */
+int intf_write_device(intf_t *intf, can_message_t msg, int priority)
+{
+	if(intf->fd < 0)
+		return -1;
+
+	if(intf->tx_count[priority] == INTF_TX_QUEUE_SIZE) {
+		uint64_t dropped = ++intf->tx_stats.dropped;
+
+		// Log 1st, 2nd, 4th, 8th... dropped frame
+		if((dropped & (dropped - 1)) == 0)
+			syslog(LOG_WARNING, "%s() transmit queue full, %llu frames dropped",
+				__FUNCTION__, (unsigned long long) dropped);
+		return -1;
+	}
+
+	intf_stats_update(intf, &msg, INTF_TRACE_TX);
+
+	// Nothing waiting, try to send directly
+	if(intf->tx_stats.depth == 0) {
+		int sent = intf->backend->write(intf, &msg, 1);
+
+		if(sent == -1)
+			return -1;
+
+		if(sent == 1) {
+			intf->tx_stats.frames++;
+			return 0;
+		}
+
+		intf_wait_writable(intf);
+	}
+
+	int tail = (intf->tx_head[priority] + intf->tx_count[priority]) % INTF_TX_QUEUE_SIZE;
+	intf->tx_queue[priority][tail] = msg;
+	intf->tx_count[priority]++;
+
+	intf->tx_stats.queued++;
+	intf->tx_stats.depth++;
+	if(intf->tx_stats.depth > intf->tx_stats.max_depth)
+		intf->tx_stats.max_depth = intf->tx_stats.depth;
+
 	return 0;
 }
 
 
 /**
  * Sends an NMT command
+ *
+ * @param node  Node-ID, 0 addresses all nodes.
  */
-int intf_send_nmt_command(intf_t *intf, uint8_t command)
+int intf_send_nmt_command(intf_t *intf, uint8_t node, uint8_t command)
 {
-	assert(intf);
+	assert(intf && node <= INTF_MAX_NODE);
 
 	can_message_t msg;
 	msg.id = 0;
 	msg.type = mt_standard;
 	msg.len = 2;
 	msg.data[0] = command;
-	msg.data[1] = 1;
+	msg.data[1] = node;
 
 	for(int i = 2; i < 8; i++)
 		msg.data[i] = 0;
 
-	return intf_write(intf, msg);
+	return intf_write(intf, msg, INTF_TX_PRIO_HIGH);
 }
 
 
 /**
- * Send read request.
+ * Send read request to a registered node.
  */
-int intf_send_read_req(intf_t *intf, uint16_t index, uint8_t subindex,
+int intf_send_read_req(intf_t *intf, uint8_t node, uint16_t index, uint8_t subindex,
 	intf_read_callback_t read_callback, intf_abort_callback_t abort_callback, void *data)
 {
 	assert(intf);
 
+	intf_node_t *n = intf_get_node(intf, node);
+	assert(n);
+
 	can_message_t msg;
-	msg.id = (0x0C << 7) + 1;
+	msg.id = (0x0C << 7) + node;
 	msg.type = mt_standard;
 
 	msg.len = 8;
@@ -330,24 +658,32 @@ int intf_send_read_req(intf_t *intf, uint16_t index, uint8_t subindex,
 	msg.data[6] = 0;
 	msg.data[7] = 0;
 
-	intf->read_callback = read_callback;
-	intf->write_callback = NULL;
-	intf->abort_callback = abort_callback;
-	intf->sdo_callback_data = data;
+	n->sdo_pending = true;
+	n->sdo_index = index;
+	n->sdo_subindex = subindex;
+
+	n->read_callback = read_callback;
+	n->write_callback = NULL;
+	n->abort_callback = abort_callback;
+	n->frame_callback = NULL;
+	n->sdo_callback_data = data;
 
-	return intf_write(intf, msg);
+	return intf_write(intf, msg, INTF_TX_PRIO_NORMAL);
 }
 
 /**
- * Send write request.
+ * Send write request to a registered node.
  */
-int intf_send_write_req(intf_t *intf, uint16_t index, uint8_t subindex, uint32_t value, uint8_t size,
+int intf_send_write_req(intf_t *intf, uint8_t node, uint16_t index, uint8_t subindex, uint32_t value, uint8_t size,
 	intf_write_callback_t write_callback, intf_abort_callback_t abort_callback, void *data)
 {
 	assert(intf);
 
+	intf_node_t *n = intf_get_node(intf, node);
+	assert(n);
+
 	can_message_t msg;
-	msg.id = (0x0C << 7) + 1;
+	msg.id = (0x0C << 7) + node;
 	msg.type = mt_standard;
 
 	msg.len = 8;
@@ -360,179 +696,733 @@ int intf_send_write_req(intf_t *intf, uint16_t index, uint8_t subindex, uint32_t
 	msg.data[6] = (value & 0x00FF0000) >> 16;
 	msg.data[7] = (value & 0xFF000000) >> 24;
 
-	intf->read_callback = NULL;
-	intf->write_callback = write_callback;
-	intf->abort_callback = abort_callback;
-	intf->sdo_callback_data = data;
+	n->sdo_pending = true;
+	n->sdo_index = index;
+	n->sdo_subindex = subindex;
+
+	n->read_callback = NULL;
+	n->write_callback = write_callback;
+	n->abort_callback = abort_callback;
+	n->frame_callback = NULL;
+	n->sdo_callback_data = data;
 
-  return intf_write(intf, msg);
+	// Drive state changes take precedence
+	int priority = (index == OB_CONTROL_WORD) ? INTF_TX_PRIO_HIGH : INTF_TX_PRIO_NORMAL;
+
+	return intf_write(intf, msg, priority);
 }
 
 
 /**
- * Parses CAN message and invokes callbacks.
+ * Send a frame of a segmented or block transfer (see sdo.h) to a
+ * registered node. Every SDO frame the node sends is passed to the
+ * callback as is, until the transfer is cancelled or another request
+ * is sent. Segments do not carry the index, so the caller decides
+ * whether a frame belongs to the transfer.
  */
-static void intf_dispatch_msg(intf_t *intf, can_message_t msg)
+int intf_send_sdo_frame(intf_t *intf, uint8_t node, const uint8_t *frame,
+	intf_frame_callback_t frame_callback, void *data)
+{
+	assert(intf && frame);
+
+	intf_node_t *n = intf_get_node(intf, node);
+	assert(n);
+
+	can_message_t msg;
+	msg.id = (0x0C << 7) + node;
+	msg.type = mt_standard;
+
+	msg.len = 8;
+	memcpy(msg.data, frame, 8);
+
+	n->sdo_pending = true;
+	n->read_callback = NULL;
+	n->write_callback = NULL;
+	n->abort_callback = NULL;
+	n->frame_callback = frame_callback;
+	n->sdo_callback_data = data;
+
+	return intf_write(intf, msg, INTF_TX_PRIO_NORMAL);
+}
+
+
+/**
+ * Stop waiting for the response to the last request sent
+ * to a node, a response that still arrives is ignored.
+ */
+void intf_cancel_sdo(intf_t *intf, uint8_t node)
 {
 	assert(intf);
-	int function = msg.id >> 7;
 
-  // Emergency messages are only logged (not handled)
-	if(function == 0x01) {
-		int emergency = msg.data[0] + (msg.data[1] << 8);
-		syslog(LOG_ALERT, "%s() received an emergency message (%04x:%02x:%02x).", __FUNCTION__, emergency, msg.data[2], msg.data[3]);
-		intf_log_emergency(emergency);
+	intf_node_t *n = intf_get_node(intf, node);
+
+	if(n)
+		intf_clear_sdo_callbacks(n);
+}
+
+
+/**
+ * Count emergency message by error code.
+ */
+static void intf_count_emcy(intf_t *intf, uint16_t code)
+{
+	intf_emcy_stats_t *stats = &intf->emcy_stats;
+	stats->total++;
+
+	for(int i = 0; i < stats->codes; i++)
+		if(stats->counts[i].code == code) {
+			stats->counts[i].count++;
+			return;
+		}
+
+	if(stats->codes == INTF_EMCY_CODES) {
+		stats->other++;
+		return;
 	}
 
-	// TPDOs
-	if(function == 0x03 || function == 0x05 || function == 0x07 || function == 0x09) {
-		if(intf->tpdo_handler)
-			intf->tpdo_handler(intf, intf->payload, (function-1)/2, msg.data);
+	stats->counts[stats->codes].code = code;
+	stats->counts[stats->codes].count = 1;
+	stats->codes++;
+}
+
+
+/**
+ * Decode emergency message, log and count it and
+ * pass it to the handler of the node that sent it.
+ */
+static void intf_on_emergency(intf_t *intf, can_message_t *msg, int arg)
+{
+	intf_emcy_t emcy;
+	emcy.node = arg;
+	emcy.code = msg->data[0] + (msg->data[1] << 8);
+	emcy.error_register = msg->data[2];
+	memcpy(emcy.manufacturer, &msg->data[3], 5);
+	emcy.time = msg->time;
+
+	syslog(LOG_ALERT, "%s() received an emergency message from node %d (%04x:%02x:%02x): %s",
+		__FUNCTION__, emcy.node, emcy.code, emcy.error_register, emcy.manufacturer[0],
+		intf_emcy_to_message(emcy.code));
+
+	intf_count_emcy(intf, emcy.code);
+
+	intf_node_t *node = intf->nodes[arg];
+
+	if(node && node->emcy_handler)
+		node->emcy_handler(intf, node->payload, &emcy);
+}
+
+
+/**
+ * Pass TPDO data to the handler registered for its node and number.
+ */
+static void intf_on_tpdo(intf_t *intf, can_message_t *msg, int arg)
+{
+	intf_node_t *node = intf->nodes[INTF_COB_ARG_NODE(arg)];
+	int pdo = INTF_COB_ARG_PDO(arg);
+
+	if(node && node->tpdo_handlers[pdo])
+		node->tpdo_handlers[pdo](intf, node->payload, pdo, msg->data, msg->time);
+}
+
+
+/**
+ * Node guard and heartbeat messages.
+ */
+static void intf_on_node_guard(intf_t *intf, can_message_t *msg, int arg)
+{
+	intf_node_t *node = intf->nodes[arg];
+
+	if(node && node->nmt_state_handler) {
+		uint8_t state = msg->data[0] & 0x7F;
+		node->nmt_state_handler(intf, node->payload, state);
 	}
+}
+
+
+/**
+ * SDO response, invokes read/write/abort callback.
+ */
+static void intf_on_sdo_response(intf_t *intf, can_message_t *msg, int arg)
+{
+	intf_node_t *node = intf->nodes[arg];
+
+	uint16_t index = msg->data[1] + (msg->data[2] << 8);
+	uint8_t subindex = msg->data[3];
+	uint32_t value = 0;
 
-	// Node guard message
-	if(function == 0x0E && intf->nmt_state_handler) {
-		uint8_t state = msg.data[0] & 0x7F;
-		intf->nmt_state_handler(intf, intf->payload, state);
+	// Segmented or block transfer in progress
+	if(node && node->sdo_pending && node->frame_callback) {
+		node->frame_callback(node->sdo_callback_data, msg->data);
+		return;
 	}
 
-	// SDO response
-	if(function == 0x0B) {
-		uint16_t index = msg.data[1] + (msg.data[2] << 8);
-		uint8_t subindex = msg.data[3];
-		uint32_t value;
+	// Response to a request we did not (or no longer) expect
+	if(!node || !node->sdo_pending || node->sdo_index != index || node->sdo_subindex != subindex) {
+		syslog(LOG_NOTICE, "%s() ignoring unexpected response (%02x) from node %d for %04x:%02x.",
+			__FUNCTION__, msg->data[0], arg, index, subindex);
+		return;
+	}
 
-		switch(msg.data[0]) {
-			case 0x80:
-			case 0x43:
-				value = msg.data[4] + (msg.data[5] << 8) + (msg.data[6] << 16) + (msg.data[7] << 24);
-				break;
-			case 0x47: value = msg.data[4] + (msg.data[5] << 8) + (msg.data[6] << 16); break;
-			case 0x4B: value = msg.data[4] + (msg.data[5] << 8); break;
-			case 0x4F: value = msg.data[4]; break;
-		}
+	if(msg->data[0] == 0x60 || msg->data[0] == 0x80 || (msg->data[0] & 0xF3) == 0x43)
+		node->sdo_pending = false;
+
+	switch(msg->data[0]) {
+		case 0x80:
+		case 0x43:
+			value = msg->data[4] + (msg->data[5] << 8) + (msg->data[6] << 16) + (msg->data[7] << 24);
+			break;
+		case 0x47: value = msg->data[4] + (msg->data[5] << 8) + (msg->data[6] << 16); break;
+		case 0x4B: value = msg->data[4] + (msg->data[5] << 8); break;
+		case 0x4F: value = msg->data[4]; break;
+	}
 
-		// Write response
-		if(msg.data[0] == 0x60) {
-			if(intf->write_callback) {
-				intf->write_callback(intf->sdo_callback_data, index, subindex);
-			} else {
-				syslog(LOG_NOTICE, "%s() received a write response, but no callback function has been set.", __FUNCTION__);
-			}
+	// Write response
+	if(msg->data[0] == 0x60) {
+		if(node->write_callback) {
+			node->write_callback(node->sdo_callback_data, index, subindex);
+		} else {
+			syslog(LOG_NOTICE, "%s() received a write response, but no callback function has been set.", __FUNCTION__);
 		}
+	}
 
-		// Read response
-		if(msg.data[0] == 0x43 || msg.data[0] == 0x47 || msg.data[0] == 0x4B || msg.data[0] == 0x4F) {
-			if(intf->read_callback) {
-				intf->read_callback(intf->sdo_callback_data, index, subindex, value);
-			} else {
-				syslog(LOG_NOTICE, "%s() received a read response, but no callback function has been set.", __FUNCTION__);
-			}
+	// Read response
+	if(msg->data[0] == 0x43 || msg->data[0] == 0x47 || msg->data[0] == 0x4B || msg->data[0] == 0x4F) {
+		if(node->read_callback) {
+			node->read_callback(node->sdo_callback_data, index, subindex, value);
+		} else {
+			syslog(LOG_NOTICE, "%s() received a read response, but no callback function has been set.", __FUNCTION__);
 		}
+	}
 
-		// Abort response
-		if(msg.data[0] == 0x80) {
-			if(intf->abort_callback) {
-				intf->abort_callback(intf->sdo_callback_data, index, subindex, value);
-			} else {
-				syslog(LOG_NOTICE, "%s() received an abort response, but no callback function has been set.", __FUNCTION__);
-			}
+	// Abort response
+	if(msg->data[0] == 0x80) {
+		if(node->abort_callback) {
+			node->abort_callback(node->sdo_callback_data, index, subindex, value);
+		} else {
+			syslog(LOG_NOTICE, "%s() received an abort response, but no callback function has been set.", __FUNCTION__);
 		}
 	}
 }
 
 
 /**
- * Called when data is pending
+ * Register handler for frames with the given COB-ID.
+ *
+ * @param intf  Interface.
+ * @param cob_id  11-bit identifier.
+ * @param handler  Handler, NULL to ignore the identifier.
+ * @param arg  Argument passed to the handler.
+ * @return 0 on success, -1 if the identifier is invalid.
  */
-static void intf_on_read(evutil_socket_t fd, short events, void *intf_v)
+int intf_register_cob(intf_t *intf, uint16_t cob_id, intf_cob_handler_t handler, int arg)
 {
-	#ifndef WIN32
-	intf_t *intf = (intf_t *) intf_v;
+	assert(intf);
 
-	// We've been closed down, stop.
-	if(!intf || !intf->fd)
+	if(cob_id >= INTF_NUM_COB_IDS)
+		return -1;
+
+	intf->cob_table[cob_id].handler = handler;
+	intf->cob_table[cob_id].arg = arg;
+
+	return 0;
+}
+
+
+/**
+ * Deliver frames with the given COB-ID to the handler of a TPDO.
+ *
+ * @param intf  Interface.
+ * @param node  Node transmitting the PDO.
+ * @param cob_id  COB-ID the PDO is transmitted on.
+ * @param pdo  PDO number (1 to INTF_NUM_TPDOS).
+ * @return 0 on success, -1 on invalid arguments.
+ */
+int intf_register_tpdo(intf_t *intf, uint8_t node, uint16_t cob_id, int pdo)
+{
+	if(pdo < 1 || pdo > INTF_NUM_TPDOS || !intf_get_node(intf, node))
+		return -1;
+
+	if(intf_register_cob(intf, cob_id, intf_on_tpdo, INTF_COB_ARG(node, pdo)) == -1)
+		return -1;
+
+	intf_update_filter(intf);
+
+	return 0;
+}
+
+
+/**
+ * Add node to the bus and register its default
+ * (pre-defined connection set) COB-IDs.
+ *
+ * @param intf  Interface.
+ * @param node  Node-ID (1 to INTF_MAX_NODE).
+ * @return 0 on success, -1 on invalid or already registered node.
+ */
+int intf_register_node(intf_t *intf, uint8_t node)
+{
+	assert(intf);
+
+	if(node < 1 || node > INTF_MAX_NODE)
+		return -1;
+
+	if(intf->nodes[node]) {
+		syslog(LOG_ERR, "%s() node %d has already been registered", __FUNCTION__, node);
+		return -1;
+	}
+
+	intf_node_t *n = new intf_node_t();
+	n->id = node;
+	n->payload = NULL;
+	n->nmt_state_handler = NULL;
+	n->close_handler = NULL;
+	n->overrun_handler = NULL;
+	n->emcy_handler = NULL;
+
+	for(int i = 0; i <= INTF_NUM_TPDOS; i++)
+		n->tpdo_handlers[i] = NULL;
+
+	intf_clear_sdo_callbacks(n);
+
+	intf->nodes[node] = n;
+
+	intf_register_cob(intf, (0x01 << 7) + node, intf_on_emergency, node);
+	intf_register_cob(intf, (0x0B << 7) + node, intf_on_sdo_response, node);
+	intf_register_cob(intf, (0x0E << 7) + node, intf_on_node_guard, node);
+
+	// TPDO n is transmitted using function code 2n + 1
+	for(int pdo = 1; pdo <= INTF_NUM_TPDOS; pdo++)
+		intf_register_cob(intf, ((2 * pdo + 1) << 7) + node, intf_on_tpdo, INTF_COB_ARG(node, pdo));
+
+	intf_update_filter(intf);
+
+	return 0;
+}
+
+
+/**
+ * Remove node and ignore frames on the COB-IDs registered for it.
+ */
+void intf_unregister_node(intf_t *intf, uint8_t node)
+{
+	assert(intf);
+
+	if(!intf_get_node(intf, node))
 		return;
 
-	TPCANRdMsg message;
-	DWORD result;
+	for(int i = 0; i < INTF_NUM_COB_IDS; i++) {
+		intf_cob_entry_t *entry = &(intf->cob_table[i]);
+
+		bool by_node = entry->handler == intf_on_emergency ||
+			entry->handler == intf_on_sdo_response || entry->handler == intf_on_node_guard;
 
-	result = LINUX_CAN_Read(intf->handle, &message);
+		if((by_node && entry->arg == node) ||
+			(entry->handler == intf_on_tpdo && INTF_COB_ARG_NODE(entry->arg) == node))
+			intf_register_cob(intf, i, NULL, 0);
+	}
 
-	/*count++;
-	if(count % 1000 == 0) {
-		double delta = get_time() - start;
-		printf("%d messages in %f seconds: %.0f Hz (%.4f sec/msg)\n", count, delta, double(count)/delta, delta/double(count));
-	}*/
+	delete intf->nodes[node];
+	intf->nodes[node] = NULL;
 
-	// Receive queue was empty, no message read
-	if(result == CAN_ERR_QRCVEMPTY) {
-		syslog(LOG_NOTICE, "%s() expected message in queue, but found none.", __FUNCTION__);
+	intf_update_filter(intf);
+}
+
+
+/**
+ * Invokes the handler registered for the COB-ID of a message.
+ */
+static void intf_dispatch_msg(intf_t *intf, can_message_t *msg)
+{
+	assert(intf && msg);
+
+	if(msg->type & mt_extended)
 		return;
+
+	intf_cob_entry_t *entry = &(intf->cob_table[msg->id & (INTF_NUM_COB_IDS - 1)]);
+
+	if(entry->handler)
+		entry->handler(intf, msg, entry->arg);
+	else
+		intf->filter_stats.unhandled++;
+}
+
+
+/**
+ * Update frames-per-wakeup statistics.
+ *
+ * @param intf  Interface that was read from.
+ * @param count  Number of frames read in this wakeup.
+ */
+static void intf_update_read_stats(intf_t *intf, int count)
+{
+	intf_read_stats_t *stats = &intf->read_stats;
+
+	stats->wakeups++;
+	stats->frames += count;
+
+	if(count == 0)
+		stats->empty_wakeups++;
+	if(count >= intf->read_limit)
+		stats->limited_wakeups++;
+	if(count > stats->max_frames)
+		stats->max_frames = count;
+	if(count > intf->report_max_frames)
+		intf->report_max_frames = count;
+
+	// Output summary statistics every X wakeups
+	if(stats->wakeups % INTF_REPORT_EVERY_X_WAKEUPS == 0) {
+		syslog(LOG_DEBUG, "%s() %llu frames in %llu wakeups; mean %.2f; max %d; %llu empty; %llu limited\n",
+			__FUNCTION__,
+			(unsigned long long) stats->frames,
+			(unsigned long long) stats->wakeups,
+			double(stats->frames) / double(stats->wakeups),
+			intf->report_max_frames,
+			(unsigned long long) stats->empty_wakeups,
+			(unsigned long long) stats->limited_wakeups);
+
+		syslog(LOG_DEBUG, "%s() %llu frames sent; %llu queued; %llu dropped; max queue depth %d\n",
+			__FUNCTION__,
+			(unsigned long long) intf->tx_stats.frames,
+			(unsigned long long) intf->tx_stats.queued,
+			(unsigned long long) intf->tx_stats.dropped,
+			intf->tx_stats.max_depth);
+
+		syslog(LOG_DEBUG, "%s() filter %s for %d COB-IDs; %llu frames rejected; %llu unhandled\n",
+			__FUNCTION__,
+			intf->filter_stats.active ? "active" : "inactive",
+			intf->filter_stats.cob_ids,
+			(unsigned long long) intf->filter_stats.rejected,
+			(unsigned long long) intf->filter_stats.unhandled);
+
+		syslog(LOG_DEBUG, "%s() %llu receive overruns; %llu frames known lost\n",
+			__FUNCTION__,
+			(unsigned long long) intf->overrun_stats.events,
+			(unsigned long long) intf->overrun_stats.lost);
+
+		intf->report_max_frames = 0;
 	}
+}
 
-	// There was an error
-	if(result != CAN_ERR_OK) {
-		syslog(LOG_ALERT, "%s() reading from the CAN bus failed interface will be closed.", __FUNCTION__);
-		intf_close(intf);
+
+/**
+ * Account for frames lost because a receive buffer overflowed.
+ * Called by backends (and fault injection) while reading, nodes
+ * are informed once the frames read have been dispatched.
+ *
+ * @param intf  Interface.
+ * @param source  Buffer that overflowed.
+ * @param lost  Number of frames lost, 0 if unknown.
+ */
+void intf_report_overrun(intf_t *intf, intf_overrun_source_t source, uint32_t lost)
+{
+	// Reported by the busy-poll thread, accounted for once received
+	if(intf->poll && intf_poll_defer_overrun(intf, source, lost))
 		return;
+
+	intf_overrun_stats_t *stats = &intf->overrun_stats;
+
+	stats->events++;
+	stats->lost += lost;
+	stats->last_time = intf_get_time();
+
+	if(source == overrun_controller)
+		stats->controller++;
+	else
+		stats->queue++;
+
+	intf->overrun_pending = true;
+	intf->overrun_lost += lost;
+}
+
+
+/**
+ * Inform nodes of an overrun reported during the last read.
+ *
+ * This happens after the frames read have been dispatched, such
+ * that a response that survived the overrun has been handled before
+ * nodes conclude their outstanding SDO request was lost.
+ */
+static void intf_notify_overrun(intf_t *intf)
+{
+	uint32_t lost = intf->overrun_lost;
+
+	intf->overrun_pending = false;
+	intf->overrun_lost = 0;
+
+	syslog(LOG_WARNING, "%s() receive overrun on %s, %u frames known lost",
+		__FUNCTION__, intf->device, lost);
+
+	for(int i = 0; i <= INTF_MAX_NODE && intf->fd >= 0; i++) {
+		intf_node_t *node = intf->nodes[i];
+
+		if(node && node->overrun_handler)
+			node->overrun_handler(intf, node->payload, lost);
 	}
+}
+
+
+/**
+ * Inject faults into, dispatch and account for frames read
+ * in one wakeup. The buffer must have room for duplicates.
+ */
+static void intf_handle_batch(intf_t *intf, can_message_t *msgs, int count)
+{
+	intf_update_read_stats(intf, count);
+
+	// Faults are injected before frames are accounted for
+	if(intf->fault)
+		count = intf_fault_receive(intf, msgs, count);
+
+	intf_receive(intf, msgs, count);
+
+	if(intf->overrun_pending && intf->fd >= 0)
+		intf_notify_overrun(intf);
+}
+
+
+/**
+ * Called when data is pending
+ *
+ * Drains the receive queue (up to the read limit, such that
+ * timers cannot be starved) and then dispatches the batch.
+ */
+static void intf_on_read(evutil_socket_t fd, short events, void *intf_v)
+{
+	intf_t *intf = (intf_t *) intf_v;
 
-	// A status message was received
-	if(message.Msg.MSGTYPE & MSGTYPE_STATUS == MSGTYPE_STATUS)
-	{
-		int32_t status = int32_t(CAN_Status(intf->handle));
+	// We've been closed down, stop.
+	if(!intf || intf->fd < 0)
+		return;
+
+	// Room for frames duplicated by fault injection
+	can_message_t msgs[2 * INTF_READ_BATCH];
+	int count = 0;
+
+	while(count < intf->read_limit) {
+		int result = intf->backend->read(intf, &msgs[count], intf->read_limit - count);
 
-		if(status < 0) {
-			syslog(LOG_ALERT, "%s() received invalid status (%x) interface will be closed.", __FUNCTION__, status);
+		// There was an error
+		if(result == -1) {
+			syslog(LOG_ALERT, "%s() reading from the CAN bus failed interface will be closed.", __FUNCTION__);
 			intf_close(intf);
 			return;
 		}
 
-		if(status != 0x20 && status != 0x00)
-			intf_log_status(__FUNCTION__, status);
+		if(result == 0)
+			break;
+
+		count += result;
+	}
+
+	intf_handle_batch(intf, msgs, count);
+}
 
+
+/**
+ * Called when the busy-poll thread has frames waiting.
+ */
+static void intf_on_poll(evutil_socket_t fd, short events, void *intf_v)
+{
+	intf_t *intf = (intf_t *) intf_v;
+
+	if(!intf || intf->fd < 0)
+		return;
+
+	can_message_t msgs[2 * INTF_READ_BATCH];
+	int count = intf_poll_receive(intf, msgs, intf->read_limit);
+
+	if(count == -1) {
+		syslog(LOG_ALERT, "%s() reading from the CAN bus failed interface will be closed.", __FUNCTION__);
+		intf_close(intf);
 		return;
 	}
 
-	uint64_t timestamp = message.dwTime * 1000 + message.wUsec;
+	intf_handle_batch(intf, msgs, count);
+}
 
-	// Tell the world we've received a message
-	can_message_t msg;
-	msg.id = message.Msg.ID;
-	msg.type = message.Msg.MSGTYPE;
-	msg.len = message.Msg.LEN;
 
-	for(int i = 0; i < 8; i++)
-		msg.data[i] = message.Msg.DATA[i];
+/**
+ * Account for, record and dispatch received messages.
+ */
+void intf_receive(intf_t *intf, can_message_t *msgs, int count)
+{
+	for(int i = 0; i < count; i++)
+		intf_stats_update(intf, &msgs[i], INTF_TRACE_RX);
+
+	if(intf->trace_enabled)
+		for(int i = 0; i < count; i++)
+			intf_trace_record(intf->trace, &msgs[i], INTF_TRACE_RX);
 
-	intf_dispatch_msg(intf, msg);
+	if(intf->capture)
+		for(int i = 0; i < count; i++)
+			intf_capture_record(intf, &msgs[i], INTF_TRACE_RX);
 
-	return;
-  #endif
+	// Tell the world we've received a message, stop
+	// when one of the handlers closed the interface.
+	for(int i = 0; i < count && intf->fd >= 0; i++)
+		intf_dispatch_msg(intf, &msgs[i]);
 }
 
 
-void intf_set_callback_payload(intf_t *intf, void *payload)
+/**
+ * Retrieve transmit statistics.
+ */
+void intf_get_tx_stats(intf_t *intf, intf_tx_stats_t *stats)
 {
-	intf->payload = payload;
+	assert(intf && stats);
+	*stats = intf->tx_stats;
 }
 
 
-void intf_set_nmt_state_handler(intf_t *intf, intf_nmt_state_handler_t handler)
+/**
+ * Retrieve acceptance filter statistics.
+ */
+void intf_get_filter_stats(intf_t *intf, intf_filter_stats_t *stats)
 {
-	intf->nmt_state_handler = handler;
+	assert(intf && stats);
+	*stats = intf->filter_stats;
 }
 
 
-void intf_set_tpdo_handler(intf_t *intf, intf_tpdo_handler_t handler)
+/**
+ * Retrieve receive overrun statistics.
+ */
+void intf_get_overrun_stats(intf_t *intf, intf_overrun_stats_t *stats)
+{
+	assert(intf && stats);
+	*stats = intf->overrun_stats;
+}
+
+
+/**
+ * Retrieve number of emergency messages per error code.
+ */
+void intf_get_emcy_stats(intf_t *intf, intf_emcy_stats_t *stats)
 {
-	intf->tpdo_handler = handler;
+	assert(intf && stats);
+	*stats = intf->emcy_stats;
 }
 
 
-void intf_set_close_handler(intf_t *intf, intf_close_handler_t handler)
+/**
+ * Enable or disable recording of frames in the trace buffer.
+ */
+void intf_set_trace(intf_t *intf, bool enabled)
 {
-  intf->close_handler = handler;
+	assert(intf);
+
+	if(intf->trace_enabled != enabled)
+		syslog(LOG_NOTICE, "%s() frame trace %s", __FUNCTION__, enabled ? "enabled" : "disabled");
+
+	intf->trace_enabled = enabled;
 }
 
+
+/**
+ * Write most recent frames to a binary trace file.
+ *
+ * @param intf  Interface.
+ * @param filename  File to write.
+ * @return Number of frames written, -1 on failure.
+ */
+int intf_dump_trace(intf_t *intf, const char *filename)
+{
+	assert(intf);
+
+	int count = intf_trace_dump(intf->trace, filename);
+
+	if(count >= 0)
+		syslog(LOG_NOTICE, "%s() wrote %d frames to %s", __FUNCTION__, count, filename);
+
+	return count;
+}
+
+
+/**
+ * Set maximum number of messages dispatched per read wakeup.
+ *
+ * Remaining messages are handled on the next event loop
+ * iteration, after timers of equal priority have had a chance to run.
+ *
+ * @param intf  Interface.
+ * @param limit  Number of messages, between 1 and INTF_READ_BATCH.
+ * @return 0 on success, -1 when the limit is out of range.
+ */
+int intf_set_read_limit(intf_t *intf, int limit)
+{
+	assert(intf);
+
+	if(limit < 1 || limit > INTF_READ_BATCH)
+		return -1;
+
+	intf->read_limit = limit;
+	return 0;
+}
+
+
+/**
+ * Copy receive statistics.
+ */
+void intf_get_read_stats(intf_t *intf, intf_read_stats_t *stats)
+{
+	assert(intf && stats);
+	*stats = intf->read_stats;
+}
+
+
+void intf_set_callback_payload(intf_t *intf, uint8_t node, void *payload)
+{
+	assert(intf_get_node(intf, node));
+	intf->nodes[node]->payload = payload;
+}
+
+
+void intf_set_nmt_state_handler(intf_t *intf, uint8_t node, intf_nmt_state_handler_t handler)
+{
+	assert(intf_get_node(intf, node));
+	intf->nodes[node]->nmt_state_handler = handler;
+}
+
+
+/**
+ * Set handler for a transmit PDO.
+ *
+ * @param intf  Interface.
+ * @param node  Registered node.
+ * @param pdo  PDO number (1 to INTF_NUM_TPDOS).
+ * @param handler  Function invoked when the PDO is received.
+ */
+void intf_set_tpdo_handler(intf_t *intf, uint8_t node, int pdo, intf_tpdo_handler_t handler)
+{
+	assert(intf && pdo >= 1 && pdo <= INTF_NUM_TPDOS);
+	assert(intf_get_node(intf, node));
+	intf->nodes[node]->tpdo_handlers[pdo] = handler;
+}
+
+
+void intf_set_close_handler(intf_t *intf, uint8_t node, intf_close_handler_t handler)
+{
+	assert(intf_get_node(intf, node));
+  intf->nodes[node]->close_handler = handler;
+}
+
+
+/**
+ * Set handler informed when frames may have been lost in a
+ * receive overrun, with the number of frames known to be lost.
+ */
+void intf_set_overrun_handler(intf_t *intf, uint8_t node, intf_overrun_handler_t handler)
+{
+	assert(intf_get_node(intf, node));
+	intf->nodes[node]->overrun_handler = handler;
+}
+
+
+/**
+ * Set handler invoked for every emergency message of a node.
+ */
+void intf_set_emcy_handler(intf_t *intf, uint8_t node, intf_emcy_handler_t handler)
+{
+	assert(intf_get_node(intf, node));
+	intf->nodes[node]->emcy_handler = handler;
+}
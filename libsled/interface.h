@@ -6,6 +6,21 @@
 struct event_base;
 struct intf_t;
 
+/**
+ * Device opened when none has been specified.
+ */
+#define INTF_DEFAULT_DEVICE "/dev/pcanpci0"
+
+/**
+ * Number of transmit PDOs per node.
+ */
+#define INTF_NUM_TPDOS 4
+
+/**
+ * Highest CANopen node-ID.
+ */
+#define INTF_MAX_NODE 127
+
 /**
  * Network management commands.
  */
@@ -38,12 +53,205 @@ struct intf_t;
 #define OB_ACTIVE_TASK       0x2081  // Currently active motion task
 #define OB_COPY_MOTION_TASK	 0x2082	 // Copy motion task
 #define OB_CONTROL_WORD 		 0x6040	 // Control word
+#define OB_MODES_OF_OPERATION	 0x6060	 // Modes of operation
+
+
+/**
+ * Receive statistics (frames dispatched per read wakeup).
+ */
+struct intf_read_stats_t {
+	uint64_t wakeups;		// Read handler invocations
+	uint64_t empty_wakeups;	// Invocations that found no message
+	uint64_t limited_wakeups;	// Invocations that hit the read limit
+	uint64_t frames;		// Total number of frames dispatched
+	int max_frames;			// Largest number of frames in one wakeup
+};
+
+
+/**
+ * Transmit statistics.
+ */
+struct intf_tx_stats_t {
+	uint64_t frames;		// Frames handed to the device
+	uint64_t queued;		// Frames that had to wait for the device
+	uint64_t dropped;		// Frames dropped because the queue was full
+	int depth;				// Frames currently queued
+	int max_depth;			// Largest number of frames queued
+};
+
+
+/**
+ * Acceptance filter statistics.
+ */
+struct intf_filter_stats_t {
+	int cob_ids;			// COB-IDs accepted by the filter
+	bool active;			// Filter has been programmed into the device
+	uint64_t rejected;		// Frames rejected by the device (if it counts them)
+	uint64_t unhandled;		// Frames received for which there is no handler
+};
+
+
+/**
+ * Receive buffer that overflowed.
+ */
+enum intf_overrun_source_t {
+	overrun_controller,		// Receive buffer of the CAN controller
+	overrun_queue			// Receive queue of the driver or socket
+};
+
+/**
+ * Receive overrun statistics. Frames lost in an overrun are
+ * only counted when the device reports how many there were.
+ */
+struct intf_overrun_stats_t {
+	uint64_t events;		// Overruns reported
+	uint64_t controller;	// Of which in the controller
+	uint64_t queue;			// Of which in a receive queue
+	uint64_t lost;			// Frames known to be lost
+	double last_time;		// Time of the last overrun
+};
+
+
+/**
+ * Emergency (EMCY) message sent by a node.
+ */
+struct intf_emcy_t {
+	uint8_t node;
+	uint16_t code;				// Emergency error code
+	uint8_t error_register;		// Error register (object 0x1001)
+	uint8_t manufacturer[5];	// Manufacturer specific error field
+	double time;				// Time of reception
+};
+
+/**
+ * Number of distinct error codes counted individually.
+ */
+#define INTF_EMCY_CODES 32
+
+/**
+ * Emergency statistics, messages are counted per error code.
+ */
+struct intf_emcy_stats_t {
+	uint64_t total;			// Messages received
+	uint64_t other;			// Of which with a code that did not fit in the table
+
+	int codes;
+	struct {
+		uint16_t code;
+		uint64_t count;
+	} counts[INTF_EMCY_CODES];
+};
+
+
+/**
+ * Distribution of the random part of injected delays.
+ */
+enum intf_jitter_t {
+	jitter_uniform,			// Between 0 and jitter
+	jitter_normal,			// Half-normal, standard deviation jitter
+	jitter_exponential		// Exponential, mean jitter
+};
+
+/**
+ * Faults injected between the interface and the device
+ * (see intf_parse_fault_profile). Times are in seconds.
+ */
+struct intf_fault_profile_t {
+	uint32_t seed;
+
+	double latency;				// Fixed delay of every frame
+	double jitter;				// Random delay added
+	intf_jitter_t distribution;
+
+	double drop;				// Probability a frame is lost
+	double burst;				// Probability a loss burst starts
+	int burst_length;			// Frames lost per burst
+	double duplicate;			// Probability a frame is delivered twice
+	double corrupt;				// Probability a payload bit is flipped
+	double reorder;				// Probability a frame is overtaken
+	double reorder_delay;		// Extra delay of an overtaken frame
+	double overrun;				// Probability of a receive overrun, losing up to burst_length frames
+
+	double bus_off_interval;	// Mean time between bus-off events, 0 disables
+	double bus_off_duration;	// All frames are lost while bus-off
+
+	bool rx, tx;				// Directions affected
+};
+
+/**
+ * Fault injection statistics.
+ */
+struct intf_fault_stats_t {
+	uint64_t delayed;			// Frames held back
+	uint64_t dropped;			// Frames lost (random and burst)
+	uint64_t duplicated;
+	uint64_t corrupted;
+	uint64_t reordered;
+	uint64_t overruns;			// Receive overruns simulated
+	uint64_t bus_off_events;
+	uint64_t bus_off_dropped;	// Frames lost while bus-off
+	double max_delay;			// Longest delay of a delivered frame (s)
+};
+
+
+/**
+ * Busy-poll statistics (see intf_set_busy_poll).
+ */
+struct intf_poll_stats_t {
+	int cpu;				// CPU the poll thread is pinned to
+	uint64_t loops;			// Iterations of the poll loop
+	uint64_t idle_loops;	// Iterations that found no frame
+	uint64_t frames;		// Frames passed to the event loop
+	uint64_t dropped;		// Frames lost because the queue was full
+	uint64_t wakeups;		// Times the event loop was woken
+	int max_depth;			// Most frames found waiting in the queue
+	double mean_latency;	// Time from read to dispatch (s)
+	double max_latency;
+};
+
+
+/**
+ * Inter-arrival histogram, bin i counts intervals of at least
+ * INTF_HISTOGRAM_BASE * 2^(i/4) us. Shorter intervals are
+ * counted in the first bin, longer ones in the last.
+ */
+#define INTF_HISTOGRAM_BINS 48
+#define INTF_HISTOGRAM_BASE 64.0
+
+/**
+ * Statistics of frames with a single COB-ID.
+ */
+struct intf_cob_stats_t {
+	uint64_t rx_frames;		// Frames received
+	uint64_t tx_frames;		// Frames sent
+	uint64_t bits;			// Estimated bits on the bus
+
+	// Time between received frames (s)
+	double last_time;
+	uint64_t intervals;
+	double min_interval, max_interval;
+	double sum_interval, sum_sq_interval;
+	uint32_t histogram[INTF_HISTOGRAM_BINS];
+};
+
+/**
+ * Bus statistics, load is the fraction of bit-times in use.
+ */
+struct intf_bus_stats_t {
+	uint64_t frames;		// Frames sent and received
+	uint64_t bits;			// Estimated bits on the bus
+	double load;			// Load during last complete window
+	double peak_load;		// Highest load of any window
+	uint64_t untrusted_stamps;	// Frames stamped on reading, the driver timestamp was implausible
+};
 
 
 // Callbacks
 typedef void(*intf_nmt_state_handler_t)(intf_t *intf, void *payload, uint8_t state);
-typedef void(*intf_tpdo_handler_t)(intf_t *intf, void *payload, int pdo, uint8_t *data);
+typedef void(*intf_tpdo_handler_t)(intf_t *intf, void *payload, int pdo, uint8_t *data, double time);
 typedef void(*intf_close_handler_t)(intf_t *intf, void *payload);
+typedef void(*intf_overrun_handler_t)(intf_t *intf, void *payload, uint32_t lost);
+typedef void(*intf_emcy_handler_t)(intf_t *intf, void *payload, const intf_emcy_t *emcy);
 
 /**
  * Callbacks for send_write_req and send_read_req.
@@ -51,23 +259,61 @@ typedef void(*intf_close_handler_t)(intf_t *intf, void *payload);
 typedef void(*intf_abort_callback_t)(void *data, uint16_t index, uint8_t subindex, uint32_t code);
 typedef void(*intf_write_callback_t)(void *data, uint16_t index, uint8_t subindex);
 typedef void(*intf_read_callback_t)(void *data, uint16_t index, uint8_t subindex, uint32_t value);
+typedef void(*intf_frame_callback_t)(void *data, const uint8_t *frame);
 
 // Functions
-intf_t *intf_create(event_base *ev_base);
+intf_t *intf_create(event_base *ev_base, const char *device);
 void intf_destroy(intf_t **intf);
 
 int intf_open(intf_t *intf);
 int intf_close(intf_t *intf);
 
-int intf_send_nmt_command(intf_t *intf, uint8_t command);
-int intf_send_read_req(intf_t *intf, uint16_t index, uint8_t subindex, intf_read_callback_t read_callback, intf_abort_callback_t abort_callback, void *data);
-int intf_send_write_req(intf_t *intf, uint16_t index, uint8_t subindex, uint32_t value, uint8_t size, intf_write_callback_t write_callback, intf_abort_callback_t abort_callback, void *data);
+int intf_set_read_limit(intf_t *intf, int limit);
+void intf_get_read_stats(intf_t *intf, intf_read_stats_t *stats);
+void intf_get_tx_stats(intf_t *intf, intf_tx_stats_t *stats);
+void intf_get_filter_stats(intf_t *intf, intf_filter_stats_t *stats);
+void intf_get_overrun_stats(intf_t *intf, intf_overrun_stats_t *stats);
+void intf_get_emcy_stats(intf_t *intf, intf_emcy_stats_t *stats);
+const char *intf_emcy_to_message(uint16_t code);
+
+void intf_get_bus_stats(intf_t *intf, intf_bus_stats_t *stats);
+const intf_cob_stats_t *intf_get_cob_stats(intf_t *intf, uint16_t cob_id);
+void intf_reset_bus_stats(intf_t *intf);
+int intf_format_bus_stats(intf_t *intf, char *buffer, int size);
+int intf_histogram_bin(double interval);
+
+void intf_set_trace(intf_t *intf, bool enabled);
+int intf_dump_trace(intf_t *intf, const char *filename);
+
+int intf_start_capture(intf_t *intf, const char *filename);
+int intf_stop_capture(intf_t *intf);
+
+void intf_fault_profile_init(intf_fault_profile_t *profile);
+int intf_parse_fault_profile(const char *spec, intf_fault_profile_t *profile);
+void intf_set_fault_profile(intf_t *intf, const intf_fault_profile_t *profile);
+int intf_get_fault_stats(intf_t *intf, intf_fault_stats_t *stats);
+
+int intf_set_busy_poll(intf_t *intf, int cpu);
+int intf_get_poll_stats(intf_t *intf, intf_poll_stats_t *stats);
+
+int intf_send_nmt_command(intf_t *intf, uint8_t node, uint8_t command);
+int intf_send_read_req(intf_t *intf, uint8_t node, uint16_t index, uint8_t subindex, intf_read_callback_t read_callback, intf_abort_callback_t abort_callback, void *data);
+int intf_send_write_req(intf_t *intf, uint8_t node, uint16_t index, uint8_t subindex, uint32_t value, uint8_t size, intf_write_callback_t write_callback, intf_abort_callback_t abort_callback, void *data);
+int intf_send_sdo_frame(intf_t *intf, uint8_t node, const uint8_t *frame, intf_frame_callback_t frame_callback, void *data);
+void intf_cancel_sdo(intf_t *intf, uint8_t node);
+
+// Nodes on the bus
+int intf_register_node(intf_t *intf, uint8_t node);
+void intf_unregister_node(intf_t *intf, uint8_t node);
+int intf_register_tpdo(intf_t *intf, uint8_t node, uint16_t cob_id, int pdo);
 
-// Callback setters
-void intf_set_callback_payload(intf_t *intf, void *payload);
+// Callback setters (per node)
+void intf_set_callback_payload(intf_t *intf, uint8_t node, void *payload);
 
-void intf_set_nmt_state_handler(intf_t *intf, intf_nmt_state_handler_t handler);
-void intf_set_tpdo_handler(intf_t *intf, intf_tpdo_handler_t handler);
-void intf_set_close_handler(intf_t *intf, intf_close_handler_t handler);
+void intf_set_nmt_state_handler(intf_t *intf, uint8_t node, intf_nmt_state_handler_t handler);
+void intf_set_tpdo_handler(intf_t *intf, uint8_t node, int pdo, intf_tpdo_handler_t handler);
+void intf_set_close_handler(intf_t *intf, uint8_t node, intf_close_handler_t handler);
+void intf_set_overrun_handler(intf_t *intf, uint8_t node, intf_overrun_handler_t handler);
+void intf_set_emcy_handler(intf_t *intf, uint8_t node, intf_emcy_handler_t handler);
 
 #endif
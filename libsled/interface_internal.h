@@ -2,16 +2,75 @@
 #define __INTERFACE_INTERNAL_H__
 
 #include <stdint.h>
+#include <stdio.h>
 #include <event2/event.h>
 
-#ifdef WIN32
-#include <PCANBasic.h>
-#else
-#include <libpcan.h>
-#endif
-
 #include "interface.h"
 
+/**
+ * Maximum number of messages read from the device per wakeup.
+ */
+#define INTF_READ_BATCH 64
+
+/**
+ * Log receive statistics every X wakeups (about 5 minutes at 1 kHz).
+ */
+#define INTF_REPORT_EVERY_X_WAKEUPS 300000
+
+/**
+ * Driver timestamps older than this (in seconds) are not trusted.
+ */
+#define INTF_MAX_RECEIVE_AGE 1.0
+
+/**
+ * Size of the COB-ID dispatch table (11-bit identifiers).
+ */
+#define INTF_NUM_COB_IDS 0x800
+
+/**
+ * Bitrate set by CAN_Init (CAN_BAUD_1M), used to estimate bus load.
+ */
+#define INTF_BITRATE 1000000
+
+/**
+ * Bus load is computed over windows of this length (s).
+ */
+#define INTF_LOAD_WINDOW 1.0
+
+/**
+ * Number of frames that can be queued for transmission (per priority).
+ */
+#define INTF_TX_QUEUE_SIZE 64
+
+/**
+ * Time after which sending is retried when the device is full but
+ * reports being writable (SocketCAN with a full qdisc), in seconds.
+ */
+#define INTF_TX_RETRY_INTERVAL 0.0005
+
+/**
+ * Size of the stdio buffer of capture files.
+ */
+#define INTF_CAPTURE_BUFFER 65536
+
+/**
+ * Transmit priorities, frames with a lower number are sent first.
+ */
+#define INTF_TX_PRIO_HIGH 0	// NMT commands and control word
+#define INTF_TX_PRIO_NORMAL 1
+#define INTF_TX_PRIORITIES 2
+
+/**
+ * Number of frames the busy-poll thread can hand
+ * to the event loop at once (power of two).
+ */
+#define INTF_POLL_QUEUE_SIZE 1024
+
+/**
+ * Number of frames kept in the trace buffer (power of two).
+ */
+#define INTF_TRACE_SIZE 65536
+
 enum message_type_t
 {
 	mt_status = 0x80,
@@ -26,22 +85,122 @@ struct can_message_t
 	uint8_t type;
 	uint8_t len;
 	uint8_t data[8];
+
+	// Receive time (CLOCK_MONOTONIC, seconds)
+	double time;
 };
 
-struct intf_t
+
+/**
+ * Low-level CAN driver used by the interface.
+ *
+ * The read function returns the number of messages read (zero
+ * when the receive queue is empty) and write returns the number
+ * of messages sent, which is less than count when the device cannot
+ * accept more frames. Writing must not block. Both return -1 when
+ * the device has failed.
+ *
+ * The optional set_filter function restricts reception to the given
+ * (sorted) standard COB-IDs. It is NULL when the device cannot filter.
+ */
+struct intf_backend_t
 {
-  event_base *ev_base;
-  HANDLE handle;
-  int fd;
-  
-  event *read_event;
-  
-  // Callbacks
-  void *payload;
-  
-  intf_nmt_state_handler_t nmt_state_handler;  
-	intf_tpdo_handler_t tpdo_handler;
-  intf_close_handler_t close_handler;
+	const char *name;
+
+	int (*open)(intf_t *intf, const char *device);
+	int (*close)(intf_t *intf);
+
+	int (*read)(intf_t *intf, can_message_t *msgs, int count);
+	int (*write)(intf_t *intf, can_message_t *msgs, int count);
+
+	int (*set_filter)(intf_t *intf, const uint16_t *ids, int count);
+};
+
+extern const intf_backend_t intf_backend_pcan;
+extern const intf_backend_t intf_backend_socketcan;
+extern const intf_backend_t intf_backend_emulator;
+extern const intf_backend_t intf_backend_replay;
+
+
+/**
+ * Trace file format: header followed by records, oldest first.
+ * Decoded by tools/trace/decode_trace.py.
+ */
+#define INTF_TRACE_MAGIC "SLEDTRC"
+#define INTF_TRACE_VERSION 1
+
+#define INTF_TRACE_RX 0
+#define INTF_TRACE_TX 1
+
+struct intf_trace_header_t
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;
+};
+
+struct intf_trace_record_t
+{
+	uint64_t seq;
+	double time;
+	uint16_t id;
+	uint8_t type;
+	uint8_t len;
+	uint8_t direction;
+	uint8_t reserved[3];
+	uint8_t data[8];
+};
+
+struct intf_trace_t;
+struct intf_fault_t;
+struct intf_poll_t;
+
+intf_trace_t *intf_trace_create(uint32_t size);
+void intf_trace_destroy(intf_trace_t **trace);
+void intf_trace_record(intf_trace_t *trace, can_message_t *msg, uint8_t direction);
+int intf_trace_dump(intf_trace_t *trace, const char *filename);
+void intf_capture_record(intf_t *intf, can_message_t *msg, uint8_t direction);
+
+
+/**
+ * Handler for frames received on a registered COB-ID.
+ *
+ * The argument is the value given at registration (e.g. the
+ * node-ID, see INTF_COB_ARG) and saves decoding the identifier.
+ */
+typedef void(*intf_cob_handler_t)(intf_t *intf, can_message_t *msg, int arg);
+
+#define INTF_COB_ARG(node, pdo) (((node) << 8) | (pdo))
+#define INTF_COB_ARG_NODE(arg) ((arg) >> 8)
+#define INTF_COB_ARG_PDO(arg) ((arg) & 0xFF)
+
+struct intf_cob_entry_t
+{
+	intf_cob_handler_t handler;
+	int arg;
+};
+
+
+/**
+ * Handlers and SDO state of a node on the bus.
+ */
+struct intf_node_t
+{
+	uint8_t id;
+
+	// Callbacks
+	void *payload;
+
+	intf_nmt_state_handler_t nmt_state_handler;
+	intf_tpdo_handler_t tpdo_handlers[INTF_NUM_TPDOS + 1];
+	intf_close_handler_t close_handler;
+	intf_overrun_handler_t overrun_handler;
+	intf_emcy_handler_t emcy_handler;
+
+	// Outstanding SDO request
+	bool sdo_pending;
+	uint16_t sdo_index;
+	uint8_t sdo_subindex;
 
 	// Data passed to read/write/abort callbacks
 	void *sdo_callback_data;
@@ -54,8 +213,126 @@ struct intf_t
 
 	// Abort SDO callback
 	intf_abort_callback_t abort_callback;
+
+	// Raw SDO frames of a segmented or block transfer
+	intf_frame_callback_t frame_callback;
 };
 
-static void intf_on_read(evutil_socket_t fd, short events, void *intf_v);
+
+struct intf_t
+{
+  event_base *ev_base;
+
+	// Number of users sharing this interface (see intf_create)
+	int references;
+	intf_t *next;
+
+	// Driver and device name
+	const intf_backend_t *backend;
+	char *device;
+
+	// Driver handle and file descriptor
+	void *handle;
+  int fd;
+
+	// Local time minus driver time of received frames (PEAK), the
+	// smallest seen since the device was opened. The 32-bit driver
+	// millisecond counter is extended using the number of wraps.
+	bool stamp_synced;
+	double stamp_offset;
+	uint32_t stamp_last_ms;
+	uint32_t stamp_wraps;
+
+  event *read_event;
+  event *write_event;
+
+	// Set by the backend when the device is full, but would report
+	// being writable, retry_event then flushes the queue instead.
+	bool tx_retry;
+	event *retry_event;
+
+	// Outbound frames waiting for the device to become writable
+	can_message_t tx_queue[INTF_TX_PRIORITIES][INTF_TX_QUEUE_SIZE];
+	int tx_head[INTF_TX_PRIORITIES];
+	int tx_count[INTF_TX_PRIORITIES];
+	intf_tx_stats_t tx_stats;
+
+	// Maximum number of messages dispatched per wakeup
+	int read_limit;
+
+	// Receive statistics
+	intf_read_stats_t read_stats;
+	int report_max_frames;
+
+	// Acceptance filter
+	intf_filter_stats_t filter_stats;
+
+	// Receive overruns, handlers are informed after the read batch
+	intf_overrun_stats_t overrun_stats;
+	bool overrun_pending;
+	uint32_t overrun_lost;
+
+	// Emergency messages
+	intf_emcy_stats_t emcy_stats;
+
+	// Nodes by node-ID, NULL when not registered
+	intf_node_t *nodes[INTF_MAX_NODE + 1];
+
+	// Bus statistics, per COB-ID allocated on first use
+	intf_cob_stats_t *cob_stats[INTF_NUM_COB_IDS];
+	intf_bus_stats_t bus_stats;
+	double load_window_start;
+
+	// Implausible driver timestamps, counted by whichever thread reads
+	// the device (see intf_poll.cc), so kept apart from bus_stats and
+	// accessed using atomics. Statistics report the count since base.
+	uint64_t untrusted_stamps;
+	uint64_t untrusted_stamps_base;
+	uint64_t load_window_bits;
+
+	// Frame trace
+	intf_trace_t *trace;
+	bool trace_enabled;
+
+	// Capture file (NULL when not capturing)
+	FILE *capture;
+	uint64_t capture_seq;
+
+	// Fault injection (NULL when disabled)
+	intf_fault_t *fault;
+
+	// Busy-poll receive thread (NULL when reading from the event loop)
+	intf_poll_t *poll;
+
+	// Handlers by COB-ID
+	intf_cob_entry_t cob_table[INTF_NUM_COB_IDS];
+};
+
+double intf_get_time();
+double intf_receive_time(intf_t *intf, double age);
+
+int intf_write(intf_t *intf, can_message_t msg, int priority);
+int intf_write_device(intf_t *intf, can_message_t msg, int priority);
+void intf_receive(intf_t *intf, can_message_t *msgs, int count);
+void intf_report_overrun(intf_t *intf, intf_overrun_source_t source, uint32_t lost);
+
+int intf_fault_receive(intf_t *intf, can_message_t *msgs, int count);
+int intf_fault_transmit(intf_t *intf, can_message_t *msg, int priority);
+void intf_fault_flush(intf_t *intf);
+
+int intf_poll_start(intf_t *intf);
+void intf_poll_stop(intf_t *intf);
+int intf_poll_fd(intf_t *intf);
+int intf_poll_receive(intf_t *intf, can_message_t *msgs, int count);
+bool intf_poll_defer_overrun(intf_t *intf, intf_overrun_source_t source, uint32_t lost);
+void intf_poll_reset_stats(intf_t *intf);
+
+void intf_start_reading(intf_t *intf);
+void intf_stop_reading(intf_t *intf);
+
+void intf_stats_init(intf_t *intf);
+void intf_stats_destroy(intf_t *intf);
+void intf_stats_update(intf_t *intf, can_message_t *msg, uint8_t direction);
+int intf_register_cob(intf_t *intf, uint16_t cob_id, intf_cob_handler_t handler, int arg);
 
 #endif
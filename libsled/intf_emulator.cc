@@ -0,0 +1,1520 @@
+/*
+ * Emulates Kollmorgen S700 drives inside the process.
+ *
+ * The device name "emulator" emulates a single drive on node 1,
+ * "emulator:1,2" emulates a drive on each of the listed nodes.
+ *
+ * The emulator understands NMT commands, produces heartbeats and answers
+ * node guarding requests, handles expedited SDO transfers to the objects
+ * used by libsled and segmented and block transfers of program data
+ * (0x1F50:01, as a CiA 302 domain), implements the DS402 state machine, homing, profile
+ * position motion tasks and the sinusoid PLC program, and transmits
+ * TPDOs according to the configured mapping, inhibit and event timers.
+ */
+
+#include "interface.h"
+#include "interface_internal.h"
+#include "sdo.h"
+
+#include <syslog.h>
+#include <assert.h>
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/eventfd.h>
+
+#include <deque>
+#include <map>
+#include <vector>
+
+
+// Node-ID of the drive emulated by default
+#define EMU_DEFAULT_NODE_ID 1
+
+// Interval at which the drive is simulated (us)
+#define EMU_TICK_INTERVAL 1000
+
+// Default heartbeat producer time (ms)
+#define EMU_HEARTBEAT_TIME 100
+
+// Duration of the homing sequence (s)
+#define EMU_HOMING_TIME 0.5
+
+// Number of transmit PDOs
+#define EMU_NUM_TPDOS 4
+
+#define EMU_KEY(index, subindex) ((uint32_t(index) << 8) | (subindex))
+
+// NMT states as reported in heartbeat messages
+#define EMU_NMT_BOOTUP 0x00
+#define EMU_NMT_STOPPED 0x04
+#define EMU_NMT_OPERATIONAL 0x05
+#define EMU_NMT_PREOPERATIONAL 0x7F
+
+// SDO abort codes
+#define EMU_ABORT_COMMAND 0x05040001
+#define EMU_ABORT_READ_ONLY 0x06010002
+#define EMU_ABORT_NO_OBJECT 0x06020000
+#define EMU_ABORT_PDO_LENGTH 0x06040042
+#define EMU_ABORT_LENGTH 0x06070010
+#define EMU_ABORT_NO_SUBINDEX 0x06090011
+
+// Domain holding program data, its largest size (bytes) and
+// the number of segments per block the drive accepts
+#define EMU_DOMAIN_INDEX 0x1F50
+#define EMU_DOMAIN_SUBINDEX 0x01
+#define EMU_DOMAIN_SIZE 0x10000
+#define EMU_BLOCK_SIZE 127
+
+
+enum emu_access_t {
+	acc_rw,
+	acc_ro
+};
+
+/**
+ * Object dictionary entry.
+ */
+struct emu_object_t {
+	uint32_t value;
+	uint8_t size;
+	emu_access_t access;
+};
+
+/**
+ * DS402 device states.
+ */
+enum emu_ds_state_t {
+	ds_switch_on_disabled,
+	ds_ready_to_switch_on,
+	ds_switched_on,
+	ds_operation_enabled,
+	ds_fault
+};
+
+/**
+ * Motion task as configured through the O_* objects.
+ */
+struct emu_task_t {
+	int32_t position;	// um
+	int32_t velocity;
+	int32_t control;
+	int32_t acc, dec;	// ms
+	int32_t table;
+	int32_t next;
+	int32_t delay;		// ms
+};
+
+/**
+ * Transmit state of a PDO.
+ */
+struct emu_tpdo_t {
+	bool sent;
+	double last_time;
+	uint8_t len;
+	uint8_t data[8];
+};
+
+/**
+ * Segmented or block transfer of the domain.
+ */
+enum emu_transfer_mode_t {
+	tr_none,
+	tr_download,			// Segmented
+	tr_upload,				// Segmented
+	tr_block_download,		// Receiving blocks
+	tr_block_download_end,	// Waiting for the end
+	tr_block_upload_start,	// Waiting for the start
+	tr_block_upload,		// Block sent, waiting for the acknowledgement
+	tr_block_upload_end		// End sent, waiting for the response
+};
+
+struct emu_transfer_t {
+	emu_transfer_mode_t mode;
+	uint8_t toggle;
+	uint32_t indicated;		// Size announced by the client, 0 if none
+	bool crc;
+
+	// Data received (download), bytes sent (upload)
+	std::vector<uint8_t> data;
+	uint32_t offset;
+
+	// Block transfer
+	uint8_t blksize;
+	uint8_t seqno;
+	uint32_t block_start;
+	bool last;				// Last segment received or sent
+};
+
+struct emu_bus_t;
+
+struct emu_t {
+	emu_bus_t *bus;
+	uint8_t node;
+
+	// Object dictionary
+	std::map<uint32_t, emu_object_t> od;
+
+	// Network management
+	uint8_t nmt_state;
+	uint8_t guard_toggle;
+	double last_heartbeat;
+
+	// DS402
+	emu_ds_state_t ds_state;
+	uint16_t control_word;
+	bool setpoint_ack;
+
+	// Homing
+	bool homed, homing;
+	double homing_start, homing_from;
+
+	// Motion tasks
+	std::map<int, emu_task_t> tasks;
+
+	bool moving;
+	int active_task;
+	int table;
+	double move_start, move_duration;
+	double move_from, move_to;
+
+	bool next_pending;
+	int next_task;
+	double next_start;
+
+	// Sinusoid PLC program (interpolated position mode)
+	bool sinusoid;
+	int sinusoid_half;
+	double sinusoid_start, sinusoid_offset;
+	double sinusoid_amplitude, sinusoid_period;
+
+	// Actual values
+	double time;
+	double position, velocity;	// um, um/s
+
+	emu_tpdo_t tpdo[EMU_NUM_TPDOS];
+
+	// Program data, kept across resets
+	std::vector<uint8_t> domain;
+	emu_transfer_t transfer;
+};
+
+/**
+ * Drives sharing the emulated bus.
+ */
+struct emu_bus_t {
+	intf_t *intf;
+
+	// Frames to be read by the host
+	std::deque<can_message_t> queue;
+
+	// Simulation timer
+	event *tick;
+
+	// Acceptance filter of the (emulated) adapter
+	bool filter;
+	std::vector<bool> accept;
+
+	std::vector<emu_t *> drives;
+};
+
+
+/** ***********************
+ * Object dictionary
+ *********************** **/
+
+
+static void emu_od_add(emu_t *emu, uint16_t index, uint8_t subindex, uint8_t size, uint32_t value, emu_access_t access)
+{
+	emu_object_t object;
+	object.value = value;
+	object.size = size;
+	object.access = access;
+
+	emu->od[EMU_KEY(index, subindex)] = object;
+}
+
+
+static emu_object_t *emu_od_find(emu_t *emu, uint16_t index, uint8_t subindex)
+{
+	std::map<uint32_t, emu_object_t>::iterator it = emu->od.find(EMU_KEY(index, subindex));
+
+	if(it == emu->od.end())
+		return NULL;
+
+	return &(it->second);
+}
+
+
+static uint32_t emu_od_get(emu_t *emu, uint16_t index, uint8_t subindex)
+{
+	emu_object_t *object = emu_od_find(emu, index, subindex);
+	return object ? object->value : 0;
+}
+
+
+static void emu_od_set(emu_t *emu, uint16_t index, uint8_t subindex, uint32_t value)
+{
+	emu_object_t *object = emu_od_find(emu, index, subindex);
+	if(object)
+		object->value = value;
+}
+
+
+/**
+ * Returns true if any subindex of the object exists.
+ */
+static bool emu_od_has_index(emu_t *emu, uint16_t index)
+{
+	std::map<uint32_t, emu_object_t>::iterator it = emu->od.lower_bound(EMU_KEY(index, 0));
+	return it != emu->od.end() && (it->first >> 8) == index;
+}
+
+
+/**
+ * Restore communication objects to power-on values.
+ */
+static void emu_od_reset_communication(emu_t *emu)
+{
+	emu_od_add(emu, 0x1017, 0x00, 2, EMU_HEARTBEAT_TIME, acc_rw);
+
+	for(int i = 0; i < 4; i++) {
+		// Receive PDOs
+		emu_od_add(emu, 0x1400 + i, 0x01, 4, 0x80000200 + 0x100 * i + emu->node, acc_rw);
+		emu_od_add(emu, 0x1400 + i, 0x02, 1, 0xFF, acc_rw);
+		emu_od_add(emu, 0x1600 + i, 0x00, 1, 0, acc_rw);
+
+		// Transmit PDOs
+		emu_od_add(emu, 0x1800 + i, 0x01, 4, 0x80000180 + 0x100 * i + emu->node, acc_rw);
+		emu_od_add(emu, 0x1800 + i, 0x02, 1, 0xFF, acc_rw);
+		emu_od_add(emu, 0x1800 + i, 0x03, 2, 0, acc_rw);
+		emu_od_add(emu, 0x1800 + i, 0x05, 2, 0, acc_rw);
+		emu_od_add(emu, 0x1A00 + i, 0x00, 1, 0, acc_rw);
+
+		for(int j = 1; j <= 8; j++) {
+			emu_od_add(emu, 0x1600 + i, j, 4, 0, acc_rw);
+			emu_od_add(emu, 0x1A00 + i, j, 4, 0, acc_rw);
+		}
+	}
+}
+
+
+/**
+ * Create all objects used by libsled.
+ */
+static void emu_od_reset(emu_t *emu)
+{
+	emu->od.clear();
+	emu_od_reset_communication(emu);
+
+	// Device profile (DS402)
+	emu_od_add(emu, OB_CONTROL_WORD, 0x00, 2, 0, acc_rw);
+	emu_od_add(emu, 0x6041, 0x00, 2, 0, acc_ro);	// Status word
+	emu_od_add(emu, 0x6060, 0x00, 1, 0, acc_rw);	// Mode of operation
+	emu_od_add(emu, 0x6061, 0x00, 1, 0, acc_ro);	// Mode of operation display
+	emu_od_add(emu, 0x6064, 0x00, 4, 0, acc_ro);	// Position actual value
+	emu_od_add(emu, 0x606C, 0x00, 4, 0, acc_ro);	// Velocity actual value
+	emu_od_add(emu, 0x6078, 0x00, 2, 0, acc_ro);	// Current actual value
+	emu_od_add(emu, 0x60F4, 0x00, 4, 0, acc_ro);	// Following error actual value
+	emu_od_add(emu, 0x60C1, 0x01, 4, 0, acc_rw);	// Interpolation data record
+
+	// Manufacturer specific
+	for(int i = 1; i <= 8; i++) {
+		emu_od_add(emu, OB_DPRVAR_WO, i, 4, 0, acc_rw);
+		emu_od_add(emu, OB_DRPVAR_RO, i, 4, 0, acc_ro);
+	}
+
+	emu_od_add(emu, OB_MOTION_TASK, 0x00, 2, 0, acc_rw);
+	emu_od_add(emu, OB_ACTIVE_TASK, 0x00, 2, 0, acc_ro);
+	emu_od_add(emu, OB_COPY_MOTION_TASK, 0x00, 4, 0, acc_rw);
+
+	emu_od_add(emu, 0x3518, 0x01, 4, 0, acc_ro);	// Error register
+	emu_od_add(emu, OB_O_O1, 0x01, 4, 0, acc_rw);
+	emu_od_add(emu, OB_O_O2, 0x01, 4, 0, acc_rw);
+
+	emu_od_add(emu, OB_O_ACC, 0x01, 4, 0, acc_rw);
+	emu_od_add(emu, OB_O_TAB, 0x01, 4, 0, acc_rw);
+	emu_od_add(emu, OB_O_C, 0x01, 4, 0, acc_rw);
+	emu_od_add(emu, OB_O_DEC, 0x01, 4, 0, acc_rw);
+	emu_od_add(emu, OB_O_FN, 0x01, 4, 0, acc_rw);
+	emu_od_add(emu, OB_O_FT, 0x01, 4, 0, acc_rw);
+	emu_od_add(emu, OB_O_P, 0x01, 4, 0, acc_rw);
+	emu_od_add(emu, OB_O_V, 0x01, 4, 0, acc_rw);
+	emu_od_add(emu, OB_O_MOVE, 0x01, 4, 0, acc_rw);
+}
+
+
+/** ***********************
+ * Frame transmission
+ *********************** **/
+
+
+/**
+ * Queue a frame for the host and wake up its read handler.
+ */
+static void emu_transmit(emu_t *emu, uint16_t id, uint8_t len, const uint8_t *data)
+{
+	can_message_t msg;
+	msg.id = id;
+	msg.type = mt_standard;
+	msg.len = len;
+	msg.time = intf_get_time();
+
+	memset(msg.data, 0, 8);
+	if(data)
+		memcpy(msg.data, data, len);
+
+	emu_bus_t *bus = emu->bus;
+
+	if(bus->filter && !bus->accept[id & (INTF_NUM_COB_IDS - 1)]) {
+		bus->intf->filter_stats.rejected++;
+		return;
+	}
+
+	bus->queue.push_back(msg);
+
+	if(bus->queue.size() == 1) {
+		uint64_t one = 1;
+		if(write(bus->intf->fd, &one, sizeof(one)) == -1)
+			syslog(LOG_ERR, "%s() could not signal host: %s", __FUNCTION__, strerror(errno));
+	}
+}
+
+
+static void emu_send_heartbeat(emu_t *emu)
+{
+	uint8_t state = emu->nmt_state;
+	emu_transmit(emu, (0x0E << 7) + emu->node, 1, &state);
+	emu->last_heartbeat = emu->time;
+}
+
+
+static void emu_send_sdo(emu_t *emu, uint8_t command, uint16_t index, uint8_t subindex, uint32_t value)
+{
+	uint8_t data[8];
+	data[0] = command;
+	data[1] = index & 0xFF;
+	data[2] = (index >> 8) & 0xFF;
+	data[3] = subindex;
+	data[4] = value & 0xFF;
+	data[5] = (value >> 8) & 0xFF;
+	data[6] = (value >> 16) & 0xFF;
+	data[7] = (value >> 24) & 0xFF;
+
+	emu_transmit(emu, (0x0B << 7) + emu->node, 8, data);
+}
+
+
+static void emu_send_frame(emu_t *emu, const uint8_t *data)
+{
+	emu_transmit(emu, (0x0B << 7) + emu->node, 8, data);
+}
+
+
+/** ***********************
+ * Drive behaviour
+ *********************** **/
+
+
+/**
+ * Compute DS402 status word from the drive state.
+ */
+static uint16_t emu_status_word(emu_t *emu)
+{
+	// Voltage enabled, remote
+	uint16_t status = 0x10 | 0x200;
+
+	switch(emu->ds_state) {
+		case ds_switch_on_disabled: status |= 0x40; break;
+		case ds_ready_to_switch_on: status |= 0x21; break;
+		case ds_switched_on: status |= 0x23; break;
+		case ds_operation_enabled: status |= 0x27; break;
+		case ds_fault: status |= 0x08; break;
+	}
+
+	int8_t mode = int8_t(emu_od_get(emu, 0x6061, 0x00));
+
+	if(!emu->moving && !emu->homing && !emu->sinusoid)
+		status |= 0x400;
+
+	if(mode == 0x06 && emu->homed && !emu->homing)
+		status |= 0x1000;
+
+	if(mode == 0x01 && emu->setpoint_ack)
+		status |= 0x1000;
+
+	return status;
+}
+
+
+/**
+ * Normalized position along a profile table (0..1).
+ */
+static double emu_table_position(int table, double t)
+{
+	if(t <= 0.0) return 0.0;
+	if(t >= 1.0) return 1.0;
+
+	// Table 0 contains a half cosine, the others minimum jerk
+	if(table == 0)
+		return (1.0 - cos(M_PI * t)) / 2.0;
+
+	return 10.0 * pow(t, 3) - 15.0 * pow(t, 4) + 6.0 * pow(t, 5);
+}
+
+
+static void emu_stop_motion(emu_t *emu)
+{
+	emu->moving = false;
+	emu->next_pending = false;
+	emu->homing = false;
+	emu->sinusoid = false;
+}
+
+
+/**
+ * Start executing a motion task.
+ */
+static void emu_start_task(emu_t *emu, int number)
+{
+	if(emu->tasks.count(number) == 0) {
+		syslog(LOG_WARNING, "%s() motion task %d has not been defined", __FUNCTION__, number);
+		return;
+	}
+
+	emu_task_t task = emu->tasks[number];
+
+	double target = task.position;
+
+	// Relative to actual position or previous target
+	if((task.control & 0x05) == 0x05)
+		target += emu->position;
+	else if((task.control & 0x03) == 0x03)
+		target += emu->move_to;
+
+	emu->moving = true;
+	emu->active_task = number;
+	emu->table = task.table;
+	emu->move_start = emu->time;
+	emu->move_duration = double(task.acc + task.dec) / 1000.0;
+	emu->move_from = emu->position;
+	emu->move_to = target;
+
+	emu->next_pending = false;
+
+	emu_od_set(emu, OB_ACTIVE_TASK, 0x00, number);
+}
+
+
+/**
+ * Handle control word written by the host.
+ */
+static void emu_control_word(emu_t *emu, uint16_t control_word)
+{
+	uint16_t previous = emu->control_word;
+	emu->control_word = control_word;
+
+	// Fault reset on rising edge of bit 7
+	if(emu->ds_state == ds_fault) {
+		if((control_word & 0x80) && !(previous & 0x80))
+			emu->ds_state = ds_switch_on_disabled;
+		return;
+	}
+
+	// Disable voltage / quick stop
+	if((control_word & 0x02) == 0x00 || (control_word & 0x06) == 0x02) {
+		emu->ds_state = ds_switch_on_disabled;
+		emu_stop_motion(emu);
+		return;
+	}
+
+	// Shutdown
+	if((control_word & 0x87) == 0x06) {
+		emu->ds_state = ds_ready_to_switch_on;
+		emu_stop_motion(emu);
+		return;
+	}
+
+	// Switch on / disable operation
+	if((control_word & 0x8F) == 0x07) {
+		if(emu->ds_state != ds_switch_on_disabled) {
+			emu->ds_state = ds_switched_on;
+			emu_stop_motion(emu);
+		}
+		return;
+	}
+
+	// Enable operation
+	if((control_word & 0x8F) == 0x0F) {
+		if(emu->ds_state == ds_switched_on)
+			emu->ds_state = ds_operation_enabled;
+
+		if(emu->ds_state != ds_operation_enabled)
+			return;
+
+		int8_t mode = int8_t(emu_od_get(emu, 0x6061, 0x00));
+		bool new_setpoint = (control_word & 0x10) && !(previous & 0x10);
+
+		// Homing mode, start homing on new set-point
+		if(mode == 0x06 && new_setpoint && !emu->homing) {
+			emu->homing = true;
+			emu->homed = false;
+			emu->homing_start = emu->time;
+			emu->homing_from = emu->position;
+		}
+
+		// Profile position mode, execute motion task and acknowledge
+		if(mode == 0x01) {
+			if(new_setpoint && emu->homed) {
+				emu->setpoint_ack = true;
+				emu_start_task(emu, emu_od_get(emu, OB_MOTION_TASK, 0x00));
+			}
+
+			if(!(control_word & 0x10))
+				emu->setpoint_ack = false;
+		}
+	}
+}
+
+
+/**
+ * Apply side effects of an SDO write.
+ */
+static void emu_on_write(emu_t *emu, uint16_t index, uint8_t subindex, uint32_t value)
+{
+	emu_task_t &task = emu->tasks[0];
+
+	switch(index) {
+		case OB_CONTROL_WORD:
+			emu_control_word(emu, value);
+			break;
+
+		case 0x6060:
+			emu_od_set(emu, 0x6061, 0x00, value);
+			emu->setpoint_ack = false;
+			break;
+
+		case OB_COPY_MOTION_TASK:
+			emu->tasks[(value >> 16) & 0xFFFF] = emu->tasks[value & 0xFFFF];
+			break;
+
+		case OB_O_P: task.position = int32_t(value); break;
+		case OB_O_V: task.velocity = int32_t(value); break;
+		case OB_O_C: task.control = int32_t(value); break;
+		case OB_O_ACC: task.acc = int32_t(value); break;
+		case OB_O_DEC: task.dec = int32_t(value); break;
+		case OB_O_TAB: task.table = int32_t(value); break;
+		case OB_O_FN: task.next = int32_t(value); break;
+		case OB_O_FT: task.delay = int32_t(value); break;
+	}
+}
+
+
+/**
+ * Validate PDO mapping before it is enabled.
+ */
+static bool emu_check_mapping(emu_t *emu, uint16_t index, uint8_t count)
+{
+	int bits = 0;
+
+	for(int i = 1; i <= count && i <= 8; i++) {
+		uint32_t entry = emu_od_get(emu, index, i);
+
+		if(!emu_od_find(emu, entry >> 16, (entry >> 8) & 0xFF))
+			return false;
+
+		bits += entry & 0xFF;
+	}
+
+	return count <= 8 && bits <= 64;
+}
+
+
+/** ***********************
+ * Domain transfers
+ *********************** **/
+
+
+static void emu_transfer_abort(emu_t *emu, uint32_t code)
+{
+	emu->transfer.mode = tr_none;
+	emu->transfer.data.clear();
+	emu_send_sdo(emu, 0x80, EMU_DOMAIN_INDEX, EMU_DOMAIN_SUBINDEX, code);
+}
+
+
+/**
+ * Store data received, once its length is known.
+ *
+ * @return True if it matches the size announced by the client.
+ */
+static bool emu_transfer_store(emu_t *emu)
+{
+	emu_transfer_t *t = &emu->transfer;
+
+	if(t->indicated && t->data.size() != t->indicated) {
+		emu_transfer_abort(emu, EMU_ABORT_LENGTH);
+		return false;
+	}
+
+	emu->domain.swap(t->data);
+	t->data.clear();
+	t->mode = tr_none;
+	return true;
+}
+
+
+/**
+ * Send the next block of an upload.
+ */
+static void emu_send_block(emu_t *emu)
+{
+	emu_transfer_t *t = &emu->transfer;
+	uint32_t size = emu->domain.size();
+
+	t->block_start = t->offset;
+	t->seqno = 0;
+	t->last = false;
+
+	while(t->seqno < t->blksize && !t->last) {
+		uint32_t n = size - t->offset;
+		if(n > SDO_SEGMENT_SIZE)
+			n = SDO_SEGMENT_SIZE;
+
+		t->last = (t->offset + n == size);
+
+		uint8_t data[8];
+		memset(data, 0, 8);
+		data[0] = (t->last ? 0x80 : 0x00) | ++t->seqno;
+		if(n > 0)
+			memcpy(data + 1, &emu->domain[t->offset], n);
+
+		emu_send_frame(emu, data);
+		t->offset += n;
+	}
+
+	t->mode = tr_block_upload;
+}
+
+
+/**
+ * Request to start a transfer of the domain.
+ *
+ * @return False if the request is not one.
+ */
+static bool emu_on_domain_initiate(emu_t *emu, uint8_t command, uint32_t value, uint8_t blksize)
+{
+	emu_transfer_t *t = &emu->transfer;
+	uint32_t size = emu->domain.size();
+
+	t->mode = tr_none;
+	t->toggle = 0;
+	t->offset = 0;
+	t->seqno = 0;
+	t->data.clear();
+
+	// Segmented download, initiate
+	if((command & 0xE2) == 0x20) {
+		t->indicated = (command & 0x01) ? value : 0;
+		if(t->indicated > EMU_DOMAIN_SIZE) {
+			emu_transfer_abort(emu, SDO_ABORT_MEMORY);
+			return true;
+		}
+
+		t->mode = tr_download;
+		emu_send_sdo(emu, 0x60, EMU_DOMAIN_INDEX, EMU_DOMAIN_SUBINDEX, 0);
+		return true;
+	}
+
+	// Segmented upload, initiate
+	if(command == 0x40) {
+		t->mode = tr_upload;
+		emu_send_sdo(emu, 0x41, EMU_DOMAIN_INDEX, EMU_DOMAIN_SUBINDEX, size);
+		return true;
+	}
+
+	// Block download, initiate
+	if((command & 0xF9) == 0xC0) {
+		t->indicated = (command & 0x02) ? value : 0;
+		if(t->indicated > EMU_DOMAIN_SIZE) {
+			emu_transfer_abort(emu, SDO_ABORT_MEMORY);
+			return true;
+		}
+
+		t->crc = (command & 0x04) != 0;
+		t->blksize = EMU_BLOCK_SIZE;
+		t->last = false;
+		t->mode = tr_block_download;
+
+		emu_send_sdo(emu, 0xA4, EMU_DOMAIN_INDEX, EMU_DOMAIN_SUBINDEX, EMU_BLOCK_SIZE);
+		return true;
+	}
+
+	// Block upload, initiate
+	if((command & 0xE3) == 0xA0) {
+		if(blksize == 0 || blksize > SDO_MAX_BLOCK_SIZE) {
+			emu_transfer_abort(emu, SDO_ABORT_BLOCK_SIZE);
+			return true;
+		}
+
+		t->crc = (command & 0x04) != 0;
+		t->blksize = blksize;
+		t->mode = tr_block_upload_start;
+
+		emu_send_sdo(emu, t->crc ? 0xC6 : 0xC2, EMU_DOMAIN_INDEX, EMU_DOMAIN_SUBINDEX, size);
+		return true;
+	}
+
+	return false;
+}
+
+
+/**
+ * Frame of a transfer in progress.
+ *
+ * @return False if the frame does not continue the transfer.
+ */
+static bool emu_on_domain_transfer(emu_t *emu, const uint8_t *data)
+{
+	emu_transfer_t *t = &emu->transfer;
+	uint8_t command = data[0];
+	uint32_t size = emu->domain.size();
+
+	// Abort by the client, segments never look like
+	// this as their sequence number is at least one
+	if(command == 0x80) {
+		t->mode = tr_none;
+		t->data.clear();
+		return true;
+	}
+
+	// Every other frame during a block is a segment
+	if(t->mode == tr_block_download) {
+		uint8_t seqno = command & 0x7F;
+		bool last = (command & 0x80) != 0;
+
+		if(seqno == t->seqno + 1) {
+			if(t->data.size() >= EMU_DOMAIN_SIZE) {
+				emu_transfer_abort(emu, SDO_ABORT_MEMORY);
+				return true;
+			}
+
+			t->data.insert(t->data.end(), data + 1, data + 1 + SDO_SEGMENT_SIZE);
+			t->seqno = seqno;
+			t->last = last;
+		}
+
+		if(!last && seqno < t->blksize)
+			return true;
+
+		uint8_t ack[8] = { 0xA2, t->seqno, t->blksize, 0, 0, 0, 0, 0 };
+		emu_send_frame(emu, ack);
+
+		if(t->last)
+			t->mode = tr_block_download_end;
+
+		t->seqno = 0;
+		return true;
+	}
+
+	switch(t->mode) {
+		case tr_download:
+			if((command & 0xE0) != 0x00)
+				return false;
+
+			if(((command >> 4) & 0x01) != t->toggle) {
+				emu_transfer_abort(emu, SDO_ABORT_TOGGLE);
+				return true;
+			}
+
+			if(t->data.size() >= EMU_DOMAIN_SIZE) {
+				emu_transfer_abort(emu, SDO_ABORT_MEMORY);
+				return true;
+			}
+
+			t->data.insert(t->data.end(), data + 1, data + 1 + SDO_SEGMENT_SIZE - ((command >> 1) & 0x07));
+
+			if((command & 0x01) && !emu_transfer_store(emu))
+				return true;
+
+			{
+				uint8_t response[8] = { uint8_t(0x20 | (t->toggle << 4)), 0, 0, 0, 0, 0, 0, 0 };
+				emu_send_frame(emu, response);
+			}
+
+			t->toggle ^= 1;
+			return true;
+
+		case tr_upload: {
+			if((command & 0xEF) != 0x60)
+				return false;
+
+			if(((command >> 4) & 0x01) != t->toggle) {
+				emu_transfer_abort(emu, SDO_ABORT_TOGGLE);
+				return true;
+			}
+
+			uint32_t n = size - t->offset;
+			if(n > SDO_SEGMENT_SIZE)
+				n = SDO_SEGMENT_SIZE;
+
+			bool last = (t->offset + n == size);
+
+			uint8_t response[8];
+			memset(response, 0, 8);
+			response[0] = (t->toggle << 4) | ((SDO_SEGMENT_SIZE - n) << 1) | (last ? 1 : 0);
+			if(n > 0)
+				memcpy(response + 1, &emu->domain[t->offset], n);
+			emu_send_frame(emu, response);
+
+			t->offset += n;
+			t->toggle ^= 1;
+
+			if(last)
+				t->mode = tr_none;
+			return true;
+		}
+
+		case tr_block_download_end: {
+			if((command & 0xE3) != 0xC1)
+				return false;
+
+			// Drop padding of the last segment
+			size_t padding = (command >> 2) & 0x07;
+			if(padding > t->data.size()) {
+				emu_transfer_abort(emu, SDO_ABORT_LENGTH);
+				return true;
+			}
+
+			t->data.resize(t->data.size() - padding);
+
+			uint16_t crc = data[1] | (data[2] << 8);
+			if(t->crc && sdo_crc16(t->data.empty() ? NULL : &t->data[0], t->data.size()) != crc) {
+				emu_transfer_abort(emu, SDO_ABORT_CRC);
+				return true;
+			}
+
+			if(!emu_transfer_store(emu))
+				return true;
+
+			uint8_t response[8] = { 0xA1, 0, 0, 0, 0, 0, 0, 0 };
+			emu_send_frame(emu, response);
+			return true;
+		}
+
+		case tr_block_upload_start:
+			if(command != 0xA3)
+				return false;
+
+			emu_send_block(emu);
+			return true;
+
+		case tr_block_upload: {
+			if(command != 0xA2)
+				return false;
+
+			uint8_t ackseq = data[1];
+
+			if(ackseq > t->seqno) {
+				emu_transfer_abort(emu, SDO_ABORT_SEQUENCE);
+				return true;
+			}
+
+			if(data[2] == 0 || data[2] > SDO_MAX_BLOCK_SIZE) {
+				emu_transfer_abort(emu, SDO_ABORT_BLOCK_SIZE);
+				return true;
+			}
+
+			bool complete = t->last && ackseq == t->seqno;
+			uint32_t last = size - (t->block_start + (t->seqno - 1) * SDO_SEGMENT_SIZE);
+
+			t->blksize = data[2];
+
+			if(!complete) {
+				uint32_t acknowledged = t->block_start + ackseq * SDO_SEGMENT_SIZE;
+				t->offset = (acknowledged < size) ? acknowledged : size;
+				emu_send_block(emu);
+				return true;
+			}
+
+			uint16_t crc = t->crc ? sdo_crc16(emu->domain.empty() ? NULL : &emu->domain[0], size) : 0;
+
+			uint8_t response[8] = { uint8_t(0xC1 | ((SDO_SEGMENT_SIZE - last) << 2)),
+				uint8_t(crc & 0xFF), uint8_t(crc >> 8), 0, 0, 0, 0, 0 };
+			emu_send_frame(emu, response);
+
+			t->mode = tr_block_upload_end;
+			return true;
+		}
+
+		case tr_block_upload_end:
+			if(command != 0xA1)
+				return false;
+
+			t->mode = tr_none;
+			return true;
+
+		default:
+			break;
+	}
+
+	return false;
+}
+
+
+/**
+ * Handle SDO request.
+ */
+static void emu_on_sdo(emu_t *emu, can_message_t *msg)
+{
+	uint8_t command = msg->data[0];
+	uint16_t index = msg->data[1] | (msg->data[2] << 8);
+	uint8_t subindex = msg->data[3];
+	uint32_t value = msg->data[4] | (msg->data[5] << 8) | (msg->data[6] << 16) | (uint32_t(msg->data[7]) << 24);
+
+	// Segments do not carry the index
+	if(emu->transfer.mode != tr_none && emu_on_domain_transfer(emu, msg->data))
+		return;
+
+	emu->transfer.mode = tr_none;
+
+	if(index == EMU_DOMAIN_INDEX && subindex == EMU_DOMAIN_SUBINDEX) {
+		if(!emu_on_domain_initiate(emu, command, value, msg->data[4]))
+			emu_send_sdo(emu, 0x80, index, subindex, EMU_ABORT_COMMAND);
+		return;
+	}
+
+	emu_object_t *object = emu_od_find(emu, index, subindex);
+
+	if(!object) {
+		emu_send_sdo(emu, 0x80, index, subindex,
+			emu_od_has_index(emu, index) ? EMU_ABORT_NO_SUBINDEX : EMU_ABORT_NO_OBJECT);
+		return;
+	}
+
+	// Expedited upload (read)
+	if(command == 0x40) {
+		uint8_t response = 0x43 | ((4 - object->size) << 2);
+		emu_send_sdo(emu, response, index, subindex, object->value);
+		return;
+	}
+
+	// Expedited download (write)
+	if((command & 0xE3) == 0x23) {
+		uint8_t size = 4 - ((command >> 2) & 0x03);
+
+		if(object->access == acc_ro) {
+			emu_send_sdo(emu, 0x80, index, subindex, EMU_ABORT_READ_ONLY);
+			return;
+		}
+
+		if(size != object->size) {
+			emu_send_sdo(emu, 0x80, index, subindex, EMU_ABORT_LENGTH);
+			return;
+		}
+
+		if(size < 4)
+			value &= (1 << (8 * size)) - 1;
+
+		// Mapping is checked when the number of entries is set
+		if(((index & 0xFF00) == 0x1A00 || (index & 0xFF00) == 0x1600) && subindex == 0)
+			if(!emu_check_mapping(emu, index, value)) {
+				emu_send_sdo(emu, 0x80, index, subindex, EMU_ABORT_PDO_LENGTH);
+				return;
+			}
+
+		object->value = value;
+		emu_on_write(emu, index, subindex, value);
+
+		emu_send_sdo(emu, 0x60, index, subindex, 0);
+		return;
+	}
+
+	emu_send_sdo(emu, 0x80, index, subindex, EMU_ABORT_COMMAND);
+}
+
+
+/**
+ * Handle NMT command.
+ */
+static void emu_on_nmt(emu_t *emu, can_message_t *msg)
+{
+	uint8_t node = msg->data[1];
+
+	if(node != 0 && node != emu->node)
+		return;
+
+	switch(msg->data[0]) {
+		case 0x01: emu->nmt_state = EMU_NMT_OPERATIONAL; break;
+		case 0x02: emu->nmt_state = EMU_NMT_STOPPED; break;
+		case 0x80: emu->nmt_state = EMU_NMT_PREOPERATIONAL; break;
+
+		// Reset node / reset communication
+		case 0x81:
+		case 0x82:
+			if(msg->data[0] == 0x81) {
+				emu_od_reset(emu);
+				emu->tasks.clear();
+			} else {
+				emu_od_reset_communication(emu);
+			}
+
+			emu->nmt_state = EMU_NMT_BOOTUP;
+			emu_send_heartbeat(emu);
+			emu->nmt_state = EMU_NMT_PREOPERATIONAL;
+			break;
+	}
+
+	// Transmit PDOs once entering operational
+	if(emu->nmt_state != EMU_NMT_OPERATIONAL)
+		for(int i = 0; i < EMU_NUM_TPDOS; i++)
+			emu->tpdo[i].sent = false;
+}
+
+
+/**
+ * Handle frame sent by the host (or another node).
+ */
+static void emu_receive(emu_t *emu, can_message_t *msg)
+{
+	emu->time = intf_get_time();
+
+	// NMT
+	if(msg->id == 0x000) {
+		emu_on_nmt(emu, msg);
+		return;
+	}
+
+	// Node guarding request
+	if(msg->id == (0x0E << 7) + emu->node && (msg->type & mt_rtr)) {
+		uint8_t state = emu->nmt_state | emu->guard_toggle;
+		emu->guard_toggle ^= 0x80;
+		emu_transmit(emu, msg->id, 1, &state);
+		return;
+	}
+
+	// SDO request
+	if(msg->id == (0x0C << 7) + emu->node) {
+		if(emu->nmt_state == EMU_NMT_PREOPERATIONAL || emu->nmt_state == EMU_NMT_OPERATIONAL)
+			emu_on_sdo(emu, msg);
+		return;
+	}
+}
+
+
+/**
+ * Advance motion by one step.
+ */
+static void emu_update_motion(emu_t *emu, double dt)
+{
+	double previous = emu->position;
+
+	// Drive must be enabled to move
+	if(emu->ds_state != ds_operation_enabled)
+		emu_stop_motion(emu);
+
+	if(emu->homing) {
+		double t = (emu->time - emu->homing_start) / EMU_HOMING_TIME;
+		emu->position = emu->homing_from * (1.0 - emu_table_position(2, t));
+
+		if(t >= 1.0) {
+			emu->homing = false;
+			emu->homed = true;
+			emu->position = 0.0;
+			emu->move_to = 0.0;
+		}
+	}
+
+	// Start next task after delay
+	if(emu->next_pending && emu->time >= emu->next_start)
+		emu_start_task(emu, emu->next_task);
+
+	if(emu->moving) {
+		double t = 1.0;
+		if(emu->move_duration > 0.0)
+			t = (emu->time - emu->move_start) / emu->move_duration;
+
+		emu->position = emu->move_from + (emu->move_to - emu->move_from) * emu_table_position(emu->table, t);
+
+		if(t >= 1.0) {
+			emu->moving = false;
+			emu_task_t &task = emu->tasks[emu->active_task];
+
+			if((task.control & 0x08) && task.next > 0) {
+				emu->next_pending = true;
+				emu->next_task = task.next;
+				emu->next_start = emu->time + task.delay / 1000.0;
+			}
+		}
+	}
+
+	// Sinusoid PLC program (interpolated position mode)
+	int8_t mode = int8_t(emu_od_get(emu, 0x6061, 0x00));
+	bool enable = emu_od_get(emu, OB_DPRVAR_WO, DPRVAR(10)) != 0;
+
+	if(!emu->sinusoid && enable && mode == 0x07 && emu->homed && emu->ds_state == ds_operation_enabled) {
+		emu->sinusoid = true;
+		emu->sinusoid_half = 0;
+		emu->sinusoid_start = emu->time;
+		emu->sinusoid_offset = emu->position;
+		emu->sinusoid_amplitude = int32_t(emu_od_get(emu, OB_DPRVAR_WO, DPRVAR(11)));
+		emu->sinusoid_period = int32_t(emu_od_get(emu, OB_DPRVAR_WO, DPRVAR(12))) / 1000.0;
+	}
+
+	if(emu->sinusoid) {
+		double t = 0.0;
+		if(emu->sinusoid_period > 0.0)
+			t = (emu->time - emu->sinusoid_start) / emu->sinusoid_period;
+
+		int half = int(floor(t));
+		double phase = t - half;
+
+		// Stop at the next change of direction once disabled
+		if(!enable && half != emu->sinusoid_half) {
+			emu->sinusoid = false;
+			half = emu->sinusoid_half;
+			phase = 1.0;
+		}
+
+		emu->sinusoid_half = half;
+
+		if(half % 2 == 1)
+			phase = 1.0 - phase;
+
+		emu->position = emu->sinusoid_offset + emu->sinusoid_amplitude * emu_table_position(0, phase);
+	}
+
+	if(dt > 0.0)
+		emu->velocity = (emu->position - previous) / dt;
+}
+
+
+/**
+ * Transmit PDOs that are due.
+ */
+static void emu_update_tpdos(emu_t *emu)
+{
+	if(emu->nmt_state != EMU_NMT_OPERATIONAL)
+		return;
+
+	for(int i = 0; i < EMU_NUM_TPDOS; i++) {
+		uint32_t cob_id = emu_od_get(emu, 0x1800 + i, 0x01);
+
+		if(cob_id & 0x80000000)
+			continue;
+
+		// Pack mapped objects
+		uint8_t data[8];
+		memset(data, 0, 8);
+		int bits = 0;
+
+		uint8_t count = emu_od_get(emu, 0x1A00 + i, 0x00);
+		for(int j = 1; j <= count; j++) {
+			uint32_t entry = emu_od_get(emu, 0x1A00 + i, j);
+			uint32_t value = emu_od_get(emu, entry >> 16, (entry >> 8) & 0xFF);
+			int length = entry & 0xFF;
+
+			for(int b = 0; b < length; b += 8)
+				data[(bits + b) / 8] = (value >> b) & 0xFF;
+
+			bits += length;
+		}
+
+		emu_tpdo_t *tpdo = &(emu->tpdo[i]);
+		uint8_t len = (bits + 7) / 8;
+
+		double inhibit = emu_od_get(emu, 0x1800 + i, 0x03) / 10000.0;
+		double event_timer = emu_od_get(emu, 0x1800 + i, 0x05) / 1000.0;
+		double elapsed = emu->time - tpdo->last_time;
+
+		bool changed = !tpdo->sent || len != tpdo->len || memcmp(data, tpdo->data, len) != 0;
+		bool due = changed && elapsed >= inhibit;
+
+		if(event_timer > 0.0 && elapsed >= event_timer)
+			due = true;
+
+		if(!due)
+			continue;
+
+		emu_transmit(emu, cob_id & 0x7FF, len, data);
+
+		tpdo->sent = true;
+		tpdo->last_time = emu->time;
+		tpdo->len = len;
+		memcpy(tpdo->data, data, len);
+	}
+}
+
+
+/**
+ * Simulate drive for one tick.
+ */
+static void emu_update(emu_t *emu, double now)
+{
+	double dt = now - emu->time;
+	emu->time = now;
+
+	emu_update_motion(emu, dt);
+
+	emu_od_set(emu, 0x6041, 0x00, emu_status_word(emu));
+	emu_od_set(emu, 0x6064, 0x00, uint32_t(int32_t(lround(emu->position))));
+	emu_od_set(emu, 0x606C, 0x00, uint32_t(int32_t(lround(emu->velocity))));
+
+	emu_update_tpdos(emu);
+
+	// Heartbeat producer
+	double heartbeat = emu_od_get(emu, 0x1017, 0x00) / 1000.0;
+	if(heartbeat > 0.0 && emu->time - emu->last_heartbeat >= heartbeat)
+		emu_send_heartbeat(emu);
+}
+
+
+/**
+ * Simulate all drives, invoked every EMU_TICK_INTERVAL.
+ */
+static void emu_on_tick(evutil_socket_t fd, short events, void *bus_v)
+{
+	emu_bus_t *bus = (emu_bus_t *) bus_v;
+	double now = intf_get_time();
+
+	for(size_t i = 0; i < bus->drives.size(); i++)
+		emu_update(bus->drives[i], now);
+}
+
+
+/** ***********************
+ * Backend functions
+ *********************** **/
+
+
+/**
+ * Power-on an emulated drive.
+ */
+static emu_t *emu_create(emu_bus_t *bus, uint8_t node)
+{
+	emu_t *emu = new emu_t();
+	emu->bus = bus;
+	emu->node = node;
+
+	emu_od_reset(emu);
+	emu->tasks[0] = emu_task_t();
+	emu->transfer.mode = tr_none;
+
+	emu->time = intf_get_time();
+	emu->last_heartbeat = emu->time;
+
+	emu->nmt_state = EMU_NMT_BOOTUP;
+	emu->guard_toggle = 0x00;
+
+	emu->ds_state = ds_switch_on_disabled;
+	emu->control_word = 0;
+	emu->setpoint_ack = false;
+
+	emu->homed = false;
+	emu->homing = false;
+	emu->homing_start = emu->homing_from = 0.0;
+
+	emu->moving = false;
+	emu->active_task = 0;
+	emu->table = 0;
+	emu->move_start = emu->move_duration = 0.0;
+	emu->move_from = emu->move_to = 0.0;
+	emu->next_pending = false;
+	emu->next_task = 0;
+	emu->next_start = 0.0;
+
+	emu->sinusoid = false;
+	emu->sinusoid_half = 0;
+	emu->sinusoid_start = emu->sinusoid_offset = 0.0;
+	emu->sinusoid_amplitude = emu->sinusoid_period = 0.0;
+
+	// Start somewhere off the reference point
+	emu->position = 12345.0;
+	emu->velocity = 0.0;
+
+	for(int i = 0; i < EMU_NUM_TPDOS; i++)
+		emu->tpdo[i].sent = false;
+
+	// Boot-up message
+	emu_send_heartbeat(emu);
+	emu->nmt_state = EMU_NMT_PREOPERATIONAL;
+
+	syslog(LOG_NOTICE, "%s() emulating S700 drive on node %d", __FUNCTION__, node);
+
+	return emu;
+}
+
+
+/**
+ * Parse node list of "emulator:1,2".
+ *
+ * @return 0 on success, -1 on an invalid list.
+ */
+static int emu_parse_nodes(const char *device, std::vector<uint8_t> &nodes)
+{
+	const char *list = strchr(device, ':');
+
+	if(!list) {
+		nodes.push_back(EMU_DEFAULT_NODE_ID);
+		return 0;
+	}
+
+	for(const char *p = list + 1; *p; ) {
+		char *end;
+		long node = strtol(p, &end, 10);
+
+		if(end == p || node < 1 || node > INTF_MAX_NODE || (*end != ',' && *end != '\0'))
+			return -1;
+
+		nodes.push_back(uint8_t(node));
+		p = (*end == ',') ? end + 1 : end;
+	}
+
+	return nodes.empty() ? -1 : 0;
+}
+
+
+/**
+ * Power-on the emulated drives.
+ */
+static int intf_emulator_open(intf_t *intf, const char *device)
+{
+	assert(intf && device);
+
+	std::vector<uint8_t> nodes;
+
+	if(emu_parse_nodes(device, nodes) == -1) {
+		fprintf(stderr, "Invalid emulator node list (%s)\n", device);
+		return -1;
+	}
+
+	int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	if(fd == -1) {
+		fprintf(stderr, "Creating emulator event failed: %s\n", strerror(errno));
+		return -1;
+	}
+
+	emu_bus_t *bus = new emu_bus_t();
+	bus->intf = intf;
+	bus->filter = false;
+	bus->accept.assign(INTF_NUM_COB_IDS, false);
+	intf->handle = (void *) bus;
+	intf->fd = fd;
+
+	for(size_t i = 0; i < nodes.size(); i++)
+		bus->drives.push_back(emu_create(bus, nodes[i]));
+
+	timeval interval;
+	interval.tv_sec = 0;
+	interval.tv_usec = EMU_TICK_INTERVAL;
+
+	bus->tick = event_new(intf->ev_base, -1, EV_PERSIST, emu_on_tick, (void *) bus);
+	event_add(bus->tick, &interval);
+
+	return 0;
+}
+
+
+/**
+ * Power-off the emulated drives.
+ */
+static int intf_emulator_close(intf_t *intf)
+{
+	assert(intf);
+
+	emu_bus_t *bus = (emu_bus_t *) intf->handle;
+
+	if(bus) {
+		event_del(bus->tick);
+		event_free(bus->tick);
+
+		for(size_t i = 0; i < bus->drives.size(); i++)
+			delete bus->drives[i];
+
+		delete bus;
+		intf->handle = NULL;
+	}
+
+	if(intf->fd >= 0)
+		close(intf->fd);
+
+	return 0;
+}
+
+
+/**
+ * Read frames transmitted by the emulated drives.
+ */
+static int intf_emulator_read(intf_t *intf, can_message_t *msgs, int count)
+{
+	assert(intf && msgs);
+
+	emu_bus_t *bus = (emu_bus_t *) intf->handle;
+	int n = 0;
+
+	while(n < count && !bus->queue.empty()) {
+		msgs[n++] = bus->queue.front();
+		bus->queue.pop_front();
+	}
+
+	// Queue is empty, reset event
+	if(bus->queue.empty()) {
+		uint64_t value;
+		if(read(intf->fd, &value, sizeof(value)) == -1 && errno != EAGAIN)
+			return -1;
+	}
+
+	return n;
+}
+
+
+/**
+ * Pass frames to all emulated drives.
+ */
+static int intf_emulator_write(intf_t *intf, can_message_t *msgs, int count)
+{
+	assert(intf && msgs);
+
+	emu_bus_t *bus = (emu_bus_t *) intf->handle;
+
+	for(int i = 0; i < count; i++)
+		for(size_t j = 0; j < bus->drives.size(); j++)
+			emu_receive(bus->drives[j], &msgs[i]);
+
+	return count;
+}
+
+
+/**
+ * Emulate acceptance filter, rejected frames are counted.
+ */
+static int intf_emulator_set_filter(intf_t *intf, const uint16_t *ids, int count)
+{
+	assert(intf && ids);
+
+	emu_bus_t *bus = (emu_bus_t *) intf->handle;
+
+	bus->filter = true;
+	bus->accept.assign(INTF_NUM_COB_IDS, false);
+
+	for(int i = 0; i < count; i++)
+		bus->accept[ids[i] & (INTF_NUM_COB_IDS - 1)] = true;
+
+	return 0;
+}
+
+
+const intf_backend_t intf_backend_emulator = {
+	"emulator",
+	intf_emulator_open,
+	intf_emulator_close,
+	intf_emulator_read,
+	intf_emulator_write,
+	intf_emulator_set_filter
+};
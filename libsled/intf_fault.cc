@@ -0,0 +1,582 @@
+/*
+ * Fault injection between the interface and its backend.
+ *
+ * Frames received from and sent to the device are delayed, reordered,
+ * dropped, duplicated or corrupted according to a profile. All random
+ * decisions are taken from a generator seeded by the profile, such that
+ * a run can be reproduced.
+ */
+
+#include "interface.h"
+#include "interface_internal.h"
+
+#include <syslog.h>
+#include <assert.h>
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <queue>
+#include <vector>
+
+
+/**
+ * Frame waiting to be delivered to the host (RX) or device (TX).
+ */
+struct intf_fault_frame_t {
+	double due;
+	uint64_t seq;		// Keeps frames with equal due time in order
+	double arrival;
+	uint8_t direction;
+	int priority;
+	can_message_t msg;
+
+	bool operator>(const intf_fault_frame_t &other) const {
+		return due > other.due || (due == other.due && seq > other.seq);
+	}
+};
+
+typedef std::priority_queue<intf_fault_frame_t,
+	std::vector<intf_fault_frame_t>, std::greater<intf_fault_frame_t> > intf_fault_queue_t;
+
+struct intf_fault_t {
+	intf_fault_profile_t profile;
+	intf_fault_stats_t stats;
+
+	uint64_t rng;
+
+	// Delayed frames
+	intf_fault_queue_t pending;
+	uint64_t seq;
+	event *timer;
+
+	// Last due time per direction, jitter does not reorder frames
+	double last_due[2];
+
+	// Frames left in current loss burst and receive overrun
+	int burst_left;
+	int overrun_left;
+
+	// Bus-off window
+	double bus_off_until;
+	double next_bus_off;
+};
+
+
+/**
+ * Uniform random number in [0, 1) (xorshift64*).
+ */
+static double intf_fault_random(intf_fault_t *fault)
+{
+	uint64_t x = fault->rng;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	fault->rng = x;
+
+	return double((x * 0x2545F4914F6CDD1DULL) >> 11) / 9007199254740992.0;
+}
+
+
+/**
+ * Random time until next bus-off event.
+ */
+static double intf_fault_bus_off_interval(intf_fault_t *fault)
+{
+	return -log(1.0 - intf_fault_random(fault)) * fault->profile.bus_off_interval;
+}
+
+
+/**
+ * Random delay of a frame.
+ */
+static double intf_fault_jitter(intf_fault_t *fault)
+{
+	double jitter = fault->profile.jitter;
+
+	if(jitter <= 0.0)
+		return 0.0;
+
+	double u = intf_fault_random(fault);
+
+	switch(fault->profile.distribution) {
+		case jitter_uniform:
+			return jitter * u;
+
+		// Half-normal with standard deviation jitter (Box-Muller)
+		case jitter_normal:
+			return jitter * fabs(sqrt(-2.0 * log(1.0 - u)) *
+				cos(2.0 * M_PI * intf_fault_random(fault)));
+
+		case jitter_exponential:
+			return -log(1.0 - u) * jitter;
+	}
+
+	return 0.0;
+}
+
+
+/**
+ * Enter and leave bus-off windows.
+ *
+ * @return True if the bus is off.
+ */
+static bool intf_fault_bus_off(intf_fault_t *fault, double now)
+{
+	if(fault->profile.bus_off_interval <= 0.0)
+		return false;
+
+	if(now >= fault->next_bus_off) {
+		fault->bus_off_until = fault->next_bus_off + fault->profile.bus_off_duration;
+		fault->next_bus_off = fault->bus_off_until + intf_fault_bus_off_interval(fault);
+		fault->stats.bus_off_events++;
+
+		syslog(LOG_WARNING, "%s() injected bus off for %.3f s", __FUNCTION__,
+			fault->profile.bus_off_duration);
+	}
+
+	return now < fault->bus_off_until;
+}
+
+
+/**
+ * Decide fate of a frame, corrupting its payload if needed.
+ *
+ * @return Number of copies to deliver, 0 when the frame is lost.
+ */
+static int intf_fault_copies(intf_fault_t *fault, can_message_t *msg, double now)
+{
+	const intf_fault_profile_t *profile = &fault->profile;
+
+	if(intf_fault_bus_off(fault, now)) {
+		fault->stats.bus_off_dropped++;
+		return 0;
+	}
+
+	if(fault->burst_left > 0) {
+		fault->burst_left--;
+		fault->stats.dropped++;
+		return 0;
+	}
+
+	if(profile->burst > 0.0 && intf_fault_random(fault) < profile->burst) {
+		fault->burst_left = profile->burst_length - 1;
+		fault->stats.dropped++;
+		return 0;
+	}
+
+	if(profile->drop > 0.0 && intf_fault_random(fault) < profile->drop) {
+		fault->stats.dropped++;
+		return 0;
+	}
+
+	// Flip a single payload bit
+	if(profile->corrupt > 0.0 && msg->len > 0 && intf_fault_random(fault) < profile->corrupt) {
+		int bit = int(intf_fault_random(fault) * 8 * msg->len);
+		msg->data[bit / 8] ^= 1 << (bit % 8);
+		fault->stats.corrupted++;
+	}
+
+	if(profile->duplicate > 0.0 && intf_fault_random(fault) < profile->duplicate) {
+		fault->stats.duplicated++;
+		return 2;
+	}
+
+	return 1;
+}
+
+
+/**
+ * Simulate a receive overrun, which loses up to burst_length
+ * frames that were read in the same batch.
+ *
+ * @return True if the frame is lost.
+ */
+static bool intf_fault_overrun(intf_fault_t *fault)
+{
+	const intf_fault_profile_t *profile = &fault->profile;
+
+	if(fault->overrun_left > 0) {
+		fault->overrun_left--;
+		return true;
+	}
+
+	if(profile->overrun > 0.0 && intf_fault_random(fault) < profile->overrun) {
+		fault->overrun_left = profile->burst_length - 1;
+		fault->stats.overruns++;
+		return true;
+	}
+
+	return false;
+}
+
+
+/**
+ * Arm timer for the first pending frame.
+ */
+static void intf_fault_schedule(intf_fault_t *fault, double now)
+{
+	if(fault->pending.empty())
+		return;
+
+	double delay = fault->pending.top().due - now;
+	if(delay < 0.0)
+		delay = 0.0;
+
+	timeval timeout;
+	timeout.tv_sec = long(delay);
+	timeout.tv_usec = long((delay - timeout.tv_sec) * 1000.0 * 1000.0);
+
+	event_add(fault->timer, &timeout);
+}
+
+
+/**
+ * Deliver frames that are due.
+ */
+static void intf_fault_on_timer(evutil_socket_t fd, short events, void *intf_v)
+{
+	intf_t *intf = (intf_t *) intf_v;
+	intf_fault_t *fault = intf->fault;
+
+	double now = intf_get_time();
+
+	while(!fault->pending.empty() && fault->pending.top().due <= now) {
+		intf_fault_frame_t frame = fault->pending.top();
+		fault->pending.pop();
+
+		double latency = now - frame.arrival;
+		if(latency > fault->stats.max_delay)
+			fault->stats.max_delay = latency;
+
+		if(frame.direction == INTF_TRACE_RX) {
+			// Frame appears to be received late
+			frame.msg.time = now;
+			intf_receive(intf, &frame.msg, 1);
+		} else {
+			intf_write_device(intf, frame.msg, frame.priority);
+		}
+
+		// Handler closed the interface or removed the shim
+		if(intf->fault != fault || intf->fd < 0)
+			return;
+	}
+
+	intf_fault_schedule(fault, now);
+}
+
+
+/**
+ * Hold frame until its (random) delay has passed.
+ *
+ * @return True if the frame was queued, false if it should be passed on now.
+ */
+static bool intf_fault_delay(intf_t *intf, can_message_t *msg, uint8_t direction, int priority, double now)
+{
+	intf_fault_t *fault = intf->fault;
+	const intf_fault_profile_t *profile = &fault->profile;
+
+	double delay = profile->latency + intf_fault_jitter(fault);
+	bool reorder = profile->reorder > 0.0 && intf_fault_random(fault) < profile->reorder;
+
+	double due = now + delay;
+
+	// Only explicit reordering lets later frames overtake
+	if(reorder) {
+		due += profile->reorder_delay;
+		fault->stats.reordered++;
+	} else {
+		if(due < fault->last_due[direction])
+			due = fault->last_due[direction];
+		fault->last_due[direction] = due;
+	}
+
+	// Nothing waiting and no delay, pass on directly
+	if(due <= now && fault->pending.empty())
+		return false;
+
+	intf_fault_frame_t frame;
+	frame.due = due;
+	frame.seq = fault->seq++;
+	frame.arrival = now;
+	frame.direction = direction;
+	frame.priority = priority;
+	frame.msg = *msg;
+
+	bool first = fault->pending.empty() || !(frame > fault->pending.top());
+	fault->pending.push(frame);
+	fault->stats.delayed++;
+
+	if(first) {
+		event_del(fault->timer);
+		intf_fault_schedule(fault, now);
+	}
+
+	return true;
+}
+
+
+/**
+ * Apply faults to received frames.
+ *
+ * @param msgs  Frames read from the device, at least 2 * count in size.
+ * @param count  Number of frames read.
+ * @return Number of frames (in msgs) to be delivered now.
+ */
+int intf_fault_receive(intf_t *intf, can_message_t *msgs, int count)
+{
+	intf_fault_t *fault = intf->fault;
+
+	if(!fault->profile.rx)
+		return count;
+
+	double now = intf_get_time();
+
+	can_message_t received[INTF_READ_BATCH];
+	memcpy(received, msgs, sizeof(can_message_t) * count);
+
+	int n = 0;
+	int lost = 0;
+
+	for(int i = 0; i < count; i++) {
+		can_message_t *msg = &received[i];
+
+		if(intf_fault_overrun(fault)) {
+			lost++;
+			continue;
+		}
+
+		int copies = intf_fault_copies(fault, msg, now);
+
+		for(int j = 0; j < copies; j++)
+			if(!intf_fault_delay(intf, msg, INTF_TRACE_RX, 0, now))
+				msgs[n++] = *msg;
+	}
+
+	// Frames arriving later were not queued behind the
+	// overrun, report it like a device would.
+	fault->overrun_left = 0;
+
+	if(lost > 0)
+		intf_report_overrun(intf, overrun_queue, lost);
+
+	return n;
+}
+
+
+/**
+ * Apply faults to a frame sent by the host.
+ *
+ * @return 1 if the frame should be written now, 0 if it was dropped or delayed.
+ */
+int intf_fault_transmit(intf_t *intf, can_message_t *msg, int priority)
+{
+	intf_fault_t *fault = intf->fault;
+
+	if(!fault->profile.tx)
+		return 1;
+
+	double now = intf_get_time();
+	int copies = intf_fault_copies(fault, msg, now);
+
+	if(copies == 0)
+		return 0;
+
+	// Duplicate is sent after the original
+	if(copies == 2 && !intf_fault_delay(intf, msg, INTF_TRACE_TX, priority, now))
+		intf_write_device(intf, *msg, priority);
+
+	return intf_fault_delay(intf, msg, INTF_TRACE_TX, priority, now) ? 0 : 1;
+}
+
+
+/**
+ * Discard delayed frames (the device has been closed).
+ */
+void intf_fault_flush(intf_t *intf)
+{
+	intf_fault_t *fault = intf->fault;
+
+	if(!fault)
+		return;
+
+	event_del(fault->timer);
+
+	while(!fault->pending.empty())
+		fault->pending.pop();
+
+	fault->last_due[INTF_TRACE_RX] = fault->last_due[INTF_TRACE_TX] = 0.0;
+}
+
+
+/**
+ * Enable fault injection.
+ *
+ * @param intf  Interface.
+ * @param profile  Faults to inject, NULL disables fault injection.
+ */
+void intf_set_fault_profile(intf_t *intf, const intf_fault_profile_t *profile)
+{
+	assert(intf);
+
+	if(intf->fault) {
+		intf_fault_flush(intf);
+		event_free(intf->fault->timer);
+		delete intf->fault;
+		intf->fault = NULL;
+	}
+
+	if(!profile)
+		return;
+
+	intf_fault_t *fault = new intf_fault_t();
+	fault->profile = *profile;
+	memset(&fault->stats, 0, sizeof(intf_fault_stats_t));
+
+	// Generator state must not be zero
+	fault->rng = (uint64_t(profile->seed) + 1) * 0x9E3779B97F4A7C15ULL;
+
+	fault->seq = 0;
+	fault->last_due[INTF_TRACE_RX] = fault->last_due[INTF_TRACE_TX] = 0.0;
+	fault->burst_left = 0;
+	fault->overrun_left = 0;
+	fault->bus_off_until = 0.0;
+	fault->next_bus_off = intf_get_time();
+
+	if(profile->bus_off_interval > 0.0)
+		fault->next_bus_off += intf_fault_bus_off_interval(fault);
+
+	fault->timer = evtimer_new(intf->ev_base, intf_fault_on_timer, (void *) intf);
+	event_priority_set(fault->timer, 0);
+
+	intf->fault = fault;
+
+	syslog(LOG_NOTICE, "%s() injecting faults (seed %u)", __FUNCTION__, profile->seed);
+}
+
+
+/**
+ * Retrieve fault injection statistics.
+ *
+ * @return 0 on success, -1 when fault injection is disabled.
+ */
+int intf_get_fault_stats(intf_t *intf, intf_fault_stats_t *stats)
+{
+	assert(intf && stats);
+
+	if(!intf->fault)
+		return -1;
+
+	*stats = intf->fault->stats;
+	return 0;
+}
+
+
+/**
+ * Initialise profile that does not inject any faults.
+ */
+void intf_fault_profile_init(intf_fault_profile_t *profile)
+{
+	assert(profile);
+
+	memset(profile, 0, sizeof(intf_fault_profile_t));
+	profile->distribution = jitter_uniform;
+	profile->burst_length = 1;
+	profile->reorder_delay = 0.001;
+	profile->rx = true;
+	profile->tx = true;
+}
+
+
+/**
+ * Parse profile from a comma-separated list of key=value pairs, e.g.
+ *
+ *   seed=1,latency=0.002,jitter=0.001,distribution=normal,drop=0.01
+ *
+ * Times are in seconds, probabilities between 0 and 1. Keys are those
+ * of intf_fault_profile_t, distribution is one of uniform, normal or
+ * exponential; rx=0 or tx=0 leaves a direction alone.
+ *
+ * @return 0 on success, -1 on an invalid specification.
+ */
+int intf_parse_fault_profile(const char *spec, intf_fault_profile_t *profile)
+{
+	assert(spec && profile);
+
+	intf_fault_profile_init(profile);
+
+	char *copy = strdup(spec);
+	char *saveptr = NULL;
+	int result = 0;
+
+	for(char *item = strtok_r(copy, ",", &saveptr); item; item = strtok_r(NULL, ",", &saveptr)) {
+		char *value = strchr(item, '=');
+
+		if(!value) {
+			result = -1;
+			break;
+		}
+
+		*value++ = '\0';
+
+		char *end;
+		double number = strtod(value, &end);
+		bool numeric = end != value && *end == '\0' && number >= 0.0;
+
+		if(strcmp(item, "distribution") == 0) {
+			if(strcmp(value, "uniform") == 0)
+				profile->distribution = jitter_uniform;
+			else if(strcmp(value, "normal") == 0)
+				profile->distribution = jitter_normal;
+			else if(strcmp(value, "exponential") == 0)
+				profile->distribution = jitter_exponential;
+			else
+				result = -1;
+		} else if(!numeric) {
+			result = -1;
+		} else if(strcmp(item, "seed") == 0) {
+			profile->seed = uint32_t(number);
+		} else if(strcmp(item, "latency") == 0) {
+			profile->latency = number;
+		} else if(strcmp(item, "jitter") == 0) {
+			profile->jitter = number;
+		} else if(strcmp(item, "drop") == 0) {
+			profile->drop = number;
+		} else if(strcmp(item, "burst") == 0) {
+			profile->burst = number;
+		} else if(strcmp(item, "burst_length") == 0) {
+			profile->burst_length = number < 1.0 ? 1 : int(number);
+		} else if(strcmp(item, "duplicate") == 0) {
+			profile->duplicate = number;
+		} else if(strcmp(item, "corrupt") == 0) {
+			profile->corrupt = number;
+		} else if(strcmp(item, "reorder") == 0) {
+			profile->reorder = number;
+		} else if(strcmp(item, "reorder_delay") == 0) {
+			profile->reorder_delay = number;
+		} else if(strcmp(item, "bus_off_interval") == 0) {
+			profile->bus_off_interval = number;
+		} else if(strcmp(item, "bus_off_duration") == 0) {
+			profile->bus_off_duration = number;
+		} else if(strcmp(item, "overrun") == 0) {
+			profile->overrun = number;
+		} else if(strcmp(item, "rx") == 0) {
+			profile->rx = number != 0.0;
+		} else if(strcmp(item, "tx") == 0) {
+			profile->tx = number != 0.0;
+		} else {
+			result = -1;
+		}
+
+		if(result == -1) {
+			fprintf(stderr, "Invalid fault profile entry (%s=%s)\n", item, value);
+			break;
+		}
+	}
+
+	free(copy);
+
+	return result;
+}
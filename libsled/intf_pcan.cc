@@ -0,0 +1,337 @@
+
+#include "interface.h"
+#include "interface_internal.h"
+
+#ifdef WIN32
+#include <PCANBasic.h>
+#else
+#include <libpcan.h>
+#endif
+
+#include <syslog.h>
+#include <assert.h>
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include <sys/stat.h>
+
+
+/**
+ * Writes PEAK CAN interface status to system log.
+ *
+ * @param function  Function where the status message was received.
+ * @param status  Status message received.
+ */
+static void intf_pcan_log_status(const char *function, int status)
+{
+  assert(function);
+
+	if(status & 0x01)
+		syslog(LOG_ALERT, "%s() chip-send-buffer full.", function);
+
+	if(status & 0x02)
+		syslog(LOG_ALERT, "%s() chip-receive-buffer overrun.", function);
+
+	if(status & 0x04)
+		syslog(LOG_WARNING, "%s() bus warning.", function);
+
+	if(status & 0x08)
+		syslog(LOG_WARNING, "%s() bus passive.", function);
+
+	if(status & 0x10)
+		syslog(LOG_ERR, "%s() bus off.", function);
+
+	if(status & 0x20)
+		syslog(LOG_INFO, "%s() receive buffer is empty.", function);
+
+	if(status & 0x40)
+		syslog(LOG_ALERT, "%s() receive buffer overrun.", function);
+
+	if(status & 0x80)
+		syslog(LOG_ALERT, "%s() send-buffer is full.", function);
+}
+
+
+#ifndef WIN32
+/**
+ * Converts PEAK driver timestamp into monotonic time.
+ *
+ * The driver stamps messages in milliseconds (32 bits) and
+ * microseconds on a clock of its own. The offset to the local
+ * clock is taken from the first frame after opening the device
+ * and lowered whenever a frame arrives sooner, i.e. it belongs
+ * to the frame that was read with the least delay.
+ */
+static double intf_pcan_receive_time(intf_t *intf, TPCANRdMsg *message)
+{
+	// Millisecond counter wrapped around (every 49 days)
+	if(intf->stamp_synced && message->dwTime < intf->stamp_last_ms &&
+			intf->stamp_last_ms - message->dwTime > 0x80000000u)
+		intf->stamp_wraps++;
+
+	intf->stamp_last_ms = message->dwTime;
+
+	double driver = (double(intf->stamp_wraps) * 4294967296.0 + double(message->dwTime)) / 1000.0 +
+		double(message->wUsec) / 1000.0 / 1000.0;
+
+	double now = intf_get_time();
+	double offset = now - driver;
+
+	if(!intf->stamp_synced || offset < intf->stamp_offset) {
+		intf->stamp_offset = offset;
+		intf->stamp_synced = true;
+	}
+
+	double age = offset - intf->stamp_offset;
+
+	// Clocks drifted apart, or the driver clock was reset
+	if(age > INTF_MAX_RECEIVE_AGE)
+		intf->stamp_offset = offset;
+
+	return intf_receive_time(intf, age);
+}
+#endif
+
+
+/**
+ * Open PEAK character device.
+ *
+ * @param intf  Interface to open.
+ * @param device  Path to device node (e.g. /dev/pcanpci0).
+ * @return 0 on success, -1 on failure.
+ */
+static int intf_pcan_open(intf_t *intf, const char *device)
+{
+	assert(intf && device);
+
+	#ifdef WIN32
+	return -1;
+	#else
+	// Check whether the device exists
+	struct stat buf;
+	if(stat(device, &buf) == -1)
+	{
+		fprintf(stderr, "Error locating device node (%s)\n", device);
+		return -1;
+	}
+
+	// Device should be a character device
+	if(!S_ISCHR(buf.st_mode))
+	{
+		fprintf(stderr, "Device node is not a character device (%s)\n", device);
+		return -1;
+	}
+
+	// Try to open interface
+	intf->handle = LINUX_CAN_Open(device, O_RDWR);
+
+	if(!intf->handle) {
+		fprintf(stderr, "Opening of CAN device failed\n");
+		return -1;
+	}
+
+	// Initialize interface
+	DWORD result = CAN_Init(intf->handle, CAN_BAUD_1M, CAN_INIT_TYPE_ST);
+
+	if(result != CAN_ERR_OK && result != CAN_ERR_QRCVEMPTY)
+	{
+		fprintf(stderr, "Initializing of CAN device failed\n");
+		CAN_Close(intf->handle);
+		intf->handle = 0;
+		return -1;
+	}
+
+	intf->fd = LINUX_CAN_FileHandle(intf->handle);
+
+	// Offset to the driver clock is taken from the first frame
+	intf->stamp_synced = false;
+	intf->stamp_wraps = 0;
+
+	return 0;
+	#endif
+}
+
+
+/**
+ * Close PEAK character device.
+ */
+static int intf_pcan_close(intf_t *intf)
+{
+	assert(intf);
+
+	#ifndef WIN32
+	if(intf->handle) {
+		DWORD result = CAN_Close(intf->handle);
+		intf->handle = 0;
+
+		if(result != CAN_ERR_OK) {
+			fprintf(stderr, "Closing of CAN device failed\n");
+			return -1;
+		}
+	}
+	#endif
+
+	return 0;
+}
+
+
+/**
+ * Read messages from the PEAK driver until its receive
+ * queue is empty or count messages have been read.
+ *
+ * Status messages are handled here and are not returned.
+ */
+static int intf_pcan_read(intf_t *intf, can_message_t *msgs, int count)
+{
+	assert(intf && msgs);
+
+	#ifdef WIN32
+	return -1;
+	#else
+	int n = 0;
+
+	while(n < count) {
+		TPCANRdMsg message;
+
+		// Zero timeout only polls the queue, it never blocks
+		DWORD result = LINUX_CAN_Read_Timeout(intf->handle, &message, 0);
+
+		// Receive queue is empty, we are done
+		if(result == CAN_ERR_QRCVEMPTY)
+			break;
+
+		// There was an error
+		if(result != CAN_ERR_OK) {
+			syslog(LOG_ALERT, "%s() reading from the CAN bus failed.", __FUNCTION__);
+			return -1;
+		}
+
+		// A status message was received
+		if((message.Msg.MSGTYPE & MSGTYPE_STATUS) == MSGTYPE_STATUS)
+		{
+			int32_t status = int32_t(CAN_Status(intf->handle));
+
+			if(status < 0) {
+				syslog(LOG_ALERT, "%s() received invalid status (%x).", __FUNCTION__, status);
+				return -1;
+			}
+
+			if(status != 0x20 && status != 0x00)
+				intf_pcan_log_status(__FUNCTION__, status);
+
+			// The driver does not tell how many frames were lost
+			if(status & 0x02)
+				intf_report_overrun(intf, overrun_controller, 0);
+			if(status & 0x40)
+				intf_report_overrun(intf, overrun_queue, 0);
+
+			// Controller has to be initialised again, which
+			// happens when the interface is reopened.
+			if(status & 0x10)
+				return -1;
+
+			continue;
+		}
+
+		msgs[n].id = message.Msg.ID;
+		msgs[n].type = message.Msg.MSGTYPE;
+		msgs[n].len = message.Msg.LEN;
+		msgs[n].time = intf_pcan_receive_time(intf, &message);
+
+		for(int i = 0; i < 8; i++)
+			msgs[n].data[i] = message.Msg.DATA[i];
+
+		n++;
+	}
+
+	return n;
+	#endif
+}
+
+
+/**
+ * Write messages one-by-one to the PEAK driver.
+ *
+ * A zero timeout only checks whether the transmit queue has
+ * room, it stops at the first message that does not fit.
+ */
+static int intf_pcan_write(intf_t *intf, can_message_t *msgs, int count)
+{
+	assert(intf && msgs);
+
+	#ifdef WIN32
+	return -1;
+	#else
+	for(int i = 0; i < count; i++) {
+		TPCANMsg cmsg;
+		cmsg.ID = msgs[i].id;
+		cmsg.MSGTYPE = msgs[i].type;
+		cmsg.LEN = msgs[i].len;
+
+		for(int j = 0; j < 8; j++)
+			cmsg.DATA[j] = msgs[i].data[j];
+
+		DWORD result = LINUX_CAN_Write_Timeout(intf->handle, &cmsg, 0);
+
+		// Transmit queue is full
+		if(result == CAN_ERR_QXMTFULL || result == CAN_ERR_XMTFULL)
+			return i;
+
+		if(result != CAN_ERR_OK) {
+			syslog(LOG_ALERT, "%s() could not send message (%x): %s", __FUNCTION__, result, strerror(errno));
+			return -1;
+		}
+	}
+
+	return count;
+	#endif
+}
+
+
+/**
+ * Program the message filter of the PEAK driver.
+ *
+ * The driver accepts frames within any of the ranges set using
+ * CAN_MsgFilter, consecutive COB-IDs are therefore merged.
+ */
+static int intf_pcan_set_filter(intf_t *intf, const uint16_t *ids, int count)
+{
+	assert(intf && ids);
+
+	#ifdef WIN32
+	return -1;
+	#else
+	if(CAN_ResetFilter(intf->handle) != CAN_ERR_OK)
+		return -1;
+
+	for(int i = 0; i < count; ) {
+		int last = i;
+		while(last + 1 < count && ids[last + 1] == ids[last] + 1)
+			last++;
+
+		if(CAN_MsgFilter(intf->handle, ids[i], ids[last], MSGTYPE_STANDARD) != CAN_ERR_OK) {
+			// Do not leave a partial filter behind
+			CAN_ResetFilter(intf->handle);
+			return -1;
+		}
+
+		i = last + 1;
+	}
+
+	return 0;
+	#endif
+}
+
+
+const intf_backend_t intf_backend_pcan = {
+	"pcan",
+	intf_pcan_open,
+	intf_pcan_close,
+	intf_pcan_read,
+	intf_pcan_write,
+	intf_pcan_set_filter
+};
@@ -0,0 +1,452 @@
+/*
+ * Busy-poll receive mode (see intf_set_busy_poll).
+ *
+ * A thread pinned to a (preferably isolated) CPU reads the device
+ * without ever sleeping and passes frames to the event loop through
+ * a single-producer single-consumer ring. The event loop is woken
+ * using an eventfd, but only once for all frames that arrive before
+ * it has emptied the ring. Everything after the read, including
+ * fault injection and dispatch, still happens on the event loop.
+ */
+
+#include "interface.h"
+#include "interface_internal.h"
+
+#include <syslog.h>
+#include <assert.h>
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/eventfd.h>
+
+
+struct intf_poll_entry_t {
+	can_message_t msg;
+	double read_time;
+};
+
+struct intf_poll_t {
+	intf_t *intf;
+	int cpu;
+
+	pthread_t thread;
+	bool running;
+
+	// Set by the event loop to end the thread, and by
+	// the thread when reading from the device failed.
+	int stop;
+	int failed;
+
+	// Wakes up the event loop, signalled is set until it has run
+	int fd;
+	int signalled;
+
+	// Ring, head is only written by the thread and tail by the event loop
+	intf_poll_entry_t ring[INTF_POLL_QUEUE_SIZE];
+	alignas(64) uint32_t head;
+	alignas(64) uint32_t tail;
+
+	// Overruns reported while the thread was reading (by source)
+	uint32_t overruns[2];
+	uint32_t overrun_lost[2];
+
+	// Written by the thread, read using atomics
+	uint64_t loops;
+	uint64_t idle_loops;
+	uint64_t frames;
+	uint64_t dropped;
+	uint64_t wakeups;
+
+	// Counters of the thread at the last reset
+	intf_poll_stats_t base;
+
+	// Written by the event loop
+	int max_depth;
+	uint64_t dispatched;
+	double sum_latency;
+	double max_latency;
+};
+
+
+// Poll thread of the calling thread (NULL on the event loop)
+static __thread intf_poll_t *intf_poll_current = NULL;
+
+
+/**
+ * Tell the CPU we are spinning (saves power and
+ * releases resources to a hyper-threaded sibling).
+ */
+static inline void intf_poll_relax()
+{
+	#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+	#elif defined(__aarch64__)
+	asm volatile("yield");
+	#endif
+}
+
+
+/**
+ * Wake up the event loop unless it has been woken already.
+ */
+static void intf_poll_signal(intf_poll_t *poll, uint64_t *wakeups)
+{
+	if(__atomic_exchange_n(&poll->signalled, 1, __ATOMIC_SEQ_CST))
+		return;
+
+	uint64_t one = 1;
+	if(write(poll->fd, &one, sizeof(one)) == -1)
+		return;
+
+	if(wakeups)
+		__atomic_store_n(&poll->wakeups, ++(*wakeups), __ATOMIC_RELAXED);
+}
+
+
+/**
+ * Poll loop, spins on non-blocking reads until stopped.
+ */
+static void *intf_poll_thread(void *poll_v)
+{
+	intf_poll_t *poll = (intf_poll_t *) poll_v;
+	intf_t *intf = poll->intf;
+
+	intf_poll_current = poll;
+
+	can_message_t msgs[INTF_READ_BATCH];
+
+	// Counters are kept locally and published without atomic
+	// read-modify-write, there is only one writer.
+	uint64_t loops = poll->loops, idle_loops = poll->idle_loops;
+	uint64_t frames = poll->frames, dropped = poll->dropped, wakeups = poll->wakeups;
+	uint32_t head = poll->head;
+
+	while(!__atomic_load_n(&poll->stop, __ATOMIC_ACQUIRE)) {
+		int count = intf->backend->read(intf, msgs, INTF_READ_BATCH);
+		__atomic_store_n(&poll->loops, ++loops, __ATOMIC_RELAXED);
+
+		if(count == -1) {
+			__atomic_store_n(&poll->failed, 1, __ATOMIC_RELEASE);
+			intf_poll_signal(poll, &wakeups);
+			break;
+		}
+
+		if(count == 0) {
+			__atomic_store_n(&poll->idle_loops, ++idle_loops, __ATOMIC_RELAXED);
+			intf_poll_relax();
+			continue;
+		}
+
+		double now = intf_get_time();
+		uint32_t tail = __atomic_load_n(&poll->tail, __ATOMIC_ACQUIRE);
+		int lost = 0;
+
+		for(int i = 0; i < count; i++) {
+			if(head - tail == INTF_POLL_QUEUE_SIZE) {
+				lost++;
+				continue;
+			}
+
+			intf_poll_entry_t *entry = &(poll->ring[head & (INTF_POLL_QUEUE_SIZE - 1)]);
+			entry->msg = msgs[i];
+			entry->read_time = now;
+			head++;
+		}
+
+		__atomic_store_n(&poll->head, head, __ATOMIC_RELEASE);
+
+		if(lost > 0) {
+			dropped += lost;
+			__atomic_store_n(&poll->dropped, dropped, __ATOMIC_RELAXED);
+			intf_poll_defer_overrun(intf, overrun_queue, lost);
+		}
+
+		frames += count - lost;
+		__atomic_store_n(&poll->frames, frames, __ATOMIC_RELAXED);
+
+		intf_poll_signal(poll, &wakeups);
+	}
+
+	return NULL;
+}
+
+
+/**
+ * Start the poll thread, called when the device has been opened.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int intf_poll_start(intf_t *intf)
+{
+	intf_poll_t *poll = intf->poll;
+	assert(poll && !poll->running);
+
+	poll->stop = 0;
+	poll->failed = 0;
+	poll->signalled = 0;
+	poll->head = poll->tail = 0;
+
+	for(int s = 0; s < 2; s++)
+		poll->overruns[s] = poll->overrun_lost[s] = 0;
+
+	// Scheduling policy and priority are inherited (see setup_realtime)
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	CPU_SET(poll->cpu, &cpus);
+	pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &cpus);
+
+	int result = pthread_create(&poll->thread, &attr, intf_poll_thread, (void *) poll);
+	pthread_attr_destroy(&attr);
+
+	if(result != 0) {
+		syslog(LOG_ERR, "%s() could not start poll thread on CPU %d: %s",
+			__FUNCTION__, poll->cpu, strerror(result));
+		return -1;
+	}
+
+	poll->running = true;
+
+	syslog(LOG_NOTICE, "%s() busy polling %s on CPU %d", __FUNCTION__, intf->device, poll->cpu);
+
+	return 0;
+}
+
+
+/**
+ * Stop the poll thread, before the device is closed.
+ * Frames that have not been dispatched are discarded.
+ */
+void intf_poll_stop(intf_t *intf)
+{
+	intf_poll_t *poll = intf->poll;
+
+	if(!poll || !poll->running)
+		return;
+
+	__atomic_store_n(&poll->stop, 1, __ATOMIC_RELEASE);
+	pthread_join(poll->thread, NULL);
+	poll->running = false;
+
+	poll->tail = poll->head;
+
+	uint64_t value;
+	if(read(poll->fd, &value, sizeof(value)) == -1 && errno != EAGAIN)
+		syslog(LOG_ERR, "%s() could not clear event: %s", __FUNCTION__, strerror(errno));
+}
+
+
+/**
+ * File descriptor that becomes readable when frames are waiting.
+ */
+int intf_poll_fd(intf_t *intf)
+{
+	assert(intf->poll);
+	return intf->poll->fd;
+}
+
+
+/**
+ * Overruns are accounted for on the event loop. When called from the
+ * poll thread, the overrun is stored until the next intf_poll_receive.
+ *
+ * @return True if the overrun has been deferred.
+ */
+bool intf_poll_defer_overrun(intf_t *intf, intf_overrun_source_t source, uint32_t lost)
+{
+	intf_poll_t *poll = intf->poll;
+
+	if(!poll || intf_poll_current != poll)
+		return false;
+
+	int s = (source == overrun_controller) ? 0 : 1;
+	__atomic_fetch_add(&poll->overrun_lost[s], lost, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&poll->overruns[s], 1, __ATOMIC_RELEASE);
+
+	return true;
+}
+
+
+/**
+ * Take frames read by the poll thread, called from the event loop.
+ *
+ * @param intf  Interface.
+ * @param msgs  Buffer receiving frames.
+ * @param count  Maximum number of frames.
+ * @return Number of frames or -1 when reading from the device failed.
+ */
+int intf_poll_receive(intf_t *intf, can_message_t *msgs, int count)
+{
+	intf_poll_t *poll = intf->poll;
+	assert(poll);
+
+	uint64_t value;
+	if(read(poll->fd, &value, sizeof(value)) == -1 && errno != EAGAIN)
+		return -1;
+
+	// From now on, new frames wake us up again
+	__atomic_store_n(&poll->signalled, 0, __ATOMIC_SEQ_CST);
+
+	for(int s = 0; s < 2; s++) {
+		uint32_t overruns = __atomic_exchange_n(&poll->overruns[s], 0, __ATOMIC_ACQUIRE);
+		uint32_t lost = __atomic_exchange_n(&poll->overrun_lost[s], 0, __ATOMIC_RELAXED);
+
+		for(uint32_t i = 0; i < overruns; i++)
+			intf_report_overrun(intf, s == 0 ? overrun_controller : overrun_queue, i == 0 ? lost : 0);
+	}
+
+	if(__atomic_load_n(&poll->failed, __ATOMIC_ACQUIRE))
+		return -1;
+
+	uint32_t head = __atomic_load_n(&poll->head, __ATOMIC_SEQ_CST);
+	uint32_t tail = poll->tail;
+
+	if(int(head - tail) > poll->max_depth)
+		poll->max_depth = int(head - tail);
+
+	double now = intf_get_time();
+	int n = 0;
+
+	while(n < count && tail != head) {
+		intf_poll_entry_t *entry = &(poll->ring[tail & (INTF_POLL_QUEUE_SIZE - 1)]);
+		msgs[n++] = entry->msg;
+
+		double latency = now - entry->read_time;
+		poll->sum_latency += latency;
+		if(latency > poll->max_latency)
+			poll->max_latency = latency;
+
+		tail++;
+	}
+
+	poll->dispatched += n;
+	__atomic_store_n(&poll->tail, tail, __ATOMIC_RELEASE);
+
+	// Read limit reached, come back on the next iteration
+	if(tail != head)
+		intf_poll_signal(poll, NULL);
+
+	return n;
+}
+
+
+/**
+ * Read the device from a thread that spins on a dedicated CPU,
+ * instead of waiting for the device in the event loop. This saves
+ * the wakeup of the event loop by the device at the cost of a CPU,
+ * which should be isolated from the scheduler (isolcpus).
+ *
+ * Simulated devices (emulator and replay) run on the event
+ * loop and cannot be polled.
+ *
+ * @param intf  Interface.
+ * @param cpu  CPU to run the poll thread on, -1 disables busy polling.
+ * @return 0 on success, -1 on failure.
+ */
+int intf_set_busy_poll(intf_t *intf, int cpu)
+{
+	assert(intf);
+
+	if(cpu >= 0 && (intf->backend == &intf_backend_emulator || intf->backend == &intf_backend_replay)) {
+		syslog(LOG_ERR, "%s() %s devices cannot be polled", __FUNCTION__, intf->backend->name);
+		return -1;
+	}
+
+	long cpus = sysconf(_SC_NPROCESSORS_CONF);
+
+	if(cpu >= CPU_SETSIZE || cpu >= cpus) {
+		syslog(LOG_ERR, "%s() there is no CPU %d", __FUNCTION__, cpu);
+		return -1;
+	}
+
+	bool open = intf->fd >= 0;
+
+	if(open)
+		intf_stop_reading(intf);
+
+	if(intf->poll) {
+		close(intf->poll->fd);
+		delete intf->poll;
+		intf->poll = NULL;
+	}
+
+	if(cpu >= 0) {
+		intf_poll_t *poll = new intf_poll_t();
+		poll->intf = intf;
+		poll->cpu = cpu;
+		poll->running = false;
+		poll->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+		if(poll->fd == -1) {
+			syslog(LOG_ERR, "%s() could not create event: %s", __FUNCTION__, strerror(errno));
+			delete poll;
+			poll = NULL;
+		} else {
+			intf->poll = poll;
+			intf_poll_reset_stats(intf);
+		}
+	}
+
+	if(open)
+		intf_start_reading(intf);
+
+	return (cpu < 0 || intf->poll) ? 0 : -1;
+}
+
+
+/**
+ * Clear busy-poll statistics.
+ */
+void intf_poll_reset_stats(intf_t *intf)
+{
+	intf_poll_t *poll = intf->poll;
+
+	if(!poll)
+		return;
+
+	poll->base.loops = __atomic_load_n(&poll->loops, __ATOMIC_RELAXED);
+	poll->base.idle_loops = __atomic_load_n(&poll->idle_loops, __ATOMIC_RELAXED);
+	poll->base.frames = __atomic_load_n(&poll->frames, __ATOMIC_RELAXED);
+	poll->base.dropped = __atomic_load_n(&poll->dropped, __ATOMIC_RELAXED);
+	poll->base.wakeups = __atomic_load_n(&poll->wakeups, __ATOMIC_RELAXED);
+
+	poll->max_depth = 0;
+	poll->dispatched = 0;
+	poll->sum_latency = 0.0;
+	poll->max_latency = 0.0;
+}
+
+
+/**
+ * Retrieve busy-poll statistics.
+ *
+ * @return 0 on success, -1 when busy polling is disabled.
+ */
+int intf_get_poll_stats(intf_t *intf, intf_poll_stats_t *stats)
+{
+	assert(intf && stats);
+
+	intf_poll_t *poll = intf->poll;
+
+	if(!poll)
+		return -1;
+
+	stats->cpu = poll->cpu;
+	stats->loops = __atomic_load_n(&poll->loops, __ATOMIC_RELAXED) - poll->base.loops;
+	stats->idle_loops = __atomic_load_n(&poll->idle_loops, __ATOMIC_RELAXED) - poll->base.idle_loops;
+	stats->frames = __atomic_load_n(&poll->frames, __ATOMIC_RELAXED) - poll->base.frames;
+	stats->dropped = __atomic_load_n(&poll->dropped, __ATOMIC_RELAXED) - poll->base.dropped;
+	stats->wakeups = __atomic_load_n(&poll->wakeups, __ATOMIC_RELAXED) - poll->base.wakeups;
+	stats->max_depth = poll->max_depth;
+	stats->mean_latency = poll->dispatched > 0 ? poll->sum_latency / poll->dispatched : 0.0;
+	stats->max_latency = poll->max_latency;
+
+	return 0;
+}
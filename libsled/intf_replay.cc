@@ -0,0 +1,265 @@
+/*
+ * Plays back frames received during a capture (see intf_start_capture).
+ *
+ * The device name replay:<file> delivers frames with their original
+ * timing, replay-fast:<file> delivers them as fast as the event loop
+ * reads them. Frames sent by the host are discarded.
+ */
+
+#include "interface.h"
+#include "interface_internal.h"
+
+#include <syslog.h>
+#include <assert.h>
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/eventfd.h>
+
+#include <vector>
+
+
+struct replay_t {
+	intf_t *intf;
+
+	// Received frames from the capture
+	std::vector<can_message_t> frames;
+	size_t next;
+
+	// Deliver frames without delay
+	bool fast;
+
+	// Capture time is mapped onto current time
+	double offset;
+	bool signalled;
+
+	event *timer;
+};
+
+
+/**
+ * Load received frames from capture file.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int replay_load(replay_t *replay, const char *filename)
+{
+	FILE *file = fopen(filename, "rb");
+
+	if(!file) {
+		fprintf(stderr, "Could not open capture %s: %s\n", filename, strerror(errno));
+		return -1;
+	}
+
+	intf_trace_header_t header;
+
+	if(fread(&header, sizeof(header), 1, file) != 1 ||
+		strncmp(header.magic, INTF_TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+		header.version != INTF_TRACE_VERSION ||
+		header.record_size != sizeof(intf_trace_record_t))
+	{
+		fprintf(stderr, "Not a capture file (%s)\n", filename);
+		fclose(file);
+		return -1;
+	}
+
+	intf_trace_record_t record;
+
+	while(fread(&record, sizeof(record), 1, file) == 1) {
+		if(record.direction != INTF_TRACE_RX)
+			continue;
+
+		can_message_t msg;
+		msg.id = record.id;
+		msg.type = record.type;
+		msg.len = record.len;
+		msg.time = record.time;
+		memcpy(msg.data, record.data, 8);
+
+		replay->frames.push_back(msg);
+	}
+
+	fclose(file);
+
+	return 0;
+}
+
+
+/**
+ * Wake up the read handler.
+ */
+static void replay_signal(replay_t *replay)
+{
+	if(replay->signalled)
+		return;
+
+	uint64_t one = 1;
+	if(write(replay->intf->fd, &one, sizeof(one)) == -1)
+		syslog(LOG_ERR, "%s() could not signal host: %s", __FUNCTION__, strerror(errno));
+
+	replay->signalled = true;
+}
+
+
+/**
+ * Wake up the read handler when the next frame is due.
+ */
+static void replay_schedule(replay_t *replay)
+{
+	if(replay->next >= replay->frames.size())
+		return;
+
+	if(replay->fast) {
+		replay_signal(replay);
+		return;
+	}
+
+	double delay = replay->frames[replay->next].time + replay->offset - intf_get_time();
+
+	if(delay <= 0.0) {
+		replay_signal(replay);
+		return;
+	}
+
+	timeval timeout;
+	timeout.tv_sec = long(delay);
+	timeout.tv_usec = long((delay - timeout.tv_sec) * 1000.0 * 1000.0);
+
+	event_add(replay->timer, &timeout);
+}
+
+
+static void replay_on_timer(evutil_socket_t fd, short events, void *replay_v)
+{
+	replay_signal((replay_t *) replay_v);
+}
+
+
+/**
+ * Open capture for replay.
+ */
+static int intf_replay_open(intf_t *intf, const char *device)
+{
+	assert(intf && device);
+
+	replay_t *replay = new replay_t();
+	replay->intf = intf;
+	replay->next = 0;
+	replay->signalled = false;
+	replay->fast = strncmp(device, "replay-fast:", 12) == 0;
+
+	const char *filename = strchr(device, ':') + 1;
+
+	if(replay_load(replay, filename) == -1) {
+		delete replay;
+		return -1;
+	}
+
+	int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	if(fd == -1) {
+		fprintf(stderr, "Creating replay event failed: %s\n", strerror(errno));
+		delete replay;
+		return -1;
+	}
+
+	intf->handle = (void *) replay;
+	intf->fd = fd;
+
+	// First frame is delivered right away
+	if(!replay->frames.empty())
+		replay->offset = intf_get_time() - replay->frames[0].time;
+
+	replay->timer = evtimer_new(intf->ev_base, replay_on_timer, (void *) replay);
+	replay_schedule(replay);
+
+	syslog(LOG_NOTICE, "%s() replaying %d frames from %s", __FUNCTION__,
+		int(replay->frames.size()), filename);
+
+	return 0;
+}
+
+
+static int intf_replay_close(intf_t *intf)
+{
+	assert(intf);
+
+	replay_t *replay = (replay_t *) intf->handle;
+
+	if(replay) {
+		event_del(replay->timer);
+		event_free(replay->timer);
+		delete replay;
+		intf->handle = NULL;
+	}
+
+	if(intf->fd >= 0)
+		close(intf->fd);
+
+	return 0;
+}
+
+
+/**
+ * Return frames that are due, stamped with the current time base.
+ */
+static int intf_replay_read(intf_t *intf, can_message_t *msgs, int count)
+{
+	assert(intf && msgs);
+
+	replay_t *replay = (replay_t *) intf->handle;
+	double now = intf_get_time();
+	int n = 0;
+
+	while(n < count && replay->next < replay->frames.size()) {
+		can_message_t *msg = &(replay->frames[replay->next]);
+
+		if(!replay->fast && msg->time + replay->offset > now)
+			break;
+
+		msgs[n] = *msg;
+		msgs[n].time = msg->time + replay->offset;
+
+		replay->next++;
+		n++;
+	}
+
+	// Not all due frames fit, keep event signalled
+	if(n == count)
+		return n;
+
+	uint64_t value;
+	if(read(intf->fd, &value, sizeof(value)) == -1 && errno != EAGAIN)
+		return -1;
+
+	replay->signalled = false;
+
+	if(replay->next < replay->frames.size())
+		replay_schedule(replay);
+	else if(n > 0)
+		syslog(LOG_NOTICE, "%s() replay finished", __FUNCTION__);
+
+	return n;
+}
+
+
+/**
+ * Frames sent by the host are discarded.
+ */
+static int intf_replay_write(intf_t *intf, can_message_t *msgs, int count)
+{
+	return count;
+}
+
+
+const intf_backend_t intf_backend_replay = {
+	"replay",
+	intf_replay_open,
+	intf_replay_close,
+	intf_replay_read,
+	intf_replay_write,
+	NULL
+};
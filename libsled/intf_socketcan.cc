@@ -0,0 +1,387 @@
+
+#include "interface.h"
+#include "interface_internal.h"
+
+#include <syslog.h>
+#include <assert.h>
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <net/if.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+
+#include <linux/can.h>
+#include <linux/can/error.h>
+#include <linux/can/raw.h>
+
+
+/**
+ * Frames dropped by the kernel because the socket receive
+ * queue was full, as last reported through SO_RXQ_OVFL.
+ */
+struct socketcan_t {
+	uint32_t drops;
+};
+
+
+/**
+ * Writes SocketCAN error frame to system log.
+ *
+ * @param function  Function where the error frame was received.
+ * @param frame  Error frame received.
+ */
+static void intf_socketcan_log_error(const char *function, can_frame *frame)
+{
+	assert(function && frame);
+
+	if(frame->can_id & CAN_ERR_CRTL) {
+		if(frame->data[1] & (CAN_ERR_CRTL_RX_OVERFLOW | CAN_ERR_CRTL_TX_OVERFLOW))
+			syslog(LOG_ALERT, "%s() controller buffer overrun.", function);
+		if(frame->data[1] & (CAN_ERR_CRTL_RX_WARNING | CAN_ERR_CRTL_TX_WARNING))
+			syslog(LOG_WARNING, "%s() bus warning.", function);
+		if(frame->data[1] & (CAN_ERR_CRTL_RX_PASSIVE | CAN_ERR_CRTL_TX_PASSIVE))
+			syslog(LOG_WARNING, "%s() bus passive.", function);
+	}
+
+	if(frame->can_id & CAN_ERR_BUSOFF)
+		syslog(LOG_ERR, "%s() bus off.", function);
+
+	if(frame->can_id & CAN_ERR_RESTARTED)
+		syslog(LOG_NOTICE, "%s() controller restarted.", function);
+}
+
+
+/**
+ * Open raw CAN socket on a network interface.
+ *
+ * The bitrate is not configured here, it should be set when the
+ * interface is brought up (ip link set can0 type can bitrate 1000000).
+ *
+ * @param intf  Interface to open.
+ * @param device  Name of the network interface (e.g. can0 or vcan0).
+ * @return 0 on success, -1 on failure.
+ */
+static int intf_socketcan_open(intf_t *intf, const char *device)
+{
+	assert(intf && device);
+
+	if(strlen(device) >= IFNAMSIZ) {
+		fprintf(stderr, "Invalid CAN interface name (%s)\n", device);
+		return -1;
+	}
+
+	int fd = socket(PF_CAN, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, CAN_RAW);
+
+	if(fd == -1) {
+		fprintf(stderr, "Opening of CAN socket failed: %s\n", strerror(errno));
+		return -1;
+	}
+
+	// Lookup interface index
+	ifreq ifr;
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, device, IFNAMSIZ - 1);
+
+	if(ioctl(fd, SIOCGIFINDEX, &ifr) == -1) {
+		fprintf(stderr, "Error locating CAN interface (%s)\n", device);
+		close(fd);
+		return -1;
+	}
+
+	// Report controller problems and bus-off as error frames
+	can_err_mask_t err_mask = CAN_ERR_CRTL | CAN_ERR_BUSOFF | CAN_ERR_RESTARTED;
+	setsockopt(fd, SOL_CAN_RAW, CAN_RAW_ERR_FILTER, &err_mask, sizeof(err_mask));
+
+	// Let the kernel stamp received frames
+	int enable = 1;
+	setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &enable, sizeof(enable));
+
+	// And count frames dropped from a full receive queue
+	setsockopt(fd, SOL_SOCKET, SO_RXQ_OVFL, &enable, sizeof(enable));
+
+	sockaddr_can addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.can_family = AF_CAN;
+	addr.can_ifindex = ifr.ifr_ifindex;
+
+	if(bind(fd, (sockaddr *) &addr, sizeof(addr)) == -1) {
+		fprintf(stderr, "Binding to CAN interface failed (%s): %s\n", device, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	socketcan_t *socketcan = new socketcan_t();
+	socketcan->drops = 0;
+
+	intf->handle = (void *) socketcan;
+	intf->fd = fd;
+
+	return 0;
+}
+
+
+/**
+ * Close raw CAN socket.
+ */
+static int intf_socketcan_close(intf_t *intf)
+{
+	assert(intf);
+
+	delete (socketcan_t *) intf->handle;
+	intf->handle = NULL;
+
+	if(intf->fd >= 0 && close(intf->fd) == -1) {
+		fprintf(stderr, "Closing of CAN socket failed\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+
+/**
+ * Converts kernel receive timestamp (CLOCK_REALTIME) into monotonic time.
+ *
+ * @param hdr  Received message header, including control messages.
+ * @param now  Current CLOCK_REALTIME time.
+ */
+static double intf_socketcan_receive_time(intf_t *intf, msghdr *hdr, timespec *now)
+{
+	for(cmsghdr *cmsg = CMSG_FIRSTHDR(hdr); cmsg; cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+		if(cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_TIMESTAMPNS)
+			continue;
+
+		timespec ts;
+		memcpy(&ts, CMSG_DATA(cmsg), sizeof(timespec));
+
+		double age = double(now->tv_sec - ts.tv_sec) +
+			double(now->tv_nsec - ts.tv_nsec) / 1000.0 / 1000.0 / 1000.0;
+
+		return intf_receive_time(intf, age);
+	}
+
+	return intf_get_time();
+}
+
+
+/**
+ * Report frames dropped from the receive queue since the last read.
+ *
+ * @param hdr  Received message header, including control messages.
+ */
+static void intf_socketcan_check_drops(intf_t *intf, msghdr *hdr)
+{
+	socketcan_t *socketcan = (socketcan_t *) intf->handle;
+
+	for(cmsghdr *cmsg = CMSG_FIRSTHDR(hdr); cmsg; cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+		if(cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SO_RXQ_OVFL)
+			continue;
+
+		uint32_t drops;
+		memcpy(&drops, CMSG_DATA(cmsg), sizeof(uint32_t));
+
+		// Counter is cumulative, unsigned subtraction handles wrap-around
+		if(drops != socketcan->drops) {
+			intf_report_overrun(intf, overrun_queue, drops - socketcan->drops);
+			socketcan->drops = drops;
+		}
+	}
+}
+
+
+/**
+ * Read all pending frames (up to count) using a single system call.
+ *
+ * Error frames are logged and not returned, overruns
+ * are reported to the interface. Bus-off is reported
+ * as a read error, like the PEAK driver does.
+ */
+static int intf_socketcan_read(intf_t *intf, can_message_t *msgs, int count)
+{
+	assert(intf && msgs);
+
+	if(count > INTF_READ_BATCH)
+		count = INTF_READ_BATCH;
+
+	can_frame frames[INTF_READ_BATCH];
+	iovec iovs[INTF_READ_BATCH];
+	mmsghdr hdrs[INTF_READ_BATCH];
+	char control[INTF_READ_BATCH][CMSG_SPACE(sizeof(timespec)) + CMSG_SPACE(sizeof(uint32_t))];
+
+	memset(hdrs, 0, sizeof(mmsghdr) * count);
+
+	for(int i = 0; i < count; i++) {
+		iovs[i].iov_base = &frames[i];
+		iovs[i].iov_len = sizeof(can_frame);
+		hdrs[i].msg_hdr.msg_iov = &iovs[i];
+		hdrs[i].msg_hdr.msg_iovlen = 1;
+		hdrs[i].msg_hdr.msg_control = control[i];
+		hdrs[i].msg_hdr.msg_controllen = sizeof(control[i]);
+	}
+
+	int received = recvmmsg(intf->fd, hdrs, count, MSG_DONTWAIT, NULL);
+
+	if(received == -1) {
+		if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+			return 0;
+
+		syslog(LOG_ALERT, "%s() reading from the CAN bus failed: %s", __FUNCTION__, strerror(errno));
+		return -1;
+	}
+
+	timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	int n = 0;
+
+	for(int i = 0; i < received; i++) {
+		can_frame *frame = &frames[i];
+
+		intf_socketcan_check_drops(intf, &hdrs[i].msg_hdr);
+
+		if(hdrs[i].msg_len < sizeof(can_frame))
+			continue;
+
+		if(frame->can_id & CAN_ERR_FLAG) {
+			intf_socketcan_log_error(__FUNCTION__, frame);
+
+			if((frame->can_id & CAN_ERR_CRTL) && (frame->data[1] & CAN_ERR_CRTL_RX_OVERFLOW))
+				intf_report_overrun(intf, overrun_controller, 0);
+
+			// Controller has to be restarted, which happens
+			// when the interface is reopened.
+			if(frame->can_id & CAN_ERR_BUSOFF)
+				return -1;
+
+			continue;
+		}
+
+		msgs[n].type = mt_standard;
+
+		if(frame->can_id & CAN_EFF_FLAG)
+			msgs[n].type |= mt_extended;
+		if(frame->can_id & CAN_RTR_FLAG)
+			msgs[n].type |= mt_rtr;
+
+		msgs[n].id = frame->can_id & CAN_EFF_MASK;
+		msgs[n].len = frame->can_dlc;
+		msgs[n].time = intf_socketcan_receive_time(intf, &hdrs[i].msg_hdr, &now);
+
+		for(int j = 0; j < 8; j++)
+			msgs[n].data[j] = frame->data[j];
+
+		n++;
+	}
+
+	return n;
+}
+
+
+/**
+ * Write all messages using a single system call where possible.
+ *
+ * Stops early, without blocking, when the interface queue is full.
+ */
+static int intf_socketcan_write(intf_t *intf, can_message_t *msgs, int count)
+{
+	assert(intf && msgs);
+
+	can_frame frames[INTF_READ_BATCH];
+	iovec iovs[INTF_READ_BATCH];
+	mmsghdr hdrs[INTF_READ_BATCH];
+
+	int sent = 0;
+
+	while(sent < count) {
+		int batch = count - sent;
+		if(batch > INTF_READ_BATCH)
+			batch = INTF_READ_BATCH;
+
+		memset(frames, 0, sizeof(can_frame) * batch);
+		memset(hdrs, 0, sizeof(mmsghdr) * batch);
+
+		for(int i = 0; i < batch; i++) {
+			can_message_t *msg = &msgs[sent + i];
+
+			frames[i].can_id = msg->id;
+			if(msg->type & mt_extended)
+				frames[i].can_id |= CAN_EFF_FLAG;
+			if(msg->type & mt_rtr)
+				frames[i].can_id |= CAN_RTR_FLAG;
+
+			frames[i].can_dlc = msg->len;
+
+			for(int j = 0; j < 8; j++)
+				frames[i].data[j] = msg->data[j];
+
+			iovs[i].iov_base = &frames[i];
+			iovs[i].iov_len = sizeof(can_frame);
+			hdrs[i].msg_hdr.msg_iov = &iovs[i];
+			hdrs[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		int result = sendmmsg(intf->fd, hdrs, batch, MSG_DONTWAIT);
+
+		if(result == -1) {
+			if(errno == EINTR)
+				continue;
+
+			// Transmit queue of the network interface is full, the
+			// socket stays writable while the queue discipline is
+			// full (ENOBUFS), so the interface retries from a timer
+			if(errno == ENOBUFS)
+				intf->tx_retry = true;
+			if(errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS)
+				break;
+
+			syslog(LOG_ALERT, "%s() could not send message: %s", __FUNCTION__, strerror(errno));
+			return -1;
+		}
+
+		sent += result;
+	}
+
+	return sent;
+}
+
+
+/**
+ * Install a CAN_RAW_FILTER that matches standard frames
+ * with the given identifiers, data frames and remote requests alike.
+ */
+static int intf_socketcan_set_filter(intf_t *intf, const uint16_t *ids, int count)
+{
+	assert(intf && ids);
+
+	if(count > CAN_RAW_FILTER_MAX)
+		return -1;
+
+	can_filter filters[CAN_RAW_FILTER_MAX];
+
+	for(int i = 0; i < count; i++) {
+		filters[i].can_id = ids[i];
+		filters[i].can_mask = CAN_EFF_FLAG | CAN_SFF_MASK;
+	}
+
+	if(setsockopt(intf->fd, SOL_CAN_RAW, CAN_RAW_FILTER, filters, sizeof(can_filter) * count) == -1) {
+		syslog(LOG_ERR, "%s() could not set filter: %s", __FUNCTION__, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+
+const intf_backend_t intf_backend_socketcan = {
+	"socketcan",
+	intf_socketcan_open,
+	intf_socketcan_close,
+	intf_socketcan_read,
+	intf_socketcan_write,
+	intf_socketcan_set_filter
+};
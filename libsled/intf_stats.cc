@@ -0,0 +1,319 @@
+
+#include "interface.h"
+#include "interface_internal.h"
+
+#include <assert.h>
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+
+/**
+ * Estimate number of bits a frame occupies on the bus.
+ *
+ * Includes start-of-frame, arbitration, control, CRC, acknowledge,
+ * end-of-frame and interframe space, plus worst-case bit stuffing.
+ */
+static int intf_frame_bits(can_message_t *msg)
+{
+	int payload = (msg->type & mt_rtr) ? 0 : 8 * msg->len;
+
+	if(msg->type & mt_extended)
+		return 67 + payload + (54 + payload - 1) / 4;
+
+	return 47 + payload + (34 + payload - 1) / 4;
+}
+
+
+/**
+ * Histogram bin of an interval (s), see INTF_HISTOGRAM_BASE.
+ */
+int intf_histogram_bin(double interval)
+{
+	double us = interval * 1000.0 * 1000.0;
+
+	if(us < INTF_HISTOGRAM_BASE)
+		return 0;
+
+	int bin = int(4.0 * log2(us / INTF_HISTOGRAM_BASE));
+
+	if(bin >= INTF_HISTOGRAM_BINS)
+		return INTF_HISTOGRAM_BINS - 1;
+
+	return bin;
+}
+
+
+void intf_stats_init(intf_t *intf)
+{
+	for(int i = 0; i < INTF_NUM_COB_IDS; i++)
+		intf->cob_stats[i] = NULL;
+
+	memset(&intf->bus_stats, 0, sizeof(intf_bus_stats_t));
+	intf->load_window_start = intf_get_time();
+	intf->load_window_bits = 0;
+
+	intf->untrusted_stamps = 0;
+	intf->untrusted_stamps_base = 0;
+}
+
+
+static uint64_t intf_get_untrusted_stamps(intf_t *intf)
+{
+	return __atomic_load_n(&intf->untrusted_stamps, __ATOMIC_RELAXED) - intf->untrusted_stamps_base;
+}
+
+
+void intf_stats_destroy(intf_t *intf)
+{
+	for(int i = 0; i < INTF_NUM_COB_IDS; i++) {
+		delete intf->cob_stats[i];
+		intf->cob_stats[i] = NULL;
+	}
+}
+
+
+/**
+ * Account for a frame sent or received.
+ *
+ * @param intf  Interface.
+ * @param msg  Frame, time should be set.
+ * @param direction  INTF_TRACE_RX or INTF_TRACE_TX.
+ */
+void intf_stats_update(intf_t *intf, can_message_t *msg, uint8_t direction)
+{
+	int bits = intf_frame_bits(msg);
+
+	// Bus load
+	intf_bus_stats_t *bus = &intf->bus_stats;
+	bus->frames++;
+	bus->bits += bits;
+
+	double elapsed = msg->time - intf->load_window_start;
+
+	if(elapsed >= INTF_LOAD_WINDOW) {
+		bus->load = double(intf->load_window_bits) / (elapsed * INTF_BITRATE);
+		if(bus->load > bus->peak_load)
+			bus->peak_load = bus->load;
+
+		intf->load_window_start = msg->time;
+		intf->load_window_bits = 0;
+	}
+
+	intf->load_window_bits += bits;
+
+	// Per COB-ID
+	uint16_t cob_id = msg->id & (INTF_NUM_COB_IDS - 1);
+	intf_cob_stats_t *stats = intf->cob_stats[cob_id];
+
+	if(!stats) {
+		stats = new intf_cob_stats_t();
+		intf->cob_stats[cob_id] = stats;
+	}
+
+	stats->bits += bits;
+
+	if(direction == INTF_TRACE_TX) {
+		stats->tx_frames++;
+		return;
+	}
+
+	if(stats->rx_frames++ > 0) {
+		double interval = msg->time - stats->last_time;
+
+		if(stats->intervals == 0 || interval < stats->min_interval)
+			stats->min_interval = interval;
+		if(interval > stats->max_interval)
+			stats->max_interval = interval;
+
+		stats->intervals++;
+		stats->sum_interval += interval;
+		stats->sum_sq_interval += interval * interval;
+		stats->histogram[intf_histogram_bin(interval)]++;
+	}
+
+	stats->last_time = msg->time;
+}
+
+
+/**
+ * Retrieve bus load and frame count.
+ */
+void intf_get_bus_stats(intf_t *intf, intf_bus_stats_t *stats)
+{
+	assert(intf && stats);
+	*stats = intf->bus_stats;
+	stats->untrusted_stamps = intf_get_untrusted_stamps(intf);
+}
+
+
+/**
+ * Retrieve statistics of a single COB-ID.
+ *
+ * @return Statistics or NULL when no frame has been seen.
+ */
+const intf_cob_stats_t *intf_get_cob_stats(intf_t *intf, uint16_t cob_id)
+{
+	assert(intf);
+
+	if(cob_id >= INTF_NUM_COB_IDS)
+		return NULL;
+
+	return intf->cob_stats[cob_id];
+}
+
+
+/**
+ * Clear all bus, filter, overrun, emergency, busy-poll and COB-ID statistics.
+ */
+void intf_reset_bus_stats(intf_t *intf)
+{
+	assert(intf);
+
+	for(int i = 0; i < INTF_NUM_COB_IDS; i++)
+		if(intf->cob_stats[i])
+			memset(intf->cob_stats[i], 0, sizeof(intf_cob_stats_t));
+
+	memset(&intf->bus_stats, 0, sizeof(intf_bus_stats_t));
+	intf->load_window_start = intf_get_time();
+	intf->load_window_bits = 0;
+	intf->untrusted_stamps_base = __atomic_load_n(&intf->untrusted_stamps, __ATOMIC_RELAXED);
+
+	memset(&intf->read_stats, 0, sizeof(intf_read_stats_t));
+
+	// Frames still queued are kept
+	intf->tx_stats.frames = 0;
+	intf->tx_stats.queued = 0;
+	intf->tx_stats.dropped = 0;
+	intf->tx_stats.max_depth = intf->tx_stats.depth;
+
+	intf->filter_stats.rejected = 0;
+	intf->filter_stats.unhandled = 0;
+
+	memset(&intf->overrun_stats, 0, sizeof(intf_overrun_stats_t));
+	memset(&intf->emcy_stats, 0, sizeof(intf_emcy_stats_t));
+
+	intf_poll_reset_stats(intf);
+}
+
+
+/**
+ * Write statistics as text, one line for the bus, one for read
+ * wakeups (frames dispatched per wakeup), one for the transmit
+ * queue, one for the acceptance filter, one for receive overruns,
+ * one for emergency messages by error code, one for busy polling
+ * and one for fault injection (when enabled) and one per COB-ID:
+ *
+ *   bus frames=12000 load=23.1% peak=30.2% untrusted_stamps=0
+ *   read wakeups=11800 empty=0 limited=0 frames=12000 max=3 limit=64
+ *   tx frames=2000 queued=12 dropped=0 depth=0 max_depth=3
+ *   filter active=1 ids=11 rejected=0 unhandled=0
+ *   overrun events=2 controller=0 queue=2 lost=17
+ *   emcy total=3 other=0 8611:2,ff07:1
+ *   poll cpu=3 loops=91000000 idle=90990000 frames=12000 dropped=0 wakeups=11800 depth=2 latency=3us max_latency=41us
+ *   fault delayed=11000 dropped=120 duplicated=0 corrupted=0 reordered=0 overruns=0 bus_off=0/0 max_delay=4210us
+ *   281 rx=10000 tx=0 mean=1000us sd=15us min=950us max=1090us hist=15:120,16:9879
+ *
+ * Histogram entries are bin:count, see INTF_HISTOGRAM_BASE.
+ *
+ * @return Number of characters written, excluding terminating null.
+ */
+int intf_format_bus_stats(intf_t *intf, char *buffer, int size)
+{
+	assert(intf && buffer && size > 0);
+
+	intf_bus_stats_t *bus = &intf->bus_stats;
+	int n = snprintf(buffer, size, "bus frames=%llu load=%.1f%% peak=%.1f%% untrusted_stamps=%llu",
+		(unsigned long long) bus->frames, bus->load * 100.0, bus->peak_load * 100.0,
+		(unsigned long long) intf_get_untrusted_stamps(intf));
+
+	intf_read_stats_t read;
+	intf_get_read_stats(intf, &read);
+	if(n < size)
+		n += snprintf(buffer + n, size - n, "\nread wakeups=%llu empty=%llu limited=%llu frames=%llu max=%d limit=%d",
+			(unsigned long long) read.wakeups, (unsigned long long) read.empty_wakeups,
+			(unsigned long long) read.limited_wakeups, (unsigned long long) read.frames,
+			read.max_frames, intf->read_limit);
+
+	intf_tx_stats_t tx;
+	intf_get_tx_stats(intf, &tx);
+	if(n < size)
+		n += snprintf(buffer + n, size - n, "\ntx frames=%llu queued=%llu dropped=%llu depth=%d max_depth=%d",
+			(unsigned long long) tx.frames, (unsigned long long) tx.queued,
+			(unsigned long long) tx.dropped, tx.depth, tx.max_depth);
+
+	intf_filter_stats_t filter;
+	intf_get_filter_stats(intf, &filter);
+	if(n < size)
+		n += snprintf(buffer + n, size - n, "\nfilter active=%d ids=%d rejected=%llu unhandled=%llu",
+			filter.active ? 1 : 0, filter.cob_ids,
+			(unsigned long long) filter.rejected, (unsigned long long) filter.unhandled);
+
+	intf_overrun_stats_t overrun;
+	intf_get_overrun_stats(intf, &overrun);
+	if(n < size)
+		n += snprintf(buffer + n, size - n, "\noverrun events=%llu controller=%llu queue=%llu lost=%llu",
+			(unsigned long long) overrun.events, (unsigned long long) overrun.controller,
+			(unsigned long long) overrun.queue, (unsigned long long) overrun.lost);
+
+	intf_emcy_stats_t emcy;
+	intf_get_emcy_stats(intf, &emcy);
+	if(n < size)
+		n += snprintf(buffer + n, size - n, "\nemcy total=%llu other=%llu",
+			(unsigned long long) emcy.total, (unsigned long long) emcy.other);
+
+	for(int i = 0; i < emcy.codes && n < size; i++)
+		n += snprintf(buffer + n, size - n, "%s%04x:%llu", i == 0 ? " " : ",",
+			emcy.counts[i].code, (unsigned long long) emcy.counts[i].count);
+
+	intf_poll_stats_t poll;
+	if(n < size && intf_get_poll_stats(intf, &poll) == 0)
+		n += snprintf(buffer + n, size - n, "\npoll cpu=%d loops=%llu idle=%llu frames=%llu dropped=%llu "
+			"wakeups=%llu depth=%d latency=%.0fus max_latency=%.0fus", poll.cpu,
+			(unsigned long long) poll.loops, (unsigned long long) poll.idle_loops,
+			(unsigned long long) poll.frames, (unsigned long long) poll.dropped,
+			(unsigned long long) poll.wakeups, poll.max_depth,
+			poll.mean_latency * 1e6, poll.max_latency * 1e6);
+
+	intf_fault_stats_t fault;
+	if(n < size && intf_get_fault_stats(intf, &fault) == 0)
+		n += snprintf(buffer + n, size - n, "\nfault delayed=%llu dropped=%llu duplicated=%llu "
+			"corrupted=%llu reordered=%llu overruns=%llu bus_off=%llu/%llu max_delay=%.0fus",
+			(unsigned long long) fault.delayed, (unsigned long long) fault.dropped,
+			(unsigned long long) fault.duplicated, (unsigned long long) fault.corrupted,
+			(unsigned long long) fault.reordered, (unsigned long long) fault.overruns,
+			(unsigned long long) fault.bus_off_events,
+			(unsigned long long) fault.bus_off_dropped, fault.max_delay * 1e6);
+
+	for(int i = 0; i < INTF_NUM_COB_IDS && n < size; i++) {
+		intf_cob_stats_t *stats = intf->cob_stats[i];
+
+		if(!stats || (stats->rx_frames == 0 && stats->tx_frames == 0))
+			continue;
+
+		n += snprintf(buffer + n, size - n, "\n%03x rx=%llu tx=%llu", i,
+			(unsigned long long) stats->rx_frames, (unsigned long long) stats->tx_frames);
+
+		if(stats->intervals == 0 || n >= size)
+			continue;
+
+		double mean = stats->sum_interval / stats->intervals;
+		double var = stats->sum_sq_interval / stats->intervals - mean * mean;
+
+		n += snprintf(buffer + n, size - n, " mean=%.0fus sd=%.0fus min=%.0fus max=%.0fus hist=",
+			mean * 1e6, sqrt(var > 0.0 ? var : 0.0) * 1e6,
+			stats->min_interval * 1e6, stats->max_interval * 1e6);
+
+		const char *separator = "";
+		for(int j = 0; j < INTF_HISTOGRAM_BINS && n < size; j++) {
+			if(stats->histogram[j] == 0)
+				continue;
+
+			n += snprintf(buffer + n, size - n, "%s%d:%u", separator, j, stats->histogram[j]);
+			separator = ",";
+		}
+	}
+
+	return n < size ? n : size - 1;
+}
@@ -0,0 +1,230 @@
+
+#include "interface.h"
+#include "interface_internal.h"
+
+#include <syslog.h>
+#include <assert.h>
+
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+
+
+/**
+ * Ring buffer holding the most recent frames.
+ *
+ * Slots are claimed using an atomic counter, such that recording
+ * never blocks and is safe from multiple threads. The sequence
+ * number is stored last and marks a record as complete.
+ */
+struct intf_trace_t {
+	intf_trace_record_t *records;
+	uint64_t head;
+	uint32_t size;
+};
+
+
+/**
+ * Allocate trace buffer.
+ *
+ * @param size  Number of records, must be a power of two.
+ * @return Trace buffer or NULL on failure.
+ */
+intf_trace_t *intf_trace_create(uint32_t size)
+{
+	assert(size > 0 && (size & (size - 1)) == 0);
+
+	intf_trace_t *trace = new intf_trace_t();
+	trace->records = new intf_trace_record_t[size];
+	trace->head = 0;
+	trace->size = size;
+
+	// Touch all pages now, not on the real-time path
+	memset(trace->records, 0, sizeof(intf_trace_record_t) * size);
+
+	return trace;
+}
+
+
+void intf_trace_destroy(intf_trace_t **trace)
+{
+	if(!*trace)
+		return;
+
+	delete[] (*trace)->records;
+	delete *trace;
+	*trace = NULL;
+}
+
+
+/**
+ * Store frame in the trace buffer.
+ *
+ * @param trace  Trace buffer.
+ * @param msg  Frame to store.
+ * @param direction  INTF_TRACE_RX or INTF_TRACE_TX.
+ */
+void intf_trace_record(intf_trace_t *trace, can_message_t *msg, uint8_t direction)
+{
+	uint64_t seq = __atomic_fetch_add(&trace->head, 1, __ATOMIC_RELAXED);
+	intf_trace_record_t *record = &(trace->records[seq & (trace->size - 1)]);
+
+	// Invalidate slot while it is being written
+	__atomic_store_n(&record->seq, ~uint64_t(0), __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	record->time = msg->time;
+	record->id = msg->id;
+	record->type = msg->type;
+	record->len = msg->len;
+	record->direction = direction;
+	memcpy(record->data, msg->data, 8);
+
+	__atomic_store_n(&record->seq, seq, __ATOMIC_RELEASE);
+}
+
+
+/**
+ * Write trace file header.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+static int intf_trace_write_header(FILE *file)
+{
+	intf_trace_header_t header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, INTF_TRACE_MAGIC, sizeof(header.magic));
+	header.version = INTF_TRACE_VERSION;
+	header.record_size = sizeof(intf_trace_record_t);
+
+	return fwrite(&header, sizeof(header), 1, file) == 1 ? 0 : -1;
+}
+
+
+/**
+ * Write contents of the trace buffer to a file, oldest frame first.
+ *
+ * @param trace  Trace buffer.
+ * @param filename  File to write to.
+ * @return Number of records written or -1 on failure.
+ */
+int intf_trace_dump(intf_trace_t *trace, const char *filename)
+{
+	assert(trace && filename);
+
+	FILE *file = fopen(filename, "wb");
+
+	if(!file) {
+		syslog(LOG_ERR, "%s() could not open %s: %s", __FUNCTION__, filename, strerror(errno));
+		return -1;
+	}
+
+	intf_trace_write_header(file);
+
+	uint64_t head = __atomic_load_n(&trace->head, __ATOMIC_ACQUIRE);
+	uint64_t first = head > trace->size ? head - trace->size : 0;
+	int count = 0;
+
+	for(uint64_t seq = first; seq < head; seq++) {
+		intf_trace_record_t *slot = &(trace->records[seq & (trace->size - 1)]);
+
+		if(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != seq)
+			continue;
+
+		intf_trace_record_t record = *slot;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+		// Overwritten while copying
+		if(__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq)
+			continue;
+
+		fwrite(&record, sizeof(record), 1, file);
+		count++;
+	}
+
+	if(fclose(file) != 0) {
+		syslog(LOG_ERR, "%s() could not write %s: %s", __FUNCTION__, filename, strerror(errno));
+		return -1;
+	}
+
+	return count;
+}
+
+
+/**
+ * Start writing all frames to a capture file.
+ *
+ * The file uses the trace format and can be
+ * replayed by opening device replay:<filename>.
+ *
+ * @param intf  Interface.
+ * @param filename  File to write to.
+ * @return 0 on success, -1 on failure.
+ */
+int intf_start_capture(intf_t *intf, const char *filename)
+{
+	assert(intf && filename);
+
+	intf_stop_capture(intf);
+
+	FILE *file = fopen(filename, "wb");
+
+	if(!file || intf_trace_write_header(file) == -1) {
+		syslog(LOG_ERR, "%s() could not open %s: %s", __FUNCTION__, filename, strerror(errno));
+		if(file)
+			fclose(file);
+		return -1;
+	}
+
+	// Buffer many frames between writes
+	setvbuf(file, NULL, _IOFBF, INTF_CAPTURE_BUFFER);
+
+	intf->capture = file;
+	intf->capture_seq = 0;
+
+	syslog(LOG_NOTICE, "%s() capturing frames to %s", __FUNCTION__, filename);
+
+	return 0;
+}
+
+
+/**
+ * Stop capturing and close capture file.
+ */
+int intf_stop_capture(intf_t *intf)
+{
+	assert(intf);
+
+	if(!intf->capture)
+		return 0;
+
+	int result = fclose(intf->capture);
+	intf->capture = NULL;
+
+	syslog(LOG_NOTICE, "%s() captured %llu frames", __FUNCTION__,
+		(unsigned long long) intf->capture_seq);
+
+	return result == 0 ? 0 : -1;
+}
+
+
+/**
+ * Append frame to capture file.
+ */
+void intf_capture_record(intf_t *intf, can_message_t *msg, uint8_t direction)
+{
+	intf_trace_record_t record;
+	record.seq = intf->capture_seq++;
+	record.time = msg->time;
+	record.id = msg->id;
+	record.type = msg->type;
+	record.len = msg->len;
+	record.direction = direction;
+	memset(record.reserved, 0, sizeof(record.reserved));
+	memcpy(record.data, msg->data, 8);
+
+	if(fwrite(&record, sizeof(record), 1, intf->capture) != 1) {
+		syslog(LOG_ERR, "%s() writing capture failed: %s", __FUNCTION__, strerror(errno));
+		intf_stop_capture(intf);
+	}
+}
@@ -56,7 +56,8 @@ struct MACHINE_TYPE {
 	} \
 	void CONCAT(PREFIX, _destroy)(MACHINE_TYPE **machine) \
 	{ \
-		free(*machine); \
+		CONCAT(PREFIX, _on_destroy)(*machine); \
+		delete *machine; \
 		*machine = NULL; \
 	} \
 	STATE_TYPE CONCAT(PREFIX, _active_state)(MACHINE_TYPE *machine) \
@@ -42,7 +42,8 @@ struct MACHINE_TYPE;
 	void CONCAT(PREFIX, _set_callback_payload)(MACHINE_TYPE *machine, void *payload); \
 	STATE_TYPE CONCAT(PREFIX, _next_state_given_event)(MACHINE_TYPE *machine, EVENT_TYPE event); \
 	void CONCAT(PREFIX, _on_enter)(MACHINE_TYPE *machine); \
-	void CONCAT(PREFIX, _on_exit)(MACHINE_TYPE *machine);
+	void CONCAT(PREFIX, _on_exit)(MACHINE_TYPE *machine); \
+	void CONCAT(PREFIX, _on_destroy)(MACHINE_TYPE *machine);
 
 #define BEGIN_FIELDS \
 	MACHINE_TYPE *CONCAT(PREFIX, _create)(
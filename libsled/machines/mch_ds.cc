@@ -161,3 +161,8 @@ void mch_ds_on_exit(mch_ds_t *machine)
 			break;
 	}
 }
+
+
+void mch_ds_on_destroy(mch_ds_t *machine)
+{
+}
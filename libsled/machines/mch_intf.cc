@@ -1,26 +1,47 @@
-
 #include "../interface.h"
 
 #include "mch_intf.h"
 
+#include <event2/event.h>
+
 #include <stdlib.h>
 #include <stdio.h>
+#include <time.h>
 
 #define MACHINE_FILE() "mch_intf_def.h"
 #include "machine_body.h"
 
 
+static double get_time()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return double(ts.tv_sec) + double(ts.tv_nsec) / 1000.0 / 1000.0 / 1000.0;
+}
+
+
+static void mch_intf_on_recover_timer(evutil_socket_t fd, short events, void *machine_v)
+{
+	mch_intf_t *machine = (mch_intf_t *) machine_v;
+	mch_intf_handle_event(machine, EV_INTF_OPEN);
+}
+
+
 mch_intf_state_t mch_intf_next_state_given_event(mch_intf_t *machine, mch_intf_event_t event)
 {
   switch(machine->state) {
     case ST_INTF_CLOSED:      
       if(event == EV_INTF_OPEN)
 				return ST_INTF_OPENING;      
+			if(event == EV_INTF_RECOVER)
+				return ST_INTF_RECOVERING;
       break;
       
     case ST_INTF_OPENING:
       if(event == EV_INTF_OPENED)
 				return ST_INTF_OPENED;
+			if(event == EV_INTF_CLOSED)
+				return ST_INTF_RECOVERING;
       break;
     
     case ST_INTF_CLOSING:
@@ -32,16 +53,53 @@ mch_intf_state_t mch_intf_next_state_given_event(mch_intf_t *machine, mch_intf_e
       if(event == EV_INTF_CLOSE)
 				return ST_INTF_CLOSING;
       break;      
+
+		case ST_INTF_RECOVERING:
+			if(event == EV_INTF_OPEN)
+				return ST_INTF_OPENING;
+			break;
   }
   
   return machine->state;
 }
 
 
+/**
+ * Wait before the next attempt to open the interface,
+ * the delay is doubled after every failed attempt.
+ */
+static void mch_intf_schedule_recovery(mch_intf_t *machine)
+{
+	if(!machine->recover)
+		return;
+
+	if(machine->down_since < 0.0)
+		machine->down_since = get_time();
+
+	if(!machine->recover_timer)
+		machine->recover_timer = evtimer_new(machine->ev_base,
+			mch_intf_on_recover_timer, (void *) machine);
+
+	timeval timeout;
+	timeout.tv_sec = long(machine->backoff);
+	timeout.tv_usec = long((machine->backoff - timeout.tv_sec) * 1000.0 * 1000.0);
+
+	evtimer_add(machine->recover_timer, &timeout);
+
+	syslog(LOG_NOTICE, "%s() reopening interface in %.1f s", __FUNCTION__, machine->backoff);
+
+	machine->backoff *= 2.0;
+	if(machine->backoff > MCH_INTF_BACKOFF_MAX)
+		machine->backoff = MCH_INTF_BACKOFF_MAX;
+}
+
+
 void mch_intf_on_enter(mch_intf_t *machine)
 {
   switch(machine->state) {
     case ST_INTF_OPENING:
+			machine->attempts++;
+
       if(intf_open(machine->interface) != 0)
 				mch_intf_handle_event(machine, EV_INTF_CLOSED);
       else
@@ -49,11 +107,23 @@ void mch_intf_on_enter(mch_intf_t *machine)
       break;
       
     case ST_INTF_CLOSING:
+			if(machine->down_since < 0.0)
+				machine->down_since = get_time();
+
       intf_close(machine->interface);
       mch_intf_handle_event(machine, EV_INTF_CLOSED);
       break;
 
 		case ST_INTF_OPENED:
+			if(machine->down_since >= 0.0) {
+				syslog(LOG_NOTICE, "%s() interface reopened after %.2f s and %u attempts",
+					__FUNCTION__, get_time() - machine->down_since, machine->attempts);
+			}
+
+			machine->down_since = -1.0;
+			machine->attempts = 0;
+			machine->backoff = MCH_INTF_BACKOFF_MIN;
+
 			if(machine->opened_handler)
 				machine->opened_handler(machine, machine->payload);
 			break;
@@ -61,6 +131,13 @@ void mch_intf_on_enter(mch_intf_t *machine)
 		case ST_INTF_CLOSED:
 			if(machine->closed_handler)
 				machine->closed_handler(machine, machine->payload);
+
+			// Interface failed, try to get it back
+			mch_intf_handle_event(machine, EV_INTF_RECOVER);
+			break;
+
+		case ST_INTF_RECOVERING:
+			mch_intf_schedule_recovery(machine);
 			break;
 	 }
 }
@@ -70,3 +147,27 @@ void mch_intf_on_exit(mch_intf_t *machine)
 {
 }
 
+
+/**
+ * Cancel a pending attempt to reopen the interface.
+ */
+void mch_intf_on_destroy(mch_intf_t *machine)
+{
+	mch_intf_disable_recovery(machine);
+}
+
+
+/**
+ * Stop reopening the interface after it fails, e.g. before
+ * the interface is destroyed. A pending attempt is cancelled.
+ */
+void mch_intf_disable_recovery(mch_intf_t *machine)
+{
+	machine->recover = false;
+
+	if(machine->recover_timer) {
+		event_del(machine->recover_timer);
+		event_free(machine->recover_timer);
+		machine->recover_timer = NULL;
+	}
+}
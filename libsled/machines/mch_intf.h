@@ -6,7 +6,19 @@
 // Define machine prefix
 #define PREFIX mch_intf
 
+/**
+ * Delay before reopening a failed interface, doubled after
+ * every failed attempt up to the maximum (s).
+ */
+#define MCH_INTF_BACKOFF_MIN 0.1
+#define MCH_INTF_BACKOFF_MAX 3.2
+
+struct event_base;
+struct event;
+
 #include "machine_header.h"
 #include "mch_intf_def.h"
 
+void mch_intf_disable_recovery(mch_intf_t *machine);
+
 #endif
@@ -7,6 +7,7 @@ BEGIN_STATES
 	STATE(ST_INTF_OPENED)
 	STATE(ST_INTF_OPENING)
 	STATE(ST_INTF_CLOSING)
+	STATE(ST_INTF_RECOVERING)
 END_STATES
 
 BEGIN_EVENTS
@@ -14,6 +15,7 @@ BEGIN_EVENTS
 	EVENT(EV_INTF_CLOSE)
 	EVENT(EV_INTF_OPENED)
 	EVENT(EV_INTF_CLOSED)
+	EVENT(EV_INTF_RECOVER)		// Internal, reopen after a delay
 END_EVENTS
 
 BEGIN_CALLBACKS
@@ -22,7 +24,24 @@ BEGIN_CALLBACKS
 END_CALLBACKS
 
 BEGIN_FIELDS
+	FIELD(event_base *, ev_base)
 	FIELD(intf_t *, interface)
+
+	// Reopen timer and current delay (s)
+	FIELD_DECL(event *, recover_timer)
+	FIELD_DECL(double, backoff)
+	FIELD_DECL(bool, recover)
+
+	// Time the interface failed, negative while open
+	FIELD_DECL(double, down_since)
+	FIELD_DECL(uint32_t, attempts)
+
+	FIELD_INIT(recover_timer, NULL)
+	FIELD_INIT(backoff, MCH_INTF_BACKOFF_MIN)
+	FIELD_INIT(recover, true)
+	FIELD_INIT(down_since, -1.0)
+	FIELD_INIT(attempts, 0)
 END_FIELDS
 
 GENERATE_DEFAULT_FUNCTIONS
+
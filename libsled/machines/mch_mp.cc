@@ -11,7 +11,7 @@
 
 void mch_mp_send_mode_switch(mch_mp_t *machine, uint8_t mode)
 {
-	mch_sdo_queue_write(machine->mch_sdo, 0x6060, 0x00, mode, 0x01);
+	mch_sdo_queue_write(machine->mch_sdo, OB_MODES_OF_OPERATION, 0x00, mode, 0x01);
 }
 
 
@@ -145,3 +145,8 @@ void mch_mp_on_exit(mch_mp_t *machine)
 	}
 }
 
+
+void mch_mp_on_destroy(mch_mp_t *machine)
+{
+}
+
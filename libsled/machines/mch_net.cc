@@ -1,76 +1,130 @@
 
 #include "../interface.h"
+#include "../pdo.h"
 #include "mch_net.h"
 #include "mch_sdo.h"
+#include "mch_sdo_await.h"
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <syslog.h>
 
 #define MACHINE_FILE() "mch_net_def.h"
 #include "machine_body.h"
 
 
-void mch_net_sdo_abort_callback(void *data, uint16_t index, uint8_t subindex, uint32_t abort)
+#define WRITE(index, subindex, value, size) \
+	mch_sdo_batch_write(&batch, index, subindex, value, size);
+
+/**
+ * Whether the drive is known to hold a TPDO mapping already,
+ * i.e. it was written since the drive last reset.
+ */
+static bool mch_net_holds_mapping(mch_sdo_t *mch_sdo, uint16_t index, const pdo_mapping_t *mapping)
 {
-	fprintf(stderr, "Error while uploading configuration (SDO index %04x:%02x abort code %04x).\n", index, subindex, abort);
-	exit(1);
-}
+	if(!mch_sdo_shadow_holds(mch_sdo, index, 0x00, mapping->count, 0x01))
+		return false;
 
+	for(int j = 0; j < mapping->count; j++)
+		if(!mch_sdo_shadow_holds(mch_sdo, index, j + 1, pdo_mapping_entry(mapping->objects[j]), 0x04))
+			return false;
 
-void mch_net_sdo_write_callback(void *data, uint16_t index, uint8_t subindex)
-{
-	mch_net_t *machine = (mch_net_t *) data;
-	mch_net_handle_event(machine, EV_NET_UPLOAD_COMPLETE);
+	return true;
 }
 
 
-#define ENQUEUE(final, index, subindex, value, size) \
-	mch_sdo_queue_write_with_cb( \
-		mch_sdo, index, subindex, value, size, \
-		final?mch_net_sdo_write_callback:NULL, mch_net_sdo_abort_callback, (void *) mch_net);
-
 /**
- * Enqueue controller configuration for transmission.
+ * Upload controller configuration.
+ *
+ * TPDOs are configured according to pdo_tpdo_mapping, which
+ * is also used to decode them. Writes of values the drive still
+ * holds are skipped by the SDO machine (see mch_sdo_shadowable),
+ * such that setting up the drive again after a short interruption
+ * takes few or no SDOs.
+ *
+ * All writes are queued at once and awaited together, the order
+ * within the queue keeps the mapping disabled while it changes.
+ * When a write fails (e.g. it timed out on a faulty bus) the
+ * upload fails, the node is then set up again from scratch.
  *
  * @param mch_sdo  SDO state machine that owns the queue.
  */
-void mch_net_queue_setup(mch_net_t *mch_net, mch_sdo_t *mch_sdo)
+static sdo_sequence_t mch_net_setup(mch_net_t *mch_net, mch_sdo_t *mch_sdo)
 {
-	// Setup TPDO1
-	ENQUEUE(0, 0x1A00, 0x00, 0x00, 0x01);
-	ENQUEUE(0, 0x1A00, 0x01, 0x60410010, 0x04);	// Status word
-	ENQUEUE(0, 0x1A00, 0x02, 0x60610008, 0x04);	// Mode of operation
-	ENQUEUE(0, 0x1A00, 0x00, 0x02, 0x01);
-
-	ENQUEUE(0, 0x1800, 0x01, 0x40000181, 0x04);
-	ENQUEUE(0, 0x1800, 0x02, 0xFF, 0x01);			// Event triggered
-	ENQUEUE(0, 0x1800, 0x03, 0x0A, 0x02);			// Inhibit timer
-	ENQUEUE(0, 0x1800, 0x05, 0x0A, 0x02);			// Event timer
-
-	// Setup TPDO2
-	ENQUEUE(0, 0x1A01, 0x00, 0x00, 0x01);
-	ENQUEUE(0, 0x1A01, 0x01, 0x60640020, 0x04);	// Position
-	ENQUEUE(0, 0x1A01, 0x02, 0x606C0020, 0x04);	// Velocity
-	ENQUEUE(0, 0x1A01, 0x00, 0x02, 0x01);
-
-	ENQUEUE(0, 0x1801, 0x01, 0x40000281, 0x04);
-	ENQUEUE(0, 0x1801, 0x02, 0xFF, 0x01);			// On change (should be sync or timer?)
-	ENQUEUE(0, 0x1801, 0x03, 0x0A, 0x02);
-	ENQUEUE(0, 0x1801, 0x05, 0x0A, 0x02);
+	sdo_batch_t batch(mch_sdo);
+
+	// TPDOs are transmitted on the pre-defined COB-IDs of the node
+	uint32_t node = mch_net->node;
+
+	for(int i = 0; i < INTF_NUM_TPDOS; i++) {
+		const pdo_mapping_t *mapping = &pdo_tpdo_mapping[i];
+		uint32_t cob_id = 0x40000180 + 0x100 * i + node;
+
+		// Mapping can only be changed while it has no entries
+		if(!mch_net_holds_mapping(mch_sdo, 0x1A00 + i, mapping)) {
+			WRITE(0x1A00 + i, 0x00, 0x00, 0x01);
+
+			for(int j = 0; j < mapping->count; j++)
+				WRITE(0x1A00 + i, j + 1, pdo_mapping_entry(mapping->objects[j]), 0x04);
+
+			if(mapping->count > 0)
+				WRITE(0x1A00 + i, 0x00, mapping->count, 0x01);
+		}
+
+		if(mapping->count == 0) {
+			WRITE(0x1800 + i, 0x01, 0x80000000 | cob_id, 0x04);	// Disabled
+			continue;
+		}
+
+		WRITE(0x1800 + i, 0x01, cob_id, 0x04);
+		WRITE(0x1800 + i, 0x02, mapping->transmission_type, 0x01);
+		WRITE(0x1800 + i, 0x03, mapping->inhibit_time, 0x02);		// Inhibit timer
+		WRITE(0x1800 + i, 0x05, mapping->event_timer, 0x02);		// Event timer
+	}
 
 	// Setup RPDO2 for IP mode
-	ENQUEUE(0, 0x1601, 0x00, 0x00, 0x01);
-	ENQUEUE(0, 0x1601, 0x01, 0x60C10120, 0x04);
-	ENQUEUE(0, 0x1601, 0x00, 0x01, 0x01);
-
-	ENQUEUE(0, 0x1401, 0x02, 0x01, 0x01);			// Every sync
-
-	// Disable TPDO 3 and 4
-	ENQUEUE(0, 0x1A02, 0x00, 0x00, 0x01);
-	ENQUEUE(0, 0x1802, 0x01, 0x40000381, 0x04);
-	
-	ENQUEUE(0, 0x1A03, 0x00, 0x00, 0x01);
-	ENQUEUE(1, 0x1803, 0x01, 0x40000481, 0x04);
+	if(!mch_sdo_shadow_holds(mch_sdo, 0x1601, 0x00, 0x01, 0x01) ||
+		!mch_sdo_shadow_holds(mch_sdo, 0x1601, 0x01, 0x60C10120, 0x04)) {
+		WRITE(0x1601, 0x00, 0x00, 0x01);
+		WRITE(0x1601, 0x01, 0x60C10120, 0x04);
+		WRITE(0x1601, 0x00, 0x01, 0x01);
+	}
+
+	WRITE(0x1401, 0x02, 0x01, 0x01);			// Every sync
+
+	if(!co_await batch) {
+		const sdo_step_t *step = &batch.steps[batch.failed];
+
+		syslog(LOG_ERR, "%s() error while uploading configuration (SDO index %04x:%02x abort code %04x)",
+			__FUNCTION__, step->index, step->subindex, step->abort_code);
+
+		mch_net->setup_failed = true;
+		co_return;
+	}
+
+	const sdo_step_t *slowest = mch_sdo_batch_slowest(&batch);
+
+	syslog(LOG_INFO, "%s() configuration of %d objects uploaded, slowest %04x:%02x took %.1f ms",
+		__FUNCTION__, int(batch.steps.size()), slowest->index, slowest->subindex, slowest->latency * 1e3);
+}
+
+
+static void mch_net_on_setup_done(void *data)
+{
+	mch_net_t *machine = (mch_net_t *) data;
+	mch_net_handle_event(machine, machine->setup_failed ? EV_NET_UPLOAD_FAILED : EV_NET_UPLOAD_COMPLETE);
+}
+
+
+/**
+ * Start uploading the configuration, an upload that is still
+ * in progress is abandoned.
+ */
+void mch_net_queue_setup(mch_net_t *mch_net, mch_sdo_t *mch_sdo)
+{
+	mch_net->setup_failed = false;
+	mch_net->setup = mch_net_setup(mch_net, mch_sdo);
+	mch_sdo_sequence_start(&mch_net->setup, mch_net_on_setup_done, (void *) mch_net);
 }
 
 
@@ -110,6 +164,8 @@ mch_net_state_t mch_net_next_state_given_event(mch_net_t *machine, mch_net_event
 				return ST_NET_DISABLED;
 			if(event == EV_NET_UPLOAD_COMPLETE)
 				return ST_NET_STARTREMOTENODE;
+			if(event == EV_NET_UPLOAD_FAILED)
+				return ST_NET_UNKNOWN;
 			if(event == EV_NET_STOPPED)
 				return ST_NET_UNKNOWN;
 			if(event == EV_NET_WATCHDOG_FAILED)
@@ -132,6 +188,8 @@ mch_net_state_t mch_net_next_state_given_event(mch_net_t *machine, mch_net_event
 				return ST_NET_DISABLED;
 			if(event == EV_NET_UPLOAD_COMPLETE)
 				return ST_NET_STARTREMOTENODE;
+			if(event == EV_NET_UPLOAD_FAILED)
+				return ST_NET_UNKNOWN;
 			break;
 
 		case ST_NET_STARTREMOTENODE:
@@ -164,7 +222,7 @@ void mch_net_on_enter(mch_net_t *machine)
 		case ST_NET_UNKNOWN:
 			if(machine->sdos_disabled_handler)
 				machine->sdos_disabled_handler(machine, machine->payload);
-			intf_send_nmt_command(machine->interface, NMT_ENTERPREOPERATIONAL);
+			intf_send_nmt_command(machine->interface, machine->node, NMT_ENTERPREOPERATIONAL);
 			break;
 
 		case ST_NET_STOPPED:
@@ -172,11 +230,11 @@ void mch_net_on_enter(mch_net_t *machine)
 				machine->sdos_disabled_handler(machine, machine->payload);
 
 		case ST_NET_STARTREMOTENODE:
-			intf_send_nmt_command(machine->interface, NMT_STARTREMOTENODE);
+			intf_send_nmt_command(machine->interface, machine->node, NMT_STARTREMOTENODE);
 			break;
 
 		case ST_NET_ENTERPREOPERATIONAL:
-			intf_send_nmt_command(machine->interface, NMT_ENTERPREOPERATIONAL);
+			intf_send_nmt_command(machine->interface, machine->node, NMT_ENTERPREOPERATIONAL);
 			break;
 
 		case ST_NET_UPLOADCONFIG:
@@ -210,3 +268,13 @@ void mch_net_on_exit(mch_net_t *machine)
 			break;
 	}
 }
+
+
+/**
+ * Abandon an upload in progress, which forgets the callbacks of its
+ * requests. The SDO machine must still exist.
+ */
+void mch_net_on_destroy(mch_net_t *machine)
+{
+	machine->setup = sdo_sequence_t();
+}
@@ -2,6 +2,7 @@
 #define __MCH_NET_H__
 
 #include "mch_sdo.h"
+#include "mch_sdo_await.h"
 
 #undef PREFIX
 
@@ -31,7 +31,14 @@ END_STATES
 
 BEGIN_FIELDS
 	FIELD(intf_t *, interface)
+	FIELD(uint8_t, node)
 	FIELD(mch_sdo_t *, mch_sdo)
+
+	// Configuration upload in progress (see mch_net_queue_setup)
+	FIELD_DECL(sdo_sequence_t, setup)
+	FIELD_DECL(bool, setup_failed)
+
+	FIELD_INIT(setup_failed, false)
 END_FIELDS
 
 BEGIN_CALLBACKS
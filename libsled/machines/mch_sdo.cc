@@ -2,11 +2,26 @@
 #include "../interface.h"
 #include "mch_sdo.h"
 
+#include <event2/event.h>
+
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+
+#include <map>
+#include <vector>
 
-#include <queue>
+
+struct sdo_callbacks_t {
+	void *data;
+	sdo_abort_callback_t abort_callback;
+	sdo_write_callback_t write_callback;
+	sdo_read_callback_t read_callback;
+	sdo_transfer_callback_t transfer_callback;
+};
 
 
 struct sdo_t {
@@ -16,20 +31,413 @@ struct sdo_t {
 	uint32_t value;
 	uint8_t size;
 
-	void *data;
-	sdo_abort_callback_t abort_callback;
-	sdo_write_callback_t write_callback;
-	sdo_read_callback_t read_callback;
+	// Segmented or block transfer of length bytes, is_write
+	// for downloads. The buffer is owned by the caller.
+	bool is_transfer;
+	bool block;
+	uint8_t *buffer;
+	uint32_t length;
+
+	// Callbacks of every write merged into this one, oldest first
+	sdo_callbacks_t callbacks[MCH_SDO_CALLBACKS];
+	int num_callbacks;
+
+	// Last time the request was sent and how often
+	double sent;
+	int attempts;
+
+	// Class, time queued and deadline (s)
+	int sdo_class;
+	double queued;
+	double deadline;
+
+	// Next request in the class or free list
+	sdo_t *next;
 };
 
 
+struct sdo_class_queue_t {
+	sdo_t *head;
+	sdo_t *tail;
+	mch_sdo_class_stats_t stats;
+};
+
+typedef sdo_class_queue_t sdo_class_queues_t[MCH_SDO_CLASSES];
+typedef std::map<uint16_t, mch_sdo_rtt_stats_t> rtt_stats_map_t;
+
+
+struct shadow_entry_t {
+	bool valid;
+	uint32_t value;
+	uint8_t size;
+};
+
+typedef std::map<uint32_t, shadow_entry_t> shadow_map_t;
+
+static sdo_t *mch_sdo_init_pool(mch_sdo_t *machine);
+
+
 #define MACHINE_FILE() "mch_sdo_def.h"
 #include "machine_body.h"
 
 
+static double get_time()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return double(ts.tv_sec) + double(ts.tv_nsec) / 1000.0 / 1000.0 / 1000.0;
+}
+
+
+/**
+ * Link all requests into the free list and empty the class queues.
+ *
+ * @return First free request.
+ */
+static sdo_t *mch_sdo_init_pool(mch_sdo_t *machine)
+{
+	assert(machine->queue_size > 0);
+
+	for(int i = 0; i < machine->queue_size; i++)
+		machine->sdo_pool[i].next = (i + 1 < machine->queue_size) ? &machine->sdo_pool[i + 1] : NULL;
+
+	memset(&machine->sdo_classes, 0, sizeof(sdo_class_queues_t));
+
+	return &machine->sdo_pool[0];
+}
+
+
+/**
+ * Account for a request that completed, whether it was answered
+ * or not, against the deadline of its class.
+ */
+static void mch_sdo_record_deadline(mch_sdo_t *machine, sdo_t *sdo)
+{
+	mch_sdo_class_stats_t *stats = &machine->sdo_classes[sdo->sdo_class].stats;
+	stats->requests++;
+
+	double late = get_time() - sdo->deadline;
+
+	if(late > 0.0) {
+		stats->missed++;
+		if(late > stats->max_late)
+			stats->max_late = late;
+	}
+}
+
+
+/**
+ * Account for the response to the active request.
+ */
+static void mch_sdo_record_response(mch_sdo_t *machine, sdo_t *sdo)
+{
+	mch_sdo_record_deadline(machine, sdo);
+
+	mch_sdo_rtt_stats_t &stats = machine->rtt_stats[sdo->index];
+	stats.requests++;
+
+	if(sdo->attempts != 1)
+		return;
+
+	double rtt = get_time() - sdo->sent;
+
+	if(stats.samples == 0 || rtt < stats.min)
+		stats.min = rtt;
+	if(rtt > stats.max)
+		stats.max = rtt;
+
+	stats.samples++;
+	stats.sum += rtt;
+	stats.histogram[intf_histogram_bin(rtt)]++;
+}
+
+
+/**
+ * Invoke read, write or abort callbacks of a request, for writes
+ * that were merged the callbacks of each of them are invoked.
+ */
+static void mch_sdo_notify_read(sdo_t *sdo, uint32_t value)
+{
+	for(int i = 0; i < sdo->num_callbacks; i++)
+		if(sdo->callbacks[i].read_callback)
+			sdo->callbacks[i].read_callback(sdo->callbacks[i].data, sdo->index, sdo->subindex, value);
+}
+
+
+static void mch_sdo_notify_write(sdo_t *sdo)
+{
+	for(int i = 0; i < sdo->num_callbacks; i++)
+		if(sdo->callbacks[i].write_callback)
+			sdo->callbacks[i].write_callback(sdo->callbacks[i].data, sdo->index, sdo->subindex);
+}
+
+
+static void mch_sdo_notify_transfer(sdo_t *sdo, uint32_t length)
+{
+	for(int i = 0; i < sdo->num_callbacks; i++)
+		if(sdo->callbacks[i].transfer_callback)
+			sdo->callbacks[i].transfer_callback(sdo->callbacks[i].data, sdo->index, sdo->subindex, length);
+}
+
+
+static void mch_sdo_notify_abort(sdo_t *sdo, uint32_t code)
+{
+	for(int i = 0; i < sdo->num_callbacks; i++)
+		if(sdo->callbacks[i].abort_callback)
+			sdo->callbacks[i].abort_callback(sdo->callbacks[i].data, sdo->index, sdo->subindex, code);
+}
+
+
+/**
+ * Return request to the free list.
+ */
+static void mch_sdo_release(mch_sdo_t *machine, sdo_t *sdo)
+{
+	assert(machine->sdo_count > 0);
+
+	sdo->next = machine->sdo_free;
+	machine->sdo_free = sdo;
+	machine->sdo_count--;
+}
+
+
+/**
+ * Release the active request.
+ */
+static void mch_sdo_release_active(mch_sdo_t *machine)
+{
+	assert(machine->sdo_active);
+
+	sdo_t *sdo = machine->sdo_active;
+	machine->sdo_active = NULL;
+
+	mch_sdo_release(machine, sdo);
+}
+
+
+/**
+ * Take the next request to send. Of the first request of every
+ * class, the one with the earliest deadline is taken. A request
+ * cannot be sent before the requests queued ahead of it in its
+ * class, these therefore inherit its deadline when it is earlier.
+ */
+static sdo_t *mch_sdo_take_next(mch_sdo_t *machine)
+{
+	int best = -1;
+	double best_deadline = 0.0;
+
+	for(int i = 0; i < MCH_SDO_CLASSES; i++) {
+		sdo_t *sdo = machine->sdo_classes[i].head;
+
+		if(!sdo)
+			continue;
+
+		double deadline = sdo->deadline;
+		for(sdo = sdo->next; sdo; sdo = sdo->next)
+			if(sdo->deadline < deadline)
+				deadline = sdo->deadline;
+
+		if(best == -1 || deadline < best_deadline) {
+			best = i;
+			best_deadline = deadline;
+		}
+	}
+
+	assert(best != -1);
+
+	sdo_class_queue_t *queue = &machine->sdo_classes[best];
+	sdo_t *sdo = queue->head;
+
+	queue->head = sdo->next;
+	if(!queue->head)
+		queue->tail = NULL;
+
+	sdo->next = NULL;
+
+	double wait = get_time() - sdo->queued;
+	if(wait > queue->stats.max_wait)
+		queue->stats.max_wait = wait;
+
+	return sdo;
+}
+
+
+static uint32_t mch_sdo_key(uint16_t index, uint8_t subindex)
+{
+	return (uint32_t(index) << 8) | subindex;
+}
+
+
+/**
+ * Objects of motion task 0, which copying a
+ * task into task 0 changes (see OB_COPY_MOTION_TASK).
+ */
+static bool mch_sdo_is_task_register(uint16_t index)
+{
+	switch(index) {
+		case OB_O_P:
+		case OB_O_V:
+		case OB_O_C:
+		case OB_O_ACC:
+		case OB_O_DEC:
+		case OB_O_TAB:
+		case OB_O_FN:
+		case OB_O_FT:
+			return true;
+	}
+
+	return false;
+}
+
+
+/**
+ * Objects kept in the shadow: PDO parameters and mappings, and the
+ * registers of motion task 0. These only change when written, or
+ * when the drive resets. Writes to other objects have an effect of
+ * their own or the drive changes the objects itself.
+ */
+static bool mch_sdo_shadowable(uint16_t index)
+{
+	if(index >= 0x1400 && index < 0x1C00)
+		return true;
+
+	return mch_sdo_is_task_register(index);
+}
+
+
+/**
+ * Forget value of an object, e.g. when a write to it failed
+ * and it is unknown whether the drive took the value.
+ */
+static void mch_sdo_shadow_forget(mch_sdo_t *machine, uint16_t index, uint8_t subindex)
+{
+	shadow_map_t::iterator it = machine->shadow.find(mch_sdo_key(index, subindex));
+
+	if(it != machine->shadow.end())
+		it->second.valid = false;
+}
+
+
+/**
+ * Account for a write before it is sent, copying a
+ * task into task 0 overwrites the registers of task 0.
+ */
+static void mch_sdo_shadow_before_write(mch_sdo_t *machine, sdo_t *sdo)
+{
+	if(sdo->index != OB_COPY_MOTION_TASK || ((sdo->value >> 16) & 0xFFFF) != 0)
+		return;
+
+	shadow_map_t::iterator it;
+	for(it = machine->shadow.begin(); it != machine->shadow.end(); it++)
+		if(mch_sdo_is_task_register(it->first >> 8))
+			it->second.valid = false;
+}
+
+
+/**
+ * Keep value the drive confirmed writing.
+ */
+static void mch_sdo_shadow_confirm(mch_sdo_t *machine, sdo_t *sdo)
+{
+	if(!mch_sdo_shadowable(sdo->index))
+		return;
+
+	shadow_entry_t &entry = machine->shadow[mch_sdo_key(sdo->index, sdo->subindex)];
+	entry.valid = true;
+	entry.value = sdo->value;
+	entry.size = sdo->size;
+}
+
+
+/**
+ * Whether the drive is known to hold a value.
+ */
+bool mch_sdo_shadow_holds(mch_sdo_t *machine, uint16_t index, uint8_t subindex, uint32_t value, uint8_t size)
+{
+	assert(machine);
+
+	shadow_map_t::const_iterator it = machine->shadow.find(mch_sdo_key(index, subindex));
+
+	return it != machine->shadow.end() && it->second.valid &&
+		it->second.value == value && it->second.size == size;
+}
+
+
+/**
+ * Whether a write would leave the object unchanged,
+ * counted as a hit or miss for shadowed objects.
+ */
+static bool mch_sdo_is_redundant(mch_sdo_t *machine, sdo_t *sdo)
+{
+	if(!sdo->is_write || sdo->is_transfer || !mch_sdo_shadowable(sdo->index))
+		return false;
+
+	if(mch_sdo_shadow_holds(machine, sdo->index, sdo->subindex, sdo->value, sdo->size)) {
+		machine->shadow_hits++;
+		return true;
+	}
+
+	machine->shadow_misses++;
+	return false;
+}
+
+
+/**
+ * Discard the shadow when the drive may have lost the values written
+ * to it, i.e. when it reset or could not be reached for a while.
+ */
+void mch_sdo_invalidate_shadow(mch_sdo_t *machine)
+{
+	assert(machine);
+
+	// Keep entries, such that no memory is allocated for them again
+	shadow_map_t::iterator it;
+	for(it = machine->shadow.begin(); it != machine->shadow.end(); it++)
+		it->second.valid = false;
+
+	machine->shadow_invalidations++;
+}
+
+
+/**
+ * Take the next request to send. Writes that would not change
+ * the object complete right away, their callbacks are invoked
+ * as if the drive confirmed them.
+ *
+ * @return Request or NULL when no request is left to send, or
+ *   when a callback changed the state of the machine.
+ */
+static sdo_t *mch_sdo_take_next_to_send(mch_sdo_t *machine)
+{
+	while(machine->sdo_count > 0) {
+		sdo_t *sdo = mch_sdo_take_next(machine);
+
+		if(!mch_sdo_is_redundant(machine, sdo))
+			return sdo;
+
+		sdo_t skipped = *sdo;
+		mch_sdo_release(machine, sdo);
+
+		mch_sdo_notify_write(&skipped);
+
+		if(machine->state != ST_SDO_SENDING || machine->sdo_active)
+			return NULL;
+	}
+
+	return NULL;
+}
+
+
 const char *mch_sdo_abort_to_message(uint32_t code)
 {
 	switch(code) {
+		case 0x05030000: return "Toggle bit not alternated.";
+		case 0x05040000: return "SDO protocol timed out.";
+		case 0x05040001: return "Client/server command specifier not valid or unknown.";
+		case 0x05040002: return "Invalid block size.";
+		case 0x05040003: return "Invalid sequence number.";
+		case 0x05040004: return "CRC error.";
+		case 0x05040005: return "Out of memory.";
 		case 0x06010000: return "Unsupported access to this object.";
 		case 0x06010001: return "Attempted read access to a write-only object.";
 		case 0x06010002: return "Attempted write access to a read-only object.";
@@ -63,13 +471,13 @@ void mch_sdo_read_callback(void *data, uint16_t index, uint8_t subindex, uint32_
 	assert(machine->sdo_active->index == index);
 	assert(machine->sdo_active->subindex == subindex);
 
+	mch_sdo_record_response(machine, sdo);
+
 	// Invoke callback
-	if(sdo->read_callback)
-		sdo->read_callback(sdo->data, index, subindex, value);
+	mch_sdo_notify_read(sdo, value);
 
-	// Free memory
-	delete sdo;
-	machine->sdo_active = NULL;
+	// Free slot
+	mch_sdo_release_active(machine);
 
 	// Notify state machine
 	mch_sdo_handle_event(machine, EV_SDO_READ_RESPONSE);
@@ -89,13 +497,14 @@ void mch_sdo_write_callback(void *data, uint16_t index, uint8_t subindex)
   assert(machine->sdo_active->index == index);
   assert(machine->sdo_active->subindex == subindex);
 
+  mch_sdo_record_response(machine, sdo);
+  mch_sdo_shadow_confirm(machine, sdo);
+
   // Invoke callback
-  if(sdo->write_callback)
-    sdo->write_callback(sdo->data, index, subindex);
+  mch_sdo_notify_write(sdo);
 
-  // Free memory
-  delete sdo;
-  machine->sdo_active = NULL;
+  // Free slot
+  mch_sdo_release_active(machine);
 
   // Notify state machine
 	mch_sdo_handle_event(machine, EV_SDO_WRITE_RESPONSE);
@@ -118,13 +527,16 @@ void mch_sdo_abort_callback(void *data, uint16_t index, uint8_t subindex, uint32
 		machine->sdo_active->is_write?"Write":"Read", index, subindex,
 		mch_sdo_abort_to_message(code));
 
+  mch_sdo_record_response(machine, sdo);
+
+  if(sdo->is_write)
+    mch_sdo_shadow_forget(machine, index, subindex);
+
   // Invoke callback
-  if(sdo->abort_callback)
-    sdo->abort_callback(sdo->data, index, subindex, code);
+  mch_sdo_notify_abort(sdo, code);
 
-  // Free memory
-  delete sdo;
-  machine->sdo_active = NULL;
+  // Free slot
+  mch_sdo_release_active(machine);
 
   // Notify state machine
 	mch_sdo_handle_event(machine, EV_SDO_ABORT_RESPONSE);
@@ -150,6 +562,10 @@ mch_sdo_state_t mch_sdo_next_state_given_event(mch_sdo_t *machine, mch_sdo_event
 		case ST_SDO_SENDING:
 			if(event == EV_NET_SDO_DISABLED)
 				return ST_SDO_DISABLED;
+			if(event == EV_SDO_TIMEOUT)
+				return ST_SDO_WAITING;
+			if(event == EV_SDO_TRANSFER_ABORTED)
+				return ST_SDO_WAITING;
 			if(event == EV_SDO_READ_RESPONSE)
 				return ST_SDO_WAITING;
 			if(event == EV_SDO_WRITE_RESPONSE)
@@ -163,136 +579,999 @@ mch_sdo_state_t mch_sdo_next_state_given_event(mch_sdo_t *machine, mch_sdo_event
 }
 
 
-void mch_sdo_send(mch_sdo_t *machine, sdo_t *sdo)
-{
-	if(sdo->is_write) {
-		intf_send_write_req(machine->interface,
-			sdo->index, sdo->subindex, sdo->value, sdo->size,
-			mch_sdo_write_callback, mch_sdo_abort_callback, (void *) machine);
-	} else {
-		intf_send_read_req(machine->interface,
-			sdo->index, sdo->subindex,
-			mch_sdo_read_callback, mch_sdo_abort_callback, (void *) machine);
-	}
-}
+static void mch_sdo_on_timeout(evutil_socket_t fd, short events, void *machine_v);
+static void mch_sdo_on_pace(evutil_socket_t fd, short events, void *machine_v);
+static void mch_sdo_frame_callback(void *data, const uint8_t *frame);
 
 
-void mch_sdo_on_enter(mch_sdo_t *machine)
+/**
+ * (Re)start waiting for a response.
+ */
+static void mch_sdo_start_timeout(mch_sdo_t *machine)
 {
-	switch(machine->state) {
-		case ST_SDO_SENDING:
-			machine->sdo_active = machine->sdo_queue.front();
-			machine->sdo_queue.pop();
+	if(!machine->timeout_timer)
+		machine->timeout_timer = evtimer_new(machine->ev_base,
+			mch_sdo_on_timeout, (void *) machine);
 
-			mch_sdo_send(machine, machine->sdo_active);
-			break;
+	timeval timeout;
+	timeout.tv_sec = long(machine->timeout);
+	timeout.tv_usec = long((machine->timeout - timeout.tv_sec) * 1000.0 * 1000.0);
 
-		case ST_SDO_WAITING:
-			if(!machine->sdo_queue.empty()) {
-				mch_sdo_handle_event(machine, EV_SDO_ITEM_AVAILABLE);
-			}
-			break;
-	}
+	evtimer_add(machine->timeout_timer, &timeout);
 }
 
 
 /**
- * Drop all SDOs in the queue.
+ * Stop the timers of the active request.
  */
-void mch_sdo_clear_queue(mch_sdo_t *machine)
+static void mch_sdo_stop_timers(mch_sdo_t *machine)
 {
-	while(!machine->sdo_queue.empty()) {
-		sdo_t *sdo = machine->sdo_queue.front();
-		machine->sdo_queue.pop();
+	if(machine->timeout_timer)
+		evtimer_del(machine->timeout_timer);
+	if(machine->pace_timer)
+		evtimer_del(machine->pace_timer);
+}
 
-		if(sdo->abort_callback)
-			sdo->abort_callback(sdo->data, sdo->index, sdo->subindex, 0);
 
-		delete sdo;
-	}
+static void mch_sdo_send_frame(mch_sdo_t *machine, const uint8_t *frame)
+{
+	intf_send_sdo_frame(machine->interface, machine->node, frame,
+		mch_sdo_frame_callback, (void *) machine);
 }
 
 
-void mch_sdo_on_exit(mch_sdo_t *machine)
+/**
+ * Send the next burst of segments of a block download, the rest
+ * of the block follows after MCH_SDO_BLOCK_INTERVAL. The timeout
+ * runs from the last segment sent.
+ */
+static void mch_sdo_send_segments(mch_sdo_t *machine)
 {
-	switch(machine->state) {
-		case ST_SDO_DISABLED:
-		case ST_SDO_ERROR:
-			mch_sdo_clear_queue(machine);
-			break;
+	uint8_t frame[8];
 
-		case ST_SDO_SENDING:
-			break;
+	mch_sdo_start_timeout(machine);
+
+	for(int i = 0; i < MCH_SDO_BLOCK_BURST; i++) {
+		bool last = sdo_transfer_next_segment(&machine->transfer, frame);
+		mch_sdo_send_frame(machine, frame);
+
+		if(last)
+			return;
 	}
+
+	if(!machine->pace_timer)
+		machine->pace_timer = evtimer_new(machine->ev_base,
+			mch_sdo_on_pace, (void *) machine);
+
+	timeval interval;
+	interval.tv_sec = 0;
+	interval.tv_usec = long(MCH_SDO_BLOCK_INTERVAL * 1000.0 * 1000.0);
+
+	evtimer_add(machine->pace_timer, &interval);
 }
 
 
-/**
- * Enqueue a write request SDO and register callback.
- *
- * If the SDO is dropped or aborted, the abort_callback is invoked.
- * In case the write succeeds the write_callback is invoked.
- */
-void mch_sdo_queue_write_with_cb(mch_sdo_t *machine, uint16_t index, uint8_t subindex, uint32_t value, uint8_t size,
-  sdo_write_callback_t write_callback, sdo_abort_callback_t abort_callback, void *data)
+static void mch_sdo_on_pace(evutil_socket_t fd, short events, void *machine_v)
 {
-	sdo_t *sdo = new sdo_t();
-	sdo->is_write = true;
-	sdo->index = index;
-	sdo->subindex = subindex;
-	sdo->value = value;
-	sdo->size = size;
+	mch_sdo_t *machine = (mch_sdo_t *) machine_v;
 
-	sdo->write_callback = write_callback;
-	sdo->read_callback = NULL;
-	sdo->abort_callback = abort_callback;
-	sdo->data = data;
+	if(machine->state != ST_SDO_SENDING || !machine->sdo_active || !machine->sdo_active->is_transfer)
+		return;
 
-	machine->sdo_queue.push(sdo);
-	mch_sdo_handle_event(machine, EV_SDO_ITEM_AVAILABLE);
+	if(machine->transfer.phase == SDO_PHASE_BLOCK)
+		mch_sdo_send_segments(machine);
 }
 
 
 /**
- * Enqueue a write request SDO.
+ * Transfer completed, the throughput includes
+ * the time spent waiting for the node.
  */
-void mch_sdo_queue_write(mch_sdo_t *machine, uint16_t index, uint8_t subindex, uint32_t value, uint8_t size)
+static void mch_sdo_transfer_done(mch_sdo_t *machine)
 {
-	mch_sdo_queue_write_with_cb(machine, index, subindex, value, size, NULL, NULL, NULL);
-}
+	sdo_t *sdo = machine->sdo_active;
+	uint32_t length = machine->transfer.length;
 
+	mch_sdo_stop_timers(machine);
+	intf_cancel_sdo(machine->interface, machine->node);
 
-/**
- * Enqueue a read request SDO and register callback.
- *
+	double elapsed = get_time() - sdo->sent;
+
+	machine->transfers++;
+	machine->transfer_bytes += length;
+	machine->transfer_time += elapsed;
+	machine->last_rate = (elapsed > 0.0) ? length / elapsed : 0.0;
+
+	mch_sdo_record_deadline(machine, sdo);
+
+	bool is_write = sdo->is_write;
+
+	if(is_write)
+		mch_sdo_notify_write(sdo);
+	else
+		mch_sdo_notify_transfer(sdo, length);
+
+	mch_sdo_release_active(machine);
+	mch_sdo_handle_event(machine, is_write ? EV_SDO_WRITE_RESPONSE : EV_SDO_READ_RESPONSE);
+}
+
+
+/**
+ * Transfer aborted by either side, event is EV_SDO_ABORT_RESPONSE
+ * when the node aborted it (as for any other request).
+ */
+static void mch_sdo_transfer_failed(mch_sdo_t *machine, mch_sdo_event_t event)
+{
+	sdo_t *sdo = machine->sdo_active;
+	uint32_t code = machine->transfer.abort_code;
+
+	mch_sdo_stop_timers(machine);
+	intf_cancel_sdo(machine->interface, machine->node);
+
+	syslog(LOG_WARNING, "%s() %s of %04x:%02x was aborted after %u bytes because: %s",
+		__FUNCTION__, sdo->is_write?"Download":"Upload", sdo->index, sdo->subindex,
+		machine->transfer.length, mch_sdo_abort_to_message(code));
+
+	machine->transfer_failures++;
+	mch_sdo_record_deadline(machine, sdo);
+
+	mch_sdo_notify_abort(sdo, code);
+
+	mch_sdo_release_active(machine);
+	mch_sdo_handle_event(machine, event);
+}
+
+
+/**
+ * Frame of the active transfer received, the
+ * timeout applies to every frame expected.
+ */
+static void mch_sdo_frame_callback(void *data, const uint8_t *frame)
+{
+	assert(data);
+
+	mch_sdo_t *machine = (mch_sdo_t *) data;
+	assert(machine->sdo_active && machine->sdo_active->is_transfer);
+
+	uint8_t reply[8];
+	int result = sdo_transfer_response(&machine->transfer, frame, reply);
+
+	if(result & SDO_REPLY)
+		mch_sdo_send_frame(machine, reply);
+
+	if(result & SDO_DONE)
+		mch_sdo_transfer_done(machine);
+	else if(result & SDO_FAILED)
+		mch_sdo_transfer_failed(machine, (result & SDO_REPLY) ? EV_SDO_TRANSFER_ABORTED : EV_SDO_ABORT_RESPONSE);
+	else if(result & SDO_SEGMENTS)
+		mch_sdo_send_segments(machine);
+	else if(result & SDO_REPLY)
+		mch_sdo_start_timeout(machine);
+}
+
+
+/**
+ * Send request and wait for its response until the timeout.
+ */
+void mch_sdo_send(mch_sdo_t *machine, sdo_t *sdo)
+{
+	mch_sdo_start_timeout(machine);
+
+	sdo->sent = get_time();
+	sdo->attempts++;
+
+	if(sdo->is_transfer) {
+		uint8_t frame[8];
+
+		sdo_transfer_init(&machine->transfer, sdo->index, sdo->subindex,
+			!sdo->is_write, sdo->block, sdo->buffer, sdo->length);
+		sdo_transfer_begin(&machine->transfer, frame);
+
+		mch_sdo_send_frame(machine, frame);
+	} else if(sdo->is_write) {
+		mch_sdo_shadow_before_write(machine, sdo);
+
+		intf_send_write_req(machine->interface, machine->node,
+			sdo->index, sdo->subindex, sdo->value, sdo->size,
+			mch_sdo_write_callback, mch_sdo_abort_callback, (void *) machine);
+	} else {
+		intf_send_read_req(machine->interface, machine->node,
+			sdo->index, sdo->subindex,
+			mch_sdo_read_callback, mch_sdo_abort_callback, (void *) machine);
+	}
+}
+
+
+void mch_sdo_on_enter(mch_sdo_t *machine)
+{
+	switch(machine->state) {
+		case ST_SDO_SENDING: {
+			sdo_t *sdo = mch_sdo_take_next_to_send(machine);
+
+			// Only redundant writes were queued
+			if(!sdo) {
+				if(machine->state == ST_SDO_SENDING && !machine->sdo_active)
+					mch_sdo_handle_event(machine, EV_SDO_WRITE_RESPONSE);
+				break;
+			}
+
+			machine->sdo_active = sdo;
+			machine->sdo_active->attempts = 0;
+			mch_sdo_send(machine, machine->sdo_active);
+			break;
+		}
+
+		case ST_SDO_WAITING:
+			if(machine->sdo_count > 0) {
+				mch_sdo_handle_event(machine, EV_SDO_ITEM_AVAILABLE);
+			}
+			break;
+	}
+}
+
+
+/**
+ * Send the active request again when its response may have been lost
+ * (e.g. in a receive overrun), rather than waiting for it forever.
+ *
+ * Should the original response arrive after all, it is taken as the
+ * answer and the response to the repeated request is ignored.
+ */
+void mch_sdo_resync(mch_sdo_t *machine)
+{
+	if(machine->state != ST_SDO_SENDING || !machine->sdo_active)
+		return;
+
+	sdo_t *sdo = machine->sdo_active;
+
+	// Frames of a transfer cannot be sent again,
+	// the transfer is aborted at the timeout instead
+	if(sdo->is_transfer)
+		return;
+
+	syslog(LOG_WARNING, "%s() response to %s SDO %04x:%02x may have been lost, sending it again",
+		__FUNCTION__, sdo->is_write?"write":"read", sdo->index, sdo->subindex);
+
+	machine->resyncs++;
+	mch_sdo_send(machine, sdo);
+}
+
+
+/**
+ * No response arrived in time, send the request again or
+ * give up on it after the last retry. The abort callback then
+ * receives MCH_SDO_ABORT_TIMEOUT and the queue continues with
+ * the next request.
+ */
+static void mch_sdo_on_timeout(evutil_socket_t fd, short events, void *machine_v)
+{
+	mch_sdo_t *machine = (mch_sdo_t *) machine_v;
+
+	if(machine->state != ST_SDO_SENDING || !machine->sdo_active)
+		return;
+
+	sdo_t *sdo = machine->sdo_active;
+	machine->timeouts++;
+
+	if(sdo->is_transfer) {
+		syslog(LOG_ERR, "%s() no response during %s of %04x:%02x within %.0f ms, aborting it",
+			__FUNCTION__, sdo->is_write?"download":"upload", sdo->index, sdo->subindex, machine->timeout * 1000.0);
+
+		uint8_t frame[8];
+		sdo_transfer_abort(&machine->transfer, SDO_ABORT_TIMEOUT, frame);
+		mch_sdo_send_frame(machine, frame);
+
+		machine->failures++;
+		mch_sdo_transfer_failed(machine, EV_SDO_TIMEOUT);
+		return;
+	}
+
+	if(sdo->attempts <= machine->retries) {
+		syslog(LOG_WARNING, "%s() no response to %s SDO %04x:%02x within %.0f ms, sending it again",
+			__FUNCTION__, sdo->is_write?"write":"read", sdo->index, sdo->subindex, machine->timeout * 1000.0);
+
+		machine->retried++;
+		mch_sdo_send(machine, sdo);
+		return;
+	}
+
+	syslog(LOG_ERR, "%s() no response to %s SDO %04x:%02x after %d attempts, giving up",
+		__FUNCTION__, sdo->is_write?"write":"read", sdo->index, sdo->subindex, sdo->attempts);
+
+	machine->failures++;
+	machine->rtt_stats[sdo->index].requests++;
+	mch_sdo_record_deadline(machine, sdo);
+
+	if(sdo->is_write)
+		mch_sdo_shadow_forget(machine, sdo->index, sdo->subindex);
+
+	// A response that still arrives belongs to no request
+	intf_cancel_sdo(machine->interface, machine->node);
+
+	mch_sdo_notify_abort(sdo, MCH_SDO_ABORT_TIMEOUT);
+
+	mch_sdo_release_active(machine);
+	mch_sdo_handle_event(machine, EV_SDO_TIMEOUT);
+}
+
+
+/**
+ * Drop all SDOs in the queue, including the request that was active
+ * when SDOs were disabled. Their abort callbacks are invoked with
+ * code 0, such that nobody keeps waiting for them (e.g. an awaited
+ * request, or the caller of a transfer who owns the buffer).
+ */
+void mch_sdo_clear_queue(mch_sdo_t *machine)
+{
+	if(machine->sdo_active) {
+		sdo_t dropped = *machine->sdo_active;
+		mch_sdo_release_active(machine);
+
+		mch_sdo_notify_abort(&dropped, 0);
+	}
+
+	for(int i = 0; i < MCH_SDO_CLASSES; i++) {
+		sdo_class_queue_t *queue = &machine->sdo_classes[i];
+
+		while(queue->head) {
+			sdo_t *sdo = queue->head;
+			queue->head = sdo->next;
+			if(!queue->head)
+				queue->tail = NULL;
+
+			sdo_t dropped = *sdo;
+			mch_sdo_release(machine, sdo);
+
+			mch_sdo_notify_abort(&dropped, 0);
+		}
+	}
+}
+
+
+static void mch_sdo_forget_request_callbacks(sdo_t *sdo, void *data)
+{
+	for(int i = 0; i < sdo->num_callbacks; i++) {
+		sdo_callbacks_t *callbacks = &sdo->callbacks[i];
+
+		if(callbacks->data != data)
+			continue;
+
+		callbacks->abort_callback = NULL;
+		callbacks->write_callback = NULL;
+		callbacks->read_callback = NULL;
+		callbacks->transfer_callback = NULL;
+	}
+}
+
+
+/**
+ * Stop invoking the callbacks registered with data for requests that
+ * are queued or active, e.g. when data is freed before they complete.
+ * The requests themselves are still sent.
+ */
+void mch_sdo_forget_callbacks(mch_sdo_t *machine, void *data)
+{
+	assert(machine);
+
+	if(machine->sdo_active)
+		mch_sdo_forget_request_callbacks(machine->sdo_active, data);
+
+	for(int i = 0; i < MCH_SDO_CLASSES; i++)
+		for(sdo_t *sdo = machine->sdo_classes[i].head; sdo; sdo = sdo->next)
+			mch_sdo_forget_request_callbacks(sdo, data);
+}
+
+
+/**
+ * Class of requests to an object.
+ */
+static int mch_sdo_class(uint16_t index)
+{
+	if(index >= 0x1000 && index < 0x2000)
+		return MCH_SDO_CLASS_BULK;
+
+	if(index == OB_O_O1 || index == OB_O_O2)
+		return MCH_SDO_CLASS_URGENT;
+
+	return MCH_SDO_CLASS_NORMAL;
+}
+
+
+/**
+ * Take a free request and queue it at the end of its class.
+ *
+ * @param sdo_class  Class of the request.
+ * @param deadline  Time to complete the request in (s),
+ *   zero or less for the default of the class.
+ * @return Request or NULL when the queue is full.
+ */
+static sdo_t *mch_sdo_take_slot(mch_sdo_t *machine, int sdo_class, double deadline)
+{
+	static const double deadlines[MCH_SDO_CLASSES] = {
+		MCH_SDO_DEADLINE_URGENT, MCH_SDO_DEADLINE_NORMAL, MCH_SDO_DEADLINE_BULK };
+
+	sdo_t *sdo = machine->sdo_free;
+
+	if(!sdo)
+		return NULL;
+
+	machine->sdo_free = sdo->next;
+	machine->sdo_count++;
+
+	if(machine->sdo_count > machine->max_depth)
+		machine->max_depth = machine->sdo_count;
+
+	sdo->sdo_class = sdo_class;
+	sdo->queued = get_time();
+	sdo->deadline = sdo->queued + (deadline > 0.0 ? deadline : deadlines[sdo_class]);
+	sdo->next = NULL;
+
+	sdo_class_queue_t *queue = &machine->sdo_classes[sdo_class];
+
+	if(queue->tail)
+		queue->tail->next = sdo;
+	else
+		queue->head = sdo;
+
+	queue->tail = sdo;
+
+	return sdo;
+}
+
+
+/**
+ * Writes to these objects are never merged, every write has an
+ * effect of its own (copying or starting a motion task, changing
+ * drive state, PLC handshakes, digital outputs used as markers and
+ * configuration sequences of the communication profile).
+ */
+static bool mch_sdo_coalescable(uint16_t index)
+{
+	if(index >= 0x1000 && index < 0x2000)
+		return false;
+
+	switch(index) {
+		case OB_CONTROL_WORD:
+		case OB_MODES_OF_OPERATION:
+		case OB_MOTION_TASK:
+		case OB_COPY_MOTION_TASK:
+		case OB_O_MOVE:
+		case OB_DPRVAR_WO:
+		case OB_O_O1:
+		case OB_O_O2:
+			return false;
+	}
+
+	return true;
+}
+
+
+/**
+ * Requests that make the drive act on the objects written before
+ * them, no write is moved ahead of these. Copying a motion task
+ * reads the registers of task 0, which chained profiles are written
+ * into one after another.
+ */
+static bool mch_sdo_is_barrier(sdo_t *sdo)
+{
+	switch(sdo->index) {
+		case OB_CONTROL_WORD:
+		case OB_MODES_OF_OPERATION:
+		case OB_MOTION_TASK:
+		case OB_COPY_MOTION_TASK:
+		case OB_O_MOVE:
+			return true;
+	}
+
+	return false;
+}
+
+
+/**
+ * Merge write into the last queued write to the same object in its
+ * class, if it has not been sent yet. The queued write then takes
+ * the new value and also invokes the callbacks of the new write. Its
+ * deadline becomes the earlier of both.
+ *
+ * @return True if the write was merged.
+ */
+static bool mch_sdo_coalesce_write(mch_sdo_t *machine, int sdo_class, double deadline,
+	uint16_t index, uint8_t subindex, uint32_t value, uint8_t size,
+	sdo_write_callback_t write_callback, sdo_abort_callback_t abort_callback, void *data)
+{
+	if(!mch_sdo_coalescable(index))
+		return false;
+
+	// Last write to the object that is not followed by a barrier
+	sdo_t *target = NULL;
+
+	for(sdo_t *sdo = machine->sdo_classes[sdo_class].head; sdo; sdo = sdo->next) {
+		if(sdo->index == index && sdo->subindex == subindex)
+			target = sdo;
+		else if(mch_sdo_is_barrier(sdo))
+			target = NULL;
+	}
+
+	if(!target || !target->is_write || target->is_transfer || target->size != size ||
+		target->num_callbacks == MCH_SDO_CALLBACKS)
+		return false;
+
+	sdo_callbacks_t *callbacks = &target->callbacks[target->num_callbacks++];
+	callbacks->write_callback = write_callback;
+	callbacks->read_callback = NULL;
+	callbacks->transfer_callback = NULL;
+	callbacks->abort_callback = abort_callback;
+	callbacks->data = data;
+
+	target->value = value;
+
+	if(deadline > 0.0 && get_time() + deadline < target->deadline)
+		target->deadline = get_time() + deadline;
+
+	machine->coalesced++;
+	return true;
+}
+
+
+/**
+ * Report request that did not fit in the queue,
+ * its abort callback is invoked with code 0.
+ */
+static int mch_sdo_overflow(mch_sdo_t *machine, bool is_write, uint16_t index, uint8_t subindex,
+	sdo_abort_callback_t abort_callback, void *data)
+{
+	machine->overflows++;
+
+	syslog(LOG_ERR, "%s() queue full (%d requests), dropped %s SDO %04x:%02x", __FUNCTION__,
+		machine->queue_size, is_write?"write":"read", index, subindex);
+
+	if(abort_callback)
+		abort_callback(data, index, subindex, 0);
+
+	return -1;
+}
+
+
+/**
+ * Free the timers. Requests that are still queued are released
+ * without invoking their callbacks, as their users are going away
+ * as well.
+ */
+void mch_sdo_on_destroy(mch_sdo_t *machine)
+{
+	if(machine->timeout_timer)
+		event_free(machine->timeout_timer);
+	if(machine->pace_timer)
+		event_free(machine->pace_timer);
+
+	machine->timeout_timer = NULL;
+	machine->pace_timer = NULL;
+}
+
+
+void mch_sdo_on_exit(mch_sdo_t *machine)
+{
+	switch(machine->state) {
+		case ST_SDO_DISABLED:
+		case ST_SDO_ERROR:
+			mch_sdo_clear_queue(machine);
+			break;
+
+		case ST_SDO_SENDING:
+			mch_sdo_stop_timers(machine);
+			break;
+	}
+}
+
+
+/**
+ * Enqueue a write request SDO with a class and deadline and register
+ * callback. Requests that depend on each other should be in the same
+ * class, as only their order within the class is kept.
+ *
+ * If the SDO is dropped or aborted, the abort_callback is invoked.
+ * In case the write succeeds the write_callback is invoked.
+ *
+ * A write to an object that is still waiting in the queue replaces
+ * the value of that write (see mch_sdo_coalesce_write), both writes
+ * invoke their callbacks when it completes.
+ *
+ * @param sdo_class  MCH_SDO_CLASS_URGENT, _NORMAL, _BULK or _AUTO.
+ * @param deadline  Time to complete the request in (s),
+ *   zero for the default of the class.
+ * @return 0 on success, -1 when the queue is full.
+ */
+int mch_sdo_queue_write_scheduled(mch_sdo_t *machine, uint16_t index, uint8_t subindex, uint32_t value, uint8_t size,
+	int sdo_class, double deadline, sdo_write_callback_t write_callback, sdo_abort_callback_t abort_callback, void *data)
+{
+	assert(sdo_class >= MCH_SDO_CLASS_AUTO && sdo_class < MCH_SDO_CLASSES);
+
+	if(sdo_class == MCH_SDO_CLASS_AUTO)
+		sdo_class = mch_sdo_class(index);
+
+	if(mch_sdo_coalesce_write(machine, sdo_class, deadline, index, subindex, value, size,
+		write_callback, abort_callback, data))
+		return 0;
+
+	sdo_t *sdo = mch_sdo_take_slot(machine, sdo_class, deadline);
+
+	if(!sdo)
+		return mch_sdo_overflow(machine, true, index, subindex, abort_callback, data);
+
+	sdo->is_write = true;
+	sdo->is_transfer = false;
+	sdo->index = index;
+	sdo->subindex = subindex;
+	sdo->value = value;
+	sdo->size = size;
+
+	sdo->callbacks[0].write_callback = write_callback;
+	sdo->callbacks[0].read_callback = NULL;
+	sdo->callbacks[0].transfer_callback = NULL;
+	sdo->callbacks[0].abort_callback = abort_callback;
+	sdo->callbacks[0].data = data;
+	sdo->num_callbacks = 1;
+
+	mch_sdo_handle_event(machine, EV_SDO_ITEM_AVAILABLE);
+	return 0;
+}
+
+
+/**
+ * Enqueue a write request SDO and register callback, in the class
+ * of the object and with the default deadline of that class.
+ *
+ * @return 0 on success, -1 when the queue is full.
+ */
+int mch_sdo_queue_write_with_cb(mch_sdo_t *machine, uint16_t index, uint8_t subindex, uint32_t value, uint8_t size,
+  sdo_write_callback_t write_callback, sdo_abort_callback_t abort_callback, void *data)
+{
+	return mch_sdo_queue_write_scheduled(machine, index, subindex, value, size,
+		MCH_SDO_CLASS_AUTO, 0.0, write_callback, abort_callback, data);
+}
+
+
+/**
+ * Enqueue a write request SDO.
+ *
+ * @return 0 on success, -1 when the queue is full.
+ */
+int mch_sdo_queue_write(mch_sdo_t *machine, uint16_t index, uint8_t subindex, uint32_t value, uint8_t size)
+{
+	return mch_sdo_queue_write_with_cb(machine, index, subindex, value, size, NULL, NULL, NULL);
+}
+
+
+/**
+ * Enqueue a read request SDO and register callback.
+ *
  * If the SDO is dropped or aborted, the abort_callback is invoked.
  * In case the read succeeds the read_callback is invoked.
+ *
+ * @return 0 on success, -1 when the queue is full.
  */
-void mch_sdo_queue_read_with_cb(mch_sdo_t *machine, uint16_t index, uint8_t subindex,
+int mch_sdo_queue_read_with_cb(mch_sdo_t *machine, uint16_t index, uint8_t subindex,
 	sdo_read_callback_t read_callback, sdo_abort_callback_t abort_callback, void *data)
 {
-	sdo_t *sdo = new sdo_t();
+	sdo_t *sdo = mch_sdo_take_slot(machine, mch_sdo_class(index), 0.0);
+
+	if(!sdo)
+		return mch_sdo_overflow(machine, false, index, subindex, abort_callback, data);
+
 	sdo->is_write = false;
+	sdo->is_transfer = false;
 	sdo->index = index;
 	sdo->subindex = subindex;
 	sdo->value = 0;
 	sdo->size = 0;
 
-	sdo->write_callback = NULL;
-	sdo->read_callback = read_callback;
-	sdo->abort_callback = abort_callback;
-	sdo->data = NULL;
+	sdo->callbacks[0].write_callback = NULL;
+	sdo->callbacks[0].read_callback = read_callback;
+	sdo->callbacks[0].transfer_callback = NULL;
+	sdo->callbacks[0].abort_callback = abort_callback;
+	sdo->callbacks[0].data = data;
+	sdo->num_callbacks = 1;
 
-	machine->sdo_queue.push(sdo);
 	mch_sdo_handle_event(machine, EV_SDO_ITEM_AVAILABLE);
+	return 0;
 }
 
 
 /**
  * Enqueue read request SDO.
+ *
+ * @return 0 on success, -1 when the queue is full.
+ */
+int mch_sdo_queue_read(mch_sdo_t *machine, uint16_t index, uint8_t subindex)
+{
+	return mch_sdo_queue_read_with_cb(machine, index, subindex, NULL, NULL, NULL);
+}
+
+
+/**
+ * Queue transfer in the bulk class, the transfer occupies the SDO
+ * channel of the node until it completes, requests queued later
+ * wait for it (see MCH_SDO_BLOCK_BURST).
+ */
+static sdo_t *mch_sdo_take_transfer(mch_sdo_t *machine, bool is_write, uint16_t index, uint8_t subindex,
+	uint8_t *buffer, uint32_t size, bool block)
+{
+	sdo_t *sdo = mch_sdo_take_slot(machine, MCH_SDO_CLASS_BULK, 0.0);
+
+	if(!sdo)
+		return NULL;
+
+	sdo->is_write = is_write;
+	sdo->is_transfer = true;
+	sdo->block = block;
+	sdo->buffer = buffer;
+	sdo->length = size;
+	sdo->index = index;
+	sdo->subindex = subindex;
+	sdo->value = 0;
+	sdo->size = 0;
+	sdo->num_callbacks = 1;
+
+	return sdo;
+}
+
+
+/**
+ * Enqueue segmented or block download of an object larger than
+ * four bytes, e.g. a table or program. The buffer has to remain
+ * valid until either callback is invoked.
+ *
+ * @param block  Block transfer, rather than segmented.
+ * @return 0 on success, -1 when the queue is full.
+ */
+int mch_sdo_queue_download(mch_sdo_t *machine, uint16_t index, uint8_t subindex,
+	const uint8_t *buffer, uint32_t size, bool block,
+	sdo_write_callback_t write_callback, sdo_abort_callback_t abort_callback, void *data)
+{
+	assert(machine && (buffer || size == 0));
+
+	sdo_t *sdo = mch_sdo_take_transfer(machine, true, index, subindex, (uint8_t *) buffer, size, block);
+
+	if(!sdo)
+		return mch_sdo_overflow(machine, true, index, subindex, abort_callback, data);
+
+	sdo->callbacks[0].write_callback = write_callback;
+	sdo->callbacks[0].read_callback = NULL;
+	sdo->callbacks[0].transfer_callback = NULL;
+	sdo->callbacks[0].abort_callback = abort_callback;
+	sdo->callbacks[0].data = data;
+
+	mch_sdo_handle_event(machine, EV_SDO_ITEM_AVAILABLE);
+	return 0;
+}
+
+
+/**
+ * Enqueue segmented or block upload of an object into a buffer of
+ * size bytes, which has to remain valid until either callback is
+ * invoked. The transfer callback receives the number of bytes read,
+ * the transfer is aborted when the object does not fit.
+ *
+ * @param block  Block transfer, rather than segmented.
+ * @return 0 on success, -1 when the queue is full.
+ */
+int mch_sdo_queue_upload(mch_sdo_t *machine, uint16_t index, uint8_t subindex,
+	uint8_t *buffer, uint32_t size, bool block,
+	sdo_transfer_callback_t transfer_callback, sdo_abort_callback_t abort_callback, void *data)
+{
+	assert(machine && (buffer || size == 0));
+
+	sdo_t *sdo = mch_sdo_take_transfer(machine, false, index, subindex, buffer, size, block);
+
+	if(!sdo)
+		return mch_sdo_overflow(machine, false, index, subindex, abort_callback, data);
+
+	sdo->callbacks[0].write_callback = NULL;
+	sdo->callbacks[0].read_callback = NULL;
+	sdo->callbacks[0].transfer_callback = transfer_callback;
+	sdo->callbacks[0].abort_callback = abort_callback;
+	sdo->callbacks[0].data = data;
+
+	mch_sdo_handle_event(machine, EV_SDO_ITEM_AVAILABLE);
+	return 0;
+}
+
+
+
+/**
+ * Set time to wait for a response (s) and the number of
+ * times a request is sent again when none arrives.
  */
-void mch_sdo_queue_read(mch_sdo_t *machine, uint16_t index, uint8_t subindex)
+void mch_sdo_set_timeout(mch_sdo_t *machine, double timeout, int retries)
 {
-	mch_sdo_queue_read_with_cb(machine, index, subindex, NULL, NULL, NULL);
+	assert(machine && timeout > 0.0 && retries >= 0);
+
+	machine->timeout = timeout;
+	machine->retries = retries;
 }
 
+
+/**
+ * Number of objects whose value is known.
+ */
+static int mch_sdo_shadow_entries(mch_sdo_t *machine)
+{
+	int entries = 0;
+
+	shadow_map_t::const_iterator it;
+	for(it = machine->shadow.begin(); it != machine->shadow.end(); it++)
+		if(it->second.valid)
+			entries++;
+
+	return entries;
+}
+
+
+/**
+ * Retrieve queue statistics.
+ */
+void mch_sdo_get_stats(mch_sdo_t *machine, mch_sdo_stats_t *stats)
+{
+	assert(machine && stats);
+
+	stats->capacity = machine->queue_size;
+	stats->depth = machine->sdo_count;
+	stats->max_depth = machine->max_depth;
+	stats->overflows = machine->overflows;
+	stats->resyncs = machine->resyncs;
+	stats->timeouts = machine->timeouts;
+	stats->retried = machine->retried;
+	stats->failures = machine->failures;
+	stats->coalesced = machine->coalesced;
+
+	stats->transfers = machine->transfers;
+	stats->transfer_failures = machine->transfer_failures;
+	stats->transfer_bytes = machine->transfer_bytes;
+	stats->transfer_rate = (machine->transfer_time > 0.0) ? machine->transfer_bytes / machine->transfer_time : 0.0;
+	stats->last_rate = machine->last_rate;
+
+	stats->shadow_entries = mch_sdo_shadow_entries(machine);
+	stats->shadow_hits = machine->shadow_hits;
+	stats->shadow_misses = machine->shadow_misses;
+	stats->shadow_invalidations = machine->shadow_invalidations;
+}
+
+
+/**
+ * Retrieve statistics of a class of requests.
+ */
+void mch_sdo_get_class_stats(mch_sdo_t *machine, int sdo_class, mch_sdo_class_stats_t *stats)
+{
+	assert(machine && stats);
+	assert(sdo_class >= 0 && sdo_class < MCH_SDO_CLASSES);
+
+	*stats = machine->sdo_classes[sdo_class].stats;
+}
+
+
+/**
+ * Retrieve round-trip times of requests to a single object index.
+ *
+ * @return Statistics or NULL when no request has completed.
+ */
+const mch_sdo_rtt_stats_t *mch_sdo_get_rtt_stats(mch_sdo_t *machine, uint16_t index)
+{
+	assert(machine);
+
+	rtt_stats_map_t::const_iterator it = machine->rtt_stats.find(index);
+
+	if(it == machine->rtt_stats.end())
+		return NULL;
+
+	return &it->second;
+}
+
+
+/**
+ * Clear queue statistics, the deepest queue restarts at the current depth.
+ */
+void mch_sdo_reset_stats(mch_sdo_t *machine)
+{
+	assert(machine);
+
+	machine->max_depth = machine->sdo_count;
+	machine->overflows = 0;
+	machine->resyncs = 0;
+	machine->timeouts = 0;
+	machine->retried = 0;
+	machine->failures = 0;
+	machine->coalesced = 0;
+
+	machine->transfers = 0;
+	machine->transfer_failures = 0;
+	machine->transfer_bytes = 0;
+	machine->transfer_time = 0.0;
+	machine->last_rate = 0.0;
+
+	machine->shadow_hits = 0;
+	machine->shadow_misses = 0;
+	machine->shadow_invalidations = 0;
+
+	for(int i = 0; i < MCH_SDO_CLASSES; i++)
+		memset(&machine->sdo_classes[i].stats, 0, sizeof(mch_sdo_class_stats_t));
+
+	// Keep entries, such that no memory is allocated for them again
+	rtt_stats_map_t::iterator it;
+	for(it = machine->rtt_stats.begin(); it != machine->rtt_stats.end(); it++)
+		memset(&it->second, 0, sizeof(mch_sdo_rtt_stats_t));
+}
+
+
+/**
+ * Write queue statistics as text, followed by a line on segmented
+ * and block transfers, a line on the shadow of the object dictionary,
+ * a line per class and a line with round-trip times per object index:
+ *
+ *   sdo depth=0 max_depth=23 capacity=1118 overflows=0 resyncs=1 timeouts=2 retried=2 failed=0 coalesced=14
+ *   sdo transfers=2 failed=0 bytes=16384 rate=21400B/s last=24100B/s
+ *   sdo shadow entries=31 hits=52 misses=37 invalidations=1
+ *   sdo class=urgent requests=12 missed=0 max_wait=420us max_late=0us
+ *   sdo 6040 requests=120 mean=812us min=540us max=2210us hist=37:3,38:90,39:24,41:2,49:1
+ *
+ * Histogram entries are bin:count, see INTF_HISTOGRAM_BASE.
+ *
+ * @return Number of characters written, excluding terminating null.
+ */
+int mch_sdo_format_stats(mch_sdo_t *machine, char *buffer, int size)
+{
+	assert(machine && buffer && size > 0);
+
+	int n = snprintf(buffer, size, "sdo depth=%d max_depth=%d capacity=%d overflows=%u resyncs=%u "
+		"timeouts=%u retried=%u failed=%u coalesced=%u", machine->sdo_count, machine->max_depth,
+		machine->queue_size, machine->overflows, machine->resyncs, machine->timeouts, machine->retried,
+		machine->failures, machine->coalesced);
+
+	if(n < size)
+		n += snprintf(buffer + n, size - n, "\nsdo transfers=%u failed=%u bytes=%llu rate=%.0fB/s last=%.0fB/s",
+			machine->transfers, machine->transfer_failures, (unsigned long long) machine->transfer_bytes,
+			(machine->transfer_time > 0.0) ? machine->transfer_bytes / machine->transfer_time : 0.0,
+			machine->last_rate);
+
+	if(n < size)
+		n += snprintf(buffer + n, size - n, "\nsdo shadow entries=%d hits=%u misses=%u invalidations=%u",
+			mch_sdo_shadow_entries(machine), machine->shadow_hits, machine->shadow_misses,
+			machine->shadow_invalidations);
+
+	static const char *names[MCH_SDO_CLASSES] = { "urgent", "normal", "bulk" };
+
+	for(int i = 0; i < MCH_SDO_CLASSES && n < size; i++) {
+		mch_sdo_class_stats_t *stats = &machine->sdo_classes[i].stats;
+
+		n += snprintf(buffer + n, size - n, "\nsdo class=%s requests=%llu missed=%llu max_wait=%.0fus max_late=%.0fus",
+			names[i], (unsigned long long) stats->requests, (unsigned long long) stats->missed,
+			stats->max_wait * 1e6, stats->max_late * 1e6);
+	}
+
+	rtt_stats_map_t::iterator it;
+	for(it = machine->rtt_stats.begin(); it != machine->rtt_stats.end() && n < size; it++) {
+		mch_sdo_rtt_stats_t *stats = &it->second;
+
+		if(stats->requests == 0)
+			continue;
+
+		n += snprintf(buffer + n, size - n, "\nsdo %04x requests=%llu", it->first,
+			(unsigned long long) stats->requests);
+
+		if(stats->samples == 0 || n >= size)
+			continue;
+
+		n += snprintf(buffer + n, size - n, " mean=%.0fus min=%.0fus max=%.0fus hist=",
+			stats->sum / stats->samples * 1e6, stats->min * 1e6, stats->max * 1e6);
+
+		const char *separator = "";
+		for(int j = 0; j < INTF_HISTOGRAM_BINS && n < size; j++) {
+			if(stats->histogram[j] == 0)
+				continue;
+
+			n += snprintf(buffer + n, size - n, "%s%d:%u", separator, j, stats->histogram[j]);
+			separator = ",";
+		}
+	}
+
+	return n < size ? n : size - 1;
+}
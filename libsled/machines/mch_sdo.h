@@ -6,23 +6,144 @@
 // Define machine prefix
 #define PREFIX mch_sdo
 
+#include "../interface.h"
+#include "../sdo.h"
+
+/**
+ * Time to wait for a response (s), the number of times a request
+ * is sent again when it does not arrive and the abort code passed
+ * to the abort callback when the request is given up on.
+ */
+#define MCH_SDO_TIMEOUT 0.1
+#define MCH_SDO_RETRIES 2
+#define MCH_SDO_ABORT_TIMEOUT 0x05040000
+
+/**
+ * Number of writes that can be merged into one request.
+ */
+#define MCH_SDO_CALLBACKS 4
+
+/**
+ * Classes of requests. Requests of one class are sent in the order
+ * they were queued, as they may depend on each other. Between classes
+ * the request with the earliest deadline goes first, by default a
+ * request has to complete within the time given for its class (s).
+ */
+#define MCH_SDO_CLASS_AUTO -1	// Class by object index
+#define MCH_SDO_CLASS_URGENT 0	// Digital outputs marking stimuli
+#define MCH_SDO_CLASS_NORMAL 1	// Drive control and motion tasks
+#define MCH_SDO_CLASS_BULK 2	// Communication profile configuration
+#define MCH_SDO_CLASSES 3
+
+#define MCH_SDO_DEADLINE_URGENT 0.002
+#define MCH_SDO_DEADLINE_NORMAL 0.010
+#define MCH_SDO_DEADLINE_BULK 1.0
+
+/**
+ * Segments of a block download are sent in bursts, such that
+ * the transmit queue does not overflow and other frames still
+ * get onto the bus. A burst of segments (frames) is sent every
+ * interval (s), i.e. 28 kB/s.
+ */
+#define MCH_SDO_BLOCK_BURST 4
+#define MCH_SDO_BLOCK_INTERVAL 0.001
+
+struct event_base;
+struct event;
+
 typedef void(*sdo_abort_callback_t)(void *data, uint16_t index, uint8_t subindex, uint32_t code);
 typedef void(*sdo_write_callback_t)(void *data, uint16_t index, uint8_t subindex);
 typedef void(*sdo_read_callback_t)(void *data, uint16_t index, uint8_t subindex, uint32_t value);
+typedef void(*sdo_transfer_callback_t)(void *data, uint16_t index, uint8_t subindex, uint32_t length);
+
+struct mch_sdo_stats_t {
+	int capacity;			// Requests the queue holds, including the active one
+	int depth;				// Requests queued now
+	int max_depth;			// Deepest queue
+	uint32_t overflows;		// Requests dropped because the queue was full
+	uint32_t resyncs;		// Requests sent again after a receive overrun
+	uint32_t timeouts;		// Responses that did not arrive in time
+	uint32_t retried;		// Requests sent again after a timeout
+	uint32_t failures;		// Requests given up on after the last retry
+	uint32_t coalesced;		// Writes merged into a queued write
+
+	// Segmented and block transfers
+	uint32_t transfers;			// Transfers completed
+	uint32_t transfer_failures;	// Transfers aborted
+	uint64_t transfer_bytes;	// Bytes of completed transfers
+	double transfer_rate;		// Mean throughput of completed transfers (B/s)
+	double last_rate;			// Throughput of the last transfer (B/s)
+
+	// Shadow of the object dictionary
+	int shadow_entries;				// Objects whose value is known
+	uint32_t shadow_hits;			// Writes skipped as the object held the value
+	uint32_t shadow_misses;			// Writes sent to objects that are shadowed
+	uint32_t shadow_invalidations;	// Times the whole shadow was discarded
+};
+
+/**
+ * Requests of a single class. Wait is the time from queueing a
+ * request until it is first sent, requests that complete after
+ * their deadline are counted as missed.
+ */
+struct mch_sdo_class_stats_t {
+	uint64_t requests;		// Requests completed (including aborts)
+	uint64_t missed;		// Requests completed after the deadline
+	double max_wait;		// Longest wait before sending (s)
+	double max_late;		// Latest completion after the deadline (s)
+};
+
+/**
+ * Time from request to response for a single object index. Requests
+ * that were sent more than once are not sampled, as the response
+ * cannot be matched to one of the attempts.
+ */
+struct mch_sdo_rtt_stats_t {
+	uint64_t requests;		// Requests completed (including aborts)
+	uint64_t samples;		// Round-trip times measured
+	double min, max, sum;	// Round-trip time (s)
+	uint32_t histogram[INTF_HISTOGRAM_BINS];
+};
 
 #include "machine_header.h"
 #include "mch_sdo_def.h"
 
-void mch_sdo_queue_write(mch_sdo_t *machine, uint16_t index, uint8_t subindex, uint32_t value, uint8_t size);
-void mch_sdo_queue_read(mch_sdo_t *machine, uint16_t index, uint8_t subindex);
+int mch_sdo_queue_write(mch_sdo_t *machine, uint16_t index, uint8_t subindex, uint32_t value, uint8_t size);
+int mch_sdo_queue_read(mch_sdo_t *machine, uint16_t index, uint8_t subindex);
+void mch_sdo_resync(mch_sdo_t *machine);
+void mch_sdo_forget_callbacks(mch_sdo_t *machine, void *data);
+const char *mch_sdo_abort_to_message(uint32_t code);
+
+void mch_sdo_set_timeout(mch_sdo_t *machine, double timeout, int retries);
+
+bool mch_sdo_shadow_holds(mch_sdo_t *machine, uint16_t index, uint8_t subindex, uint32_t value, uint8_t size);
+void mch_sdo_invalidate_shadow(mch_sdo_t *machine);
+
+void mch_sdo_get_stats(mch_sdo_t *machine, mch_sdo_stats_t *stats);
+void mch_sdo_get_class_stats(mch_sdo_t *machine, int sdo_class, mch_sdo_class_stats_t *stats);
+const mch_sdo_rtt_stats_t *mch_sdo_get_rtt_stats(mch_sdo_t *machine, uint16_t index);
+void mch_sdo_reset_stats(mch_sdo_t *machine);
+int mch_sdo_format_stats(mch_sdo_t *machine, char *buffer, int size);
 
-void mch_sdo_queue_write_with_cb(mch_sdo_t *machine, 
+int mch_sdo_queue_write_with_cb(mch_sdo_t *machine, 
 	uint16_t index, uint8_t subindex, uint32_t value, uint8_t size,
 	sdo_write_callback_t write_callback, sdo_abort_callback_t abort_callback, void *data);
 
-void mch_sdo_queue_read_with_cb(mch_sdo_t *machine, 
-  uint16_t index, uint8_t subindex, uint32_t value,
-  sdo_read_callback_t read_callback, sdo_abort_callback_t abort_callback, void *data);
+int mch_sdo_queue_write_scheduled(mch_sdo_t *machine,
+	uint16_t index, uint8_t subindex, uint32_t value, uint8_t size, int sdo_class, double deadline,
+	sdo_write_callback_t write_callback, sdo_abort_callback_t abort_callback, void *data);
+
+int mch_sdo_queue_read_with_cb(mch_sdo_t *machine,
+	uint16_t index, uint8_t subindex,
+	sdo_read_callback_t read_callback, sdo_abort_callback_t abort_callback, void *data);
+
+int mch_sdo_queue_download(mch_sdo_t *machine, uint16_t index, uint8_t subindex,
+	const uint8_t *buffer, uint32_t size, bool block,
+	sdo_write_callback_t write_callback, sdo_abort_callback_t abort_callback, void *data);
+
+int mch_sdo_queue_upload(mch_sdo_t *machine, uint16_t index, uint8_t subindex,
+	uint8_t *buffer, uint32_t size, bool block,
+	sdo_transfer_callback_t transfer_callback, sdo_abort_callback_t abort_callback, void *data);
 
 #endif
 
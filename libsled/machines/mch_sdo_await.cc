@@ -0,0 +1,290 @@
+#include "mch_sdo_await.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+
+static double get_time()
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return double(ts.tv_sec) + double(ts.tv_nsec) / 1000.0 / 1000.0 / 1000.0;
+}
+
+
+sdo_batch_t::sdo_batch_t(mch_sdo_t *machine)
+	: machine(machine), pending(0), failed(-1), queueing(-1)
+{
+	assert(machine);
+}
+
+
+sdo_batch_t::~sdo_batch_t()
+{
+	if(pending > 0)
+		mch_sdo_forget_callbacks(machine, (void *) this);
+}
+
+
+/**
+ * First step of a request to index:subindex that did not complete,
+ * requests to the same object complete in the order they were queued.
+ * Callbacks invoked while a request is queued (it was dropped, or
+ * the drive holds the value already) belong to that request.
+ */
+static sdo_step_t *mch_sdo_batch_find(sdo_batch_t *batch, uint16_t index, uint8_t subindex)
+{
+	if(batch->queueing >= 0)
+		return &batch->steps[batch->queueing];
+
+	for(size_t i = 0; i < batch->steps.size(); i++) {
+		sdo_step_t *step = &batch->steps[i];
+
+		if(!step->done && step->index == index && step->subindex == subindex)
+			return step;
+	}
+
+	return NULL;
+}
+
+
+/**
+ * Mark step as completed and resume the awaiting coroutine when
+ * the batch completed or the step failed.
+ */
+static void mch_sdo_batch_complete(sdo_batch_t *batch, sdo_step_t *step, bool ok)
+{
+	step->done = true;
+	step->ok = ok;
+	step->latency = get_time() - step->queued;
+
+	batch->pending--;
+
+	if(!ok && batch->failed < 0)
+		batch->failed = int(step - &batch->steps[0]);
+
+	if(!batch->waiter || !batch->await_ready())
+		return;
+
+	std::coroutine_handle<> waiter = batch->waiter;
+	batch->waiter = std::coroutine_handle<>();
+	waiter.resume();
+}
+
+
+static void mch_sdo_batch_on_write(void *data, uint16_t index, uint8_t subindex)
+{
+	sdo_batch_t *batch = (sdo_batch_t *) data;
+	sdo_step_t *step = mch_sdo_batch_find(batch, index, subindex);
+
+	assert(step);
+	mch_sdo_batch_complete(batch, step, true);
+}
+
+
+static void mch_sdo_batch_on_read(void *data, uint16_t index, uint8_t subindex, uint32_t value)
+{
+	sdo_batch_t *batch = (sdo_batch_t *) data;
+	sdo_step_t *step = mch_sdo_batch_find(batch, index, subindex);
+
+	assert(step);
+	step->value = value;
+	mch_sdo_batch_complete(batch, step, true);
+}
+
+
+static void mch_sdo_batch_on_abort(void *data, uint16_t index, uint8_t subindex, uint32_t code)
+{
+	sdo_batch_t *batch = (sdo_batch_t *) data;
+	sdo_step_t *step = mch_sdo_batch_find(batch, index, subindex);
+
+	assert(step);
+	step->abort_code = code;
+	mch_sdo_batch_complete(batch, step, false);
+}
+
+
+static int mch_sdo_batch_add(sdo_batch_t *batch, bool is_write, uint16_t index, uint8_t subindex, uint32_t value)
+{
+	sdo_step_t step;
+
+	step.index = index;
+	step.subindex = subindex;
+	step.is_write = is_write;
+	step.done = false;
+	step.ok = false;
+	step.abort_code = 0;
+	step.value = value;
+	step.queued = get_time();
+	step.latency = 0.0;
+
+	batch->steps.push_back(step);
+	batch->pending++;
+
+	batch->queueing = int(batch->steps.size()) - 1;
+	return batch->queueing;
+}
+
+
+/**
+ * Request of a step was queued, or not when the result is -1.
+ * A request that did not fit fails its step and thereby the batch.
+ */
+static void mch_sdo_batch_queued(sdo_batch_t *batch, int i, int result)
+{
+	batch->queueing = -1;
+
+	sdo_step_t *step = &batch->steps[i];
+
+	if(result == -1 && !step->done)
+		mch_sdo_batch_complete(batch, step, false);
+}
+
+
+/**
+ * Queue write as part of the batch.
+ *
+ * The step is added before the request is queued, a request that
+ * does not fit in the queue fails its step (abort code 0) and the
+ * batch right away.
+ */
+void mch_sdo_batch_write(sdo_batch_t *batch, uint16_t index, uint8_t subindex, uint32_t value, uint8_t size)
+{
+	assert(batch);
+
+	int i = mch_sdo_batch_add(batch, true, index, subindex, value);
+
+	int result = mch_sdo_queue_write_with_cb(batch->machine, index, subindex, value, size,
+		mch_sdo_batch_on_write, mch_sdo_batch_on_abort, (void *) batch);
+
+	mch_sdo_batch_queued(batch, i, result);
+}
+
+
+/**
+ * Queue read as part of the batch, the value is stored in its step.
+ * Like writes, a read that does not fit fails the batch right away.
+ */
+void mch_sdo_batch_read(sdo_batch_t *batch, uint16_t index, uint8_t subindex)
+{
+	assert(batch);
+
+	int i = mch_sdo_batch_add(batch, false, index, subindex, 0);
+
+	int result = mch_sdo_queue_read_with_cb(batch->machine, index, subindex,
+		mch_sdo_batch_on_read, mch_sdo_batch_on_abort, (void *) batch);
+
+	mch_sdo_batch_queued(batch, i, result);
+}
+
+
+/**
+ * Completed step that took longest.
+ *
+ * @return Step or NULL when no step completed.
+ */
+const sdo_step_t *mch_sdo_batch_slowest(const sdo_batch_t *batch)
+{
+	assert(batch);
+
+	const sdo_step_t *slowest = NULL;
+
+	for(size_t i = 0; i < batch->steps.size(); i++) {
+		const sdo_step_t *step = &batch->steps[i];
+
+		if(step->done && (!slowest || step->latency > slowest->latency))
+			slowest = step;
+	}
+
+	return slowest;
+}
+
+
+sdo_request_t::sdo_request_t(mch_sdo_t *machine, uint16_t index, uint8_t subindex)
+	: sdo_batch_t(machine)
+{
+	mch_sdo_batch_read(this, index, subindex);
+}
+
+
+sdo_request_t::sdo_request_t(mch_sdo_t *machine, uint16_t index, uint8_t subindex, uint32_t value, uint8_t size)
+	: sdo_batch_t(machine)
+{
+	mch_sdo_batch_write(this, index, subindex, value, size);
+}
+
+
+void sdo_sequence_t::final_awaiter_t::await_suspend(handle_t handle) noexcept
+{
+	// The callback may destroy the coroutine, copy it first
+	promise_type &promise = handle.promise();
+	sdo_sequence_callback_t callback = promise.callback;
+	void *data = promise.data;
+
+	if(callback)
+		callback(data);
+}
+
+
+void sdo_sequence_t::promise_type::unhandled_exception()
+{
+	fprintf(stderr, "Unhandled exception in SDO sequence.\n");
+	abort();
+}
+
+
+sdo_sequence_t::sdo_sequence_t(sdo_sequence_t &&other)
+	: handle(other.handle)
+{
+	other.handle = handle_t();
+}
+
+
+sdo_sequence_t &sdo_sequence_t::operator=(sdo_sequence_t &&other)
+{
+	if(this == &other)
+		return *this;
+
+	if(handle)
+		handle.destroy();
+
+	handle = other.handle;
+	other.handle = handle_t();
+
+	return *this;
+}
+
+
+sdo_sequence_t::~sdo_sequence_t()
+{
+	if(handle)
+		handle.destroy();
+}
+
+
+/**
+ * Run sequence until it awaits its first request.
+ *
+ * @param callback  Invoked when the sequence returns, may be NULL.
+ */
+void mch_sdo_sequence_start(sdo_sequence_t *sequence, sdo_sequence_callback_t callback, void *data)
+{
+	assert(sequence && sequence->handle);
+
+	sequence->handle.promise().callback = callback;
+	sequence->handle.promise().data = data;
+	sequence->handle.resume();
+}
+
+
+/**
+ * Whether the sequence returned (or was never created).
+ */
+bool mch_sdo_sequence_done(const sdo_sequence_t *sequence)
+{
+	assert(sequence);
+
+	return !sequence->handle || sequence->handle.done();
+}
@@ -0,0 +1,126 @@
+#ifndef __MCH_SDO_AWAIT_H__
+#define __MCH_SDO_AWAIT_H__
+
+#include "mch_sdo.h"
+
+#include <coroutine>
+#include <vector>
+
+/**
+ * SDO requests that can be awaited in C++20 coroutines, such that a
+ * sequence of requests reads as straight-line code instead of a chain
+ * of callbacks. Coroutines are resumed from the SDO callbacks, i.e.
+ * from the event loop that drives the SDO machine.
+ *
+ *   static sdo_sequence_t read_fault(mch_sdo_t *mch_sdo)
+ *   {
+ *       sdo_step_t step = co_await sdo_request_t(mch_sdo, 0x3518, 0x01);
+ *       if(step.ok)
+ *           ...
+ *   }
+ *
+ * Requests are queued when they are created, requests added to a batch
+ * are sent back to back (as they are queued in order) and are awaited
+ * together.
+ */
+
+/**
+ * A single request of a batch, latency is the time from queueing it
+ * until its response arrived (s).
+ */
+struct sdo_step_t {
+	uint16_t index;
+	uint8_t subindex;
+	bool is_write;
+
+	bool done;
+	bool ok;
+	uint32_t abort_code;	// When done and not ok, 0 when dropped
+	uint32_t value;			// Value written or read
+
+	double queued;
+	double latency;
+};
+
+/**
+ * Requests awaited together. Awaiting the batch resumes the coroutine
+ * once every request completed (true) or as soon as one failed (false).
+ * Callbacks of requests that did not complete are forgotten when the
+ * batch goes out of scope.
+ */
+struct sdo_batch_t {
+	explicit sdo_batch_t(mch_sdo_t *machine);
+	~sdo_batch_t();
+
+	sdo_batch_t(const sdo_batch_t &) = delete;
+	sdo_batch_t &operator=(const sdo_batch_t &) = delete;
+
+	bool await_ready() const { return pending == 0 || failed >= 0; }
+	void await_suspend(std::coroutine_handle<> handle) { waiter = handle; }
+	bool await_resume() const { return failed < 0; }
+
+	mch_sdo_t *machine;
+	std::vector<sdo_step_t> steps;
+	int pending;		// Requests not completed yet
+	int failed;			// Step that failed first, -1 if none
+	int queueing;		// Step whose request is being queued, -1 if none
+	std::coroutine_handle<> waiter;
+};
+
+void mch_sdo_batch_write(sdo_batch_t *batch, uint16_t index, uint8_t subindex, uint32_t value, uint8_t size);
+void mch_sdo_batch_read(sdo_batch_t *batch, uint16_t index, uint8_t subindex);
+const sdo_step_t *mch_sdo_batch_slowest(const sdo_batch_t *batch);
+
+/**
+ * Single read or write, awaiting it yields its step.
+ */
+struct sdo_request_t : sdo_batch_t {
+	sdo_request_t(mch_sdo_t *machine, uint16_t index, uint8_t subindex);
+	sdo_request_t(mch_sdo_t *machine, uint16_t index, uint8_t subindex, uint32_t value, uint8_t size);
+
+	const sdo_step_t &await_resume() const { return steps[0]; }
+};
+
+/**
+ * Coroutine that runs a sequence of requests. It starts when passed
+ * to mch_sdo_sequence_start and invokes the callback when it returns.
+ * Destroying the sequence stops it (if it did not return yet).
+ */
+typedef void(*sdo_sequence_callback_t)(void *data);
+
+struct sdo_sequence_t {
+	struct promise_type;
+	typedef std::coroutine_handle<promise_type> handle_t;
+
+	// Invokes the callback once the coroutine is suspended, the
+	// callback may destroy the sequence
+	struct final_awaiter_t {
+		bool await_ready() noexcept { return false; }
+		void await_suspend(handle_t handle) noexcept;
+		void await_resume() noexcept {}
+	};
+
+	struct promise_type {
+		sdo_sequence_callback_t callback;
+		void *data;
+
+		sdo_sequence_t get_return_object() { return sdo_sequence_t(handle_t::from_promise(*this)); }
+		std::suspend_always initial_suspend() noexcept { return std::suspend_always(); }
+		final_awaiter_t final_suspend() noexcept { return final_awaiter_t(); }
+		void return_void() {}
+		void unhandled_exception();
+	};
+
+	sdo_sequence_t() : handle() {}
+	explicit sdo_sequence_t(handle_t handle) : handle(handle) {}
+	sdo_sequence_t(sdo_sequence_t &&other);
+	sdo_sequence_t &operator=(sdo_sequence_t &&other);
+	~sdo_sequence_t();
+
+	handle_t handle;
+};
+
+void mch_sdo_sequence_start(sdo_sequence_t *sequence, sdo_sequence_callback_t callback, void *data);
+bool mch_sdo_sequence_done(const sdo_sequence_t *sequence);
+
+#endif
@@ -7,6 +7,8 @@ BEGIN_EVENTS
 	EVENT(EV_NET_SDO_ENABLED)		// From net machine (mch_net.cc)
 
 	EVENT(EV_SDO_ITEM_AVAILABLE)	// Internal event
+	EVENT(EV_SDO_TIMEOUT)			// Internal event
+	EVENT(EV_SDO_TRANSFER_ABORTED)	// Internal event
 
 	EVENT(EV_SDO_READ_RESPONSE)		// From CANOpen (interface.cc)
 	EVENT(EV_SDO_WRITE_RESPONSE)	// From CANOpen (interface.cc)
@@ -24,12 +26,86 @@ BEGIN_CALLBACKS
 END_CALLBACKS
 
 BEGIN_FIELDS
+	FIELD(event_base *, ev_base)
 	FIELD(intf_t *, interface)
+	FIELD(uint8_t, node)
+	FIELD(int, queue_size)
 
-	FIELD_DECL(std::queue<sdo_t *>, sdo_queue)
+	// Pool of queue_size requests, free ones are linked together, the
+	// others are queued by class or active (sdo_count includes both)
+	FIELD_DECL(std::vector<sdo_t>, sdo_pool)
+	FIELD_DECL(sdo_class_queues_t, sdo_classes)
+	FIELD_DECL(sdo_t *, sdo_free)
+	FIELD_DECL(int, sdo_count)
 	FIELD_DECL(sdo_t *, sdo_active)
 
+	// Deepest queue, requests dropped because the queue was full
+	// and writes merged into a queued write to the same object
+	FIELD_DECL(int, max_depth)
+	FIELD_DECL(uint32_t, overflows)
+	FIELD_DECL(uint32_t, coalesced)
+
+	// Requests sent again because their response may have been lost
+	FIELD_DECL(uint32_t, resyncs)
+
+	// Time to wait for a response (s) and number of times to resend
+	FIELD_DECL(event *, timeout_timer)
+	FIELD_DECL(double, timeout)
+	FIELD_DECL(int, retries)
+
+	// Responses that did not arrive in time, requests resent
+	// because of it and requests given up on
+	FIELD_DECL(uint32_t, timeouts)
+	FIELD_DECL(uint32_t, retried)
+	FIELD_DECL(uint32_t, failures)
+
+	// Round-trip times by object index
+	FIELD_DECL(rtt_stats_map_t, rtt_stats)
+
+	// State of the active segmented or block transfer and the
+	// timer sending the next burst of block segments
+	FIELD_DECL(sdo_transfer_t, transfer)
+	FIELD_DECL(event *, pace_timer)
+
+	// Transfers completed and aborted, bytes and time (s) of
+	// completed transfers and throughput of the last one (B/s)
+	FIELD_DECL(uint32_t, transfers)
+	FIELD_DECL(uint32_t, transfer_failures)
+	FIELD_DECL(uint64_t, transfer_bytes)
+	FIELD_DECL(double, transfer_time)
+	FIELD_DECL(double, last_rate)
+
+	// Last value confirmed by the drive for objects that only change
+	// when written (see mch_sdo_shadowable), writes of the same value
+	// again are skipped
+	FIELD_DECL(shadow_map_t, shadow)
+	FIELD_DECL(uint32_t, shadow_hits)
+	FIELD_DECL(uint32_t, shadow_misses)
+	FIELD_DECL(uint32_t, shadow_invalidations)
+
+	FIELD_INIT(sdo_pool, std::vector<sdo_t>(queue_size))
+	FIELD_INIT(sdo_free, mch_sdo_init_pool(machine))
+	FIELD_INIT(sdo_count, 0)
 	FIELD_INIT(sdo_active, NULL)
+	FIELD_INIT(max_depth, 0)
+	FIELD_INIT(overflows, 0)
+	FIELD_INIT(coalesced, 0)
+	FIELD_INIT(resyncs, 0)
+	FIELD_INIT(timeout_timer, NULL)
+	FIELD_INIT(timeout, MCH_SDO_TIMEOUT)
+	FIELD_INIT(retries, MCH_SDO_RETRIES)
+	FIELD_INIT(timeouts, 0)
+	FIELD_INIT(retried, 0)
+	FIELD_INIT(failures, 0)
+	FIELD_INIT(pace_timer, NULL)
+	FIELD_INIT(transfers, 0)
+	FIELD_INIT(transfer_failures, 0)
+	FIELD_INIT(transfer_bytes, 0)
+	FIELD_INIT(transfer_time, 0.0)
+	FIELD_INIT(last_rate, 0.0)
+	FIELD_INIT(shadow_hits, 0)
+	FIELD_INIT(shadow_misses, 0)
+	FIELD_INIT(shadow_invalidations, 0)
 END_FIELDS
 
 GENERATE_DEFAULT_FUNCTIONS
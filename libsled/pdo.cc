@@ -0,0 +1,99 @@
+#include "pdo.h"
+
+#include <assert.h>
+#include <string.h>
+
+
+/**
+ * Unpack little-endian value of type T. The type is known when the
+ * decoder is compiled, such that decoding does not depend on it.
+ */
+template<typename T, typename U>
+static void pdo_unpack(const uint8_t *src, uint8_t *dst)
+{
+	U value = 0;
+	for(size_t i = 0; i < sizeof(U); i++)
+		value |= U(src[i]) << (8 * i);
+
+	T result = T(value);
+	memcpy(dst, &result, sizeof(T));
+}
+
+#define PDO_OBJECT(index, subindex, type, utype, field, name) \
+	{ index, subindex, 8 * sizeof(type), offsetof(pdo_sample_t, field), pdo_unpack<type, utype>, name }
+
+
+/**
+ * Objects by pdo_object_id_t.
+ */
+const pdo_object_t pdo_objects[PDO_NUM_OBJECTS] = {
+	PDO_OBJECT(0x6041, 0x00, uint16_t, uint16_t, status_word, "status word"),
+	PDO_OBJECT(0x6061, 0x00, int8_t, uint8_t, mode, "mode of operation"),
+	PDO_OBJECT(0x6064, 0x00, int32_t, uint32_t, position, "position"),
+	PDO_OBJECT(0x606C, 0x00, int32_t, uint32_t, velocity, "velocity"),
+	PDO_OBJECT(0x60F4, 0x00, int32_t, uint32_t, following_error, "following error"),
+	PDO_OBJECT(0x6078, 0x00, int16_t, uint16_t, current, "current"),
+	PDO_OBJECT(OB_ACTIVE_TASK, 0x00, uint16_t, uint16_t, active_task, "active motion task")
+};
+
+
+/**
+ * Transmit PDOs of the drive. TPDO1 reports the device state and
+ * TPDO2 the actual position, both on change (at most every 1 ms)
+ * and at least every 10 ms. TPDO3 and TPDO4 are not used.
+ */
+const pdo_mapping_t pdo_tpdo_mapping[INTF_NUM_TPDOS] = {
+	{ 0xFF, 0x0A, 0x0A, 2, { PDO_STATUS_WORD, PDO_MODE } },
+	{ 0xFF, 0x0A, 0x0A, 2, { PDO_POSITION, PDO_VELOCITY } },
+	{ 0xFF, 0x00, 0x00, 0, { } },
+	{ 0xFF, 0x00, 0x00, 0, { } }
+};
+
+
+/**
+ * Mapping entry (index, subindex and length) as written to 0x1A0n.
+ */
+uint32_t pdo_mapping_entry(pdo_object_id_t object)
+{
+	assert(object >= 0 && object < PDO_NUM_OBJECTS);
+
+	const pdo_object_t *o = &pdo_objects[object];
+	return (uint32_t(o->index) << 16) | (uint32_t(o->subindex) << 8) | o->bits;
+}
+
+
+/**
+ * Compile decoder for a mapping.
+ *
+ * @param mapping  Objects in the order they are mapped.
+ * @param decoder  Decoder to initialise.
+ * @return 0 on success, -1 if the objects do not fit in a frame.
+ */
+int pdo_compile(const pdo_mapping_t *mapping, pdo_decoder_t *decoder)
+{
+	assert(mapping && decoder);
+
+	decoder->count = 0;
+	decoder->length = 0;
+	decoder->fields = 0;
+
+	if(mapping->count < 0 || mapping->count > PDO_MAX_ENTRIES)
+		return -1;
+
+	for(int i = 0; i < mapping->count; i++) {
+		const pdo_object_t *object = &pdo_objects[mapping->objects[i]];
+
+		if(decoder->length + object->bits / 8 > 8)
+			return -1;
+
+		decoder->ops[i].src = decoder->length;
+		decoder->ops[i].dst = object->offset;
+		decoder->ops[i].unpack = object->unpack;
+
+		decoder->length += object->bits / 8;
+		decoder->fields |= PDO_FIELD(mapping->objects[i]);
+		decoder->count++;
+	}
+
+	return 0;
+}
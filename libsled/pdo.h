@@ -0,0 +1,102 @@
+#ifndef __PDO_H__
+#define __PDO_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "interface.h"
+
+/**
+ * Maximum number of objects mapped into a single PDO.
+ */
+#define PDO_MAX_ENTRIES 8
+
+/**
+ * Values of objects that can be mapped into a TPDO.
+ * Fields keep the last value received.
+ */
+struct pdo_sample_t {
+	uint16_t status_word;		// 0x6041
+	int8_t mode;				// 0x6061 Mode of operation display
+	int32_t position;			// 0x6064 Position actual value (um)
+	int32_t velocity;			// 0x606C Velocity actual value (um/s)
+	int32_t following_error;	// 0x60F4 Following error actual value (um)
+	int16_t current;			// 0x6078 Current actual value
+	uint16_t active_task;		// 0x2081 Active motion task
+};
+
+/**
+ * Objects that can be mapped, PDO_FIELD(object) is the bit
+ * in pdo_decoder_t::fields that is set when it is decoded.
+ */
+enum pdo_object_id_t {
+	PDO_STATUS_WORD,
+	PDO_MODE,
+	PDO_POSITION,
+	PDO_VELOCITY,
+	PDO_FOLLOWING_ERROR,
+	PDO_CURRENT,
+	PDO_ACTIVE_TASK,
+	PDO_NUM_OBJECTS
+};
+
+#define PDO_FIELD(object) (1u << (object))
+
+typedef void(*pdo_unpack_t)(const uint8_t *src, uint8_t *dst);
+
+/**
+ * Object dictionary entry and the sample field it is decoded into.
+ */
+struct pdo_object_t {
+	uint16_t index;
+	uint8_t subindex;
+	uint8_t bits;
+	size_t offset;
+	pdo_unpack_t unpack;
+	const char *name;
+};
+
+/**
+ * TPDO configuration, uploaded by the network state machine.
+ * A PDO without objects is disabled.
+ */
+struct pdo_mapping_t {
+	uint8_t transmission_type;	// 0xFF: event triggered
+	uint16_t inhibit_time;		// 100 us
+	uint16_t event_timer;		// ms
+	int count;
+	pdo_object_id_t objects[PDO_MAX_ENTRIES];
+};
+
+/**
+ * Decoder compiled from a mapping.
+ */
+struct pdo_decoder_t {
+	int count;
+	int length;			// Bytes occupied in the frame
+	uint32_t fields;	// PDO_FIELD of each object decoded
+
+	struct {
+		uint8_t src;
+		uint16_t dst;
+		pdo_unpack_t unpack;
+	} ops[PDO_MAX_ENTRIES];
+};
+
+extern const pdo_object_t pdo_objects[PDO_NUM_OBJECTS];
+extern const pdo_mapping_t pdo_tpdo_mapping[INTF_NUM_TPDOS];
+
+uint32_t pdo_mapping_entry(pdo_object_id_t object);
+int pdo_compile(const pdo_mapping_t *mapping, pdo_decoder_t *decoder);
+
+
+/**
+ * Unpack mapped objects of a received PDO into the sample.
+ */
+static inline void pdo_decode(const pdo_decoder_t *decoder, const uint8_t *data, pdo_sample_t *sample)
+{
+	for(int i = 0; i < decoder->count; i++)
+		decoder->ops[i].unpack(data + decoder->ops[i].src, (uint8_t *) sample + decoder->ops[i].dst);
+}
+
+#endif
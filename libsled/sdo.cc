@@ -0,0 +1,474 @@
+#include "sdo.h"
+
+#include <assert.h>
+#include <string.h>
+
+
+static void sdo_put_u32(uint8_t *dst, uint32_t value)
+{
+	for(int i = 0; i < 4; i++)
+		dst[i] = (value >> (8 * i)) & 0xFF;
+}
+
+
+static uint32_t sdo_get_u32(const uint8_t *src)
+{
+	return src[0] + (src[1] << 8) + (src[2] << 16) + (uint32_t(src[3]) << 24);
+}
+
+
+/**
+ * Start frame with command specifier and multiplexer of the transfer.
+ */
+static void sdo_put_header(sdo_transfer_t *transfer, uint8_t *frame, uint8_t command)
+{
+	memset(frame, 0, 8);
+	frame[0] = command;
+	frame[1] = transfer->index & 0xFF;
+	frame[2] = transfer->index >> 8;
+	frame[3] = transfer->subindex;
+}
+
+
+/**
+ * Whether a response is for the object of the transfer.
+ */
+static bool sdo_is_response_to(sdo_transfer_t *transfer, const uint8_t *response)
+{
+	return response[1] + (response[2] << 8) == transfer->index && response[3] == transfer->subindex;
+}
+
+
+/**
+ * CRC of block transfers (CRC-16-CCITT, polynomial 0x1021).
+ *
+ * @param crc  CRC of the preceding data, 0 to start.
+ */
+uint16_t sdo_crc16(const uint8_t *data, uint32_t size, uint16_t crc)
+{
+	for(uint32_t i = 0; i < size; i++) {
+		crc ^= uint16_t(data[i]) << 8;
+
+		for(int bit = 0; bit < 8; bit++)
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+	}
+
+	return crc;
+}
+
+
+/**
+ * Prepare transfer of an object.
+ *
+ * @param upload  Read the object from the node, rather than write it.
+ * @param block  Block transfer, rather than segmented.
+ * @param buffer  Data to write, or buffer to read into.
+ * @param size  Bytes to write, or size of the buffer.
+ */
+void sdo_transfer_init(sdo_transfer_t *transfer, uint16_t index, uint8_t subindex,
+	bool upload, bool block, uint8_t *buffer, uint32_t size)
+{
+	assert(transfer && (buffer || size == 0));
+
+	memset(transfer, 0, sizeof(sdo_transfer_t));
+
+	transfer->index = index;
+	transfer->subindex = subindex;
+	transfer->upload = upload;
+	transfer->block = block;
+	transfer->buffer = buffer;
+	transfer->size = size;
+	transfer->phase = SDO_PHASE_INITIATE;
+}
+
+
+/**
+ * Initiate request, the first frame of the transfer.
+ */
+void sdo_transfer_begin(sdo_transfer_t *transfer, uint8_t *frame)
+{
+	assert(transfer && frame);
+
+	if(transfer->upload && transfer->block) {
+		sdo_put_header(transfer, frame, 0xA4);
+		frame[4] = SDO_MAX_BLOCK_SIZE;
+	} else if(transfer->upload) {
+		sdo_put_header(transfer, frame, 0x40);
+	} else {
+		sdo_put_header(transfer, frame, transfer->block ? 0xC6 : 0x21);
+		sdo_put_u32(frame + 4, transfer->size);
+	}
+
+	transfer->phase = SDO_PHASE_INITIATE;
+}
+
+
+/**
+ * Abort request, ending the transfer.
+ */
+void sdo_transfer_abort(sdo_transfer_t *transfer, uint32_t code, uint8_t *frame)
+{
+	assert(transfer && frame);
+
+	sdo_put_header(transfer, frame, 0x80);
+	sdo_put_u32(frame + 4, code);
+
+	transfer->abort_code = code;
+	transfer->phase = SDO_PHASE_DONE;
+}
+
+
+static int sdo_fail(sdo_transfer_t *transfer, uint32_t code, uint8_t *reply)
+{
+	sdo_transfer_abort(transfer, code, reply);
+	return SDO_REPLY | SDO_FAILED;
+}
+
+
+/**
+ * Next segment of a segmented download.
+ */
+static int sdo_download_segment(sdo_transfer_t *transfer, uint8_t *reply)
+{
+	uint32_t n = transfer->size - transfer->length;
+	if(n > SDO_SEGMENT_SIZE)
+		n = SDO_SEGMENT_SIZE;
+
+	bool last = (transfer->length + n == transfer->size);
+
+	memset(reply, 0, 8);
+	reply[0] = (transfer->toggle << 4) | ((SDO_SEGMENT_SIZE - n) << 1) | (last ? 1 : 0);
+	memcpy(reply + 1, transfer->buffer + transfer->length, n);
+
+	transfer->length += n;
+	return SDO_REPLY;
+}
+
+
+static int sdo_initiate_response(sdo_transfer_t *transfer, const uint8_t *response, uint8_t *reply)
+{
+	uint8_t command = response[0];
+
+	// Response to an earlier request that was given up on
+	if(!sdo_is_response_to(transfer, response))
+		return 0;
+
+	// Segmented download
+	if(!transfer->upload && !transfer->block) {
+		if(command != 0x60)
+			return sdo_fail(transfer, SDO_ABORT_COMMAND, reply);
+
+		transfer->phase = SDO_PHASE_SEGMENT;
+		return sdo_download_segment(transfer, reply);
+	}
+
+	// Block download
+	if(!transfer->upload) {
+		if((command & 0xFB) != 0xA0)
+			return sdo_fail(transfer, SDO_ABORT_COMMAND, reply);
+
+		if(response[4] == 0 || response[4] > SDO_MAX_BLOCK_SIZE)
+			return sdo_fail(transfer, SDO_ABORT_BLOCK_SIZE, reply);
+
+		transfer->crc = (command & 0x04) != 0;
+		transfer->blksize = response[4];
+		transfer->seqno = 0;
+		transfer->block_start = 0;
+		transfer->phase = SDO_PHASE_BLOCK;
+		return SDO_SEGMENTS;
+	}
+
+	// Segmented upload, small objects may be
+	// answered with an expedited upload instead
+	if((command & 0xE0) == 0x40) {
+		if(command & 0x02) {
+			uint32_t n = (command & 0x01) ? 4 - ((command >> 2) & 0x03) : 4;
+
+			if(n > transfer->size)
+				return sdo_fail(transfer, SDO_ABORT_MEMORY, reply);
+
+			memcpy(transfer->buffer, response + 4, n);
+			transfer->length = n;
+			transfer->phase = SDO_PHASE_DONE;
+			return SDO_DONE;
+		}
+
+		if(transfer->block)
+			return sdo_fail(transfer, SDO_ABORT_COMMAND, reply);
+
+		if(command & 0x01) {
+			transfer->indicated = sdo_get_u32(response + 4);
+			if(transfer->indicated > transfer->size)
+				return sdo_fail(transfer, SDO_ABORT_MEMORY, reply);
+		}
+
+		transfer->phase = SDO_PHASE_SEGMENT;
+		memset(reply, 0, 8);
+		reply[0] = 0x60;
+		return SDO_REPLY;
+	}
+
+	// Block upload
+	if(!transfer->block || (command & 0xF9) != 0xC0)
+		return sdo_fail(transfer, SDO_ABORT_COMMAND, reply);
+
+	if(command & 0x02) {
+		transfer->indicated = sdo_get_u32(response + 4);
+		if(transfer->indicated > transfer->size)
+			return sdo_fail(transfer, SDO_ABORT_MEMORY, reply);
+	}
+
+	transfer->crc = (command & 0x04) != 0;
+	transfer->blksize = SDO_MAX_BLOCK_SIZE;
+	transfer->seqno = 0;
+	transfer->phase = SDO_PHASE_BLOCK;
+
+	memset(reply, 0, 8);
+	reply[0] = 0xA3;
+	return SDO_REPLY;
+}
+
+
+static int sdo_segment_response(sdo_transfer_t *transfer, const uint8_t *response, uint8_t *reply)
+{
+	uint8_t command = response[0];
+
+	if(((command >> 4) & 0x01) != transfer->toggle)
+		return sdo_fail(transfer, SDO_ABORT_TOGGLE, reply);
+
+	// Download, segment acknowledged
+	if(!transfer->upload) {
+		if((command & 0xEF) != 0x20)
+			return sdo_fail(transfer, SDO_ABORT_COMMAND, reply);
+
+		transfer->toggle ^= 1;
+
+		if(transfer->length == transfer->size) {
+			transfer->phase = SDO_PHASE_DONE;
+			return SDO_DONE;
+		}
+
+		return sdo_download_segment(transfer, reply);
+	}
+
+	// Upload, segment received
+	if((command & 0xE0) != 0x00)
+		return sdo_fail(transfer, SDO_ABORT_COMMAND, reply);
+
+	uint32_t n = SDO_SEGMENT_SIZE - ((command >> 1) & 0x07);
+
+	if(transfer->length + n > transfer->size)
+		return sdo_fail(transfer, SDO_ABORT_MEMORY, reply);
+
+	memcpy(transfer->buffer + transfer->length, response + 1, n);
+	transfer->length += n;
+	transfer->toggle ^= 1;
+
+	if(command & 0x01) {
+		if(transfer->indicated && transfer->length != transfer->indicated)
+			return sdo_fail(transfer, SDO_ABORT_LENGTH, reply);
+
+		transfer->phase = SDO_PHASE_DONE;
+		return SDO_DONE;
+	}
+
+	memset(reply, 0, 8);
+	reply[0] = 0x60 | (transfer->toggle << 4);
+	return SDO_REPLY;
+}
+
+
+/**
+ * Block of a download acknowledged. Segments after the last one
+ * received in sequence are sent again in the next block.
+ */
+static int sdo_block_ack(sdo_transfer_t *transfer, const uint8_t *response, uint8_t *reply)
+{
+	if(response[0] != 0xA2)
+		return sdo_fail(transfer, SDO_ABORT_COMMAND, reply);
+
+	uint8_t ackseq = response[1];
+
+	if(ackseq > transfer->seqno)
+		return sdo_fail(transfer, SDO_ABORT_SEQUENCE, reply);
+
+	if(response[2] == 0 || response[2] > SDO_MAX_BLOCK_SIZE)
+		return sdo_fail(transfer, SDO_ABORT_BLOCK_SIZE, reply);
+
+	bool complete = (ackseq == transfer->seqno && transfer->length == transfer->size);
+
+	// Bytes in the last segment
+	uint32_t last = transfer->size - (transfer->block_start + (transfer->seqno - 1) * SDO_SEGMENT_SIZE);
+
+	uint32_t acknowledged = transfer->block_start + ackseq * SDO_SEGMENT_SIZE;
+	transfer->length = (acknowledged < transfer->size) ? acknowledged : transfer->size;
+	transfer->block_start = transfer->length;
+	transfer->blksize = response[2];
+	transfer->seqno = 0;
+
+	if(!complete)
+		return SDO_SEGMENTS;
+
+	transfer->phase = SDO_PHASE_END;
+
+	uint16_t crc = transfer->crc ? sdo_crc16(transfer->buffer, transfer->size) : 0;
+
+	memset(reply, 0, 8);
+	reply[0] = 0xC1 | ((SDO_SEGMENT_SIZE - last) << 2);
+	reply[1] = crc & 0xFF;
+	reply[2] = crc >> 8;
+	return SDO_REPLY;
+}
+
+
+/**
+ * Segment of an upload block received. Segments out of sequence are
+ * dropped, the node sends them again after the acknowledgement.
+ */
+static int sdo_block_segment(sdo_transfer_t *transfer, const uint8_t *response, uint8_t *reply)
+{
+	uint8_t seqno = response[0] & 0x7F;
+	bool last = (response[0] & 0x80) != 0;
+
+	if(seqno == transfer->seqno + 1) {
+		// Length of the last segment follows at the end
+		if(last) {
+			memcpy(transfer->last, response + 1, SDO_SEGMENT_SIZE);
+		} else {
+			if(transfer->length + SDO_SEGMENT_SIZE > transfer->size)
+				return sdo_fail(transfer, SDO_ABORT_MEMORY, reply);
+
+			memcpy(transfer->buffer + transfer->length, response + 1, SDO_SEGMENT_SIZE);
+			transfer->length += SDO_SEGMENT_SIZE;
+		}
+
+		transfer->seqno = seqno;
+	}
+
+	if(!last && seqno < transfer->blksize)
+		return 0;
+
+	memset(reply, 0, 8);
+	reply[0] = 0xA2;
+	reply[1] = transfer->seqno;
+	reply[2] = transfer->blksize;
+
+	if(last && seqno == transfer->seqno)
+		transfer->phase = SDO_PHASE_END;
+
+	transfer->seqno = 0;
+	return SDO_REPLY;
+}
+
+
+static int sdo_end_response(sdo_transfer_t *transfer, const uint8_t *response, uint8_t *reply)
+{
+	uint8_t command = response[0];
+
+	// Download, end acknowledged
+	if(!transfer->upload) {
+		if(command != 0xA1)
+			return sdo_fail(transfer, SDO_ABORT_COMMAND, reply);
+
+		transfer->phase = SDO_PHASE_DONE;
+		return SDO_DONE;
+	}
+
+	// Upload, length of the last segment and CRC
+	if((command & 0xE3) != 0xC1)
+		return sdo_fail(transfer, SDO_ABORT_COMMAND, reply);
+
+	uint32_t n = SDO_SEGMENT_SIZE - ((command >> 2) & 0x07);
+
+	if(transfer->length + n > transfer->size)
+		return sdo_fail(transfer, SDO_ABORT_MEMORY, reply);
+
+	memcpy(transfer->buffer + transfer->length, transfer->last, n);
+	transfer->length += n;
+
+	if(transfer->indicated && transfer->length != transfer->indicated)
+		return sdo_fail(transfer, SDO_ABORT_LENGTH, reply);
+
+	uint16_t crc = response[1] + (response[2] << 8);
+	if(transfer->crc && sdo_crc16(transfer->buffer, transfer->length) != crc)
+		return sdo_fail(transfer, SDO_ABORT_CRC, reply);
+
+	transfer->phase = SDO_PHASE_DONE;
+
+	memset(reply, 0, 8);
+	reply[0] = 0xA1;
+	return SDO_REPLY | SDO_DONE;
+}
+
+
+/**
+ * Process frame received from the node.
+ *
+ * @param response  Frame received.
+ * @param reply  Frame to send when SDO_REPLY is returned.
+ * @return Combination of SDO_REPLY, SDO_SEGMENTS, SDO_DONE and
+ *   SDO_FAILED, 0 when the frame is ignored.
+ */
+int sdo_transfer_response(sdo_transfer_t *transfer, const uint8_t *response, uint8_t *reply)
+{
+	assert(transfer && response && reply);
+
+	// Aborted by the node, upload segments never look like this
+	// as their sequence number is at least one
+	if(response[0] == 0x80 && transfer->phase != SDO_PHASE_DONE) {
+		transfer->abort_code = sdo_get_u32(response + 4);
+		transfer->phase = SDO_PHASE_DONE;
+		return SDO_FAILED;
+	}
+
+	switch(transfer->phase) {
+		case SDO_PHASE_INITIATE:
+			return sdo_initiate_response(transfer, response, reply);
+
+		case SDO_PHASE_SEGMENT:
+			return sdo_segment_response(transfer, response, reply);
+
+		case SDO_PHASE_BLOCK:
+			if(transfer->upload)
+				return sdo_block_segment(transfer, response, reply);
+			return sdo_block_ack(transfer, response, reply);
+
+		case SDO_PHASE_END:
+			return sdo_end_response(transfer, response, reply);
+
+		case SDO_PHASE_DONE:
+			break;
+	}
+
+	return 0;
+}
+
+
+/**
+ * Next segment of a block download, after sdo_transfer_response
+ * returned SDO_SEGMENTS.
+ *
+ * @return True if this is the last segment of the block, the
+ *   acknowledgement of the node has to be awaited.
+ */
+bool sdo_transfer_next_segment(sdo_transfer_t *transfer, uint8_t *frame)
+{
+	assert(transfer && frame);
+	assert(transfer->phase == SDO_PHASE_BLOCK && !transfer->upload);
+
+	uint32_t n = transfer->size - transfer->length;
+	if(n > SDO_SEGMENT_SIZE)
+		n = SDO_SEGMENT_SIZE;
+
+	bool last = (transfer->length + n == transfer->size);
+
+	transfer->seqno++;
+
+	memset(frame, 0, 8);
+	frame[0] = (last ? 0x80 : 0x00) | transfer->seqno;
+	memcpy(frame + 1, transfer->buffer + transfer->length, n);
+
+	transfer->length += n;
+
+	return last || transfer->seqno == transfer->blksize;
+}
@@ -0,0 +1,86 @@
+#ifndef __SDO_H__
+#define __SDO_H__
+
+#include <stdint.h>
+
+/**
+ * Segmented and block SDO transfers (CiA 301), client side.
+ *
+ * The transfer does not send frames itself, every function fills
+ * the frame to send next. Expedited requests are sent by
+ * intf_send_read_req and intf_send_write_req instead.
+ */
+
+/**
+ * Bytes per segment and the largest number of
+ * segments per block.
+ */
+#define SDO_SEGMENT_SIZE 7
+#define SDO_MAX_BLOCK_SIZE 127
+
+/**
+ * Abort codes sent or received by a transfer.
+ */
+#define SDO_ABORT_TOGGLE 0x05030000		// Toggle bit not alternated
+#define SDO_ABORT_TIMEOUT 0x05040000	// SDO protocol timed out
+#define SDO_ABORT_COMMAND 0x05040001	// Command specifier not valid or unknown
+#define SDO_ABORT_BLOCK_SIZE 0x05040002	// Invalid block size
+#define SDO_ABORT_SEQUENCE 0x05040003	// Invalid sequence number
+#define SDO_ABORT_CRC 0x05040004		// CRC error
+#define SDO_ABORT_MEMORY 0x05040005		// Out of memory
+#define SDO_ABORT_LENGTH 0x06070010		// Length of service parameter does not match
+
+/**
+ * Result of sdo_transfer_response, a combination of:
+ */
+#define SDO_REPLY 0x01		// Send the reply frame
+#define SDO_SEGMENTS 0x02	// Send segments of the next block (see sdo_transfer_next_segment)
+#define SDO_DONE 0x04		// Transfer completed
+#define SDO_FAILED 0x08		// Transfer aborted, see abort_code
+
+enum sdo_phase_t {
+	SDO_PHASE_INITIATE,		// Waiting for response to the initiate request
+	SDO_PHASE_SEGMENT,		// Segmented transfer
+	SDO_PHASE_BLOCK,		// Sending or receiving blocks
+	SDO_PHASE_END,			// Waiting for end of a block transfer
+	SDO_PHASE_DONE
+};
+
+/**
+ * State of a single transfer. Downloads send size bytes of the
+ * buffer to the node, uploads receive at most size bytes into it.
+ */
+struct sdo_transfer_t {
+	uint16_t index;
+	uint8_t subindex;
+	bool upload;
+	bool block;
+
+	uint8_t *buffer;
+	uint32_t size;
+	uint32_t length;		// Bytes sent or received so far
+	uint32_t indicated;		// Size announced by the node (upload), 0 if unknown
+
+	sdo_phase_t phase;
+	uint8_t toggle;
+
+	// Block transfer
+	uint8_t blksize;
+	uint8_t seqno;			// Last segment sent or received in sequence
+	uint32_t block_start;	// Offset of the first segment in the block
+	bool crc;				// Both sides check the CRC
+	uint8_t last[SDO_SEGMENT_SIZE];	// Last segment of a block upload, until its length is known
+
+	uint32_t abort_code;
+};
+
+uint16_t sdo_crc16(const uint8_t *data, uint32_t size, uint16_t crc = 0);
+
+void sdo_transfer_init(sdo_transfer_t *transfer, uint16_t index, uint8_t subindex,
+	bool upload, bool block, uint8_t *buffer, uint32_t size);
+void sdo_transfer_begin(sdo_transfer_t *transfer, uint8_t *frame);
+int sdo_transfer_response(sdo_transfer_t *transfer, const uint8_t *response, uint8_t *reply);
+bool sdo_transfer_next_segment(sdo_transfer_t *transfer, uint8_t *frame);
+void sdo_transfer_abort(sdo_transfer_t *transfer, uint32_t code, uint8_t *frame);
+
+#endif
@@ -6,6 +6,7 @@
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <syslog.h>
 #include <time.h>
 
@@ -49,6 +50,8 @@ static void intf_on_nmt(intf_t *intf, void *payload, uint8_t state)
 	sled_t *sled = (sled_t *) payload;
 
 	switch(state) {
+		// Boot-up, the drive lost all values written to it
+		case 0x00: mch_sdo_invalidate_shadow(sled->mch_sdo); break;
 		case 0x04: mch_net_handle_event(sled->mch_net, EV_NET_STOPPED); break;
 		case 0x05: mch_net_handle_event(sled->mch_net, EV_NET_OPERATIONAL); break;
 		case 0x7F: mch_net_handle_event(sled->mch_net, EV_NET_PREOPERATIONAL); break;
@@ -59,98 +62,157 @@ static void intf_on_nmt(intf_t *intf, void *payload, uint8_t state)
 
 
 /**
- * Handle TPDO.
+ * Handle status word and mode of operation.
  */
-static void intf_on_tpdo(intf_t *intf, void *payload, int pdo, uint8_t *data)
+static void sled_on_status(sled_t *sled, uint16_t status, uint8_t mode)
 {
-	sled_t *sled = (sled_t *) payload;
-
-	if(pdo == 1) {
-		uint16_t status = (data[1] << 8) | data[0];
-		uint8_t mode = data[2];
+	if((status & 0x4F) == 0x40) mch_ds_handle_event(sled->mch_ds, EV_DS_NOT_READY_TO_SWITCH_ON);
+	if((status & 0x6F) == 0x21) mch_ds_handle_event(sled->mch_ds, EV_DS_READY_TO_SWITCH_ON);
+	if((status & 0x6F) == 0x23) mch_ds_handle_event(sled->mch_ds, EV_DS_SWITCHED_ON);
+	if((status & 0x6F) == 0x27) mch_ds_handle_event(sled->mch_ds, EV_DS_OPERATION_ENABLED);
+	if((status & 0x4F) == 0x08) mch_ds_handle_event(sled->mch_ds, EV_DS_FAULT);
+	if((status & 0x4F) == 0x0F) mch_ds_handle_event(sled->mch_ds, EV_DS_FAULT_REACTION_ACTIVE);
+	if((status & 0x6F) == 0x07) mch_ds_handle_event(sled->mch_ds, EV_DS_QUICK_STOP_ACTIVE);
+
+	if((status & 0x10) == 0x10)
+		mch_ds_handle_event(sled->mch_ds, EV_DS_VOLTAGE_ENABLED);
+	else
+		mch_ds_handle_event(sled->mch_ds, EV_DS_VOLTAGE_DISABLED);
+
+	if((status & 0x400) == 0x400)
+		mch_mp_handle_event(sled->mch_mp, EV_MP_TARGET_REACHED);
+
+	// Profile position (PP) mode
+	if(mode == 0x01) {
+		mch_mp_handle_event(sled->mch_mp, EV_MP_MODE_PP);
+
+		if((status & 0x1000) == 0x1000)
+			mch_mp_handle_event(sled->mch_mp, EV_MP_SETPOINT_ACK);
+		else
+			mch_mp_handle_event(sled->mch_mp, EV_MP_SETPOINT_NACK);
+	}
 
-		if((status & 0x4F) == 0x40) mch_ds_handle_event(sled->mch_ds, EV_DS_NOT_READY_TO_SWITCH_ON);
-		if((status & 0x6F) == 0x21) mch_ds_handle_event(sled->mch_ds, EV_DS_READY_TO_SWITCH_ON);
-		if((status & 0x6F) == 0x23) mch_ds_handle_event(sled->mch_ds, EV_DS_SWITCHED_ON);
-		if((status & 0x6F) == 0x27) mch_ds_handle_event(sled->mch_ds, EV_DS_OPERATION_ENABLED);
-		if((status & 0x4F) == 0x08) mch_ds_handle_event(sled->mch_ds, EV_DS_FAULT);
-		if((status & 0x4F) == 0x0F) mch_ds_handle_event(sled->mch_ds, EV_DS_FAULT_REACTION_ACTIVE);
-		if((status & 0x6F) == 0x07) mch_ds_handle_event(sled->mch_ds, EV_DS_QUICK_STOP_ACTIVE);
+	// Homing mode
+	if(mode == 0x06) {
+		mch_mp_handle_event(sled->mch_mp, EV_MP_MODE_HOMING);
 
-		if((status & 0x10) == 0x10)
-			mch_ds_handle_event(sled->mch_ds, EV_DS_VOLTAGE_ENABLED);
+		if((status & 0x1000) == 0x1000)
+			mch_mp_handle_event(sled->mch_mp, EV_MP_HOMED);
 		else
-			mch_ds_handle_event(sled->mch_ds, EV_DS_VOLTAGE_DISABLED);
+			mch_mp_handle_event(sled->mch_mp, EV_MP_NOTHOMED);
+	}
 
-		if((status & 0x400) == 0x400)
-			mch_mp_handle_event(sled->mch_mp, EV_MP_TARGET_REACHED);
+	// Interpolated positioning mode
+	if(mode == 0x07) {
+		mch_mp_handle_event(sled->mch_mp, EV_MP_MODE_IP);
+	}
+}
 
-		// Profile position (PP) mode
-		if(mode == 0x01) {
-			mch_mp_handle_event(sled->mch_mp, EV_MP_MODE_PP);
 
-			if((status & 0x1000) == 0x1000)
-				mch_mp_handle_event(sled->mch_mp, EV_MP_SETPOINT_ACK);
-			else
-				mch_mp_handle_event(sled->mch_mp, EV_MP_SETPOINT_NACK);
-		}
+/**
+ * Decode TPDO using the decoder compiled from its mapping
+ * and handle the objects it contains.
+ *
+ * @param time  Time at which the PDO was received by the CAN driver.
+ */
+static void intf_on_tpdo(intf_t *intf, void *payload, int pdo, uint8_t *data, double time)
+{
+	sled_t *sled = (sled_t *) payload;
+	const pdo_decoder_t *decoder = &(sled->tpdo_decoders[pdo]);
 
-		// Homing mode
-		if(mode == 0x06) {
-			mch_mp_handle_event(sled->mch_mp, EV_MP_MODE_HOMING);
+	pdo_decode(decoder, data, &sled->sample);
 
-			if((status & 0x1000) == 0x1000)
-				mch_mp_handle_event(sled->mch_mp, EV_MP_HOMED);
-			else
-				mch_mp_handle_event(sled->mch_mp, EV_MP_NOTHOMED);
-		}
+	if(decoder->fields & PDO_FIELD(PDO_STATUS_WORD))
+		sled_on_status(sled, sled->sample.status_word, sled->sample.mode);
 
-		// Interpolated positioning mode
-		if(mode == 0x07) {
-			mch_mp_handle_event(sled->mch_mp, EV_MP_MODE_IP);
-		}
+	if(decoder->fields & PDO_FIELD(PDO_POSITION)) {
+		sled->last_time = time;
+		sled->last_position = sled->sample.position / 1000.0 / 1000.0;
+		sled->last_velocity = sled->sample.velocity / 1000.0 / 1000.0;
 	}
+}
 
-	if(pdo == 2) {
-		int32_t position = (data[3] << 24) | (data[2] << 16) | (data[1] << 8) | data[0];
-		int32_t velocity = (data[7] << 24) | (data[6] << 16) | (data[5] << 8) | data[4];
 
-		sled->last_time = get_time();
-		sled->last_position = position / 1000.0 / 1000.0;
-		sled->last_velocity = velocity / 1000.0 / 1000.0;
-	}
+/**
+ * Frames may have been lost in a receive overrun. Position samples
+ * are marked as having a gap and an outstanding SDO is sent again.
+ *
+ * @param lost  Number of frames known to be lost, 0 if unknown.
+ */
+static void intf_on_overrun(intf_t *intf, void *payload, uint32_t lost)
+{
+	sled_t *sled = (sled_t *) payload;
+
+	sled->sample_gaps++;
+	mch_sdo_resync(sled->mch_sdo);
 }
 
 
-static void nmt_watchdog(evutil_socket_t fd, short flags, void *param)
+/**
+ * Pass emergency message on to the user of the sled.
+ */
+static void intf_on_emcy(intf_t *intf, void *payload, const intf_emcy_t *emcy)
 {
-	static bool message_written = false;
+	sled_t *sled = (sled_t *) payload;
+
+	if(!sled->emergency_handler)
+		return;
+
+	sled_emergency_t emergency;
+	emergency.node = emcy->node;
+	emergency.code = emcy->code;
+	emergency.error_register = emcy->error_register;
+	memcpy(emergency.manufacturer, emcy->manufacturer, 5);
+	emergency.time = emcy->time;
+	emergency.description = intf_emcy_to_message(emcy->code);
+
+	sled->emergency_handler(sled, sled->emergency_data, &emergency);
+}
+
 
+static void nmt_watchdog(evutil_socket_t fd, short flags, void *param)
+{
 	sled_t *sled = (sled_t *) param;
 	double delta = get_time() - sled->time_last_nmt_msg;
 
 	// More than two seconds ago...
 	if(delta > MAX_NMT_DELAY) {
-		if(!message_written) {
-			syslog(LOG_ERR, "%s() last NMT message was received "
+		if(!sled->watchdog_reported) {
+			syslog(LOG_ERR, "%s() last NMT message from node %d was received "
 				"%.2f seconds ago where only %.2f seconds are allowed",
-				__FUNCTION__, delta, MAX_NMT_DELAY);
-			message_written = true;
+				__FUNCTION__, sled->node, delta, MAX_NMT_DELAY);
+			sled->watchdog_reported = true;
+
+			// The drive may have reset meanwhile
+			mch_sdo_invalidate_shadow(sled->mch_sdo);
 		}
 		mch_net_handle_event(sled->mch_net, EV_NET_WATCHDOG_FAILED);
 	} else {
-		if(message_written) {
-			syslog(LOG_NOTICE, "%s() NMT message received",
-				__FUNCTION__);
-			message_written = false;
+		if(sled->watchdog_reported) {
+			syslog(LOG_NOTICE, "%s() NMT message received from node %d",
+				__FUNCTION__, sled->node);
+			sled->watchdog_reported = false;
 		}
 	}
 }
 
 
-// Inform network interface that the interface has opened / closed.
+// Inform network interface that the interface has opened.
 CALLBACK_FUNCTION_EVENT(intf, on_opened, net, EV_NET_INTF_OPENED);
-CALLBACK_FUNCTION_EVENT(intf, on_closed, net, EV_NET_INTF_CLOSED);
+
+// Inform network interface that the interface has closed,
+// recovery lasts until the drive is operational again.
+void mch_intf_on_closed(mch_intf_t *mch_intf, void *payload)
+{
+	sled_t *sled = (sled_t *) payload;
+
+	if(sled->down_since < 0.0) {
+		sled->down_since = get_time();
+		sled->failures++;
+	}
+
+	mch_net_handle_event(sled->mch_net, EV_NET_INTF_CLOSED);
+}
 
 // Inform SDO machine that SDO transmission is (not) possible.
 CALLBACK_FUNCTION_EVENT(net, on_sdos_enabled, sdo, EV_NET_SDO_ENABLED);
@@ -160,6 +222,20 @@ CALLBACK_FUNCTION_EVENT(net, on_sdos_disabled, sdo, EV_NET_SDO_DISABLED);
 void mch_net_on_enter_operational(mch_net_t *mch_net, void *payload)
 {
 	sled_t *sled = (sled_t *) payload;
+
+	if(sled->down_since >= 0.0) {
+		sled->last_recovery = get_time() - sled->down_since;
+		if(sled->last_recovery > sled->max_recovery)
+			sled->max_recovery = sled->last_recovery;
+
+		sled->recoveries++;
+		sled->down_since = -1.0;
+
+		syslog(LOG_NOTICE, "%s() node %d operational %.2f s after interface failure",
+			__FUNCTION__, sled->node, sled->last_recovery);
+	}
+
+	// Profiles are kept, but written again before use
 	sled_profiles_reset(sled);
 	mch_ds_handle_event(sled->mch_ds, EV_DS_NET_OPERATIONAL);
 }
@@ -177,9 +253,9 @@ CALLBACK_FUNCTION_EVENT(ds, on_operation_disabled, mp, EV_MP_DS_INOPERATIONAL);
 static void setup_state_machines(sled_t *sled)
 {
 	// Setup state machines
-	sled->mch_intf = mch_intf_create(sled->interface);
-	sled->mch_sdo = mch_sdo_create(sled->interface);
-	sled->mch_net = mch_net_create(sled->interface, sled->mch_sdo);
+	sled->mch_intf = mch_intf_create(sled->ev_base, sled->interface);
+	sled->mch_sdo = mch_sdo_create(sled->ev_base, sled->interface, sled->node, SDO_QUEUE_SIZE);
+	sled->mch_net = mch_net_create(sled->interface, sled->node, sled->mch_sdo);
 	sled->mch_ds = mch_ds_create(sled->interface, sled->mch_sdo);
 	sled->mch_mp = mch_mp_create(sled->interface, sled->mch_sdo);
 
@@ -207,15 +283,56 @@ static void setup_state_machines(sled_t *sled)
 
 
 /**
- * Setup sled structures.
+ * Setup sled structures for the drive on node 1.
+ *
+ * @param ev_base  LibEvent event_base.
+ * @param device  CAN device to use, NULL for default.
  */
-sled_t *sled_create(event_base *ev_base)
+sled_t *sled_create(event_base *ev_base, const char *device)
 {
+	return sled_create_node(ev_base, device, 1);
+}
+
+
+/**
+ * Setup sled structures for the drive with the given node-ID.
+ *
+ * Sleds created on the same device and event base share the
+ * CAN interface, such that several axes can be driven over one bus.
+ *
+ * @param ev_base  LibEvent event_base.
+ * @param device  CAN device to use, NULL for default.
+ * @param node  CANopen node-ID of the drive (1 to 127).
+ * @return Sled or NULL when the node is invalid or already in use.
+ */
+sled_t *sled_create_node(event_base *ev_base, const char *device, int node)
+{
+	intf_t *interface = intf_create(ev_base, device);
+
+	if(node < 1 || node > INTF_MAX_NODE || intf_register_node(interface, node) == -1) {
+		fprintf(stderr, "Could not use node %d on the CAN bus\n", node);
+		intf_destroy(&interface);
+		return NULL;
+	}
+
 	sled_t *sled = (sled_t *) malloc(sizeof(sled_t));
 	sled->ev_base = ev_base;
+	sled->interface = interface;
+	sled->node = node;
 
 	/* Make sure the watchdog times out */
 	sled->time_last_nmt_msg = get_time() - MAX_NMT_DELAY;
+	sled->watchdog_reported = false;
+
+	sled->sample_gaps = 0;
+	sled->selected_task = -1;
+
+	sled->emergency_handler = NULL;
+	sled->emergency_data = NULL;
+
+	sled->down_since = -1.0;
+	sled->failures = sled->recoveries = 0;
+	sled->last_recovery = sled->max_recovery = 0.0;
 
 	////////////////////////
 	// Initialise profiles
@@ -236,17 +353,26 @@ sled_t *sled_create(event_base *ev_base)
 	////////////////////////////
 	// Interface-specific part
 
-	// Create interface
-	sled->interface = intf_create(sled->ev_base);
-	intf_set_callback_payload(sled->interface, (void *) sled);
+	// Route frames of our node to this sled
+	intf_set_callback_payload(sled->interface, sled->node, (void *) sled);
 
 	// Setup state machines
 	setup_state_machines(sled);
 
 	// Register interface callback functions
-	intf_set_close_handler(sled->interface, intf_on_close);
-	intf_set_nmt_state_handler(sled->interface, intf_on_nmt);
-	intf_set_tpdo_handler(sled->interface, intf_on_tpdo);
+	intf_set_close_handler(sled->interface, sled->node, intf_on_close);
+	intf_set_nmt_state_handler(sled->interface, sled->node, intf_on_nmt);
+	intf_set_overrun_handler(sled->interface, sled->node, intf_on_overrun);
+	intf_set_emcy_handler(sled->interface, sled->node, intf_on_emcy);
+	// Decode TPDOs as they are mapped by mch_net
+	memset(&sled->sample, 0, sizeof(pdo_sample_t));
+
+	for(int pdo = 1; pdo <= INTF_NUM_TPDOS; pdo++) {
+		pdo_compile(&pdo_tpdo_mapping[pdo - 1], &(sled->tpdo_decoders[pdo]));
+
+		if(sled->tpdo_decoders[pdo].count > 0)
+			intf_set_tpdo_handler(sled->interface, sled->node, pdo, intf_on_tpdo);
+	}
 
 	// Create watch-dog timer
 	timeval watchdog_timeout;
@@ -274,6 +400,24 @@ void sled_destroy(sled_t **handle)
 {
 	sled_t *sled = *handle;
 
+	event_del(sled->watchdog);
+	event_free(sled->watchdog);
+
+	mch_intf_disable_recovery(sled->mch_intf);
+
+	// Other sleds may still use the interface, responses
+	// and messages of our node are no longer dispatched
+	intf_unregister_node(sled->interface, sled->node);
+
+	// The configuration upload still uses the SDO machine
+	mch_mp_destroy(&sled->mch_mp);
+	mch_ds_destroy(&sled->mch_ds);
+	mch_net_destroy(&sled->mch_net);
+	mch_sdo_destroy(&sled->mch_sdo);
+	mch_intf_destroy(&sled->mch_intf);
+
+	intf_destroy(&sled->interface);
+
 	free(*handle);
 	*handle = NULL;
 }
@@ -316,6 +460,24 @@ int sled_rt_get_position_and_time(sled_t *handle, double &position, double &time
 }
 
 
+/**
+ * Returns number of receive overruns since the sled was created.
+ *
+ * Position samples may have been lost when the number changes
+ * between two calls to sled_rt_get_position_and_time.
+ *
+ * @param handle  Sled handle.
+ * @param gaps  Number of overruns (by-reference).
+ */
+int sled_rt_get_sample_gaps(sled_t *handle, unsigned int &gaps)
+{
+	assert(handle);
+
+	gaps = handle->sample_gaps;
+	return 0;
+}
+
+
 /**
  * Returns current sled position.
  *
@@ -387,7 +549,8 @@ int sled_sinusoid_stop(sled_t *handle)
 	sled_profile_set_next(handle, handle->sinusoid_there, -1, 0.0, bln_after);
 	sled_profile_set_next(handle, handle->sinusoid_back, -1, 0.0, bln_after);
 
-	return sled_profile_write_pending_changes(handle, handle->sinusoid_there);
+	// The chain has to be cut before the current half period ends
+	return sled_profile_write_pending_changes(handle, handle->sinusoid_there, SLED_PROFILE_DEADLINE);
 	#else
 	if(mch_mp_active_state(handle->mch_mp) != ST_MP_IP_SINUSOID) {
 		syslog(LOG_ERR, "%s() unable to stop, not started", __FUNCTION__);
@@ -418,8 +581,312 @@ int sled_light_set_state(sled_t *handle, bool state)
 	if(mch_sdo_active_state(handle->mch_sdo) == ST_SDO_DISABLED)
 		return -1;
 
-	mch_sdo_queue_write(handle->mch_sdo, OB_O_O1, 0x01, state?0x01:0x00, 0x04);
+	mch_sdo_queue_write_scheduled(handle->mch_sdo, OB_O_O1, 0x01, state?0x01:0x00, 0x04,
+		MCH_SDO_CLASS_URGENT, SLED_LIGHT_DEADLINE, NULL, NULL, NULL);
 
 	return 0;
 }
 
+
+/**
+ * Enable or disable tracing of CAN frames.
+ *
+ * @param handle  libsled handle.
+ * @param state  True to record frames in the trace buffer.
+ */
+void sled_trace_set_state(sled_t *handle, bool state)
+{
+	assert(handle);
+	intf_set_trace(handle->interface, state);
+}
+
+
+/**
+ * Write recently sent and received CAN frames to a file.
+ *
+ * @param handle  libsled handle.
+ * @param filename  Trace file, decoded by tools/trace/decode_trace.py.
+ *
+ * @return Number of frames written, -1 on failure.
+ */
+int sled_trace_dump(sled_t *handle, const char *filename)
+{
+	assert(handle);
+	return intf_dump_trace(handle->interface, filename);
+}
+
+
+/**
+ * Record all CAN frames sent and received to a file.
+ *
+ * The capture can be played back by creating a sled
+ * with device replay:<filename> or replay-fast:<filename>.
+ *
+ * @param handle  libsled handle.
+ * @param filename  File to write, NULL to stop capturing.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int sled_capture(sled_t *handle, const char *filename)
+{
+	assert(handle);
+
+	if(!filename)
+		return intf_stop_capture(handle->interface);
+
+	return intf_start_capture(handle->interface, filename);
+}
+
+
+/**
+ * Inject faults between the state machines and the CAN device.
+ *
+ * @param handle  libsled handle.
+ * @param profile  Fault profile (see intf_parse_fault_profile),
+ *   NULL to stop injecting faults.
+ *
+ * @return 0 on success, -1 on an invalid profile.
+ */
+int sled_fault_inject(sled_t *handle, const char *profile)
+{
+	assert(handle);
+
+	if(!profile) {
+		intf_set_fault_profile(handle->interface, NULL);
+		return 0;
+	}
+
+	intf_fault_profile_t faults;
+
+	if(intf_parse_fault_profile(profile, &faults) == -1)
+		return -1;
+
+	intf_set_fault_profile(handle->interface, &faults);
+
+	return 0;
+}
+
+
+/**
+ * Read the CAN device from a thread spinning on the given CPU,
+ * instead of waiting for it in the event loop. The CPU should be
+ * isolated from the scheduler (isolcpus), such that the thread
+ * does not compete with the event loop.
+ *
+ * @param handle  libsled handle.
+ * @param cpu  CPU to poll on, -1 to stop busy polling.
+ *
+ * @return 0 on success, -1 when the device cannot be polled.
+ */
+int sled_busy_poll(sled_t *handle, int cpu)
+{
+	assert(handle);
+
+	return intf_set_busy_poll(handle->interface, cpu);
+}
+
+
+/**
+ * Set the maximum number of frames dispatched per read wakeup. The
+ * remaining frames are dispatched after timers of the event loop had
+ * a chance to run, at the cost of another wakeup. The read line of
+ * sled_bus_statistics shows how often the limit was hit.
+ *
+ * @param handle  libsled handle.
+ * @param limit  Number of frames, 1 to 64 (the default).
+ *
+ * @return 0 on success, -1 when the limit is out of range.
+ */
+int sled_read_limit(sled_t *handle, int limit)
+{
+	assert(handle);
+
+	return intf_set_read_limit(handle->interface, limit);
+}
+
+
+/**
+ * Set how long to wait for the response to an SDO request and how
+ * often to send it again. When the last attempt times out as well,
+ * the request is aborted and the next one is sent. The defaults
+ * are MCH_SDO_TIMEOUT and MCH_SDO_RETRIES.
+ *
+ * @param handle  libsled handle.
+ * @param timeout  Time to wait for a response (s).
+ * @param retries  Number of times to send a request again.
+ *
+ * @return 0 on success, -1 on invalid arguments.
+ */
+int sled_sdo_timeout(sled_t *handle, double timeout, int retries)
+{
+	assert(handle);
+
+	if(timeout <= 0.0 || retries < 0)
+		return -1;
+
+	mch_sdo_set_timeout(handle->mch_sdo, timeout, retries);
+
+	return 0;
+}
+
+
+/**
+ * Handler of a transfer, passed to the SDO machine.
+ */
+struct sled_transfer_ctx_t {
+	sled_t *sled;
+	sled_transfer_handler_t handler;
+	void *data;
+	uint32_t size;
+};
+
+
+static void sled_transfer_finish(sled_transfer_ctx_t *ctx, uint16_t index, uint8_t subindex,
+	bool success, uint32_t length, uint32_t code)
+{
+	sled_transfer_t transfer;
+	transfer.index = index;
+	transfer.subindex = subindex;
+	transfer.success = success;
+	transfer.length = length;
+	transfer.abort_code = code;
+	transfer.description = success ? "Transfer completed." : mch_sdo_abort_to_message(code);
+
+	if(ctx->handler)
+		ctx->handler(ctx->sled, ctx->data, &transfer);
+
+	delete ctx;
+}
+
+
+static void sled_on_download(void *data, uint16_t index, uint8_t subindex)
+{
+	sled_transfer_ctx_t *ctx = (sled_transfer_ctx_t *) data;
+	sled_transfer_finish(ctx, index, subindex, true, ctx->size, 0);
+}
+
+
+static void sled_on_upload(void *data, uint16_t index, uint8_t subindex, uint32_t length)
+{
+	sled_transfer_finish((sled_transfer_ctx_t *) data, index, subindex, true, length, 0);
+}
+
+
+static void sled_on_transfer_abort(void *data, uint16_t index, uint8_t subindex, uint32_t code)
+{
+	sled_transfer_finish((sled_transfer_ctx_t *) data, index, subindex, false, 0, code);
+}
+
+
+static sled_transfer_ctx_t *sled_transfer_ctx(sled_t *handle, sled_transfer_handler_t handler, void *data, uint32_t size)
+{
+	sled_transfer_ctx_t *ctx = new sled_transfer_ctx_t();
+	ctx->sled = handle;
+	ctx->handler = handler;
+	ctx->data = data;
+	ctx->size = size;
+
+	return ctx;
+}
+
+
+/**
+ * Write an object larger than four bytes, such as a table or PLC
+ * program, by segmented or block SDO transfer. The transfer is
+ * queued behind other SDO requests and occupies the SDO channel
+ * of the drive until it completes, it should therefore not be
+ * started while the sled moves. The buffer has to remain valid
+ * until the handler is invoked.
+ *
+ * @param handle  libsled handle.
+ * @param block  Block transfer (faster), rather than segmented.
+ * @param handler  Invoked when the transfer completes or fails.
+ *
+ * @return 0 on success, -1 when the SDO queue is full (the
+ *   handler has been invoked with abort code 0 then).
+ */
+int sled_sdo_download(sled_t *handle, uint16_t index, uint8_t subindex, const uint8_t *buffer, uint32_t size,
+	bool block, sled_transfer_handler_t handler, void *data)
+{
+	assert(handle && (buffer || size == 0));
+
+	return mch_sdo_queue_download(handle->mch_sdo, index, subindex, buffer, size, block,
+		sled_on_download, sled_on_transfer_abort, (void *) sled_transfer_ctx(handle, handler, data, size));
+}
+
+
+/**
+ * Read an object into a buffer of size bytes by segmented or block
+ * SDO transfer (see sled_sdo_download). The handler receives the
+ * number of bytes read, the transfer fails when the object does
+ * not fit in the buffer.
+ *
+ * @return 0 on success, -1 when the SDO queue is full.
+ */
+int sled_sdo_upload(sled_t *handle, uint16_t index, uint8_t subindex, uint8_t *buffer, uint32_t size,
+	bool block, sled_transfer_handler_t handler, void *data)
+{
+	assert(handle && (buffer || size == 0));
+
+	return mch_sdo_queue_upload(handle->mch_sdo, index, subindex, buffer, size, block,
+		sled_on_upload, sled_on_transfer_abort, (void *) sled_transfer_ctx(handle, handler, data, size));
+}
+
+
+/**
+ * Write CAN bus statistics (load, frames and inter-arrival
+ * times per COB-ID) as text, followed by SDO statistics (see
+ * mch_sdo_format_stats) and a line on recovery from interface
+ * failures (not cleared by reset):
+ *
+ *   recovery failures=1 recovered=1 last=1.62s max=1.62s
+ *
+ * @param handle  libsled handle.
+ * @param buffer  Buffer receiving null-terminated text.
+ * @param size  Size of the buffer.
+ * @param reset  Clear statistics after writing them.
+ *
+ * @return Number of characters written.
+ */
+int sled_bus_statistics(sled_t *handle, char *buffer, int size, bool reset)
+{
+	assert(handle);
+
+	int n = intf_format_bus_stats(handle->interface, buffer, size);
+
+	if(n < size - 2) {
+		buffer[n++] = '\n';
+		n += mch_sdo_format_stats(handle->mch_sdo, buffer + n, size - n);
+	}
+
+	if(n < size - 1)
+		n += snprintf(buffer + n, size - n, "\nrecovery failures=%u recovered=%u last=%.2fs max=%.2fs",
+			handle->failures, handle->recoveries, handle->last_recovery, handle->max_recovery);
+
+	if(n >= size)
+		n = size - 1;
+
+	if(reset) {
+		intf_reset_bus_stats(handle->interface);
+		mch_sdo_reset_stats(handle->mch_sdo);
+	}
+
+	return n;
+}
+
+
+/**
+ * Set function invoked for every emergency message
+ * sent by the drive, as soon as it has been received.
+ *
+ * @param handle  libsled handle.
+ * @param handler  Handler or NULL to ignore emergencies.
+ * @param data  Passed on to the handler.
+ */
+void sled_set_emergency_handler(sled_t *handle, sled_emergency_handler_t handler, void *data)
+{
+	assert(handle);
+
+	handle->emergency_handler = handler;
+	handle->emergency_data = data;
+}
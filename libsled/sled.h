@@ -1,19 +1,47 @@
 #ifndef __SLED_H__
 #define __SLED_H__
 
+#include <stdint.h>
+
 extern "C" {
 
 struct event_base;
 struct sled_t;
 
+// Emergency message sent by the drive
+struct sled_emergency_t {
+	int node;
+	uint16_t code;
+	uint8_t error_register;
+	uint8_t manufacturer[5];
+	double time;
+	const char *description;
+};
+
+typedef void(*sled_emergency_handler_t)(sled_t *sled, void *data, const sled_emergency_t *emergency);
+
+// Result of a segmented or block SDO transfer
+struct sled_transfer_t {
+	uint16_t index;
+	uint8_t subindex;
+	bool success;
+	uint32_t length;		// Bytes transferred
+	uint32_t abort_code;	// On failure, 0 if the transfer was dropped
+	const char *description;
+};
+
+typedef void(*sled_transfer_handler_t)(sled_t *sled, void *data, const sled_transfer_t *transfer);
+
 // Opening and closing of connection to sled
-sled_t *sled_create(event_base *ev_base);
+sled_t *sled_create(event_base *ev_base, const char *device);
+sled_t *sled_create_node(event_base *ev_base, const char *device, int node);
 void sled_destroy(sled_t **sled);
 
 // Set-points
 int sled_rt_new_setpoint(sled_t *handle, double position);
 int sled_rt_get_position(sled_t *handle, double &position);
 int sled_rt_get_position_and_time(sled_t *handle, double &position, double &time);
+int sled_rt_get_sample_gaps(sled_t *handle, unsigned int &gaps);
 
 // Sinusoids
 int sled_sinusoid_start(sled_t *sled, double amplitude, double period);
@@ -22,6 +50,35 @@ int sled_sinusoid_stop(sled_t *sled);
 // Light
 int sled_light_set_state(sled_t *sled, bool state);
 
+// Frame trace
+void sled_trace_set_state(sled_t *sled, bool state);
+int sled_trace_dump(sled_t *sled, const char *filename);
+int sled_capture(sled_t *sled, const char *filename);
+
+// Bus statistics
+int sled_bus_statistics(sled_t *sled, char *buffer, int size, bool reset);
+
+// Fault injection
+int sled_fault_inject(sled_t *sled, const char *profile);
+
+// Busy polling of the CAN device
+int sled_busy_poll(sled_t *sled, int cpu);
+
+// Frames dispatched per read wakeup
+int sled_read_limit(sled_t *sled, int limit);
+
+// SDO response timeout
+int sled_sdo_timeout(sled_t *sled, double timeout, int retries);
+
+// Segmented and block SDO transfers (tables, programs)
+int sled_sdo_download(sled_t *sled, uint16_t index, uint8_t subindex, const uint8_t *buffer, uint32_t size,
+	bool block, sled_transfer_handler_t handler, void *data);
+int sled_sdo_upload(sled_t *sled, uint16_t index, uint8_t subindex, uint8_t *buffer, uint32_t size,
+	bool block, sled_transfer_handler_t handler, void *data);
+
+// Emergency messages
+void sled_set_emergency_handler(sled_t *sled, sled_emergency_handler_t handler, void *data);
+
 }
 
 #endif
@@ -7,6 +7,7 @@
 #include "sled_profile.h"
 
 #include "interface.h"
+#include "pdo.h"
 
 #include "machines/mch_intf.h"
 #include "machines/mch_net.h"
@@ -16,6 +17,17 @@
 
 #define MAX_PROFILES 99
 
+// SDO requests that can be queued, enough for writing a chain
+// of all profiles (10 requests each) after configuring the drive.
+#define SDO_QUEUE_SIZE (MAX_PROFILES * 10 + 128)
+
+// Deadlines of time-critical SDO writes (s). The light marks stimuli,
+// a profile is started once its fields and its motion task number
+// were written and the control word is written right after that.
+#define SLED_LIGHT_DEADLINE 0.001
+#define SLED_PROFILE_DEADLINE 0.005
+#define SLED_START_DEADLINE 0.001
+
 /**
  * Generates callback function for callback FNAME of the SNAME machine.
  * When executed it sends event EVENT to the DNAME machine.
@@ -83,11 +95,16 @@ struct sled_t {
 	// Profile loaded in register 0.
 	int current_profile;
 
+	// Motion task selected last, it is started once
+	// the profiles it consists of have been written.
+	int selected_task;
+
 	// Lib event event base
 	event_base *ev_base;
 
-	// CANOpen interface
+	// CANOpen interface and node-ID of the drive
 	intf_t *interface;
+	uint8_t node;
 
 	// State machines
 	mch_intf_t *mch_intf;
@@ -96,9 +113,20 @@ struct sled_t {
 	mch_ds_t *mch_ds;
 	mch_mp_t *mch_mp;
 
+	// Decoders of mapped TPDOs and the values they produce
+	pdo_decoder_t tpdo_decoders[INTF_NUM_TPDOS + 1];
+	pdo_sample_t sample;
+
 	// Last position and velocity
 	double last_time, last_position, last_velocity;
 
+	// Receive overruns, position samples may be missing
+	unsigned int sample_gaps;
+
+	// Receives emergency messages of the drive
+	sled_emergency_handler_t emergency_handler;
+	void *emergency_data;
+
 	// Profiles for sinusoid
 	int sinusoid_there, sinusoid_back;
 
@@ -107,6 +135,13 @@ struct sled_t {
 
 	// Watchdog event
 	event *watchdog;
+	bool watchdog_reported;
+
+	// Recovery from interface failures, down_since is
+	// negative while the drive is (or has never been) operational.
+	double down_since;
+	unsigned int failures, recoveries;
+	double last_recovery, max_recovery;
 };
 
 
@@ -60,6 +60,13 @@ static void sled_profile_mark_as_unsaved(sled_profile_t *profile)
 }
 
 
+/**
+ * Fields that changed and fields of which the last
+ * write failed have to be written (again).
+ */
+#define FIELD_PENDING(state) ((state) == FIELD_CHANGED || (state) == FIELD_INVALID)
+
+
 /**
  * Returns true when changes are pending. False if not.
  */
@@ -67,19 +74,33 @@ static bool sled_profile_has_changes_pending(sled_profile_t *profile)
 {
 	assert(profile);
 
-	if(profile->_ob_o_p   == FIELD_CHANGED) return true;
-	if(profile->_ob_o_v   == FIELD_CHANGED) return true;
-	if(profile->_ob_o_c   == FIELD_CHANGED) return true;
-	if(profile->_ob_o_acc == FIELD_CHANGED) return true;
-	if(profile->_ob_o_dec == FIELD_CHANGED) return true;
-	if(profile->_ob_o_tab == FIELD_CHANGED) return true;
-	if(profile->_ob_o_fn  == FIELD_CHANGED) return true;
-	if(profile->_ob_o_ft  == FIELD_CHANGED) return true;
+	if(FIELD_PENDING(profile->_ob_o_p))   return true;
+	if(FIELD_PENDING(profile->_ob_o_v))   return true;
+	if(FIELD_PENDING(profile->_ob_o_c))   return true;
+	if(FIELD_PENDING(profile->_ob_o_acc)) return true;
+	if(FIELD_PENDING(profile->_ob_o_dec)) return true;
+	if(FIELD_PENDING(profile->_ob_o_tab)) return true;
+	if(FIELD_PENDING(profile->_ob_o_fn))  return true;
+	if(FIELD_PENDING(profile->_ob_o_ft))  return true;
 
 	return false;
 }
 
 
+/**
+ * Returns true when every field has been written.
+ */
+static bool sled_profile_is_written(sled_profile_t *profile)
+{
+	assert(profile);
+
+	return profile->_ob_o_p == FIELD_WRITTEN && profile->_ob_o_v == FIELD_WRITTEN &&
+		profile->_ob_o_c == FIELD_WRITTEN && profile->_ob_o_acc == FIELD_WRITTEN &&
+		profile->_ob_o_dec == FIELD_WRITTEN && profile->_ob_o_tab == FIELD_WRITTEN &&
+		profile->_ob_o_fn == FIELD_WRITTEN && profile->_ob_o_ft == FIELD_WRITTEN;
+}
+
+
 /**
  * Set state of field identified by dictionary index.
  */
@@ -111,39 +132,43 @@ static void on_success_callback(void *data, uint16_t index, uint8_t subindex)
 
 
 /**
- * Mark field as invalid (write failed).
+ * Mark field as invalid (write failed). The profile is not started
+ * (see on_task_selected) and the field is written again when
+ * the profile is executed next.
  */
 static void on_failure_callback(void *data, uint16_t index, uint8_t subindex, uint32_t abort)
 {
 	sled_profile_t *profile = (sled_profile_t *) data;
 	sled_profile_set_field_state(profile, index, FIELD_INVALID);
 
-	syslog(LOG_ERR, "%s() uploading of profile failed \
-			abort code %04x on index %04x:%02x",
-			__FUNCTION__, abort, index, subindex);
-
-	exit(1);
+	syslog(LOG_ERR, "%s() uploading of profile %d failed, "
+			"abort code %04x on index %04x:%02x",
+			__FUNCTION__, profile->profile, abort, index, subindex);
 }
 
 
 #define WRITE_FIELD_IF_CHANGED(name, index, value) \
-	if(profile->_ ## name == FIELD_CHANGED) { \
+	if(FIELD_PENDING(profile->_ ## name)) { \
 		profile->_ ## name = FIELD_WRITING; \
-		mch_sdo_queue_write_with_cb( \
-				sled->mch_sdo, index, 0x01, value, 0x04, \
+		mch_sdo_queue_write_scheduled( \
+				sled->mch_sdo, index, 0x01, value, 0x04, MCH_SDO_CLASS_NORMAL, deadline, \
 				on_success_callback, on_failure_callback, (void *) profile \
 				); \
 	}
 
 
 #define COPY_MOTION_TASK(from, to) \
-	mch_sdo_queue_write(sled->mch_sdo, OB_COPY_MOTION_TASK, 0x0, (from & 0xFFFF) | ((to & 0xFFFF) << 16), 0x04);
+	mch_sdo_queue_write_scheduled(sled->mch_sdo, OB_COPY_MOTION_TASK, 0x0, (from & 0xFFFF) | ((to & 0xFFFF) << 16), 0x04, \
+		MCH_SDO_CLASS_NORMAL, deadline, NULL, NULL, NULL);
 
 
 /**
  * Writes all pending changes to the device.
+ *
+ * @param deadline  Time to complete each write in (s), zero for
+ *   the default of the SDO class.
  */
-int sled_profile_write_pending_changes(sled_t *sled, int profile_id)
+int sled_profile_write_pending_changes(sled_t *sled, int profile_id, double deadline)
 {
 	sled_profile_t *profile = &(sled->profiles[profile_id]);
 
@@ -179,9 +204,13 @@ int sled_profile_write_pending_changes(sled_t *sled, int profile_id)
 	COPY_MOTION_TASK(0x00, profile->profile);
 	profile->never_sent = false;
 
+	// Slot 0 holds the profile now, it need not be copied into it
+	// again (which would also force all its fields to be written)
+	sled->current_profile = profile->profile;
+
 	// Write profiles that the current profile depends on...
 	if(profile->next_profile >= 0)
-		sled_profile_write_pending_changes(sled, profile->next_profile);
+		sled_profile_write_pending_changes(sled, profile->next_profile, deadline);
 
 	return 0;
 }
@@ -381,6 +410,57 @@ int sled_profile_set_next(sled_t *sled, int profile, int next_profile, double de
 }
 
 
+/**
+ * Returns the profile that is executed as motion task, -1 if none.
+ */
+static int sled_profile_find(sled_t *sled, int task)
+{
+	for(int i = 0; i < MAX_PROFILES; i++)
+		if(sled->profiles[i].in_use && sled->profiles[i].profile == task)
+			return i;
+
+	return -1;
+}
+
+
+/**
+ * Start the motion task selected last (the one the drive will run),
+ * unless writing one of the profiles it consists of failed. Those
+ * profiles keep their invalid fields until they are executed again,
+ * the motor stays idle.
+ */
+static void on_task_selected(void *data, uint16_t index, uint8_t subindex)
+{
+	sled_t *sled = (sled_t *) data;
+	int task = sled->selected_task;
+	int profile = sled_profile_find(sled, task);
+
+	// Follow the chain, it may loop back (sinusoid)
+	for(int i = profile, n = 0; i >= 0 && n < MAX_PROFILES; i = sled->profiles[i].next_profile, n++) {
+		if(!sled_profile_is_written(&sled->profiles[i])) {
+			syslog(LOG_ERR, "%s() profile %d was not written, motion task %d not started",
+					__FUNCTION__, sled->profiles[i].profile, task);
+			return;
+		}
+	}
+
+	if(mch_mp_active_state(sled->mch_mp) != ST_MP_PP_IDLE) {
+		syslog(LOG_ERR, "%s() motion task %d not started, motor not idle", __FUNCTION__, task);
+		return;
+	}
+
+	mch_sdo_queue_write_scheduled(sled->mch_sdo, OB_CONTROL_WORD, 0x00, 0x1F | 0x20, 0x02,
+		MCH_SDO_CLASS_NORMAL, SLED_START_DEADLINE, NULL, NULL, NULL);
+	mch_mp_handle_event(sled->mch_mp, EV_MP_SETPOINT_SET);
+}
+
+
+static void on_task_failed(void *data, uint16_t index, uint8_t subindex, uint32_t abort)
+{
+	syslog(LOG_ERR, "%s() selecting motion task failed, abort code %04x", __FUNCTION__, abort);
+}
+
+
 /**
  * Execute specified profile.
  *
@@ -407,13 +487,13 @@ int sled_profile_execute(sled_t *sled, int profile)
 		return -1;
 	}
 
-	sled_profile_write_pending_changes(sled, profile);
+	sled_profile_write_pending_changes(sled, profile, SLED_PROFILE_DEADLINE);
 
-	// Set motion profile to be executed
-	mch_sdo_queue_write(sled->mch_sdo, OB_MOTION_TASK, 0x00, sled->profiles[profile].profile, 0x02);
-	mch_sdo_queue_write(sled->mch_sdo, OB_CONTROL_WORD, 0x00, 0x1F | 0x20, 0x02);
-
-	mch_mp_handle_event(sled->mch_mp, EV_MP_SETPOINT_SET);
+	// Set motion profile to be executed, it is started once
+	// the writes of its fields (queued before) have completed
+	sled->selected_task = sled->profiles[profile].profile;
+	mch_sdo_queue_write_scheduled(sled->mch_sdo, OB_MOTION_TASK, 0x00, sled->selected_task, 0x02,
+		MCH_SDO_CLASS_NORMAL, SLED_PROFILE_DEADLINE, on_task_selected, on_task_failed, (void *) sled);
 
 	return 0;
 }
@@ -0,0 +1,426 @@
+/*
+ * Sleds that run on their own event loop thread.
+ *
+ * Every CAN device has its own event loop, running the state machines
+ * of the sleds on it, such that axes on different buses do not delay
+ * each other. The RTC3D server runs on
+ * the main thread and talks to the sleds through job queues.
+ */
+
+#include "axis.h"
+
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#include <sys/eventfd.h>
+
+
+/**
+ * Create event base for the server or a sled, libevent
+ * does not lock as every base is used by a single thread.
+ */
+event_base *server_event_base_new()
+{
+	event_config *cfg = event_config_new();
+	event_config_require_features(cfg, EV_FEATURE_FDS);
+	#ifdef EVENT_BASE_FLAG_PRECISE_TIMER
+	event_config_set_flag(cfg, EVENT_BASE_FLAG_PRECISE_TIMER);
+	#endif
+	event_config_set_flag(cfg, EVENT_BASE_FLAG_NOLOCK);
+	event_config_set_flag(cfg, EVENT_BASE_FLAG_NO_CACHE_TIME);
+
+	event_base *ev_base = event_base_new_with_config(cfg);
+	event_config_free(cfg);
+
+	if(ev_base)
+		event_base_priority_init(ev_base, 2);
+
+	return ev_base;
+}
+
+
+/**
+ * Setup queue, handler is invoked on the thread
+ * running ev_base when jobs are waiting.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int queue_init(server_queue_t *queue, event_base *ev_base, event_callback_fn handler, void *arg)
+{
+	queue->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	if(queue->fd == -1) {
+		fprintf(stderr, "Creating queue event failed: %s\n", strerror(errno));
+		return -1;
+	}
+
+	pthread_mutex_init(&queue->lock, NULL);
+
+	queue->ready = event_new(ev_base, queue->fd, EV_READ | EV_PERSIST, handler, arg);
+	event_priority_set(queue->ready, 1);
+	event_add(queue->ready, NULL);
+
+	return 0;
+}
+
+
+/**
+ * Free queue, jobs that are still waiting are discarded.
+ */
+void queue_destroy(server_queue_t *queue)
+{
+	event_del(queue->ready);
+	event_free(queue->ready);
+	close(queue->fd);
+
+	while(!queue->jobs.empty()) {
+		delete queue->jobs.front();
+		queue->jobs.pop_front();
+	}
+
+	pthread_mutex_destroy(&queue->lock);
+}
+
+
+/**
+ * Pass job to the thread of the queue (from any thread).
+ */
+void queue_push(server_queue_t *queue, server_job_t *job)
+{
+	pthread_mutex_lock(&queue->lock);
+	bool wakeup = queue->jobs.empty();
+	queue->jobs.push_back(job);
+	pthread_mutex_unlock(&queue->lock);
+
+	uint64_t one = 1;
+	if(wakeup && write(queue->fd, &one, sizeof(one)) == -1)
+		syslog(LOG_ERR, "%s() could not signal queue: %s", __FUNCTION__, strerror(errno));
+}
+
+
+/**
+ * Take next job, called by the handler of the queue.
+ *
+ * @return Job or NULL when the queue is empty.
+ */
+server_job_t *queue_pop(server_queue_t *queue)
+{
+	pthread_mutex_lock(&queue->lock);
+
+	server_job_t *job = NULL;
+
+	if(!queue->jobs.empty()) {
+		job = queue->jobs.front();
+		queue->jobs.pop_front();
+	}
+
+	// Clear event before the last job is taken, such
+	// that jobs pushed after this wake us up again.
+	if(queue->jobs.empty()) {
+		uint64_t value;
+		if(read(queue->fd, &value, sizeof(value)) == -1 && errno != EAGAIN)
+			syslog(LOG_ERR, "%s() could not clear queue: %s", __FUNCTION__, strerror(errno));
+	}
+
+	pthread_mutex_unlock(&queue->lock);
+
+	return job;
+}
+
+
+/**
+ * Run jobs on the thread of the axis, replies
+ * are returned to the RTC3D thread.
+ */
+static void axis_on_jobs(evutil_socket_t fd, short events, void *axis_v)
+{
+	sled_axis_t *axis = (sled_axis_t *) axis_v;
+	server_job_t *job;
+
+	while((job = queue_pop(&axis->jobs)) != NULL) {
+		job->reply = rpl_none;
+		job->run(job);
+
+		if(job->reply == rpl_none)
+			delete job;
+		else
+			queue_push(&axis->ctx->replies, job);
+	}
+}
+
+
+/**
+ * Publish position for streaming.
+ */
+static void axis_on_sample(evutil_socket_t fd, short events, void *axis_v)
+{
+	sled_axis_t *axis = (sled_axis_t *) axis_v;
+
+	double position, time;
+	unsigned int gaps;
+
+	sled_rt_get_position_and_time(axis->sled, position, time);
+	sled_rt_get_sample_gaps(axis->sled, gaps);
+
+	pthread_mutex_lock(&axis->sample_lock);
+	axis->position = position;
+	axis->time = time;
+	axis->gaps = gaps;
+	pthread_mutex_unlock(&axis->sample_lock);
+}
+
+
+/**
+ * Emergency messages are pushed to all clients.
+ */
+static void axis_on_emergency(sled_t *sled, void *data, const sled_emergency_t *emergency)
+{
+	sled_axis_t *axis = (sled_axis_t *) data;
+
+	char message[160];
+	const uint8_t *m = emergency->manufacturer;
+	snprintf(message, sizeof(message), "emcy sled=%d node=%d code=%04x register=%02x data=%02x%02x%02x%02x%02x %s",
+		axis->id, emergency->node, emergency->code, emergency->error_register,
+		m[0], m[1], m[2], m[3], m[4], emergency->description);
+
+	server_job_t *job = new server_job_t();
+	job->axis = axis;
+	job->reply = rpl_broadcast;
+	job->text = message;
+
+	queue_push(&axis->ctx->replies, job);
+}
+
+
+/**
+ * Create sled and its event loop, the thread is started by axis_start.
+ *
+ * @param ctx  Server context.
+ * @param id  Sled ID used in commands.
+ * @param options  Device and node of the sled.
+ * @param host  Axis on the same device, whose event loop (and thereby
+ *   interface) the sled shares, NULL for a new event loop. The options
+ *   of the device are those of the host.
+ * @return Axis or NULL on failure.
+ */
+sled_axis_t *axis_create(sled_server_ctx_t *ctx, int id, const axis_options_t *options, sled_axis_t *host)
+{
+	sled_axis_t *axis = new sled_axis_t();
+	axis->id = id;
+	axis->ctx = ctx;
+	axis->options = *options;
+	axis->host = host;
+	axis->running = false;
+
+	axis->ev_base = host ? host->ev_base : server_event_base_new();
+
+	if(!axis->ev_base) {
+		fprintf(stderr, "Error initializing libevent for sled %d.\n", id);
+		delete axis;
+		return NULL;
+	}
+
+	axis->sled = sled_create_node(axis->ev_base, options->device, options->node);
+
+	if(!axis->sled) {
+		if(!host)
+			event_base_free(axis->ev_base);
+		delete axis;
+		return NULL;
+	}
+
+	if(options->capture && sled_capture(axis->sled, options->capture) == -1) {
+		fprintf(stderr, "Could not capture to %s.\n", options->capture);
+		axis_destroy(&axis);
+		return NULL;
+	}
+
+	if(options->fault && sled_fault_inject(axis->sled, options->fault) == -1) {
+		fprintf(stderr, "Invalid fault profile (%s).\n", options->fault);
+		axis_destroy(&axis);
+		return NULL;
+	}
+
+	if(options->poll_cpu >= 0 && sled_busy_poll(axis->sled, options->poll_cpu) == -1) {
+		fprintf(stderr, "Could not busy-poll on CPU %d.\n", options->poll_cpu);
+		axis_destroy(&axis);
+		return NULL;
+	}
+
+	if(options->read_limit > 0 && sled_read_limit(axis->sled, options->read_limit) == -1) {
+		fprintf(stderr, "Invalid read limit (%d).\n", options->read_limit);
+		axis_destroy(&axis);
+		return NULL;
+	}
+
+	sled_set_emergency_handler(axis->sled, axis_on_emergency, (void *) axis);
+
+	if(queue_init(&axis->jobs, axis->ev_base, axis_on_jobs, (void *) axis) == -1) {
+		sled_destroy(&axis->sled);
+		if(!host)
+			event_base_free(axis->ev_base);
+		delete axis;
+		return NULL;
+	}
+
+	pthread_mutex_init(&axis->sample_lock, NULL);
+	axis->position = axis->time = 0.0;
+	axis->gaps = 0;
+
+	timeval interval;
+	interval.tv_sec = 0;
+	interval.tv_usec = SAMPLE_INTERVAL;
+
+	axis->sample_timer = event_new(axis->ev_base, -1, EV_PERSIST, axis_on_sample, (void *) axis);
+	event_add(axis->sample_timer, &interval);
+
+	axis->sample_gaps = 0;
+	axis->frame = 0;
+	axis->trace_enabled = true;
+
+	return axis;
+}
+
+
+static void *axis_thread(void *axis_v)
+{
+	sled_axis_t *axis = (sled_axis_t *) axis_v;
+
+	event_base_loop(axis->ev_base, 0);
+
+	syslog(LOG_NOTICE, "%s() event loop of sled %d stopped", __FUNCTION__, axis->id);
+
+	return NULL;
+}
+
+
+/**
+ * Run event loop of the sled on its own thread, pinned to
+ * the CPU given in the options. The scheduling policy and
+ * priority are inherited (see setup_realtime). Sleds that
+ * share the event loop of a host run once the host does.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int axis_start(sled_axis_t *axis)
+{
+	if(axis->host) {
+		syslog(LOG_NOTICE, "%s() sled %d on node %d runs on the thread of sled %d", __FUNCTION__,
+			axis->id, axis->options.node, axis->host->id);
+		return 0;
+	}
+
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+
+	if(axis->options.cpu >= 0) {
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(axis->options.cpu, &cpus);
+		pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &cpus);
+	}
+
+	int result = pthread_create(&axis->thread, &attr, axis_thread, (void *) axis);
+	pthread_attr_destroy(&attr);
+
+	if(result != 0) {
+		fprintf(stderr, "Could not start thread of sled %d: %s\n", axis->id, strerror(result));
+		return -1;
+	}
+
+	axis->running = true;
+
+	syslog(LOG_NOTICE, "%s() sled %d on %s node %d started", __FUNCTION__,
+		axis->id, axis->options.device ? axis->options.device : "default device", axis->options.node);
+
+	return 0;
+}
+
+
+static void axis_job_stop(server_job_t *job)
+{
+	event_base_loopbreak(job->axis->ev_base);
+}
+
+
+/**
+ * Stop event loop of the sled and wait for its thread, which
+ * also stops the sleds that share it.
+ */
+void axis_stop(sled_axis_t *axis)
+{
+	if(!axis->running)
+		return;
+
+	server_job_t *job = new server_job_t();
+	job->run = axis_job_stop;
+	job->axis = axis;
+	axis_submit(axis, job);
+
+	pthread_join(axis->thread, NULL);
+	axis->running = false;
+}
+
+
+/**
+ * Free sled and event loop, stopping the thread first. Sleds that
+ * share the event loop have to be destroyed before their host, with
+ * the thread of the host stopped.
+ */
+void axis_destroy(sled_axis_t **axis)
+{
+	axis_stop(*axis);
+
+	if((*axis)->sample_timer) {
+		event_free((*axis)->sample_timer);
+		queue_destroy(&(*axis)->jobs);
+		pthread_mutex_destroy(&(*axis)->sample_lock);
+	}
+
+	sled_destroy(&(*axis)->sled);
+
+	if(!(*axis)->host)
+		event_base_free((*axis)->ev_base);
+
+	delete *axis;
+	*axis = NULL;
+}
+
+
+/**
+ * Whether two sleds are on the same CAN device (NULL is the default device).
+ */
+bool axis_same_device(const axis_options_t *a, const axis_options_t *b)
+{
+	const char *device_a = a->device ? a->device : "";
+	const char *device_b = b->device ? b->device : "";
+
+	return strcmp(device_a, device_b) == 0;
+}
+
+
+/**
+ * Run job on the thread of the axis, from the RTC3D thread.
+ */
+void axis_submit(sled_axis_t *axis, server_job_t *job)
+{
+	job->axis = axis;
+	queue_push(&axis->jobs, job);
+}
+
+
+/**
+ * Last position (m), its time (s) and number of receive overruns.
+ */
+void axis_get_sample(sled_axis_t *axis, double &position, double &time, unsigned int &gaps)
+{
+	pthread_mutex_lock(&axis->sample_lock);
+	position = axis->position;
+	time = axis->time;
+	gaps = axis->gaps;
+	pthread_mutex_unlock(&axis->sample_lock);
+}
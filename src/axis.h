@@ -0,0 +1,120 @@
+#ifndef __AXIS_H__
+#define __AXIS_H__
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <list>
+#include <map>
+#include <string>
+
+#include <event2/event.h>
+
+#include "server.h"
+#include "parser.h"
+
+struct sled_axis_t;
+struct server_job_t;
+
+typedef void(*server_job_fn_t)(server_job_t *job);
+
+enum reply_type_t {
+	rpl_none,			// Nothing to send
+	rpl_command,		// Command packet to the client
+	rpl_error,			// Error packet to the client
+	rpl_data,			// Data frame holding position
+	rpl_broadcast		// Error packet to all clients
+};
+
+
+/**
+ * Work passed from the RTC3D thread to the thread of a sled,
+ * and returned with the reply. The connection may have been closed
+ * before the reply arrives, client identifies it in that case.
+ */
+struct server_job_t {
+	server_job_fn_t run;
+	sled_axis_t *axis;
+
+	rtc3d_connection_t *conn;
+	uintptr_t client;
+	command_t command;
+
+	reply_type_t reply;
+	std::string text;
+	double position;
+};
+
+
+/**
+ * Options of a single sled (see --device).
+ */
+struct axis_options_t {
+	const char *device;
+	int node;
+	int cpu;				// CPU to run the event loop on, -1 for any
+	int poll_cpu;			// CPU for busy polling, -1 disables
+	int read_limit;			// Frames per read wakeup, 0 for the default
+	const char *fault;
+	const char *capture;
+};
+
+
+/**
+ * A sled with its own event loop, running on its own thread.
+ * Sleds on the same device (nodes of one bus) share the event loop
+ * and thread of the first of them, the host, such that the device
+ * is opened once.
+ *
+ * Only the thread of the axis touches the sled. The RTC3D thread
+ * passes commands as jobs and reads positions from the sample,
+ * which the axis thread updates every SAMPLE_INTERVAL.
+ */
+struct sled_axis_t {
+	int id;
+	sled_server_ctx_t *ctx;
+	axis_options_t options;
+
+	sled_axis_t *host;		// Axis whose event loop this one runs on, NULL if its own
+	event_base *ev_base;
+	pthread_t thread;
+	bool running;
+
+	sled_t *sled;
+
+	// Maps protocol profile ids onto sled profile ids
+	std::map<int, int> profile_tlate;
+
+	// Jobs for this axis
+	server_queue_t jobs;
+
+	// Last sample, protected by the lock
+	pthread_mutex_t sample_lock;
+	double position, time;
+	unsigned int gaps;
+	event *sample_timer;
+
+	// Used by the RTC3D thread only
+	std::list<rtc3d_connection_t *> stream_clients;
+	unsigned int sample_gaps;
+	uint32_t frame;
+	bool trace_enabled;
+};
+
+
+event_base *server_event_base_new();
+
+int queue_init(server_queue_t *queue, event_base *ev_base, event_callback_fn handler, void *arg);
+void queue_destroy(server_queue_t *queue);
+void queue_push(server_queue_t *queue, server_job_t *job);
+server_job_t *queue_pop(server_queue_t *queue);
+
+sled_axis_t *axis_create(sled_server_ctx_t *ctx, int id, const axis_options_t *options, sled_axis_t *host);
+void axis_destroy(sled_axis_t **axis);
+int axis_start(sled_axis_t *axis);
+void axis_stop(sled_axis_t *axis);
+void axis_submit(sled_axis_t *axis, server_job_t *job);
+bool axis_same_device(const axis_options_t *a, const axis_options_t *b);
+void axis_get_sample(sled_axis_t *axis, double &position, double &time, unsigned int &gaps);
+
+#endif
@@ -3,6 +3,7 @@
 #include <getopt.h>
 #include <stdexcept>
 #include <utility>
+#include <vector>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -22,6 +23,7 @@
 
 #include <event2/event.h>
 #include "server.h"
+#include "axis.h"
 
 #define MAX_EVENTS 10
 #define PRIORITY 49
@@ -187,6 +189,21 @@ static void print_help()
 
 	printf("\n");
 	printf("  --no-daemon   Do not daemonize.\n");
+	printf("  --device=DEV  CAN device, either a PEAK device node (default "
+		"/dev/pcanpci0) or a SocketCAN interface (e.g. can0 or vcan0).\n");
+	printf("                Use emulator for a simulated drive, or replay:FILE and\n"
+		"                replay-fast:FILE to play back a capture.\n");
+	printf("                Repeat to control several sleds, the options below apply\n"
+		"                to the sled of the preceding --device. Sleds on the same\n"
+		"                device share it, give the device options only once.\n");
+	printf("  --node=ID     CANopen node-ID of the drive (default 1).\n");
+	printf("  --cpu=CPU     Run the event loop of the sled on CPU.\n");
+	printf("  --fault=SPEC  Inject CAN faults, e.g. seed=1,latency=0.002,jitter=0.001,drop=0.01\n"
+		"                (for testing only).\n");
+	printf("  --capture=FILE  Record all CAN frames to FILE (absolute path).\n");
+	printf("  --busy-poll=CPU  Read the CAN device from a thread spinning on CPU,\n"
+		"                which should be isolated (isolcpus) and differ from --cpu.\n");
+	printf("  --read-limit=N  Dispatch at most N frames per read wakeup (1-64, default 64).\n");
 	printf("  --help        Print help text.\n");
 	printf("\n");
 }
@@ -196,6 +213,16 @@ int main(int argc, char **argv)
 {
 	int daemonize_flag = 1;
 	uid_t uid = get_uid_by_name("sled");
+	// Options of every sled, the first may be given before --device
+	std::vector<axis_options_t> sleds(1);
+	sleds[0].device = NULL;
+	sleds[0].node = 1;
+	sleds[0].cpu = -1;
+	sleds[0].poll_cpu = -1;
+	sleds[0].read_limit = 0;
+	sleds[0].fault = NULL;
+	sleds[0].capture = NULL;
+	bool device_given = false;
 
 	/* Parse command line arguments */
 	static struct option long_options[] =
@@ -203,13 +230,20 @@ int main(int argc, char **argv)
 			{"no-daemon",	no_argument, &daemonize_flag, 0},
 			{"help",		no_argument, 0, 'h'},
 			{"user",		required_argument, 0, 'u'},
+			{"device",		required_argument, 0, 'd'},
+			{"capture",		required_argument, 0, 'c'},
+			{"node",		required_argument, 0, 'n'},
+			{"fault",		required_argument, 0, 'f'},
+			{"busy-poll",	required_argument, 0, 'p'},
+			{"read-limit",	required_argument, 0, 'r'},
+			{"cpu",			required_argument, 0, 'C'},
 			{"\0", 0, 0, 0}
 		};
 
 	int option_index = 0;
 	int c = 0;
 
-	while((c = getopt_long(argc, argv, "hu:", long_options, &option_index)) != -1) {
+	while((c = getopt_long(argc, argv, "hu:d:c:n:f:p:r:C:", long_options, &option_index)) != -1) {
 		switch(c) {
 			case 'u':
 				uid = get_uid_by_name(optarg);
@@ -219,6 +253,58 @@ int main(int argc, char **argv)
 				}
 				break;
 
+			case 'd':
+				if(device_given) {
+					axis_options_t options = sleds.back();
+					options.node = 1;
+					options.cpu = options.poll_cpu = -1;
+					options.read_limit = 0;
+					options.fault = options.capture = NULL;
+					sleds.push_back(options);
+				}
+				sleds.back().device = optarg;
+				device_given = true;
+				break;
+
+			case 'c':
+				sleds.back().capture = optarg;
+				break;
+
+			case 'n':
+				sleds.back().node = atoi(optarg);
+				if(sleds.back().node < 1 || sleds.back().node > 127) {
+					fprintf(stderr, "Invalid node-ID specified (%s).\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+
+			case 'f':
+				sleds.back().fault = optarg;
+				break;
+
+			case 'r':
+				sleds.back().read_limit = atoi(optarg);
+				if(sleds.back().read_limit < 1 || sleds.back().read_limit > 64) {
+					fprintf(stderr, "Invalid read limit specified (%s).\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+
+			case 'p':
+			case 'C': {
+				int cpu = atoi(optarg);
+				if(cpu < 0) {
+					fprintf(stderr, "Invalid CPU specified (%s).\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+
+				if(c == 'p')
+					sleds.back().poll_cpu = cpu;
+				else
+					sleds.back().cpu = cpu;
+				break;
+			}
+
 			case 'h':
 				print_help();
 				exit(EXIT_SUCCESS);
@@ -226,6 +312,35 @@ int main(int argc, char **argv)
 		}
 	}
 
+	// The poll thread spins, it would starve the event loop
+	for(size_t i = 0; i < sleds.size(); i++)
+		if(sleds[i].poll_cpu >= 0 && sleds[i].poll_cpu == sleds[i].cpu) {
+			fprintf(stderr, "Give --busy-poll a CPU other than --cpu (%d).\n", sleds[i].cpu);
+			exit(EXIT_FAILURE);
+		}
+
+	// Sleds on one device share its event loop and interface
+	for(size_t i = 1; i < sleds.size(); i++)
+		for(size_t j = 0; j < i; j++) {
+			if(!axis_same_device(&sleds[i], &sleds[j]))
+				continue;
+
+			if(sleds[i].node == sleds[j].node) {
+				fprintf(stderr, "Node %d of %s given twice.\n", sleds[i].node,
+					sleds[i].device ? sleds[i].device : "default device");
+				exit(EXIT_FAILURE);
+			}
+
+			if(sleds[i].cpu >= 0 || sleds[i].poll_cpu >= 0 || sleds[i].read_limit > 0 ||
+					sleds[i].fault || sleds[i].capture) {
+				fprintf(stderr, "Give --cpu, --busy-poll, --read-limit, --fault and --capture "
+					"with the first --device=%s only.\n", sleds[i].device);
+				exit(EXIT_FAILURE);
+			}
+
+			break;
+		}
+
 	if(daemonize_flag && (uid == -1)) {
 		fprintf(stderr, "Default user 'sled' does not exist, "
 			"and no user was specified.\n");
@@ -263,25 +378,16 @@ int main(int argc, char **argv)
 		}
 	}
 
-	/* Setup libevent */
-	event_config *cfg = event_config_new();
-	event_config_require_features(cfg, EV_FEATURE_FDS);
-	#ifdef EVENT_BASE_FLAG_PRECISE_TIMER
-	event_config_set_flag(cfg, EVENT_BASE_FLAG_PRECISE_TIMER);
-	#endif
-	event_config_set_flag(cfg, EVENT_BASE_FLAG_NOLOCK);
-	event_config_set_flag(cfg, EVENT_BASE_FLAG_NO_CACHE_TIME);
-
-	event_base *ev_base = event_base_new_with_config(cfg);
-	event_base_priority_init(ev_base, 2);
+	/* Setup libevent, the sleds each get their own event base */
+	event_base *ev_base = server_event_base_new();
 
 	if(!ev_base) {
 		fprintf(stderr, "Error initializing libevent.\n");
 		return 1;
 	}
 
-	/* Setup context */
-	sled_server_ctx_t *context = setup_sled_server_context(ev_base);
+	/* Setup context and start sleds */
+	sled_server_ctx_t *context = setup_sled_server_context(ev_base, sleds);
 
 	if(context == NULL)
 		return 1;
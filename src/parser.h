@@ -17,6 +17,9 @@ enum status_t {
 struct command_t {
   command_type_t type;
 
+  // sled the command is for (prefix "sled ID")
+  int sled;
+
   // boolean for start/stop on/off
   bool boolean;
 
@@ -1,23 +1,32 @@
 #include "server.h"
 #include "parser.h"
+#include "axis.h"
 
 #include <math.h>
 #include <stdlib.h>
+#include <stdio.h>
 #include <arpa/inet.h>
 #include <time.h>
 #include <syslog.h>
+#include <signal.h>
 #include <event2/event.h>
 
 
-// Interval at which new samples are sent in us
-#define SAMPLE_INTERVAL 1000
-
 // Interval after which samples are counted as invalid
 #define MAX_SAMPLE_INTERVAL 2000
 
 // Output summary statistics every 5 minutes
 #define REPORT_EVERY_X_SAMPLES int(300 * (1e6/SAMPLE_INTERVAL))
 
+// CAN frame trace is written here on SIGUSR1 (sled 0)
+#define TRACE_FILE "/tmp/sled-trace.bin"
+
+// Trace of other sleds, formatted with the sled ID
+#define TRACE_FILE_SLED "/tmp/sled-trace-%d.bin"
+
+// Size of the bus statistics reply
+#define BUS_STATISTICS_SIZE 16384
+
 
 /**
  * Returns current time in seconds.
@@ -35,132 +44,136 @@ static double get_time()
 /**
  * Translate protocol profile IDs into sled profile IDs.
  *
- * @param ctx  Sled context
+ * @param axis  Sled the profile belongs to.
  * @param profile  Profile ID received from network.
  * @return Internal ID
  */
-static int tlate_profile_id(sled_server_ctx_t* ctx, int profile)
+static int tlate_profile_id(sled_axis_t *axis, int profile)
 {
-	if(ctx->profile_tlate.count(profile) == 1) {
-		return ctx->profile_tlate[profile];
+	if(axis->profile_tlate.count(profile) == 1) {
+		return axis->profile_tlate[profile];
 	}
 
-	int profile_id = sled_profile_create(ctx->sled);
-	ctx->profile_tlate.insert( std::pair<int, int>(profile, profile_id) );
+	int profile_id = sled_profile_create(axis->sled);
+	axis->profile_tlate.insert( std::pair<int, int>(profile, profile_id) );
 
 	return profile_id;
 }
 
 
 /**
- * Called on client disconnect, makes sure that the client
- * is no longer on the stream-frames-list.
+ * Set reply of a job.
  */
-static void rtc3d_disconnect_handler(rtc3d_connection_t *rtc3d_conn, void **ptr)
+static void job_reply(server_job_t *job, reply_type_t type, const char *text)
 {
-	sled_server_ctx_t *ctx = (sled_server_ctx_t *) rtc3d_get_global_data(rtc3d_conn);
-	ctx->stream_clients.remove(rtc3d_conn);
-	syslog(LOG_NOTICE, "%s() removing client", __FUNCTION__);
+	job->reply = type;
+	job->text = text;
 }
 
 
 /**
- * Executes a (string) command by invoking either
- * the network or sled subsystem.
+ * Called on client connect, remembers the client
+ * such that emergencies can be pushed to it.
+ *
+ * @return Number identifying the client.
  */
-static void rtc3d_command_handler(rtc3d_connection_t *rtc3d_conn, char *cmd)
+static void *rtc3d_connect_handler(rtc3d_connection_t *rtc3d_conn)
 {
 	sled_server_ctx_t *ctx = (sled_server_ctx_t *) rtc3d_get_global_data(rtc3d_conn);
-	command_t command;
+	ctx->clients.push_back(rtc3d_conn);
+	return (void *) ++ctx->next_client;
+}
 
-	int retval = parser_parse_string(ctx->parser, cmd, &command);
 
-	if(retval == -1) {
-		rtc3d_send_error(rtc3d_conn, (char *) "err-syntaxerror");
-		return;
-	}
+/**
+ * Called on client disconnect, makes sure that the client
+ * is no longer on the client and stream-frames-lists.
+ */
+static void rtc3d_disconnect_handler(rtc3d_connection_t *rtc3d_conn, void **ptr)
+{
+	sled_server_ctx_t *ctx = (sled_server_ctx_t *) rtc3d_get_global_data(rtc3d_conn);
+	ctx->clients.remove(rtc3d_conn);
 
-	switch(command.type) {
-		case cmd_setbyteorder: {
-			rtc3d_set_byte_order(rtc3d_conn, command.byte_order);
-			rtc3d_send_command(rtc3d_conn, (char *) "ok-setbyteorder");
-			break;
-		}
+	for(size_t i = 0; i < ctx->axes.size(); i++)
+		ctx->axes[i]->stream_clients.remove(rtc3d_conn);
 
+	syslog(LOG_NOTICE, "%s() removing client", __FUNCTION__);
+}
 
-		case cmd_streamframes: {
-			if(command.boolean) {
-				ctx->stream_clients.remove(rtc3d_conn);
-				ctx->stream_clients.push_back(rtc3d_conn);
-				syslog(LOG_NOTICE, "%s() adding client", __FUNCTION__);
-			} else {
-				ctx->stream_clients.remove(rtc3d_conn);
-			}
-			rtc3d_send_command(rtc3d_conn, (char *) "ok-streamframes");
-			break;
-		}
 
+/**
+ * Executes a (string) command on the thread of the sled
+ * it addresses, the reply is sent by on_replies.
+ */
+static void run_command(server_job_t *job)
+{
+	sled_axis_t *axis = job->axis;
+	command_t &command = job->command;
 
+	switch(command.type) {
 		case cmd_sendcurrentframe: {
 			double position;
-			if(sled_rt_get_position(ctx->sled, position) == -1)
-				rtc3d_send_error(rtc3d_conn, (char *) "err-sendcurrentframe");
-			else
-				rtc3d_send_data(rtc3d_conn, -1, -1, position * 1000.0);
+			if(sled_rt_get_position(axis->sled, position) == -1) {
+				job_reply(job, rpl_error, "err-sendcurrentframe");
+			} else {
+				job->reply = rpl_data;
+				job->position = position;
+			}
 			break;
 		}
 
 
 		case cmd_profile_execute: {
-			int profile_id = tlate_profile_id(ctx, command.profile);
-			int retval = sled_profile_execute(ctx->sled, profile_id);
+			int profile_id = tlate_profile_id(axis, command.profile);
+			int retval = sled_profile_execute(axis->sled, profile_id);
 
 			if(retval == -1)
-				rtc3d_send_error(rtc3d_conn, (char *) "err-profile-execute");
+				job_reply(job, rpl_error, "err-profile-execute");
 			else
-				rtc3d_send_command(rtc3d_conn, (char *) "ok-profile-execute");
+				job_reply(job, rpl_command, "ok-profile-execute");
 			break;
 		}
 
 
 		case cmd_profile_set: {
-			int profile_id = tlate_profile_id(ctx, command.profile);
+			int profile_id = tlate_profile_id(axis, command.profile);
 
 			if(profile_id < 0) {
 				syslog(LOG_ERR, "%s() invalid profile %d", __FUNCTION__, profile_id);
-				rtc3d_send_error(rtc3d_conn, (char *) "err-profile-set");
+				job_reply(job, rpl_error, "err-profile-set");
 				break;
 			}
 
 			// Check position...
 			if(abs(command.position) > 0.5) {
 				syslog(LOG_ERR, "%s() invalid profile, position out of bounds", __FUNCTION__);
-				rtc3d_send_error(rtc3d_conn, (char *) "err-profile-set");
+				job_reply(job, rpl_error, "err-profile-set");
+				break;
 			}
 
-			if(sled_profile_set_target(ctx->sled, profile_id, 
-					command.position_type, 
-					command.position, 
+			if(sled_profile_set_target(axis->sled, profile_id,
+					command.position_type,
+					command.position,
 					command.time) == -1) {
 				syslog(LOG_ERR, "setting of position failed (%.3fm in %.2fs)", command.position, command.time);
-				rtc3d_send_error(rtc3d_conn, (char *) "err-profile-set");
+				job_reply(job, rpl_error, "err-profile-set");
 				break;
 			}
 
 			if(command.next_profile >= 0) {
-				int next_profile_id = tlate_profile_id(ctx, command.next_profile);
+				int next_profile_id = tlate_profile_id(axis, command.next_profile);
 
 				if(next_profile_id < 0) {
-					rtc3d_send_error(rtc3d_conn, (char *) "err-profile-set");
+					job_reply(job, rpl_error, "err-profile-set");
 					break;
 				}
 
-				sled_profile_set_next(ctx->sled, profile_id, next_profile_id, command.next_delay, command.blend_type);
+				sled_profile_set_next(axis->sled, profile_id, next_profile_id, command.next_delay, command.blend_type);
 			} else {
-				sled_profile_set_next(ctx->sled, profile_id, -1, 0, bln_none);
+				sled_profile_set_next(axis->sled, profile_id, -1, 0, bln_none);
 			}
 
-			rtc3d_send_command(rtc3d_conn, (char *) "ok-profile-set");
+			job_reply(job, rpl_command, "ok-profile-set");
 
 			break;
 		}
@@ -168,18 +181,18 @@ static void rtc3d_command_handler(rtc3d_connection_t *rtc3d_conn, char *cmd)
 
 		case cmd_sinusoid: {
 			if(command.boolean) {
-				if(sled_sinusoid_start(ctx->sled, command.amplitude, command.period) == -1) {
+				if(sled_sinusoid_start(axis->sled, command.amplitude, command.period) == -1) {
 					syslog(LOG_ERR, "%s() could not start sinusoid", __FUNCTION__);
-					rtc3d_send_error(rtc3d_conn, (char *) "err-sinusoid-start");
+					job_reply(job, rpl_error, "err-sinusoid-start");
 				} else {
-					rtc3d_send_command(rtc3d_conn, (char *) "ok-sinusoid-start");
+					job_reply(job, rpl_command, "ok-sinusoid-start");
 				}
 			} else {
-				if(sled_sinusoid_stop(ctx->sled) == -1) {
+				if(sled_sinusoid_stop(axis->sled) == -1) {
 					syslog(LOG_ERR, "%s() could not stop sinusoid", __FUNCTION__);
-					rtc3d_send_error(rtc3d_conn, (char *) "err-sinusoid-stop");
+					job_reply(job, rpl_error, "err-sinusoid-stop");
 				} else {
-					rtc3d_send_command(rtc3d_conn, (char *) "ok-sinusoid-stop");
+					job_reply(job, rpl_command, "ok-sinusoid-stop");
 				}
 			}
 
@@ -188,10 +201,10 @@ static void rtc3d_command_handler(rtc3d_connection_t *rtc3d_conn, char *cmd)
 
 
 		case cmd_lights: {
-			if(sled_light_set_state(ctx->sled, command.boolean) == -1)
-				rtc3d_send_error(rtc3d_conn, (char *) "err-light");
+			if(sled_light_set_state(axis->sled, command.boolean) == -1)
+				job_reply(job, rpl_error, "err-light");
 			else
-				rtc3d_send_command(rtc3d_conn, (char *) "ok-light");
+				job_reply(job, rpl_command, "ok-light");
 			break;
 		}
 
@@ -209,20 +222,135 @@ static void rtc3d_command_handler(rtc3d_connection_t *rtc3d_conn, char *cmd)
 		}
 
 
+		case cmd_sendbusstatistics: {
+			static __thread char reply[BUS_STATISTICS_SIZE];
+			int n = snprintf(reply, sizeof(reply), "ok-busstatistics\n");
+			sled_bus_statistics(axis->sled, reply + n, sizeof(reply) - n, command.boolean);
+			job_reply(job, rpl_command, reply);
+			break;
+		}
+
+		default: {
+			job_reply(job, rpl_error, "err-notsupported");
+		}
+	}
+}
+
+
+/**
+ * Executes a (string) command, either directly when it
+ * concerns the network or by passing it to the thread of
+ * the sled it addresses (sled 0 unless prefixed by sled ID).
+ */
+static void rtc3d_command_handler(rtc3d_connection_t *rtc3d_conn, char *cmd)
+{
+	sled_server_ctx_t *ctx = (sled_server_ctx_t *) rtc3d_get_global_data(rtc3d_conn);
+	command_t command;
+	command.sled = 0;
+
+	int retval = parser_parse_string(ctx->parser, cmd, &command);
+
+	if(retval == -1) {
+		rtc3d_send_error(rtc3d_conn, (char *) "err-syntaxerror");
+		return;
+	}
+
+	if(command.sled < 0 || command.sled >= int(ctx->axes.size())) {
+		rtc3d_send_error(rtc3d_conn, (char *) "err-nosuchsled");
+		return;
+	}
+
+	sled_axis_t *axis = ctx->axes[command.sled];
+
+	switch(command.type) {
+		case cmd_setbyteorder: {
+			rtc3d_set_byte_order(rtc3d_conn, command.byte_order);
+			rtc3d_send_command(rtc3d_conn, (char *) "ok-setbyteorder");
+			break;
+		}
+
+
+		// A client receives frames of one sled at a time
+		case cmd_streamframes: {
+			for(size_t i = 0; i < ctx->axes.size(); i++)
+				ctx->axes[i]->stream_clients.remove(rtc3d_conn);
+
+			if(command.boolean) {
+				axis->stream_clients.push_back(rtc3d_conn);
+				syslog(LOG_NOTICE, "%s() adding client to sled %d", __FUNCTION__, axis->id);
+			}
+			rtc3d_send_command(rtc3d_conn, (char *) "ok-streamframes");
+			break;
+		}
+
+
 		case cmd_bye: {
 			rtc3d_send_command(rtc3d_conn, (char *) "bye");
 			rtc3d_disconnect(rtc3d_conn);
 			break;
 		}
 
+
 		default: {
-			rtc3d_send_error(rtc3d_conn, (char *) "err-notsupported");
+			server_job_t *job = new server_job_t();
+			job->run = run_command;
+			job->conn = rtc3d_conn;
+			job->client = (uintptr_t) rtc3d_get_local_data(rtc3d_conn);
+			job->command = command;
+			axis_submit(axis, job);
 		}
 	}
 
 }
 
 
+/**
+ * Find connection that submitted a job.
+ *
+ * @return Connection or NULL when the client has disconnected.
+ */
+static rtc3d_connection_t *find_client(sled_server_ctx_t *ctx, server_job_t *job)
+{
+	for(std::list<rtc3d_connection_t *>::iterator it = (ctx->clients).begin();
+		it != (ctx->clients).end(); it++) {
+		if(*it == job->conn && (uintptr_t) rtc3d_get_local_data(*it) == job->client)
+			return *it;
+	}
+
+	return NULL;
+}
+
+
+/**
+ * Send replies of jobs executed by the sled threads.
+ */
+static void on_replies(evutil_socket_t fd, short events, void *arg)
+{
+	sled_server_ctx_t *ctx = (sled_server_ctx_t *) arg;
+	server_job_t *job;
+
+	while((job = queue_pop(&ctx->replies)) != NULL) {
+		char *text = (char *) job->text.c_str();
+
+		if(job->reply == rpl_broadcast) {
+			for(std::list<rtc3d_connection_t *>::iterator it = (ctx->clients).begin();
+				it != (ctx->clients).end(); it++) {
+				rtc3d_send_error(*it, text);
+			}
+		} else if(rtc3d_connection_t *conn = find_client(ctx, job)) {
+			if(job->reply == rpl_command)
+				rtc3d_send_command(conn, text);
+			else if(job->reply == rpl_error)
+				rtc3d_send_error(conn, text);
+			else if(job->reply == rpl_data)
+				rtc3d_send_data(conn, -1, -1, job->position * 1000.0);
+		}
+
+		delete job;
+	}
+}
+
+
 static void update_timeout_stats(double time_actual)
 {
 	static double time_previous = time_actual;
@@ -267,26 +395,87 @@ static void on_timeout(evutil_socket_t sock, short events, void *arg)
 	double tcurrent = get_time();
 	update_timeout_stats(tcurrent);
 
-	// Get position
-	double position, time;
-	sled_rt_get_position_and_time(ctx->sled, position, time);
+	for(size_t i = 0; i < ctx->axes.size(); i++) {
+		sled_axis_t *axis = ctx->axes[i];
 
-	// Send position to all clients
-	static int frame = 0;
+		if(axis->stream_clients.empty())
+			continue;
 
-	for(std::list<rtc3d_connection_t *>::iterator it = (ctx->stream_clients).begin();
-		it != (ctx->stream_clients).end(); it++) {
-		rtc3d_send_data(*it, frame, (uint64_t) (time * 1e6), position * 1000.0);
+		// Get position, as published by the thread of the sled
+		double position, time;
+		unsigned int gaps;
+		axis_get_sample(axis, position, time, gaps);
+
+		// Samples were lost since the previous frame, flag this
+		// frame by setting the delta field of the marker to one.
+		float gap = (gaps != axis->sample_gaps) ? 1.0 : 0.0;
+		axis->sample_gaps = gaps;
+
+		// Send position to all clients
+		for(std::list<rtc3d_connection_t *>::iterator it = (axis->stream_clients).begin();
+			it != (axis->stream_clients).end(); it++) {
+			rtc3d_send_marker(*it, axis->frame, (uint64_t) (time * 1e6), position * 1000.0, gap);
+		}
+
+		axis->frame++;
 	}
+}
 
-	frame++;
+
+static void run_trace_dump(server_job_t *job)
+{
+	char filename[64];
+
+	if(job->axis->id == 0)
+		snprintf(filename, sizeof(filename), TRACE_FILE);
+	else
+		snprintf(filename, sizeof(filename), TRACE_FILE_SLED, job->axis->id);
+
+	sled_trace_dump(job->axis->sled, filename);
+}
+
+
+static void run_trace_toggle(server_job_t *job)
+{
+	sled_trace_set_state(job->axis->sled, job->command.boolean);
+}
+
+
+/**
+ * Dump CAN frame trace (SIGUSR1) or toggle tracing (SIGUSR2)
+ * of all sleds.
+ */
+static void on_trace_signal(evutil_socket_t sig, short events, void *arg)
+{
+	sled_server_ctx_t *ctx = (sled_server_ctx_t *) arg;
+
+	for(size_t i = 0; i < ctx->axes.size(); i++) {
+		sled_axis_t *axis = ctx->axes[i];
+		server_job_t *job = new server_job_t();
+
+		if(sig == SIGUSR1) {
+			job->run = run_trace_dump;
+		} else {
+			axis->trace_enabled = !axis->trace_enabled;
+			job->run = run_trace_toggle;
+			job->command.boolean = axis->trace_enabled;
+		}
+
+		axis_submit(axis, job);
+	}
 }
 
 
 /**
  * Create server context (to be passed to RTC3D server).
+ *
+ * Every sled runs on its own thread, commands are routed
+ * to a sled by the ID, which is its position in options.
+ *
+ * @param ev_base  LibEvent event_base of the RTC3D server.
+ * @param options  CAN device, node-ID etc. of every sled.
  */
-sled_server_ctx_t *setup_sled_server_context(event_base *ev_base)
+sled_server_ctx_t *setup_sled_server_context(event_base *ev_base, const std::vector<axis_options_t> &options)
 {
 	sled_server_ctx_t *ctx;
 
@@ -296,24 +485,47 @@ sled_server_ctx_t *setup_sled_server_context(event_base *ev_base)
 		return NULL;
 	}
 
+	ctx->next_client = 0;
+
 	ctx->parser = parser_create();
 	if(ctx->parser == NULL) {
 		delete ctx;
 		return NULL;
 	}
 
-	ctx->sled = sled_create(ev_base);
+	if(queue_init(&ctx->replies, ev_base, on_replies, (void *) ctx) == -1) {
+		parser_destroy(&(ctx->parser));
+		delete ctx;
+		return NULL;
+	}
+
+	for(size_t i = 0; i < options.size(); i++) {
+		// Nodes on one device share its event loop and interface
+		sled_axis_t *host = NULL;
+		for(size_t j = 0; j < ctx->axes.size() && !host; j++)
+			if(!ctx->axes[j]->host && axis_same_device(&options[i], &options[j]))
+				host = ctx->axes[j];
+
+		sled_axis_t *axis = axis_create(ctx, int(i), &options[i], host);
+
+		if(axis == NULL) {
+			teardown_sled_server_context(&ctx);
+			return NULL;
+		}
+
+		ctx->axes.push_back(axis);
+	}
 
 	/* Setup server */
 	ctx->server = rtc3d_setup_server(ev_base, (void *) ctx, 3375);
 
 	if(ctx->server == NULL) {
-		sled_destroy(&(ctx->sled));
-		parser_destroy(&(ctx->parser));
-		delete ctx;
+		teardown_sled_server_context(&ctx);
+		return NULL;
 	}
 
 	/* Install handlers */
+	rtc3d_set_connect_handler(ctx->server, rtc3d_connect_handler);
 	rtc3d_set_disconnect_handler(ctx->server, rtc3d_disconnect_handler);
 	rtc3d_set_command_handler(ctx->server, rtc3d_command_handler);
 
@@ -325,22 +537,45 @@ sled_server_ctx_t *setup_sled_server_context(event_base *ev_base)
 	event *periodic = event_new(ev_base, fileno(stdout), EV_READ | EV_PERSIST, on_timeout, (void *) ctx);
 	event_add(periodic, &timeout);
 
+	// Frame trace control
+	event *trace_dump = evsignal_new(ev_base, SIGUSR1, on_trace_signal, (void *) ctx);
+	event_add(trace_dump, NULL);
+
+	event *trace_toggle = evsignal_new(ev_base, SIGUSR2, on_trace_signal, (void *) ctx);
+	event_add(trace_toggle, NULL);
+
+	// Sleds start once everything is in place
+	for(size_t i = 0; i < ctx->axes.size(); i++)
+		if(axis_start(ctx->axes[i]) == -1) {
+			teardown_sled_server_context(&ctx);
+			return NULL;
+		}
+
 	return ctx;
 }
 
 
 /**
- * Destroy context passed to RTC3D server.
+ * Destroy context passed to RTC3D server,
+ * stopping the threads of all sleds.
  */
 void teardown_sled_server_context(sled_server_ctx_t **ctx)
 {
-	sled_destroy(&(*ctx)->sled);
+	// Stop all threads before freeing the sleds that share them,
+	// hosts come before the sleds on their event loop
+	for(size_t i = 0; i < (*ctx)->axes.size(); i++)
+		axis_stop((*ctx)->axes[i]);
+
+	for(size_t i = (*ctx)->axes.size(); i > 0; i--)
+		axis_destroy(&(*ctx)->axes[i - 1]);
+
 	parser_destroy(&(*ctx)->parser);
 
-	rtc3d_teardown_server(&(*ctx)->server);
+	if((*ctx)->server)
+		rtc3d_teardown_server(&(*ctx)->server);
+
+	queue_destroy(&(*ctx)->replies);
 
 	delete *ctx;
 	*ctx = NULL;
 }
-
-
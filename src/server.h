@@ -3,6 +3,9 @@
 
 #include <map>
 #include <list>
+#include <vector>
+#include <deque>
+#include <pthread.h>
 #include <libsled/sled.h>
 #include <librtc3d/rtc3d.h>
 
@@ -19,23 +22,47 @@ enum command_type_t {
   cmd_home,
   cmd_clearfault,
   cmd_setinternalstatus,
-  cmd_sendinternalstatus
+  cmd_sendinternalstatus,
+  cmd_sendbusstatistics
+};
+
+// Interval at which new samples are sent in us
+#define SAMPLE_INTERVAL 1000
+
+struct event;
+struct event_base;
+struct sled_axis_t;
+struct server_job_t;
+struct axis_options_t;
+
+/**
+ * Jobs waiting for a thread, the eventfd is readable while
+ * the queue is not empty (see queue_init).
+ */
+struct server_queue_t {
+	pthread_mutex_t lock;
+	std::deque<server_job_t *> jobs;
+	int fd;
+	event *ready;
 };
 
 struct sled_server_ctx_t {
 	void *parser;
-	sled_t *sled;
 	rtc3d_server_t *server;
 
-	std::list<rtc3d_connection_t *> stream_clients;
+	// Sleds by ID, each runs on its own thread
+	std::vector<sled_axis_t *> axes;
 
-	// Maps protocol profile ids onto sled profile ids
-	std::map<int, int> profile_tlate;
-};
+	// Replies and messages from the sled threads
+	server_queue_t replies;
 
-struct event_base;
+	// Connected clients, identified by number as a
+	// connection may be gone when a reply arrives.
+	std::list<rtc3d_connection_t *> clients;
+	uintptr_t next_client;
+};
 
-sled_server_ctx_t *setup_sled_server_context(event_base *ev_base);
+sled_server_ctx_t *setup_sled_server_context(event_base *ev_base, const std::vector<axis_options_t> &options);
 void teardown_sled_server_context(sled_server_ctx_t **ctx);
 
 #endif
@@ -0,0 +1,233 @@
+#include <execinfo.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+
+#include <map>
+
+#include <event2/event.h>
+#include <sled.h>
+#include <sled_profile.h>
+#include <interface.h>
+#include <interface_internal.h>
+
+/**
+ * Runs two chained profiles on the drive emulator, then changes the
+ * target of both and runs them again. Checks that the sled passes
+ * through both new targets and that the motion tasks the drive ends
+ * up with (reconstructed from all SDO writes, which are captured)
+ * hold them.
+ */
+
+#define FIRST_POSITION 0.10
+#define SECOND_POSITION 0.00
+#define NEW_FIRST_POSITION 0.30
+#define NEW_SECOND_POSITION 0.05
+#define TARGET_TIME 0.5
+#define CHAIN_DELAY 0.2
+#define TEST_TIMEOUT 20
+
+#define CAPTURE_FILE "/tmp/chain-test.trace"
+
+
+struct test_t {
+	event_base *ev_base;
+	sled_t *sled;
+
+	int first;
+	int second;
+	int phase;
+	double max_position;
+	int ticks;
+	int result;
+};
+
+// Registers of a motion task by object index
+typedef std::map<uint16_t, int32_t> task_t;
+
+
+void signal_handler(int signal)
+{
+	void *array[10];
+	size_t size;
+
+	size = backtrace(array, 10);
+	backtrace_symbols_fd(array, size, STDERR_FILENO);
+	exit(1);
+}
+
+
+/**
+ * Replay the SDO writes to the motion task registers and copies
+ * between motion tasks that were sent to the drive.
+ */
+static int read_tasks(const char *filename, std::map<int, task_t> &tasks)
+{
+	FILE *file = fopen(filename, "rb");
+
+	if(!file)
+		return -1;
+
+	intf_trace_header_t header;
+	if(fread(&header, sizeof(header), 1, file) != 1) {
+		fclose(file);
+		return -1;
+	}
+
+	intf_trace_record_t record;
+	while(fread(&record, sizeof(record), 1, file) == 1) {
+		if(record.direction != INTF_TRACE_TX || record.id != 0x601 || record.data[0] != 0x23)
+			continue;
+
+		uint16_t index = record.data[1] | (record.data[2] << 8);
+		int32_t value = record.data[4] | (record.data[5] << 8) |
+			(record.data[6] << 16) | (record.data[7] << 24);
+
+		if(index == OB_COPY_MOTION_TASK)
+			tasks[(value >> 16) & 0xFFFF] = tasks[value & 0xFFFF];
+		else if(index >= OB_O_ACC && index <= OB_O_V)
+			tasks[0][index] = value;
+	}
+
+	fclose(file);
+	return 0;
+}
+
+
+/**
+ * The first task has to hold the new first position and continue
+ * with a task that holds the new second position.
+ */
+static int check_tasks()
+{
+	std::map<int, task_t> tasks;
+
+	if(read_tasks(CAPTURE_FILE, tasks) != 0) {
+		fprintf(stderr, "Unable to read %s\n", CAPTURE_FILE);
+		return 1;
+	}
+
+	std::map<int, task_t>::iterator it;
+	for(it = tasks.begin(); it != tasks.end(); it++) {
+		if(it->first == 0)
+			continue;
+
+		task_t &task = it->second;
+		printf("Task %d position=%d next=%d\n", it->first, task[OB_O_P], task[OB_O_FN]);
+
+		if(task[OB_O_P] != int32_t(NEW_FIRST_POSITION * 1000.0 * 1000.0))
+			continue;
+
+		task_t &next = tasks[task[OB_O_FN]];
+		if(next[OB_O_P] == int32_t(NEW_SECOND_POSITION * 1000.0 * 1000.0))
+			return 0;
+	}
+
+	fprintf(stderr, "Drive did not receive the new targets\n");
+	return 1;
+}
+
+
+void on_tick(evutil_socket_t fd, short events, void *test_v)
+{
+	test_t *test = (test_t *) test_v;
+	test->ticks++;
+
+	if(test->ticks > TEST_TIMEOUT * 10) {
+		fprintf(stderr, "Timeout\n");
+		event_base_loopbreak(test->ev_base);
+		return;
+	}
+
+	double position;
+	if(sled_rt_get_position(test->sled, position) != 0)
+		return;
+
+	if(position > test->max_position)
+		test->max_position = position;
+
+	switch(test->phase) {
+		// Run both profiles once, such that they were sent before
+		case 0:
+			if(sled_profile_execute(test->sled, test->first) == 0) {
+				printf("Sled ready after %.1f s\n", test->ticks / 10.0);
+				test->phase = 1;
+			}
+			break;
+
+		case 1:
+			if(test->max_position < FIRST_POSITION - 1e-5 || fabs(position - SECOND_POSITION) > 1e-5)
+				break;
+
+			sled_profile_set_target(test->sled, test->first, pos_absolute, NEW_FIRST_POSITION, TARGET_TIME);
+			sled_profile_set_target(test->sled, test->second, pos_absolute, NEW_SECOND_POSITION, TARGET_TIME);
+
+			if(sled_profile_execute(test->sled, test->first) == 0) {
+				test->max_position = position;
+				test->phase = 2;
+			}
+			break;
+
+		case 2:
+			if(fabs(position - NEW_SECOND_POSITION) > 1e-5)
+				break;
+
+			// Settled on the second target, possibly without the first
+			if(test->max_position < NEW_FIRST_POSITION - 1e-5) {
+				fprintf(stderr, "Sled did not reach %.2f (max %.4f)\n", NEW_FIRST_POSITION, test->max_position);
+				event_base_loopbreak(test->ev_base);
+				break;
+			}
+
+			printf("Both targets reached after %.1f s\n", test->ticks / 10.0);
+			sled_capture(test->sled, NULL);
+
+			test->result = check_tasks();
+			event_base_loopbreak(test->ev_base);
+			break;
+	}
+}
+
+
+int main(int argc, char *argv[])
+{
+	signal(SIGSEGV, signal_handler);
+
+	test_t test;
+	test.ev_base = event_base_new();
+	test.phase = 0;
+	test.max_position = 0.0;
+	test.ticks = 0;
+	test.result = 1;
+
+	if(!test.ev_base) {
+		fprintf(stderr, "Unable to initialize event base\n");
+		exit(1);
+	}
+
+	test.sled = sled_create(test.ev_base, "emulator");
+	sled_capture(test.sled, CAPTURE_FILE);
+
+	test.first = sled_profile_create(test.sled);
+	test.second = sled_profile_create(test.sled);
+	sled_profile_set_target(test.sled, test.first, pos_absolute, FIRST_POSITION, TARGET_TIME);
+	sled_profile_set_target(test.sled, test.second, pos_absolute, SECOND_POSITION, TARGET_TIME);
+	sled_profile_set_next(test.sled, test.first, test.second, CHAIN_DELAY, bln_after);
+
+	timeval interval;
+	interval.tv_sec = 0;
+	interval.tv_usec = 100000;
+
+	event *tick = event_new(test.ev_base, -1, EV_PERSIST, on_tick, &test);
+	event_add(tick, &interval);
+
+	event_base_loop(test.ev_base, 0);
+
+	event_free(tick);
+	sled_destroy(&test.sled);
+
+	return test.result;
+}
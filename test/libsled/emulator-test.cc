@@ -0,0 +1,110 @@
+
+#include <execinfo.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <unistd.h>
+
+#include <event2/event.h>
+#include <sled.h>
+#include <sled_profile.h>
+
+/**
+ * Runs libsled against the built-in drive emulator: waits for the
+ * sled to become ready, executes a profile and checks the position.
+ */
+
+#define TARGET_POSITION 0.10
+#define TARGET_TIME 1.0
+#define TEST_TIMEOUT 20
+
+
+struct test_t {
+	event_base *ev_base;
+	sled_t *sled;
+
+	int profile;
+	bool executed;
+	int ticks;
+	int result;
+};
+
+
+void signal_handler(int signal)
+{
+	void *array[10];
+	size_t size;
+
+	size = backtrace(array, 10);
+	backtrace_symbols_fd(array, size, STDERR_FILENO);
+	exit(1);
+}
+
+
+void on_tick(evutil_socket_t fd, short events, void *test_v)
+{
+	test_t *test = (test_t *) test_v;
+	test->ticks++;
+
+	if(test->ticks > TEST_TIMEOUT * 10) {
+		fprintf(stderr, "Timeout\n");
+		event_base_loopbreak(test->ev_base);
+		return;
+	}
+
+	double position;
+	if(sled_rt_get_position(test->sled, position) != 0)
+		return;
+
+	// Execute profile as soon as the sled is ready
+	if(!test->executed) {
+		if(sled_profile_execute(test->sled, test->profile) == 0) {
+			printf("Sled ready after %.1f s\n", test->ticks / 10.0);
+			test->executed = true;
+		}
+		return;
+	}
+
+	if(fabs(position - TARGET_POSITION) < 1e-5) {
+		printf("Target reached after %.1f s\n", test->ticks / 10.0);
+		test->result = 0;
+		event_base_loopbreak(test->ev_base);
+	}
+}
+
+
+int main(int argc, char *argv[])
+{
+	signal(SIGSEGV, signal_handler);
+
+	test_t test;
+	test.ev_base = event_base_new();
+	test.executed = false;
+	test.ticks = 0;
+	test.result = 1;
+
+	if(!test.ev_base) {
+		fprintf(stderr, "Unable to initialize event base\n");
+		exit(1);
+	}
+
+	test.sled = sled_create(test.ev_base, "emulator");
+
+	test.profile = sled_profile_create(test.sled);
+	sled_profile_set_target(test.sled, test.profile, pos_absolute, TARGET_POSITION, TARGET_TIME);
+
+	timeval interval;
+	interval.tv_sec = 0;
+	interval.tv_usec = 100000;
+
+	event *tick = event_new(test.ev_base, -1, EV_PERSIST, on_tick, &test);
+	event_add(tick, &interval);
+
+	event_base_loop(test.ev_base, 0);
+
+	event_free(tick);
+	sled_destroy(&test.sled);
+
+	return test.result;
+}
@@ -33,7 +33,8 @@ int main(int argc, char *argv[])
 		exit(1);
 	}
 
-	sled_t *sled = sled_create(ev_base);
+	// Optional device (e.g. vcan0) as first argument
+	sled_t *sled = sled_create(ev_base, argc > 1 ? argv[1] : NULL);
 
 	//mch_intf_handle_event(machines.mch_intf, EV_INTF_OPEN);
 	event_base_loop(ev_base, 0);
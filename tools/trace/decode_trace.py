@@ -0,0 +1,74 @@
+from __future__ import print_function
+
+import struct
+import sys
+
+#
+# Prints a CAN frame trace written by sled-server
+# (kill -USR1 <pid>, see /tmp/sled-trace.bin) in
+# the format used by candump -x -ta:
+#
+#  (0012.345678)  can0  TX - -  601   [8]  40 41 60 00 00 00 00 00
+#
+# Usage:
+#  python decode_trace.py /tmp/sled-trace.bin
+#
+# Time is CLOCK_MONOTONIC, use -r for time relative
+# to the first frame.
+#
+
+MAGIC = b'SLEDTRC'
+HEADER = struct.Struct('<8sII')
+RECORD = struct.Struct('<QdHBBB3x8s')
+
+MT_RTR = 0x01
+MT_EXTENDED = 0x02
+
+
+def decode(filename, relative):
+  with open(filename, 'rb') as f:
+    magic, version, record_size = HEADER.unpack(f.read(HEADER.size))
+
+    if magic.rstrip(b'\0') != MAGIC or version != 1:
+      sys.exit('%s is not a sled trace file' % filename)
+
+    if record_size != RECORD.size:
+      sys.exit('Unexpected record size (%d)' % record_size)
+
+    start = None
+
+    while True:
+      data = f.read(RECORD.size)
+      if len(data) < RECORD.size:
+        break
+
+      seq, time, cob_id, mtype, length, direction, payload = RECORD.unpack(data)
+
+      if start is None:
+        start = time
+      if relative:
+        time -= start
+
+      if mtype & MT_EXTENDED:
+        ident = '%08X' % cob_id
+      else:
+        ident = '%03X' % cob_id
+
+      if mtype & MT_RTR:
+        body = 'remote request'
+      else:
+        body = ' '.join('%02X' % b for b in bytearray(payload[:length]))
+
+      print('(%011.6f)  can0  %s - -  %s   [%d]  %s' %
+        (time, 'TX' if direction else 'RX', ident, length, body))
+
+
+if __name__ == '__main__':
+  args = sys.argv[1:]
+  relative = '-r' in args
+  files = [a for a in args if a != '-r']
+
+  if len(files) != 1:
+    sys.exit('Usage: %s [-r] trace-file' % sys.argv[0])
+
+  decode(files[0], relative)